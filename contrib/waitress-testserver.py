@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+##
+## Loopback http(s) server for testing and benchmarking libwaitress.
+##
+## GET /bytes/N     N bytes with Content-Length, honors Range: bytes=a-[b]
+## GET /chunked/N   N bytes with chunked transfer-encoding
+##
+## Query parameters (all optional):
+##   chunk=N   chunk size for /chunked (default 8192)
+##   delay=MS  wait before sending the response
+##   stall=MS  wait after sending the headers
+##   drop=N    close the connection after N bytes of the body
+##   rate=N    send the body at N bytes/s at most (per connection)
+##   status=N  respond with this status code and an empty body
+##
+## With --run the server picks free ports, runs the given command with the
+## plain url (and, if --cert/--key are given, the tls url and the
+## certificate's sha1 fingerprint) appended and exits with its status:
+##
+##   waitress-testserver.py --run ./waitress-test bench
+##
+
+import argparse
+import hashlib
+import http.server
+import socket
+import socketserver
+import ssl
+import subprocess
+import sys
+import threading
+import time
+from urllib.parse import urlsplit, parse_qs
+
+PATTERN = bytes(range(256)) * 256
+
+def body(offset, size):
+    """deterministic body data, byte i of a resource is i % 256"""
+    out = bytearray()
+    while size > 0:
+        start = offset % len(PATTERN)
+        piece = PATTERN[start:start + size]
+        out += piece
+        offset += len(piece)
+        size -= len(piece)
+    return bytes(out)
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+    # headers and body are written separately
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def do_POST(self):
+        length = int(self.headers.get('Content-Length', 0))
+        data = self.rfile.read(length)
+        self.send_response(200)
+        self.send_header('Content-Length', str(len(data)))
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_GET(self):
+        url = urlsplit(self.path)
+        query = {k: v[-1] for k, v in parse_qs(url.query).items()}
+        parts = url.path.strip('/').split('/')
+        delay = int(query.get('delay', 0))
+        if delay > 0:
+            time.sleep(delay / 1000)
+
+        if 'status' in query:
+            self.send_response(int(query['status']))
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+        if len(parts) != 2 or parts[0] not in ('bytes', 'chunked') or \
+                not parts[1].isdigit():
+            self.send_error(404)
+            return
+
+        size = int(parts[1])
+        drop = int(query['drop']) if 'drop' in query else None
+        if parts[0] == 'bytes':
+            self.send_identity(size, query, drop)
+        else:
+            self.send_chunked(size, query, drop)
+
+    def stall(self, query):
+        stall = int(query.get('stall', 0))
+        if stall > 0:
+            self.wfile.flush()
+            time.sleep(stall / 1000)
+
+    def write_body(self, data, query):
+        rate = int(query.get('rate', 0))
+        if rate <= 0:
+            self.wfile.write(data)
+            return
+        # small pieces, so the rate holds over short spans too
+        piece = max(1, rate // 20)
+        for i in range(0, len(data), piece):
+            self.wfile.write(data[i:i + piece])
+            self.wfile.flush()
+            time.sleep(len(data[i:i + piece]) / rate)
+
+    def send_identity(self, size, query, drop):
+        start, end = 0, size
+        ranged = self.headers.get('Range', '')
+        if ranged.startswith('bytes='):
+            first, _, last = ranged[6:].partition('-')
+            start = int(first or 0)
+            end = min(int(last) + 1, size) if last else size
+            if start >= size or start >= end:
+                self.send_response(416)
+                self.send_header('Content-Range', 'bytes */%d' % size)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' %
+                    (start, end - 1, size))
+        else:
+            self.send_response(200)
+        self.send_header('Content-Length', str(end - start))
+        self.send_header('Accept-Ranges', 'bytes')
+        self.end_headers()
+        self.stall(query)
+
+        pos, sent = start, 0
+        while pos < end:
+            n = min(65536, end - pos)
+            if drop is not None and sent + n > drop:
+                self.write_body(body(pos, drop - sent), query)
+                self.close_connection = True
+                return
+            self.write_body(body(pos, n), query)
+            pos += n
+            sent += n
+
+    def send_chunked(self, size, query, drop):
+        chunk = max(1, int(query.get('chunk', 8192)))
+        self.send_response(200)
+        self.send_header('Transfer-Encoding', 'chunked')
+        self.end_headers()
+        self.stall(query)
+
+        pos = 0
+        while pos < size:
+            n = min(chunk, size - pos)
+            data = b'%x\r\n' % n + body(pos, n) + b'\r\n'
+            if drop is not None and pos + n > drop:
+                self.write_body(data[:len(data) - 2 - (pos + n - drop)],
+                        query)
+                self.close_connection = True
+                return
+            self.write_body(data, query)
+            pos += n
+        self.wfile.write(b'0\r\n\r\n')
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+    def shutdown_request(self, request):
+        # openssl forgets sessions of connections closed without
+        # close_notify, which would make resumption hit or miss
+        if isinstance(request, ssl.SSLSocket):
+            try:
+                request.settimeout(1)
+                request.unwrap()
+            except (OSError, ValueError):
+                pass
+        super().shutdown_request(request)
+
+def serve(port, cert=None, key=None):
+    server = Server(('127.0.0.1', port), Handler)
+    # accepted sockets inherit it, the tls handshake runs before the handler
+    # gets the connection
+    server.socket.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    if cert is not None:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(cert, key)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    return server
+
+def fingerprint(cert):
+    """sha1 of the first certificate in a pem file, which may hold the key
+    too"""
+    with open(cert) as f:
+        pem = f.read()
+    end = '-----END CERTIFICATE-----'
+    start = pem.index('-----BEGIN CERTIFICATE-----')
+    der = ssl.PEM_cert_to_DER_cert(pem[start:pem.index(end, start) + len(end)])
+    return hashlib.sha1(der).hexdigest().upper()
+
+def main():
+    parser = argparse.ArgumentParser(description='libwaitress test server')
+    parser.add_argument('--port', type=int, default=8090)
+    parser.add_argument('--tls-port', type=int, default=8091)
+    parser.add_argument('--cert', help='pem certificate, enables tls')
+    parser.add_argument('--key', help='pem private key')
+    parser.add_argument('--run', nargs=argparse.REMAINDER,
+            help='run command against the server and exit')
+    args = parser.parse_args()
+
+    if args.run:
+        args.port = args.tls_port = 0
+    plain = serve(args.port)
+    urls = ['http://127.0.0.1:%d/' % plain.server_address[1]]
+    if args.cert is not None:
+        tls = serve(args.tls_port, args.cert, args.key or args.cert)
+        urls += ['http://127.0.0.1:%d/' % tls.server_address[1],
+                fingerprint(args.cert)]
+
+    if args.run:
+        sys.exit(subprocess.call(args.run + urls))
+
+    print(' '.join(urls), flush=True)
+    try:
+        while True:
+            time.sleep(3600)
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == '__main__':
+    main()
@@ -24,7 +24,7 @@ THE SOFTWARE.
 */
 
 #ifndef __FreeBSD__
-#define _POSIX_C_SOURCE 1 /* required by getaddrinfo() */
+#define _POSIX_C_SOURCE 200112L /* required by getaddrinfo(), clock_gettime() */
 #define _BSD_SOURCE /* snprintf() */
 #define _DARWIN_C_SOURCE /* snprintf() on OS X */
 #endif
@@ -49,6 +49,10 @@ THE SOFTWARE.
 	setsockopt(handle, level, optname, (char*)(optval), optlen)
 #define waitress_getsockopt(handle, level, optname, optval, optlen) \
 	getsockopt(handle, level, optname, (char*)(optval), optlen)
+#define waitress_wouldblock()				(WSAGetLastError() == WSAEWOULDBLOCK)
+#define waitress_iovec_t					WSABUF
+#define waitress_iov_set(iov, base, size) \
+	((iov).buf = (CHAR *) (base), (iov).len = (ULONG) (size))
 #else
 #define waitress_size_t_spec				"%zu"
 #define waitress_nfds_t						nfds_t
@@ -59,6 +63,11 @@ THE SOFTWARE.
 	setsockopt(handle, level, optname, optval, optlen)
 #define waitress_getsockopt(handle, level, optname, optval, optlen) \
 	getsockopt(handle, level, optname, optval, optlen)
+#define waitress_wouldblock()				(errno == EAGAIN || errno == EWOULDBLOCK)
+#define waitress_iovec_t					struct iovec
+#define waitress_iov_set(iov, base, size) \
+	((iov).iov_base = (void *) (base), (iov).iov_len = (size))
+#define waitress_writev(handle, iov, iovcnt)	writev(handle, iov, iovcnt)
 #endif
 
 #include "config.h"
@@ -70,15 +79,6 @@ THE SOFTWARE.
 #include <polarssl/ctr_drbg.h>
 #include <polarssl/x509.h>
 #include <polarssl/sha1.h>
-
-struct _polarssl_ctx
-{
-	ssl_context			ssl;
-	ssl_session			session;
-	entropy_context		entrophy;
-	ctr_drbg_context	rnd;
-};
-
 #endif
 
 #include <sys/types.h>
@@ -87,10 +87,17 @@ struct _polarssl_ctx
 #include <winsock2.h>
 #include <windows.h>
 #include <ws2tcpip.h>
+#include <sys/timeb.h>
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #endif
 #include <string.h>
 #include <unistd.h>
@@ -101,11 +108,39 @@ struct _polarssl_ctx
 #include <errno.h>
 #include <assert.h>
 #include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
 
 #if WAITRESS_USE_GNUTLS
+#include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #endif
 
+#if WAITRESS_USE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+#endif
+
+#if WAITRESS_USE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef _WIN32
+/*	writev () on winsock
+ */
+static ssize_t waitress_writev (SOCKET handle, WSABUF *iov, int iovcnt) {
+	DWORD sent = 0;
+
+	if (WSASend (handle, iov, iovcnt, &sent, 0, NULL, NULL) != 0) {
+		return -1;
+	}
+	return (ssize_t) sent;
+}
+#endif
+
 #define strcaseeq(a,b) (waitress_strcasecmp(a,b) == 0)
 #define WAITRESS_HTTP_VERSION "1.1"
 
@@ -114,7 +149,49 @@ typedef struct {
 	size_t pos;
 } WaitressFetchBufCbBuffer_t;
 
-static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *, size_t *);
+static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *);
+static WaitressReturn_t WaitressH2Start (WaitressHandle_t *);
+
+/*	tls library interface, see WAITRESS_USE_* and WaitressTlsSelect. A
+ *	session reads/writes through the socket wrappers of the handle it is
+ *	bound to (WaitressTlsBind), which honor its timeouts and cancellation.
+ */
+typedef struct {
+	const char *name;
+	/* set up the library once per process, false if it is unusable */
+	bool (*init) (void);
+	/* new client session bound to the handle, optionally offering h2 */
+	WaitressTlsSession_t *(*sessionNew) (WaitressHandle_t *, bool);
+	void (*sessionFree) (WaitressTlsSession_t *);
+	/* true when done; on non-blocking sockets the handshake must be
+	 * continued if request.wouldBlock is set */
+	bool (*handshake) (WaitressTlsSession_t *);
+	/* bytes transferred, 0 if the peer closed the connection, -1 on error */
+	ssize_t (*read) (WaitressTlsSession_t *, char *, size_t);
+	ssize_t (*write) (WaitressTlsSession_t *, const char *, size_t);
+	/* sha1 of the peer's certificate, 20 bytes */
+	bool (*fingerprint) (WaitressTlsSession_t *, char *);
+	/* the handshake resumed an imported session */
+	bool (*resumed) (WaitressTlsSession_t *);
+	/* server agreed to talk http/2 */
+	bool (*alpnH2) (WaitressTlsSession_t *);
+	/* decrypted data was not read yet */
+	bool (*pending) (WaitressTlsSession_t *);
+	/* serialize session for resumption (into a malloc'd buffer) and resume
+	 * it in a new session before its handshake */
+	bool (*sessionExport) (WaitressTlsSession_t *, void **, size_t *);
+	bool (*sessionImport) (WaitressTlsSession_t *, const void *, size_t);
+	/* send close notify */
+	void (*bye) (WaitressTlsSession_t *);
+} WaitressTlsProvider_t;
+
+/*	common part of every library's session
+ */
+struct WaitressTlsSession {
+	const WaitressTlsProvider_t *provider;
+	/* handle whose socket wrappers are used */
+	WaitressHandle_t *waith;
+};
 
 #define READ_RET(buf, count, size) \
 		if ((wRet = waith->request.read (waith, buf, count, size)) != \
@@ -123,7 +200,7 @@ static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *, size_t *);
 		}
 
 #define WRITE_RET(buf, count) \
-		if ((wRet = waith->request.write (waith, buf, count)) != WAITRESS_RET_OK) { \
+		if ((wRet = WaitressWriteAll (waith, buf, count)) != WAITRESS_RET_OK) { \
 			return wRet; \
 		}
 
@@ -176,6 +253,15 @@ void WaitressInit (WaitressHandle_t *waith) {
 
 	memset (waith, 0, sizeof (*waith));
 	waith->timeout = 30000;
+	waith->keepAlive = true;
+	waith->retry.maxAttempts = 3;
+	waith->retry.backoffBase = 500;
+	waith->retry.backoffMax = 8000;
+	waith->retry.jitter = 50;
+	waith->sockOpts.recvBuffer = 256*1024;
+	/* requests are written at once, holding back the tls handshake's
+	 * small writes only costs a delayed ack each */
+	waith->sockOpts.noDelay = true;
 }
 
 void WaitressFree (WaitressHandle_t *waith) {
@@ -533,74 +619,277 @@ WaitressReturn_t WaitressFetchBuf (WaitressHandle_t *waith, char **retBuffer) {
 	return wRet;
 }
 
-/*	write () wrapper with poll () timeout
+/*	monotonic clock
+ *	@return microseconds
+ */
+static int64_t WaitressNowUs (void) {
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceFrequency (&freq);
+	QueryPerformanceCounter (&count);
+	return count.QuadPart / freq.QuadPart * 1000000 +
+			count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/*	monotonic clock
+ *	@return milliseconds
+ */
+static int64_t WaitressNow (void) {
+	return WaitressNowUs () / 1000;
+}
+
+/*	deadline for pthread_cond_timedwait (), which uses the realtime clock
+ *	@param set to now plus timeout
+ *	@param milliseconds
+ */
+void WaitressCondDeadline (struct timespec *deadline, const int timeout) {
+#ifdef _WIN32
+	struct __timeb64 now;
+	_ftime64 (&now);
+	deadline->tv_sec = now.time;
+	deadline->tv_nsec = now.millitm * 1000000;
+#else
+	clock_gettime (CLOCK_REALTIME, deadline);
+#endif
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (timeout % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000) {
+		++deadline->tv_sec;
+		deadline->tv_nsec -= 1000000000;
+	}
+}
+
+/*	wait until fd is ready or the handle's request is cancelled
  *	@param waitress handle
- *	@param write buffer
- *	@param write count bytes
- *	@return number of written bytes or -1 on error
+ *	@param socket, -1 to wait for cancellation only
+ *	@param wait for fd to become writable instead of readable
+ *	@param milliseconds
+ *	@return WAITRESS_RET_OK if fd is ready, WAITRESS_RET_TIMEOUT,
+ *		WAITRESS_RET_CANCELLED or WAITRESS_RET_ERR
  */
-static ssize_t WaitressPollWrite (void *data, const void *buf, size_t count) {
-	int pollres = -1;
-	ssize_t retSize;
-	WaitressHandle_t *waith = data;
-	fd_set fds;
+static WaitressReturn_t WaitressWaitFd (const WaitressHandle_t *waith,
+		const int fd, const bool write, const int timeout) {
+	const int cancelFd = waith->cancel != NULL ? waith->cancel->fds[0] : -1;
+	fd_set readFds, writeFds, exceptFds;
 	struct timeval tv;
+	int pollres;
 
-	assert (waith != NULL);
-	assert (buf != NULL);
+	if (fd == -1 && cancelFd == -1) {
+		/* select () fails without sockets on windows */
+#ifdef _WIN32
+		Sleep (timeout);
+#else
+		struct timespec ts;
 
-	/* FIXME: simplify logic */
-	memset (&tv, 0, sizeof (tv));
-	tv.tv_sec = waith->timeout / 1000;
-	tv.tv_usec = (waith->timeout % 1000) * 1000;
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000;
+		while (nanosleep (&ts, &ts) == -1 && errno == EINTR);
+#endif
+		return WAITRESS_RET_TIMEOUT;
+	}
 
-	FD_ZERO (&fds);
-	FD_SET (waith->request.sockfd, &fds);
+	memset (&tv, 0, sizeof (tv));
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	FD_ZERO (&readFds);
+	FD_ZERO (&writeFds);
+	FD_ZERO (&exceptFds);
+	if (fd != -1) {
+		FD_SET (fd, write ? &writeFds : &readFds);
+		FD_SET (fd, &exceptFds);
+	}
+	if (cancelFd != -1) {
+		FD_SET (cancelFd, &readFds);
+	}
 
-	pollres = select (waith->request.sockfd, NULL, &fds, &fds, &tv);
+	pollres = select ((fd > cancelFd ? fd : cancelFd) + 1, &readFds,
+			&writeFds, &exceptFds, &tv);
 	if (pollres == 0) {
-		waith->request.readWriteRet = WAITRESS_RET_TIMEOUT;
-		return -1;
+		return WAITRESS_RET_TIMEOUT;
 	} else if (pollres == -1) {
-		waith->request.readWriteRet = WAITRESS_RET_ERR;
+		return WAITRESS_RET_ERR;
+	} else if (cancelFd != -1 && FD_ISSET (cancelFd, &readFds)) {
+		return WAITRESS_RET_CANCELLED;
+	}
+	return WAITRESS_RET_OK;
+}
+
+/*	was the handle's request cancelled?
+ */
+static bool WaitressCancelled (const WaitressHandle_t *waith) {
+	return waith->cancel != NULL &&
+			WaitressWaitFd (waith, -1, false, 0) == WAITRESS_RET_CANCELLED;
+}
+
+/*	record end of a request phase, once per attempt
+ *	@param waitress handle
+ *	@param field of waith->timing
+ */
+static void WaitressTimingMark (WaitressHandle_t *waith,
+		int64_t * const mark) {
+	if (*mark < 0) {
+		*mark = WaitressNowUs () - waith->request.started;
+	}
+}
+
+/*	forget phases of the previous attempt
+ */
+static void WaitressTimingReset (WaitressHandle_t *waith) {
+	waith->timing.resolved = -1;
+	waith->timing.connected = -1;
+	waith->timing.handshakeDone = -1;
+	waith->timing.requestSent = -1;
+	waith->timing.firstByte = -1;
+	waith->timing.done = -1;
+}
+
+/*	start a phase of the request
+ *	@param waitress handle
+ *	@param time limit in ms, 0 for none
+ */
+static void WaitressPhaseStart (WaitressHandle_t *waith, const int limit) {
+	waith->request.phaseDeadline = limit > 0 ? WaitressNow () + limit : 0;
+}
+
+/*	earliest deadline of a request
+ *	@param waitress handle
+ *	@param time of the last read/write, the next one is due within timeout
+ *	@return absolute time on the monotonic clock
+ */
+static int64_t WaitressDeadline (const WaitressHandle_t *waith,
+		const int64_t lastActivity) {
+	int64_t deadline = lastActivity + waith->timeout;
+
+	if (waith->request.phaseDeadline != 0 &&
+			waith->request.phaseDeadline < deadline) {
+		deadline = waith->request.phaseDeadline;
+	}
+	if (waith->request.totalDeadline != 0 &&
+			waith->request.totalDeadline < deadline) {
+		deadline = waith->request.totalDeadline;
+	}
+	return deadline;
+}
+
+/*	time left for the next blocking read/write
+ *	@return milliseconds, 0 if a deadline passed already
+ */
+static int WaitressTimeLeft (const WaitressHandle_t *waith) {
+	const int64_t now = WaitressNow ();
+	const int64_t left = WaitressDeadline (waith, now) - now;
+
+	return left > 0 ? (int) left : 0;
+}
+
+/*	non-blocking socket is not ready, the caller (or the tls library) has
+ *	to try again once it is
+ *	@param waitress handle
+ *	@param waiting for the socket to become writable (or readable)
+ *	@return return value for read/write wrappers
+ */
+static ssize_t WaitressWouldBlock (WaitressHandle_t *waith, const bool write) {
+	waith->request.wouldBlock = true;
+	waith->request.wantWrite = write;
+	waith->request.readWriteRet = WAITRESS_RET_ERR;
+	return -1;
+}
+
+/*	writev () wrapper with poll () timeout
+ *	@param waitress handle
+ *	@param buffers, written in one go
+ *	@param number of buffers
+ *	@return number of written bytes or -1 on error
+ */
+static ssize_t WaitressPollWritev (WaitressHandle_t *waith,
+		waitress_iovec_t *iov, int iovcnt) {
+	ssize_t retSize;
+
+	assert (waith != NULL);
+	assert (iov != NULL);
+
+	if (!waith->request.nonBlocking &&
+			(waith->request.readWriteRet = WaitressWaitFd (waith,
+			waith->request.sockfd, true, WaitressTimeLeft (waith))) !=
+			WAITRESS_RET_OK) {
 		return -1;
 	}
-	if ((retSize = waitress_write (waith->request.sockfd, buf, count)) == -1) {
+	if ((retSize = waitress_writev (waith->request.sockfd, iov, iovcnt)) ==
+			-1) {
+		if (waith->request.nonBlocking && waitress_wouldblock ()) {
+			return WaitressWouldBlock (waith, true);
+		}
 		waith->request.readWriteRet = WAITRESS_RET_ERR;
 		return -1;
 	}
+	waith->timing.bytesSent += retSize;
 	waith->request.readWriteRet = WAITRESS_RET_OK;
 	return retSize;
 }
 
+/*	write () wrapper with poll () timeout
+ *	@param waitress handle
+ *	@param write buffer
+ *	@param write count bytes
+ *	@return number of written bytes or -1 on error
+ */
+static ssize_t WaitressPollWrite (void *data, const void *buf, size_t count) {
+	waitress_iovec_t iov;
+
+	assert (buf != NULL);
+
+	waitress_iov_set (iov, buf, count);
+	return WaitressPollWritev (data, &iov, 1);
+}
+
 static WaitressReturn_t WaitressOrdinaryWrite (void *data, const char *buf,
-		const size_t size) {
+		const size_t size, size_t *retSize) {
 	WaitressHandle_t *waith = data;
 
-	WaitressPollWrite (waith, buf, size);
+	const ssize_t ret = WaitressPollWrite (waith, buf, size);
+	if (ret >= 0) {
+		*retSize = (size_t) ret;
+	}
 	return waith->request.readWriteRet;
 }
 
 static WaitressReturn_t WaitressTlsWrite (void *data, const char *buf,
-		const size_t size) {
-#if WAITRESS_USE_GNUTLS
+		const size_t size, size_t *retSize) {
 	WaitressHandle_t *waith = data;
+	WaitressTlsSession_t * const session = waith->request.tlsSession;
 
-	if (gnutls_record_send (waith->request.tlsSession, buf, size) < 0) {
-		return WAITRESS_RET_TLS_WRITE_ERR;
+	const ssize_t ret = session->provider->write (session, buf, size);
+	if (ret < 0) {
+		return waith->request.readWriteRet == WAITRESS_RET_CANCELLED ?
+				WAITRESS_RET_CANCELLED : WAITRESS_RET_TLS_WRITE_ERR;
 	}
+	*retSize = (size_t) ret;
 	return waith->request.readWriteRet;
-#endif
+}
 
-#if WAITRESS_USE_POLARSSL
-	WaitressHandle_t *waith = data;
+/*	write whole buffer, blocking
+ */
+static WaitressReturn_t WaitressWriteAll (WaitressHandle_t *waith,
+		const char *buf, size_t size) {
+	while (size > 0) {
+		size_t written = 0;
+		WaitressReturn_t wRet;
 
-	if (ssl_write (&waith->request.sslCtx->ssl, buf, size) < 0) {
-		return WAITRESS_RET_TLS_WRITE_ERR;
+		if ((wRet = waith->request.write (waith, buf, size, &written)) !=
+				WAITRESS_RET_OK) {
+			return wRet;
+		}
+		buf += written;
+		size -= written;
 	}
-
-	return waith->request.readWriteRet;
-#endif
+	return WAITRESS_RET_OK;
 }
 
 /*	read () wrapper with poll () timeout
@@ -610,35 +899,26 @@ static WaitressReturn_t WaitressTlsWrite (void *data, const char *buf,
  *	@return number of read bytes or -1 on error
  */
 static ssize_t WaitressPollRead (void *data, void *buf, size_t count) {
-	int pollres = -1;
 	ssize_t retSize;
 	WaitressHandle_t *waith = data;
-	fd_set fds;
-	struct timeval tv;
 
 	assert (waith != NULL);
 	assert (buf != NULL);
 
-	memset (&tv, 0, sizeof (tv));
-	tv.tv_sec = waith->timeout / 1000;
-	tv.tv_usec = (waith->timeout % 1000) * 1000;
-
-	/* FIXME: simplify logic */
-	FD_ZERO (&fds);
-	FD_SET (waith->request.sockfd, &fds);
-
-	pollres = select (waith->request.sockfd, &fds, NULL, &fds, &tv);
-	if (pollres == 0) {
-		waith->request.readWriteRet = WAITRESS_RET_TIMEOUT;
-		return -1;
-	} else if (pollres == -1) {
-		waith->request.readWriteRet = WAITRESS_RET_ERR;
+	if (!waith->request.nonBlocking &&
+			(waith->request.readWriteRet = WaitressWaitFd (waith,
+			waith->request.sockfd, false, WaitressTimeLeft (waith))) !=
+			WAITRESS_RET_OK) {
 		return -1;
 	}
 	if ((retSize = waitress_read (waith->request.sockfd, buf, count)) == -1) {
+		if (waith->request.nonBlocking && waitress_wouldblock ()) {
+			return WaitressWouldBlock (waith, false);
+		}
 		waith->request.readWriteRet = WAITRESS_RET_READ_ERR;
 		return -1;
 	}
+	waith->timing.bytesReceived += retSize;
 	waith->request.readWriteRet = WAITRESS_RET_OK;
 	return retSize;
 }
@@ -648,7 +928,7 @@ static WaitressReturn_t WaitressOrdinaryRead (void *data, char *buf,
 	WaitressHandle_t *waith = data;
 
 	const ssize_t ret = WaitressPollRead (waith, buf, size);
-	if (ret != -1) {
+	if (ret >= 0) {
 		assert (ret >= 0);
 		*retSize = (size_t) ret;
 	}
@@ -657,43 +937,20 @@ static WaitressReturn_t WaitressOrdinaryRead (void *data, char *buf,
 
 static WaitressReturn_t WaitressTlsRead (void *data, char *buf,
 		const size_t size, size_t *retSize) {
-#if WAITRESS_USE_GNUTLS
 	WaitressHandle_t *waith = data;
+	WaitressTlsSession_t * const session = waith->request.tlsSession;
 
-	ssize_t ret = gnutls_record_recv (waith->request.tlsSession, buf, size);
+	const ssize_t ret = session->provider->read (session, buf, size);
 	if (ret < 0) {
-		return WAITRESS_RET_TLS_READ_ERR;
-	} else {
-		*retSize = ret;
+		return waith->request.readWriteRet == WAITRESS_RET_CANCELLED ?
+				WAITRESS_RET_CANCELLED : WAITRESS_RET_TLS_READ_ERR;
+	}
+	*retSize = (size_t) ret;
+	if (ret == 0) {
+		/* close notify, not an error */
+		waith->request.readWriteRet = WAITRESS_RET_OK;
 	}
 	return waith->request.readWriteRet;
-#endif
-
-#if WAITRESS_USE_POLARSSL
-	WaitressHandle_t *waith = data;
-	int ret;
-
-	*retSize = 0;
-
-	do
-	{
-		ret = ssl_read (&waith->request.sslCtx->ssl, buf, size);
-
-		if (ret == POLARSSL_ERR_SSL_PEER_CLOSE_NOTIFY)
-			return (waith->request.readWriteRet = WAITRESS_RET_OK);
-
-		if (ret < 0)
-			return (waith->request.readWriteRet = WAITRESS_RET_TLS_READ_ERR);
-
-		if (ret >= 0)
-			break;
-
-	} while (1);
-
-	*retSize = ret;
-
-	return (waith->request.readWriteRet = WAITRESS_RET_OK);
-#endif
 }
 
 /*	send basic http authorization
@@ -737,32 +994,94 @@ static const char *WaitressDefaultPort (const WaitressUrl_t * const url) {
 	}
 }
 
-/*	get line from string
- *	@param string beginning/return value of last call
- *	@return start of _next_ line or NULL if there is no next line
+#if WAITRESS_USE_ZLIB
+typedef struct WaitressInflate {
+	z_stream stream;
+	/* end of compressed data was seen, ignore anything after it */
+	bool done;
+	char out[WAITRESS_BUFFER_SIZE];
+} WaitressInflate_t;
+
+/*	set up decompressor for request.contentEncoding
+ *	@param waitress handle
+ *	@param first byte of the compressed body
  */
-static char *WaitressGetline (char * const str) {
-	char *eol;
+static bool WaitressInflateInit (WaitressHandle_t *waith, const char first) {
+	WaitressInflate_t *inf;
+	/* gzip or zlib wrapper, detected automatically */
+	int windowBits = 15 + 32;
+
+	/* some servers send raw deflate data, zlib data starts with method
+	 * 8 and a window size up to 2^15 instead */
+	if (waith->request.contentEncoding == ENCODING_DEFLATE &&
+			((first & 0x0f) != 8 || ((unsigned char) first >> 4) > 7)) {
+		windowBits = -15;
+	}
 
-	assert (str != NULL);
+	if ((inf = calloc (1, sizeof (*inf))) == NULL) {
+		return false;
+	}
+	if (inflateInit2 (&inf->stream, windowBits) != Z_OK) {
+		free (inf);
+		return false;
+	}
+	waith->request.inflate = inf;
+	return true;
+}
 
-	eol = strchr (str, '\n');
-	if (eol == NULL) {
-		return NULL;
+/*	free decompressor
+ */
+static void WaitressInflateFree (WaitressHandle_t *waith) {
+	if (waith->request.inflate != NULL) {
+		inflateEnd (&waith->request.inflate->stream);
+		free (waith->request.inflate);
+		waith->request.inflate = NULL;
 	}
+}
+
+/*	decompress body data and pass it to the callback
+ */
+static WaitressHandlerReturn_t WaitressInflate (WaitressHandle_t *waith,
+		char *buf, const size_t size) {
+	WaitressInflate_t *inf;
 
-	/* make lines parseable by string routines */
-	*eol = '\0';
-	if (eol-1 >= str && *(eol-1) == '\r') {
-		*(eol-1) = '\0';
+	if (waith->request.inflate == NULL &&
+			!WaitressInflateInit (waith, buf[0])) {
+		return WAITRESS_HANDLER_ERR;
 	}
-	/* skip \0 */
-	++eol;
+	inf = waith->request.inflate;
+
+	inf->stream.next_in = (Bytef *) buf;
+	inf->stream.avail_in = size;
+	/* there may be output pending even if all input was consumed */
+	while (!inf->done && (inf->stream.avail_in > 0 ||
+			inf->stream.avail_out == 0)) {
+		size_t produced;
+		int ret;
+
+		inf->stream.next_out = (Bytef *) inf->out;
+		inf->stream.avail_out = sizeof (inf->out);
+		ret = inflate (&inf->stream, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			inf->done = true;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			return WAITRESS_HANDLER_ERR;
+		}
 
-	assert (eol >= str);
+		produced = sizeof (inf->out) - inf->stream.avail_out;
+		if (produced > 0 && waith->callback (inf->out, produced,
+				waith->data) == WAITRESS_CB_RET_ERR) {
+			return WAITRESS_HANDLER_ABORTED;
+		}
+		if (ret == Z_BUF_ERROR) {
+			/* no progress possible, wait for more input */
+			break;
+		}
+	}
 
-	return eol;
+	return WAITRESS_HANDLER_CONTINUE;
 }
+#endif
 
 /*	identity encoding handler
  */
@@ -774,6 +1093,11 @@ static WaitressHandlerReturn_t WaitressHandleIdentity (void *data, char *buf,
 	assert (buf != NULL);
 
 	waith->request.contentReceived += size;
+#if WAITRESS_USE_ZLIB
+	if (waith->request.contentEncoding != ENCODING_IDENTITY) {
+		return WaitressInflate (waith, buf, size);
+	}
+#endif
 	if (waith->callback (buf, size, waith->data) == WAITRESS_CB_RET_ERR) {
 		return WAITRESS_HANDLER_ABORTED;
 	} else {
@@ -789,24 +1113,27 @@ static WaitressHandlerReturn_t WaitressHandleChunked (void *data, char *buf,
 	size_t pos = 0;
 
 	while (pos < size) {
+		const char c = buf[pos];
+
 		switch (waith->request.chunkedState) {
 			case CHUNKSIZE:
-				/* Poor man’s hex to integer. This avoids another buffer that
-				 * fills until the terminating \r\n is received. */
-				if (buf[pos] >= '0' && buf[pos] <= '9') {
-					waith->request.chunkSize <<= 4;
-					waith->request.chunkSize |= buf[pos] & 0xf;
-				} else if (buf[pos] >= 'a' && buf[pos] <= 'f') {
-					waith->request.chunkSize <<= 4;
-					waith->request.chunkSize |= (buf[pos]+9) & 0xf;
-				} else if (buf[pos] == '\r') {
-					/* ignore */
-				} else if (buf[pos] == '\n') {
-					waith->request.chunkedState = DATA;
-					/* last chunk has size 0 */
-					if (waith->request.chunkSize == 0) {
-						return WAITRESS_HANDLER_DONE;
+			case CHUNKEXT:
+				if (c == '\n') {
+					/* last chunk has size 0 and may be followed by trailers */
+					waith->request.chunkedState =
+							waith->request.chunkSize == 0 ? TRAILER : DATA;
+				} else if (c == '\r' || waith->request.chunkedState == CHUNKEXT) {
+					/* ignore, including chunk extensions */
+				} else if (isxdigit ((unsigned char) c)) {
+					/* Poor man’s hex to integer. This avoids another buffer that
+					 * fills until the terminating \r\n is received. */
+					if (waith->request.chunkSize > SIZE_MAX >> 4) {
+						return WAITRESS_HANDLER_ERR;
 					}
+					waith->request.chunkSize <<= 4;
+					waith->request.chunkSize |= (c <= '9' ? c : c+9) & 0xf;
+				} else if (c == ';' || c == ' ' || c == '\t') {
+					waith->request.chunkedState = CHUNKEXT;
 				} else {
 					/* everything else is a protocol violation */
 					return WAITRESS_HANDLER_ERR;
@@ -817,26 +1144,45 @@ static WaitressHandlerReturn_t WaitressHandleChunked (void *data, char *buf,
 			case DATA:
 				if (waith->request.chunkSize > 0) {
 					size_t payloadSize = size - pos;
+					WaitressHandlerReturn_t ret;
 					assert (size >= pos);
 
 					if (payloadSize > waith->request.chunkSize) {
 						payloadSize = waith->request.chunkSize;
 					}
-					if (WaitressHandleIdentity (waith, &buf[pos],
-							payloadSize) == WAITRESS_HANDLER_ABORTED) {
-						return WAITRESS_HANDLER_ABORTED;
+					if ((ret = WaitressHandleIdentity (waith, &buf[pos],
+							payloadSize)) != WAITRESS_HANDLER_CONTINUE) {
+						return ret;
 					}
 					pos += payloadSize;
 					assert (waith->request.chunkSize >= payloadSize);
 					waith->request.chunkSize -= payloadSize;
 				} else {
 					/* next chunk size starts in the next line */
-					if (buf[pos] == '\n') {
+					if (c == '\n') {
 						waith->request.chunkedState = CHUNKSIZE;
 					}
 					++pos;
 				}
 				break;
+
+			case TRAILER:
+				/* an empty line ends the body, anything else is a trailer
+				 * field */
+				if (c == '\n') {
+					return WAITRESS_HANDLER_DONE;
+				} else if (c != '\r') {
+					waith->request.chunkedState = TRAILERLINE;
+				}
+				++pos;
+				break;
+
+			case TRAILERLINE:
+				if (c == '\n') {
+					waith->request.chunkedState = TRAILER;
+				}
+				++pos;
+				break;
 		}
 	}
 
@@ -854,10 +1200,30 @@ static void WaitressHandleHeader (WaitressHandle_t *waith, const char * const ke
 	if (strcaseeq (key, "Content-Length")) {
 		waith->request.contentLength = atol (value);
 		waith->request.contentLengthKnown = true;
+	} else if (strcaseeq (key, "Content-Range")) {
+		/* bytes first-last/total, total may be * (unknown) */
+		const char * const total = strchr (value, '/');
+		if (strncmp (value, "bytes ", 6) == 0 && total != NULL) {
+			waith->request.rangeStart = atol (value + 6);
+			waith->request.rangeTotal = total[1] == '*' ? SIZE_MAX :
+					(size_t) atol (total + 1);
+		}
 	} else if (strcaseeq (key, "Transfer-Encoding")) {
 		if (strcaseeq (value, "chunked")) {
 			waith->request.dataHandler = WaitressHandleChunked;
 		}
+	} else if (strcaseeq (key, "Connection")) {
+		if (strcaseeq (value, "close")) {
+			waith->request.keepAlive = false;
+		}
+#if WAITRESS_USE_ZLIB
+	} else if (strcaseeq (key, "Content-Encoding")) {
+		if (strcaseeq (value, "gzip") || strcaseeq (value, "x-gzip")) {
+			waith->request.contentEncoding = ENCODING_GZIP;
+		} else if (strcaseeq (value, "deflate")) {
+			waith->request.contentEncoding = ENCODING_DEFLATE;
+		}
+#endif
 	}
 }
 
@@ -874,38 +1240,107 @@ static int WaitressParseStatusline (const char * const line) {
 	return -1;
 }
 
-/*	verify server certificate
+/*	evaluate status line collected in request.hdrValue
  */
-static WaitressReturn_t WaitressTlsVerify (const WaitressHandle_t *waith) {
-#if WAITRESS_USE_GNUTLS
-	gnutls_session_t session = waith->request.tlsSession;
-	unsigned int certListSize;
-	const gnutls_datum_t *certList;
-	gnutls_x509_crt_t cert;
-	char fingerprint[20];
-	size_t fingerprintSize;
+static WaitressReturn_t WaitressHandleStatusline (WaitressHandle_t *waith) {
+	char * const line = waith->request.hdrValue;
 
-	if (gnutls_certificate_type_get (session) != GNUTLS_CRT_X509) {
-		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+	/* long reason phrases are cut off */
+	if (waith->request.hdrValueLen >= sizeof (waith->request.hdrValue)) {
+		waith->request.hdrValueLen = sizeof (waith->request.hdrValue) - 1;
 	}
+	line[waith->request.hdrValueLen] = '\0';
+	waith->request.hdrValueLen = 0;
 
-	if ((certList = gnutls_certificate_get_peers (session,
-			&certListSize)) == NULL) {
-		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+	/* http/1.0 servers close the connection by default */
+	if (strncmp (line, "HTTP/1.0", 8) == 0) {
+		waith->request.keepAlive = false;
 	}
 
-	if (gnutls_x509_crt_init (&cert) != GNUTLS_E_SUCCESS) {
-		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+	switch (WaitressParseStatusline (line)) {
+		case 200:
+		case 206:
+			waith->request.hdrParseMode = HDRM_LINES;
+			break;
+
+		case 400:
+			return WAITRESS_RET_BAD_REQUEST;
+			break;
+
+		case 403:
+			return WAITRESS_RET_FORBIDDEN;
+			break;
+
+		case 404:
+			return WAITRESS_RET_NOTFOUND;
+			break;
+
+		case 502:
+		case 503:
+		case 504:
+			return WAITRESS_RET_SERVICE_UNAVAILABLE;
+			break;
+
+		case 407:
+			/* Fix for GlobalPandora.com. Proxy sometimes 'miss' credentials.
+			 * Same request send again is handled properly.
+			 */
+			if (WaitressProxyEnabled (waith))
+				return WAITRESS_RET_RETRY;
+			else
+				return WAITRESS_RET_STATUS_UNKNOWN;
+			break;
+
+		case -1:
+			/* ignore invalid line */
+			break;
+
+		default:
+			return WAITRESS_RET_STATUS_UNKNOWN;
+			break;
 	}
 
-	if (gnutls_x509_crt_import (cert, &certList[0],
-			GNUTLS_X509_FMT_DER) != GNUTLS_E_SUCCESS) {
-		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+	return WAITRESS_RET_OK;
+}
+
+/*	append byte to header token
+ *	@param token buffer
+ *	@param token length, grows beyond buffer size if the token does not fit
+ *	@param buffer size
+ *	@param byte
+ */
+static void WaitressHeaderAppend (char * const token, size_t * const len,
+		const size_t size, const char c) {
+	if (*len < size-1) {
+		token[*len] = c;
 	}
+	if (*len < size) {
+		++*len;
+	}
+}
+
+/*	strip trailing whitespace and terminate header token
+ *	@return false if the token was too long
+ */
+static bool WaitressHeaderTerminate (char * const token, size_t * const len,
+		const size_t size) {
+	if (*len >= size) {
+		return false;
+	}
+	while (*len > 0 && isspace ((unsigned char) token[*len-1])) {
+		--*len;
+	}
+	token[*len] = '\0';
+	return true;
+}
 
-	fingerprintSize = sizeof (fingerprint);
-	if (gnutls_x509_crt_get_fingerprint (cert, GNUTLS_DIG_SHA1, fingerprint,
-			&fingerprintSize) != 0) {
+/*	verify server certificate
+ */
+static WaitressReturn_t WaitressTlsVerify (const WaitressHandle_t *waith) {
+	WaitressTlsSession_t * const session = waith->request.tlsSession;
+	char fingerprint[20];
+
+	if (!session->provider->fingerprint (session, fingerprint)) {
 		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
 	}
 
@@ -914,486 +1349,5647 @@ static WaitressReturn_t WaitressTlsVerify (const WaitressHandle_t *waith) {
 		return WAITRESS_RET_TLS_FINGERPRINT_MISMATCH;
 	}
 
-	gnutls_x509_crt_deinit (cert);
-
 	return WAITRESS_RET_OK;
-#endif
+}
+
+static void WaitressDisableBlocking(int sockfd)
+{
+	#ifdef _WIN32
+	u_long iMode = 1;
+	ioctlsocket(sockfd, FIONBIO, &iMode);
+	#else
+	fcntl (sockfd, F_SETFL, O_NONBLOCK);
+	#endif
+	}
+
+#if WAITRESS_USE_GNUTLS
+/* credentials and priorities shared by all sessions, see WaitressGnutlsInit */
+static struct {
+	pthread_once_t once;
+	bool ok;
+	gnutls_certificate_credentials_t cred;
+	gnutls_priority_t priority;
+} waitressGnutls = {PTHREAD_ONCE_INIT};
+
+typedef struct {
+	WaitressTlsSession_t base;
+	gnutls_session_t session;
+} WaitressGnutlsSession_t;
+
+static const WaitressTlsProvider_t waitressTlsGnutls;
+
+static void WaitressGnutlsGlobalFree (void) {
+	gnutls_priority_deinit (waitressGnutls.priority);
+	gnutls_certificate_free_credentials (waitressGnutls.cred);
+	waitressGnutls.ok = false;
+}
+
+static void WaitressGnutlsGlobalInit (void) {
+	if (gnutls_certificate_allocate_credentials (&waitressGnutls.cred) !=
+			GNUTLS_E_SUCCESS) {
+		return;
+	}
+	if (gnutls_priority_init (&waitressGnutls.priority, "NORMAL", NULL) !=
+			GNUTLS_E_SUCCESS) {
+		gnutls_certificate_free_credentials (waitressGnutls.cred);
+		return;
+	}
+
+	waitressGnutls.ok = true;
+	atexit (WaitressGnutlsGlobalFree);
+}
+
+static bool WaitressGnutlsInit (void) {
+	pthread_once (&waitressGnutls.once, WaitressGnutlsGlobalInit);
+	return waitressGnutls.ok;
+}
+
+/*	transport functions, gnutls retries if errno is EAGAIN
+ */
+static ssize_t WaitressGnutlsPull (gnutls_transport_ptr_t data, void *buf,
+		size_t size) {
+	WaitressGnutlsSession_t * const s = data;
+
+	const ssize_t ret = WaitressPollRead (s->base.waith, buf, size);
+	if (ret < 0 && s->base.waith->request.wouldBlock) {
+		gnutls_transport_set_errno (s->session, EAGAIN);
+	}
+	return ret;
+}
+
+static ssize_t WaitressGnutlsPush (gnutls_transport_ptr_t data,
+		const void *buf, size_t size) {
+	WaitressGnutlsSession_t * const s = data;
+
+	const ssize_t ret = WaitressPollWrite (s->base.waith, buf, size);
+	if (ret < 0 && s->base.waith->request.wouldBlock) {
+		gnutls_transport_set_errno (s->session, EAGAIN);
+	}
+	return ret;
+}
+
+static WaitressTlsSession_t *WaitressGnutlsSessionNew (
+		WaitressHandle_t *waith, const bool h2) {
+	WaitressGnutlsSession_t *s;
+
+	if ((s = calloc (1, sizeof (*s))) == NULL) {
+		return NULL;
+	}
+	if (gnutls_init (&s->session, GNUTLS_CLIENT) != GNUTLS_E_SUCCESS) {
+		free (s);
+		return NULL;
+	}
+	gnutls_priority_set (s->session, waitressGnutls.priority);
+	if (gnutls_credentials_set (s->session, GNUTLS_CRD_CERTIFICATE,
+			waitressGnutls.cred) != GNUTLS_E_SUCCESS) {
+		gnutls_deinit (s->session);
+		free (s);
+		return NULL;
+	}
+
+	/* set up custom read/write functions */
+	gnutls_transport_set_ptr (s->session, (gnutls_transport_ptr_t) s);
+	gnutls_transport_set_pull_function (s->session, WaitressGnutlsPull);
+	gnutls_transport_set_push_function (s->session, WaitressGnutlsPush);
+
+	if (h2) {
+		static const gnutls_datum_t protocols[] = {
+				{(unsigned char *) "h2", 2},
+				{(unsigned char *) "http/1.1", 8}};
+		gnutls_alpn_set_protocols (s->session, protocols, 2, 0);
+	}
+
+	s->base.provider = &waitressTlsGnutls;
+	s->base.waith = waith;
+	return &s->base;
+}
+
+static void WaitressGnutlsSessionFree (WaitressTlsSession_t *session) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+
+	gnutls_deinit (s->session);
+	free (s);
+}
+
+static bool WaitressGnutlsHandshake (WaitressTlsSession_t *session) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+
+	return gnutls_handshake (s->session) == GNUTLS_E_SUCCESS;
+}
+
+static ssize_t WaitressGnutlsRead (WaitressTlsSession_t *session, char *buf,
+		size_t size) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+	ssize_t ret;
+
+	/* post-handshake messages like tls 1.3 session tickets are consumed
+	 * silently and reported as GNUTLS_E_AGAIN */
+	do {
+		ret = gnutls_record_recv (s->session, buf, size);
+	} while ((ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED) &&
+			session->waith->request.readWriteRet == WAITRESS_RET_OK);
+	return ret < 0 ? -1 : ret;
+}
+
+static ssize_t WaitressGnutlsWrite (WaitressTlsSession_t *session,
+		const char *buf, size_t size) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+
+	const ssize_t ret = gnutls_record_send (s->session, buf, size);
+	return ret < 0 ? -1 : ret;
+}
+
+static bool WaitressGnutlsFingerprint (WaitressTlsSession_t *session,
+		char *fingerprint) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+	unsigned int certListSize;
+	const gnutls_datum_t *certList;
+	gnutls_x509_crt_t cert;
+	size_t fingerprintSize = 20;
+	bool ok;
+
+	if (gnutls_certificate_type_get (s->session) != GNUTLS_CRT_X509) {
+		return false;
+	}
+
+	if ((certList = gnutls_certificate_get_peers (s->session,
+			&certListSize)) == NULL) {
+		return false;
+	}
+
+	if (gnutls_x509_crt_init (&cert) != GNUTLS_E_SUCCESS) {
+		return false;
+	}
+
+	ok = gnutls_x509_crt_import (cert, &certList[0],
+			GNUTLS_X509_FMT_DER) == GNUTLS_E_SUCCESS &&
+			gnutls_x509_crt_get_fingerprint (cert, GNUTLS_DIG_SHA1,
+			fingerprint, &fingerprintSize) == 0 && fingerprintSize == 20;
+	gnutls_x509_crt_deinit (cert);
+
+	return ok;
+}
+
+static bool WaitressGnutlsResumed (WaitressTlsSession_t *session) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+
+	return gnutls_session_is_resumed (s->session) != 0;
+}
+
+static bool WaitressGnutlsAlpnH2 (WaitressTlsSession_t *session) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+	gnutls_datum_t protocol;
+
+	return gnutls_alpn_get_selected_protocol (s->session, &protocol) ==
+			GNUTLS_E_SUCCESS && protocol.size == 2 &&
+			memcmp (protocol.data, "h2", 2) == 0;
+}
+
+static bool WaitressGnutlsPending (WaitressTlsSession_t *session) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+
+	return gnutls_record_check_pending (s->session) > 0;
+}
+
+static bool WaitressGnutlsSessionExport (WaitressTlsSession_t *session,
+		void **data, size_t *size) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+	gnutls_datum_t datum;
+
+	if (gnutls_session_get_data2 (s->session, &datum) != GNUTLS_E_SUCCESS) {
+		return false;
+	}
+	/* gnutls may use its own allocator */
+	if ((*data = malloc (datum.size)) == NULL) {
+		gnutls_free (datum.data);
+		return false;
+	}
+	memcpy (*data, datum.data, datum.size);
+	*size = datum.size;
+	gnutls_free (datum.data);
+
+	return true;
+}
+
+static bool WaitressGnutlsSessionImport (WaitressTlsSession_t *session,
+		const void *data, size_t size) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+
+	return gnutls_session_set_data (s->session, data, size) ==
+			GNUTLS_E_SUCCESS;
+}
+
+static void WaitressGnutlsBye (WaitressTlsSession_t *session) {
+	WaitressGnutlsSession_t * const s = (WaitressGnutlsSession_t *) session;
+
+	gnutls_bye (s->session, GNUTLS_SHUT_RDWR);
+}
+
+static const WaitressTlsProvider_t waitressTlsGnutls = {
+	"gnutls",
+	WaitressGnutlsInit,
+	WaitressGnutlsSessionNew,
+	WaitressGnutlsSessionFree,
+	WaitressGnutlsHandshake,
+	WaitressGnutlsRead,
+	WaitressGnutlsWrite,
+	WaitressGnutlsFingerprint,
+	WaitressGnutlsResumed,
+	WaitressGnutlsAlpnH2,
+	WaitressGnutlsPending,
+	WaitressGnutlsSessionExport,
+	WaitressGnutlsSessionImport,
+	WaitressGnutlsBye,
+};
+#endif
+
+#if WAITRESS_USE_POLARSSL
+/* seeding the random number generator is expensive, so it is shared by all
+ * sessions; see WaitressPolarsslInit */
+static struct {
+	pthread_once_t once;
+	bool ok;
+	entropy_context entropy;
+	ctr_drbg_context rnd;
+	/* ctr_drbg is not thread-safe */
+	pthread_mutex_t rndLock;
+} waitressPolarssl = {PTHREAD_ONCE_INIT};
+
+typedef struct {
+	WaitressTlsSession_t base;
+	ssl_context ssl;
+	ssl_session session;
+} WaitressPolarsslSession_t;
+
+static const WaitressTlsProvider_t waitressTlsPolarssl;
+
+static void WaitressPolarsslGlobalInit (void) {
+	pthread_mutex_init (&waitressPolarssl.rndLock, NULL);
+	entropy_init (&waitressPolarssl.entropy);
+	if (ctr_drbg_init (&waitressPolarssl.rnd, entropy_func,
+			&waitressPolarssl.entropy, (unsigned char *) "libwaitress", 11)
+			!= 0) {
+		return;
+	}
+	waitressPolarssl.ok = true;
+}
+
+static bool WaitressPolarsslInit (void) {
+	pthread_once (&waitressPolarssl.once, WaitressPolarsslGlobalInit);
+	return waitressPolarssl.ok;
+}
+
+static int WaitressPolarsslRandom (void *data, unsigned char *out,
+		size_t len) {
+	int ret;
+
+	pthread_mutex_lock (&waitressPolarssl.rndLock);
+	ret = ctr_drbg_random (data, out, len);
+	pthread_mutex_unlock (&waitressPolarssl.rndLock);
+
+	return ret;
+}
+
+/*	transport functions, polarssl retries on WANT_READ/WANT_WRITE
+ */
+static int WaitressPolarsslRecv (void *data, unsigned char *buf,
+		size_t size) {
+	WaitressPolarsslSession_t * const s = data;
+
+	const ssize_t ret = WaitressPollRead (s->base.waith, buf, size);
+	if (ret < 0 && s->base.waith->request.wouldBlock) {
+		return POLARSSL_ERR_NET_WANT_READ;
+	}
+	return (int) ret;
+}
+
+static int WaitressPolarsslSend (void *data, const unsigned char *buf,
+		size_t size) {
+	WaitressPolarsslSession_t * const s = data;
+
+	const ssize_t ret = WaitressPollWrite (s->base.waith, buf, size);
+	if (ret < 0 && s->base.waith->request.wouldBlock) {
+		return POLARSSL_ERR_NET_WANT_WRITE;
+	}
+	return (int) ret;
+}
+
+static WaitressTlsSession_t *WaitressPolarsslSessionNew (
+		WaitressHandle_t *waith, const bool h2) {
+	WaitressPolarsslSession_t *s;
+
+	if ((s = calloc (1, sizeof (*s))) == NULL) {
+		return NULL;
+	}
+	if (ssl_init (&s->ssl) != 0) {
+		free (s);
+		return NULL;
+	}
+	ssl_set_endpoint (&s->ssl, SSL_IS_CLIENT);
+	ssl_set_authmode (&s->ssl, SSL_VERIFY_NONE);
+	ssl_set_rng (&s->ssl, WaitressPolarsslRandom, &waitressPolarssl.rnd);
+	ssl_set_ciphersuites (&s->ssl, ssl_default_ciphersuites);
+	ssl_set_session (&s->ssl, 1, WAITRESS_TLS_SESSION_TIMEOUT, &s->session);
+	ssl_set_bio (&s->ssl, WaitressPolarsslRecv, s, WaitressPolarsslSend, s);
+#ifdef POLARSSL_SSL_ALPN
+	if (h2) {
+		static const char *protocols[] = {"h2", "http/1.1", NULL};
+		ssl_set_alpn_protocols (&s->ssl, protocols);
+	}
+#else
+	(void) h2;
+#endif
+
+	s->base.provider = &waitressTlsPolarssl;
+	s->base.waith = waith;
+	return &s->base;
+}
+
+static void WaitressPolarsslSessionFree (WaitressTlsSession_t *session) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	ssl_free (&s->ssl);
+	free (s);
+}
+
+static bool WaitressPolarsslHandshake (WaitressTlsSession_t *session) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	return ssl_handshake (&s->ssl) == 0;
+}
+
+static ssize_t WaitressPolarsslRead (WaitressTlsSession_t *session,
+		char *buf, size_t size) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	const int ret = ssl_read (&s->ssl, (unsigned char *) buf, size);
+	if (ret == POLARSSL_ERR_SSL_PEER_CLOSE_NOTIFY) {
+		return 0;
+	}
+	return ret < 0 ? -1 : ret;
+}
+
+static ssize_t WaitressPolarsslWrite (WaitressTlsSession_t *session,
+		const char *buf, size_t size) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	const int ret = ssl_write (&s->ssl, (const unsigned char *) buf, size);
+	return ret < 0 ? -1 : ret;
+}
+
+static bool WaitressPolarsslFingerprint (WaitressTlsSession_t *session,
+		char *fingerprint) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+	const x509_cert * const cert = s->ssl.peer_cert;
+
+	if (cert == NULL) {
+		return false;
+	}
+	sha1 (cert->raw.p, cert->raw.len, (unsigned char *) fingerprint);
+	return true;
+}
+
+static bool WaitressPolarsslResumed (WaitressTlsSession_t *session) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	return s->ssl.resume != 0;
+}
+
+static bool WaitressPolarsslAlpnH2 (WaitressTlsSession_t *session) {
+#ifdef POLARSSL_SSL_ALPN
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+	const char * const protocol = ssl_get_alpn_protocol (&s->ssl);
+
+	return protocol != NULL && strcmp (protocol, "h2") == 0;
+#else
+	(void) session;
+	return false;
+#endif
+}
+
+static bool WaitressPolarsslPending (WaitressTlsSession_t *session) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	return ssl_get_bytes_avail (&s->ssl) > 0;
+}
+
+/*	sessions hold no pointers but next, which is cleared
+ */
+static bool WaitressPolarsslSessionExport (WaitressTlsSession_t *session,
+		void **data, size_t *size) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+	ssl_session *copy;
+
+	if (s->session.length == 0) {
+		/* server does not support resumption */
+		return false;
+	}
+	if ((copy = malloc (sizeof (*copy))) == NULL) {
+		return false;
+	}
+	memcpy (copy, &s->session, sizeof (*copy));
+	copy->next = NULL;
+	*data = copy;
+	*size = sizeof (*copy);
+
+	return true;
+}
+
+static bool WaitressPolarsslSessionImport (WaitressTlsSession_t *session,
+		const void *data, size_t size) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	if (size != sizeof (s->session)) {
+		return false;
+	}
+	memcpy (&s->session, data, sizeof (s->session));
+	s->session.next = NULL;
+
+	return true;
+}
+
+static void WaitressPolarsslBye (WaitressTlsSession_t *session) {
+	WaitressPolarsslSession_t * const s =
+			(WaitressPolarsslSession_t *) session;
+
+	ssl_close_notify (&s->ssl);
+}
+
+static const WaitressTlsProvider_t waitressTlsPolarssl = {
+	"polarssl",
+	WaitressPolarsslInit,
+	WaitressPolarsslSessionNew,
+	WaitressPolarsslSessionFree,
+	WaitressPolarsslHandshake,
+	WaitressPolarsslRead,
+	WaitressPolarsslWrite,
+	WaitressPolarsslFingerprint,
+	WaitressPolarsslResumed,
+	WaitressPolarsslAlpnH2,
+	WaitressPolarsslPending,
+	WaitressPolarsslSessionExport,
+	WaitressPolarsslSessionImport,
+	WaitressPolarsslBye,
+};
+#endif
+
+#if WAITRESS_USE_OPENSSL
+/* context and socket wrapper bio shared by all sessions, see
+ * WaitressOpensslInit */
+static struct {
+	pthread_once_t once;
+	bool ok;
+	SSL_CTX *ctx;
+	BIO_METHOD *bio;
+} waitressOpenssl = {PTHREAD_ONCE_INIT};
+
+typedef struct {
+	WaitressTlsSession_t base;
+	SSL *ssl;
+} WaitressOpensslSession_t;
+
+static const WaitressTlsProvider_t waitressTlsOpenssl;
+
+/*	bio reading/writing through the handle's socket wrappers
+ */
+static int WaitressOpensslBioRead (BIO *bio, char *buf, int size) {
+	WaitressOpensslSession_t * const s = BIO_get_data (bio);
+
+	const ssize_t ret = WaitressPollRead (s->base.waith, buf, size);
+	BIO_clear_retry_flags (bio);
+	if (ret < 0 && s->base.waith->request.wouldBlock) {
+		BIO_set_retry_read (bio);
+	}
+	return (int) ret;
+}
+
+static int WaitressOpensslBioWrite (BIO *bio, const char *buf, int size) {
+	WaitressOpensslSession_t * const s = BIO_get_data (bio);
+
+	const ssize_t ret = WaitressPollWrite (s->base.waith, buf, size);
+	BIO_clear_retry_flags (bio);
+	if (ret < 0 && s->base.waith->request.wouldBlock) {
+		BIO_set_retry_write (bio);
+	}
+	return (int) ret;
+}
+
+static long WaitressOpensslBioCtrl (BIO *bio, int cmd, long num, void *ptr) {
+	(void) bio;
+	(void) num;
+	(void) ptr;
+	/* nothing is buffered */
+	return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+}
+
+static int WaitressOpensslBioCreate (BIO *bio) {
+	BIO_set_init (bio, 1);
+	return 1;
+}
+
+static void WaitressOpensslGlobalFree (void) {
+	SSL_CTX_free (waitressOpenssl.ctx);
+	BIO_meth_free (waitressOpenssl.bio);
+	waitressOpenssl.ok = false;
+}
+
+static void WaitressOpensslGlobalInit (void) {
+	if ((waitressOpenssl.ctx = SSL_CTX_new (TLS_client_method ())) == NULL) {
+		return;
+	}
+	/* the certificate is checked by WaitressTlsVerify, sessions are cached
+	 * by WaitressTlsCacheStore */
+	SSL_CTX_set_verify (waitressOpenssl.ctx, SSL_VERIFY_NONE, NULL);
+	SSL_CTX_set_session_cache_mode (waitressOpenssl.ctx, SSL_SESS_CACHE_OFF);
+
+	if ((waitressOpenssl.bio = BIO_meth_new (BIO_get_new_index () |
+			BIO_TYPE_SOURCE_SINK, "waitress")) == NULL) {
+		SSL_CTX_free (waitressOpenssl.ctx);
+		return;
+	}
+	BIO_meth_set_read (waitressOpenssl.bio, WaitressOpensslBioRead);
+	BIO_meth_set_write (waitressOpenssl.bio, WaitressOpensslBioWrite);
+	BIO_meth_set_ctrl (waitressOpenssl.bio, WaitressOpensslBioCtrl);
+	BIO_meth_set_create (waitressOpenssl.bio, WaitressOpensslBioCreate);
+
+	waitressOpenssl.ok = true;
+	atexit (WaitressOpensslGlobalFree);
+}
+
+static bool WaitressOpensslInit (void) {
+	pthread_once (&waitressOpenssl.once, WaitressOpensslGlobalInit);
+	return waitressOpenssl.ok;
+}
+
+static WaitressTlsSession_t *WaitressOpensslSessionNew (
+		WaitressHandle_t *waith, const bool h2) {
+	WaitressOpensslSession_t *s;
+	BIO *bio;
+
+	if ((s = calloc (1, sizeof (*s))) == NULL) {
+		return NULL;
+	}
+	if ((s->ssl = SSL_new (waitressOpenssl.ctx)) == NULL) {
+		free (s);
+		return NULL;
+	}
+	if ((bio = BIO_new (waitressOpenssl.bio)) == NULL) {
+		SSL_free (s->ssl);
+		free (s);
+		return NULL;
+	}
+	BIO_set_data (bio, s);
+	SSL_set_bio (s->ssl, bio, bio);
+
+	if (h2) {
+		static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+		SSL_set_alpn_protos (s->ssl, protocols, sizeof (protocols) - 1);
+	}
+
+	s->base.provider = &waitressTlsOpenssl;
+	s->base.waith = waith;
+	return &s->base;
+}
+
+static void WaitressOpensslSessionFree (WaitressTlsSession_t *session) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+
+	/* frees the bio too */
+	SSL_free (s->ssl);
+	free (s);
+}
+
+static bool WaitressOpensslHandshake (WaitressTlsSession_t *session) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+
+	ERR_clear_error ();
+	return SSL_connect (s->ssl) == 1;
+}
+
+static ssize_t WaitressOpensslRead (WaitressTlsSession_t *session, char *buf,
+		size_t size) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+	int ret;
+
+	ERR_clear_error ();
+	if ((ret = SSL_read (s->ssl, buf, size > INT_MAX ? INT_MAX : size)) > 0) {
+		return ret;
+	}
+	return SSL_get_error (s->ssl, ret) == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+static ssize_t WaitressOpensslWrite (WaitressTlsSession_t *session,
+		const char *buf, size_t size) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+	int ret;
+
+	ERR_clear_error ();
+	ret = SSL_write (s->ssl, buf, size > INT_MAX ? INT_MAX : size);
+	return ret > 0 ? ret : -1;
+}
+
+static bool WaitressOpensslFingerprint (WaitressTlsSession_t *session,
+		char *fingerprint) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+	unsigned int size = 0;
+	X509 *cert;
+	bool ok;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	cert = SSL_get1_peer_certificate (s->ssl);
+#else
+	cert = SSL_get_peer_certificate (s->ssl);
+#endif
+	if (cert == NULL) {
+		return false;
+	}
+	ok = X509_digest (cert, EVP_sha1 (), (unsigned char *) fingerprint,
+			&size) == 1 && size == 20;
+	X509_free (cert);
+
+	return ok;
+}
+
+static bool WaitressOpensslResumed (WaitressTlsSession_t *session) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+
+	return SSL_session_reused (s->ssl) == 1;
+}
+
+static bool WaitressOpensslAlpnH2 (WaitressTlsSession_t *session) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+	const unsigned char *protocol;
+	unsigned int size;
+
+	SSL_get0_alpn_selected (s->ssl, &protocol, &size);
+	return size == 2 && memcmp (protocol, "h2", 2) == 0;
+}
+
+static bool WaitressOpensslPending (WaitressTlsSession_t *session) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+
+	return SSL_pending (s->ssl) > 0;
+}
+
+static bool WaitressOpensslSessionExport (WaitressTlsSession_t *session,
+		void **data, size_t *size) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+	SSL_SESSION * const sess = SSL_get_session (s->ssl);
+	unsigned char *p;
+	int len;
+
+	/* tls 1.3 sessions become resumable once a ticket arrived */
+	if (sess == NULL || !SSL_SESSION_is_resumable (sess) ||
+			(len = i2d_SSL_SESSION (sess, NULL)) <= 0) {
+		return false;
+	}
+	if ((*data = malloc (len)) == NULL) {
+		return false;
+	}
+	p = *data;
+	i2d_SSL_SESSION (sess, &p);
+	*size = len;
+
+	return true;
+}
+
+static bool WaitressOpensslSessionImport (WaitressTlsSession_t *session,
+		const void *data, size_t size) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+	const unsigned char *p = data;
+	SSL_SESSION *sess;
+	bool ok;
+
+	if ((sess = d2i_SSL_SESSION (NULL, &p, size)) == NULL) {
+		return false;
+	}
+	ok = SSL_set_session (s->ssl, sess) == 1;
+	SSL_SESSION_free (sess);
+
+	return ok;
+}
+
+static void WaitressOpensslBye (WaitressTlsSession_t *session) {
+	WaitressOpensslSession_t * const s = (WaitressOpensslSession_t *) session;
+
+	SSL_shutdown (s->ssl);
+}
+
+static const WaitressTlsProvider_t waitressTlsOpenssl = {
+	"openssl",
+	WaitressOpensslInit,
+	WaitressOpensslSessionNew,
+	WaitressOpensslSessionFree,
+	WaitressOpensslHandshake,
+	WaitressOpensslRead,
+	WaitressOpensslWrite,
+	WaitressOpensslFingerprint,
+	WaitressOpensslResumed,
+	WaitressOpensslAlpnH2,
+	WaitressOpensslPending,
+	WaitressOpensslSessionExport,
+	WaitressOpensslSessionImport,
+	WaitressOpensslBye,
+};
+#endif
+
+/* compiled in tls libraries, the first one is the default */
+static const WaitressTlsProvider_t * const waitressTlsProviders[] = {
+#if WAITRESS_USE_GNUTLS
+	&waitressTlsGnutls,
+#endif
+#if WAITRESS_USE_POLARSSL
+	&waitressTlsPolarssl,
+#endif
+#if WAITRESS_USE_OPENSSL
+	&waitressTlsOpenssl,
+#endif
+	NULL,
+};
+
+/* library used for new connections, protected by lock */
+static struct {
+	pthread_mutex_t lock;
+	const WaitressTlsProvider_t *provider;
+} waitressTlsSelected = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+/*	pick tls library for new connections, existing ones keep theirs
+ *	@param library name (gnutls, polarssl, openssl) or NULL for the default
+ *	@return false if the library was not compiled in
+ */
+bool WaitressTlsSelect (const char *name) {
+	const WaitressTlsProvider_t * const *provider = waitressTlsProviders;
+
+	if (name != NULL) {
+		while (*provider != NULL && strcmp ((*provider)->name, name) != 0) {
+			++provider;
+		}
+		if (*provider == NULL) {
+			return false;
+		}
+	}
+
+	pthread_mutex_lock (&waitressTlsSelected.lock);
+	waitressTlsSelected.provider = *provider;
+	pthread_mutex_unlock (&waitressTlsSelected.lock);
+
+	return true;
+}
+
+/*	tls library for new connections
+ */
+static const WaitressTlsProvider_t *WaitressTlsProvider (void) {
+	const WaitressTlsProvider_t *provider;
+
+	pthread_mutex_lock (&waitressTlsSelected.lock);
+	provider = waitressTlsSelected.provider;
+	pthread_mutex_unlock (&waitressTlsSelected.lock);
+
+	return provider != NULL ? provider : waitressTlsProviders[0];
+}
+
+/*	name of the tls library used for new connections, NULL if there is none
+ */
+const char *WaitressTlsSelected (void) {
+	const WaitressTlsProvider_t * const provider = WaitressTlsProvider ();
+
+	return provider != NULL ? provider->name : NULL;
+}
+
+/*	cached tls session, resumed by the next connection to the same host
+ */
+typedef struct WaitressTlsCacheEntry {
+	char *key;
+	time_t stored;
+	/* fingerprint the peer was verified against */
+	char tlsFingerprint[20];
+	/* exported session, only the library that exported it can resume it */
+	const WaitressTlsProvider_t *provider;
+	void *data;
+	size_t size;
+	struct WaitressTlsCacheEntry *next;
+} WaitressTlsCacheEntry_t;
+
+/* shared by all handles, protected by lock */
+static struct {
+	pthread_mutex_t lock;
+	WaitressTlsCacheEntry_t *entries;
+} waitressTlsCache = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+static char *WaitressTlsCacheKey (const WaitressHandle_t *waith) {
+	char key[1024];
+
+	waitress_snprintf (key, sizeof (key), "%s:%s", waith->url.host,
+			WaitressDefaultPort (&waith->url));
+	return waitress_strdup (key);
+}
+
+static void WaitressTlsCacheEntryFree (WaitressTlsCacheEntry_t *entry) {
+	free (entry->data);
+	free (entry->key);
+	free (entry);
+}
+
+/*	unlink cache entry for key, caller must hold the lock
+ */
+static WaitressTlsCacheEntry_t *WaitressTlsCacheUnlink (const char *key) {
+	WaitressTlsCacheEntry_t **prev = &waitressTlsCache.entries;
+
+	while (*prev != NULL) {
+		WaitressTlsCacheEntry_t * const cur = *prev;
+		if (strcmp (cur->key, key) == 0) {
+			*prev = cur->next;
+			cur->next = NULL;
+			return cur;
+		}
+		prev = &cur->next;
+	}
+	return NULL;
+}
+
+/*	hand cached session to the handle's new tls session, must be called
+ *	before the handshake
+ *	@param waitress handle
+ *	@return true if there was a session to resume
+ */
+static bool WaitressTlsCacheLoad (WaitressHandle_t *waith) {
+	WaitressTlsSession_t * const session = waith->request.tlsSession;
+	WaitressTlsCacheEntry_t *entry;
+	char *key = WaitressTlsCacheKey (waith);
+	bool loaded = false;
+
+	pthread_mutex_lock (&waitressTlsCache.lock);
+	for (entry = waitressTlsCache.entries; entry != NULL;
+			entry = entry->next) {
+		if (strcmp (entry->key, key) == 0) {
+			break;
+		}
+	}
+	/* a session verified against another fingerprint must not skip our
+	 * verification */
+	if (entry != NULL && entry->provider == session->provider &&
+			time (NULL) - entry->stored < WAITRESS_TLS_SESSION_TIMEOUT &&
+			memcmp (entry->tlsFingerprint, waith->tlsFingerprint,
+			sizeof (entry->tlsFingerprint)) == 0) {
+		loaded = session->provider->sessionImport (session, entry->data,
+				entry->size);
+	}
+	pthread_mutex_unlock (&waitressTlsCache.lock);
+	free (key);
+
+	return loaded;
+}
+
+/*	remember the handle's verified tls session
+ */
+static void WaitressTlsCacheStore (WaitressHandle_t *waith) {
+	WaitressTlsSession_t * const session = waith->request.tlsSession;
+	WaitressTlsCacheEntry_t *entry, *cur, *evict = NULL;
+	size_t count = 0;
+
+	if ((entry = calloc (1, sizeof (*entry))) == NULL) {
+		return;
+	}
+
+	if (!session->provider->sessionExport (session, &entry->data,
+			&entry->size)) {
+		free (entry);
+		return;
+	}
+	entry->provider = session->provider;
+
+	entry->key = WaitressTlsCacheKey (waith);
+	entry->stored = time (NULL);
+	memcpy (entry->tlsFingerprint, waith->tlsFingerprint,
+			sizeof (entry->tlsFingerprint));
+
+	pthread_mutex_lock (&waitressTlsCache.lock);
+	cur = WaitressTlsCacheUnlink (entry->key);
+	entry->next = waitressTlsCache.entries;
+	waitressTlsCache.entries = entry;
+	/* drop least recently stored session if the cache is full */
+	for (entry = waitressTlsCache.entries; entry != NULL; entry = entry->next) {
+		if (++count == WAITRESS_TLS_CACHE_SIZE && entry->next != NULL) {
+			evict = entry->next;
+			entry->next = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock (&waitressTlsCache.lock);
+
+	if (cur != NULL) {
+		WaitressTlsCacheEntryFree (cur);
+	}
+	while (evict != NULL) {
+		WaitressTlsCacheEntry_t * const next = evict->next;
+		WaitressTlsCacheEntryFree (evict);
+		evict = next;
+	}
+}
+
+/*	forget cached session, i.e. because resuming it failed
+ */
+static void WaitressTlsCacheDrop (const WaitressHandle_t *waith) {
+	WaitressTlsCacheEntry_t *entry;
+	char *key = WaitressTlsCacheKey (waith);
+
+	pthread_mutex_lock (&waitressTlsCache.lock);
+	entry = WaitressTlsCacheUnlink (key);
+	pthread_mutex_unlock (&waitressTlsCache.lock);
+	free (key);
+
+	if (entry != NULL) {
+		WaitressTlsCacheEntryFree (entry);
+	}
+}
+
+/*	set up tls session for the current connection
+ */
+static WaitressReturn_t WaitressTlsInit (WaitressHandle_t *waith) {
+	const WaitressTlsProvider_t * const provider = WaitressTlsProvider ();
+
+	if (provider == NULL || !provider->init ()) {
+		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+	}
+	if ((waith->request.tlsSession = provider->sessionNew (waith,
+			waith->http2 && !waith->request.nonBlocking)) == NULL) {
+		return WAITRESS_RET_ERR;
+	}
+
+	return WAITRESS_RET_OK;
+}
+
+/*	let the tls session read/write through this handle's socket wrappers,
+ *	i.e. when it takes over a pooled or shared connection
+ */
+static void WaitressTlsBind (WaitressHandle_t *waith) {
+	waith->request.tlsSession->waith = waith;
+}
+
+/*	resolved address
+ */
+typedef struct {
+	int family, socktype, protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+} WaitressAddr_t;
+
+/*	name lookup, either running in a resolver thread or already done
+ */
+typedef struct WaitressDnsJob {
+	char *key;
+	char *host, *port;
+	bool done;
+	/* result, count is 0 if the lookup failed */
+	WaitressAddr_t *addrs;
+	size_t count;
+	/* waiters and the resolver thread, protected by waitressDns.lock */
+	unsigned int refs;
+	struct WaitressDnsJob *next;
+} WaitressDnsJob_t;
+
+/*	cached lookup result
+ */
+typedef struct WaitressDnsCacheEntry {
+	char *key;
+	time_t stored;
+	WaitressAddr_t *addrs;
+	size_t count;
+	struct WaitressDnsCacheEntry *next;
+} WaitressDnsCacheEntry_t;
+
+/* shared by all handles, protected by lock; finished lookups are signalled
+ * through cond */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	WaitressDnsCacheEntry_t *entries;
+	/* lookups in progress */
+	WaitressDnsJob_t *jobs;
+} waitressDns = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL,
+		NULL};
+
+static char *WaitressDnsKey (const char *host, const char *port) {
+	char key[1024];
+
+	waitress_snprintf (key, sizeof (key), "%s:%s", host, port);
+	return waitress_strdup (key);
+}
+
+/*	copy address list
+ *	@return copy or NULL if count is 0 or out of memory
+ */
+static WaitressAddr_t *WaitressDnsCopy (const WaitressAddr_t *addrs,
+		const size_t count) {
+	WaitressAddr_t *copy;
+
+	if (count == 0 || (copy = malloc (count * sizeof (*copy))) == NULL) {
+		return NULL;
+	}
+	memcpy (copy, addrs, count * sizeof (*copy));
+	return copy;
+}
+
+static void WaitressDnsCacheEntryFree (WaitressDnsCacheEntry_t *entry) {
+	free (entry->addrs);
+	free (entry->key);
+	free (entry);
+}
+
+/*	drop reference to job, caller must hold the lock
+ */
+static void WaitressDnsJobUnref (WaitressDnsJob_t *job) {
+	assert (job->refs > 0);
+	if (--job->refs == 0) {
+		free (job->addrs);
+		free (job->host);
+		free (job->port);
+		free (job->key);
+		free (job);
+	}
+}
+
+/*	store lookup result, caller must hold the lock
+ */
+static void WaitressDnsCacheStore (const WaitressDnsJob_t *job) {
+	WaitressDnsCacheEntry_t *entry, **prev;
+	size_t count = 0;
+
+	if ((entry = calloc (1, sizeof (*entry))) == NULL) {
+		return;
+	}
+	entry->key = waitress_strdup (job->key);
+	entry->stored = time (NULL);
+	entry->addrs = WaitressDnsCopy (job->addrs, job->count);
+	entry->count = entry->addrs != NULL ? job->count : 0;
+	if (entry->key == NULL || entry->count == 0) {
+		WaitressDnsCacheEntryFree (entry);
+		return;
+	}
+
+	/* newest first, replaces older entries for the same key and evicts the
+	 * oldest ones if the cache is full */
+	entry->next = waitressDns.entries;
+	waitressDns.entries = entry;
+	prev = &entry->next;
+	while (*prev != NULL) {
+		WaitressDnsCacheEntry_t * const cur = *prev;
+		if (strcmp (cur->key, entry->key) == 0 ||
+				++count >= WAITRESS_DNS_CACHE_SIZE) {
+			*prev = cur->next;
+			WaitressDnsCacheEntryFree (cur);
+		} else {
+			prev = &cur->next;
+		}
+	}
+}
+
+/*	alternate address families, starting with the preferred (first) one, so
+ *	connection attempts cover both early on
+ */
+static void WaitressDnsInterleave (WaitressAddr_t *addrs, const size_t count) {
+	WaitressAddr_t *sorted;
+	size_t a = 0, b = 0, n = 0;
+
+	if (count < 3 || (sorted = malloc (count * sizeof (*sorted))) == NULL) {
+		return;
+	}
+
+	/* a walks the preferred family, b all others */
+	while (n < count) {
+		while (a < count && addrs[a].family != addrs[0].family) {
+			++a;
+		}
+		if (a < count) {
+			sorted[n++] = addrs[a++];
+		}
+		while (b < count && addrs[b].family == addrs[0].family) {
+			++b;
+		}
+		if (b < count) {
+			sorted[n++] = addrs[b++];
+		}
+	}
+	memcpy (addrs, sorted, count * sizeof (*addrs));
+	free (sorted);
+}
+
+/*	resolve name, then hand the result to all waiters
+ */
+static void *WaitressDnsThread (void *data) {
+	WaitressDnsJob_t * const job = data;
+	struct addrinfo hints, *res = NULL, *cur;
+	WaitressAddr_t *addrs = NULL;
+	size_t count = 0;
+
+	memset (&hints, 0, sizeof hints);
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo (job->host, job->port, &hints, &res) == 0) {
+		for (cur = res; cur != NULL; cur = cur->ai_next) {
+			++count;
+		}
+		addrs = calloc (count, sizeof (*addrs));
+		count = 0;
+		for (cur = res; addrs != NULL && cur != NULL; cur = cur->ai_next) {
+			if (cur->ai_addrlen > sizeof (addrs[count].addr)) {
+				continue;
+			}
+			addrs[count].family = cur->ai_family;
+			addrs[count].socktype = cur->ai_socktype;
+			addrs[count].protocol = cur->ai_protocol;
+			addrs[count].addrlen = cur->ai_addrlen;
+			memcpy (&addrs[count].addr, cur->ai_addr, cur->ai_addrlen);
+			++count;
+		}
+		freeaddrinfo (res);
+		if (addrs != NULL) {
+			WaitressDnsInterleave (addrs, count);
+		}
+	}
+
+	pthread_mutex_lock (&waitressDns.lock);
+	job->addrs = addrs;
+	job->count = count;
+	job->done = true;
+	if (count > 0) {
+		WaitressDnsCacheStore (job);
+	}
+	/* no longer in progress */
+	{
+		WaitressDnsJob_t **prev = &waitressDns.jobs;
+		while (*prev != NULL) {
+			if (*prev == job) {
+				*prev = job->next;
+				break;
+			}
+			prev = &(*prev)->next;
+		}
+	}
+	pthread_cond_broadcast (&waitressDns.cond);
+	WaitressDnsJobUnref (job);
+	pthread_mutex_unlock (&waitressDns.lock);
+
+	return NULL;
+}
+
+/*	start name lookup, answered from cache if possible. Lookups run in their
+ *	own thread, so a slow name server can be given up on; concurrent lookups
+ *	of the same name share one thread.
+ *	@param host
+ *	@param port
+ *	@return lookup, release with WaitressDnsRelease, NULL if out of memory
+ */
+static WaitressDnsJob_t *WaitressDnsStart (const char *host,
+		const char *port) {
+	WaitressDnsJob_t *job;
+	WaitressDnsCacheEntry_t **prev;
+	const time_t now = time (NULL);
+	pthread_attr_t attr;
+	pthread_t thread;
+	bool started;
+
+	if ((job = calloc (1, sizeof (*job))) == NULL) {
+		return NULL;
+	}
+	job->key = WaitressDnsKey (host, port);
+	job->host = waitress_strdup (host);
+	job->port = waitress_strdup (port);
+	job->refs = 1;
+	if (job->key == NULL || job->host == NULL || job->port == NULL) {
+		pthread_mutex_lock (&waitressDns.lock);
+		WaitressDnsJobUnref (job);
+		pthread_mutex_unlock (&waitressDns.lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock (&waitressDns.lock);
+	prev = &waitressDns.entries;
+	while (*prev != NULL) {
+		WaitressDnsCacheEntry_t * const cur = *prev;
+
+		if (now - cur->stored >= WAITRESS_DNS_CACHE_TTL) {
+			/* expired */
+			*prev = cur->next;
+			WaitressDnsCacheEntryFree (cur);
+		} else if (strcmp (cur->key, job->key) == 0) {
+			job->addrs = WaitressDnsCopy (cur->addrs, cur->count);
+			job->count = job->addrs != NULL ? cur->count : 0;
+			job->done = job->addrs != NULL;
+			break;
+		} else {
+			prev = &cur->next;
+		}
+	}
+	if (!job->done) {
+		WaitressDnsJob_t *cur;
+
+		/* join lookup in progress */
+		for (cur = waitressDns.jobs; cur != NULL; cur = cur->next) {
+			if (strcmp (cur->key, job->key) == 0) {
+				++cur->refs;
+				WaitressDnsJobUnref (job);
+				job = cur;
+				break;
+			}
+		}
+	}
+	if (!job->done && job->refs == 1) {
+		/* new lookup, the thread holds a reference too */
+		++job->refs;
+		pthread_attr_init (&attr);
+		pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+		started = pthread_create (&thread, &attr, WaitressDnsThread, job) == 0;
+		pthread_attr_destroy (&attr);
+		if (started) {
+			job->next = waitressDns.jobs;
+			waitressDns.jobs = job;
+		} else {
+			/* resolve in caller's thread then */
+			pthread_mutex_unlock (&waitressDns.lock);
+			WaitressDnsThread (job);
+			return job;
+		}
+	}
+	pthread_mutex_unlock (&waitressDns.lock);
+
+	return job;
+}
+
+/*	lookup finished?
+ */
+static bool WaitressDnsDone (WaitressDnsJob_t *job) {
+	bool done;
+
+	pthread_mutex_lock (&waitressDns.lock);
+	done = job->done;
+	pthread_mutex_unlock (&waitressDns.lock);
+
+	return done;
+}
+
+/*	wait for lookup to finish, WaitressCancel () wakes us up
+ *	@param waitress handle
+ *	@param lookup
+ *	@param give up after this many milliseconds
+ *	@return true if it finished
+ */
+static bool WaitressDnsWait (const WaitressHandle_t *waith,
+		WaitressDnsJob_t *job, const int timeout) {
+	struct timespec deadline;
+	bool done;
+
+	WaitressCondDeadline (&deadline, timeout);
+
+	pthread_mutex_lock (&waitressDns.lock);
+	while (!job->done && !WaitressCancelled (waith) &&
+			pthread_cond_timedwait (&waitressDns.cond, &waitressDns.lock,
+			&deadline) != ETIMEDOUT);
+	done = job->done;
+	pthread_mutex_unlock (&waitressDns.lock);
+
+	return done;
+}
+
+static void WaitressDnsRelease (WaitressDnsJob_t *job) {
+	pthread_mutex_lock (&waitressDns.lock);
+	WaitressDnsJobUnref (job);
+	pthread_mutex_unlock (&waitressDns.lock);
+}
+
+/*	remove name from cache, i.e. because its address did not work
+ */
+static void WaitressDnsForget (const char *host, const char *port) {
+	WaitressDnsCacheEntry_t **prev;
+	char *key = WaitressDnsKey (host, port);
+
+	if (key == NULL) {
+		return;
+	}
+	pthread_mutex_lock (&waitressDns.lock);
+	prev = &waitressDns.entries;
+	while (*prev != NULL) {
+		WaitressDnsCacheEntry_t * const cur = *prev;
+		if (strcmp (cur->key, key) == 0) {
+			*prev = cur->next;
+			WaitressDnsCacheEntryFree (cur);
+		} else {
+			prev = &cur->next;
+		}
+	}
+	pthread_mutex_unlock (&waitressDns.lock);
+	free (key);
+}
+
+/*	host and port we actually connect to
+ */
+static void WaitressConnectHost (const WaitressHandle_t *waith,
+		const char **host, const char **port) {
+	if (WaitressProxyEnabled (waith)) {
+		*host = waith->proxy.host;
+		*port = WaitressDefaultPort (&waith->proxy);
+	} else {
+		*host = waith->url.host;
+		*port = WaitressDefaultPort (&waith->url);
+	}
+}
+
+/*	set up cancellation; a pipe, or a pair of connected sockets on windows,
+ *	where select () does not work with anything else
+ *	@param cancellation handle
+ *	@return true on success, the handle is unusable otherwise
+ */
+bool WaitressCancelInit (WaitressCancel_t *cancel) {
+	assert (cancel != NULL);
+
+	cancel->fds[0] = cancel->fds[1] = -1;
+
+#ifdef _WIN32
+	{
+		struct sockaddr_in addr;
+		int addrlen = sizeof (addr);
+		SOCKET listener;
+
+		WaitressStaticInit ();
+
+		if ((listener = socket (AF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+			return false;
+		}
+		memset (&addr, 0, sizeof (addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+		if (bind (listener, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+				getsockname (listener, (struct sockaddr *) &addr,
+				&addrlen) != 0 || listen (listener, 1) != 0 ||
+				(cancel->fds[1] = socket (AF_INET, SOCK_STREAM, 0)) == -1 ||
+				connect (cancel->fds[1], (struct sockaddr *) &addr,
+				sizeof (addr)) != 0 ||
+				(cancel->fds[0] = accept (listener, NULL, NULL)) == -1) {
+			closesocket (listener);
+			WaitressCancelFree (cancel);
+			return false;
+		}
+		closesocket (listener);
+	}
+#else
+	if (pipe (cancel->fds) != 0) {
+		cancel->fds[0] = cancel->fds[1] = -1;
+		return false;
+	}
+#endif
+	WaitressDisableBlocking (cancel->fds[0]);
+	WaitressDisableBlocking (cancel->fds[1]);
+
+	return true;
+}
+
+void WaitressCancelFree (WaitressCancel_t *cancel) {
+	assert (cancel != NULL);
+
+	if (cancel->fds[0] != -1) {
+		waitress_close (cancel->fds[0]);
+	}
+	if (cancel->fds[1] != -1) {
+		waitress_close (cancel->fds[1]);
+	}
+	cancel->fds[0] = cancel->fds[1] = -1;
+}
+
+/*	abort requests of all handles using this cancellation handle, safe to
+ *	call from any thread; they keep failing until WaitressCancelReset ()
+ */
+void WaitressCancel (WaitressCancel_t *cancel) {
+	assert (cancel != NULL);
+
+	if (cancel->fds[1] != -1) {
+		const char byte = 0;
+		/* fails only if the pipe is full, which is just as good */
+		if (waitress_write (cancel->fds[1], &byte, 1) != 1) {
+			/* nothing to do */
+		}
+	}
+
+	/* name lookups wait on a condition variable, not on the pipe */
+	pthread_mutex_lock (&waitressDns.lock);
+	pthread_cond_broadcast (&waitressDns.cond);
+	pthread_mutex_unlock (&waitressDns.lock);
+}
+
+/*	make cancellation handle usable for new requests
+ */
+void WaitressCancelReset (WaitressCancel_t *cancel) {
+	char buf[64];
+
+	assert (cancel != NULL);
+
+	if (cancel->fds[0] != -1) {
+		while (waitress_read (cancel->fds[0], buf, sizeof (buf)) > 0);
+	}
+}
+
+/*	set up token bucket, it starts out full
+ *	@param rate limit
+ *	@param bytes per second, 0 is unlimited
+ *	@param bucket size, one buffer if 0
+ */
+void WaitressRateLimitInit (WaitressRateLimit_t *limit, size_t rate,
+		size_t burst) {
+	assert (limit != NULL);
+
+	memset (limit, 0, sizeof (*limit));
+	pthread_mutex_init (&limit->lock, NULL);
+	WaitressRateLimitSet (limit, rate, burst);
+}
+
+void WaitressRateLimitFree (WaitressRateLimit_t *limit) {
+	assert (limit != NULL);
+
+	pthread_mutex_destroy (&limit->lock);
+}
+
+/*	change rate limit, safe while it is in use; a previously unlimited
+ *	bucket starts out full
+ */
+void WaitressRateLimitSet (WaitressRateLimit_t *limit, size_t rate,
+		size_t burst) {
+	assert (limit != NULL);
+
+	pthread_mutex_lock (&limit->lock);
+	if (limit->rate == 0) {
+		limit->tokens = burst > 0 ? burst : WAITRESS_BUFFER_SIZE;
+		limit->refilled = WaitressNowUs ();
+	}
+	limit->rate = rate;
+	limit->burst = burst > 0 ? burst : WAITRESS_BUFFER_SIZE;
+	pthread_mutex_unlock (&limit->lock);
+}
+
+/*	bytes that may be read now according to a bucket
+ *	@param rate limit, may be NULL
+ *	@param at most this many
+ *	@param set to ms until something may be read, if nothing may
+ */
+static size_t WaitressRateLimitAvailable (WaitressRateLimit_t *limit,
+		size_t size, int *wait) {
+	if (limit == NULL) {
+		return size;
+	}
+
+	pthread_mutex_lock (&limit->lock);
+	if (limit->rate > 0) {
+		const int64_t now = WaitressNowUs ();
+
+		limit->tokens += (double) (now - limit->refilled) * limit->rate /
+				1000000;
+		if (limit->tokens > limit->burst) {
+			limit->tokens = limit->burst;
+		}
+		limit->refilled = now;
+
+		if (limit->tokens < 1) {
+			/* round up, waking up early would just spin */
+			*wait = (int) ((1 - limit->tokens) * 1000 / limit->rate) + 1;
+			size = 0;
+		} else if (limit->tokens < size) {
+			size = (size_t) limit->tokens;
+		}
+	}
+	pthread_mutex_unlock (&limit->lock);
+
+	return size;
+}
+
+/*	take bytes read from a bucket, it may go below zero if handles sharing
+ *	it read at the same time
+ */
+static void WaitressRateLimitConsume (WaitressRateLimit_t *limit,
+		const size_t size) {
+	if (limit == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock (&limit->lock);
+	if (limit->rate > 0) {
+		limit->tokens -= size;
+	}
+	pthread_mutex_unlock (&limit->lock);
+}
+
+/*	bytes of the body that may be read now, limited by the handle's and the
+ *	global rate limit
+ *	@param waitress handle
+ *	@param set to ms until something may be read, if nothing may
+ *	@return 0 if nothing may be read now, otherwise at most a buffer
+ */
+static size_t WaitressThrottle (WaitressHandle_t *waith, int *wait) {
+	size_t size = WAITRESS_BUFFER_SIZE;
+
+	size = WaitressRateLimitAvailable (waith->rateLimit, size, wait);
+	if (size > 0) {
+		size = WaitressRateLimitAvailable (waith->globalRateLimit, size, wait);
+	}
+	return size;
+}
+
+static void WaitressThrottleConsume (WaitressHandle_t *waith,
+		const size_t size) {
+	WaitressRateLimitConsume (waith->rateLimit, size);
+	WaitressRateLimitConsume (waith->globalRateLimit, size);
+}
+
+/*	failures of a host, entries exist only for hosts whose last attempt
+ *	failed
+ */
+typedef struct WaitressBreaker {
+	char *key;
+	/* failed attempts in a row */
+	unsigned int failures;
+	/* requests fail immediately until then (monotonic clock, ms) */
+	int64_t openUntil;
+	struct WaitressBreaker *next;
+} WaitressBreaker_t;
+
+/* shared by all handles, protected by lock */
+static struct {
+	pthread_mutex_t lock;
+	WaitressBreaker_t *entries;
+} waitressBreaker = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+static void WaitressBreakerFree (WaitressBreaker_t *entry) {
+	free (entry->key);
+	free (entry);
+}
+
+/*	find host's entry, caller must hold the lock
+ *	@param host:port
+ *	@param unlink entry from the list
+ *	@return entry or NULL
+ */
+static WaitressBreaker_t *WaitressBreakerFind (const char *key,
+		const bool unlink) {
+	WaitressBreaker_t **prev = &waitressBreaker.entries;
+
+	while (*prev != NULL) {
+		WaitressBreaker_t * const cur = *prev;
+		if (strcmp (cur->key, key) == 0) {
+			if (unlink) {
+				*prev = cur->next;
+				cur->next = NULL;
+			}
+			return cur;
+		}
+		prev = &cur->next;
+	}
+	return NULL;
+}
+
+/*	may a new attempt be made? once the cool-down is over a single attempt
+ *	is let through, the circuit stays open while it runs
+ *	@param waitress handle
+ *	@return false if the request should fail immediately
+ */
+static bool WaitressBreakerAllow (const WaitressHandle_t *waith) {
+	const char *host, *port;
+	WaitressBreaker_t *entry;
+	char *key;
+	bool allow = true;
+
+	WaitressConnectHost (waith, &host, &port);
+	if ((key = WaitressDnsKey (host, port)) == NULL) {
+		return true;
+	}
+
+	pthread_mutex_lock (&waitressBreaker.lock);
+	entry = WaitressBreakerFind (key, false);
+	if (entry != NULL && entry->failures >= WAITRESS_BREAKER_THRESHOLD) {
+		const int64_t now = WaitressNow ();
+		if (now < entry->openUntil) {
+			allow = false;
+		} else {
+			entry->openUntil = now + WAITRESS_BREAKER_COOLDOWN * 1000;
+		}
+	}
+	pthread_mutex_unlock (&waitressBreaker.lock);
+
+	free (key);
+	return allow;
+}
+
+/*	record result of an attempt
+ *	@param waitress handle
+ *	@param attempt failed with a transient error
+ */
+static void WaitressBreakerRecord (const WaitressHandle_t *waith,
+		const bool failed) {
+	const char *host, *port;
+	WaitressBreaker_t *entry;
+	char *key;
+
+	WaitressConnectHost (waith, &host, &port);
+	if ((key = WaitressDnsKey (host, port)) == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock (&waitressBreaker.lock);
+	entry = WaitressBreakerFind (key, true);
+	if (!failed) {
+		if (entry != NULL) {
+			WaitressBreakerFree (entry);
+		}
+	} else {
+		WaitressBreaker_t **prev;
+		size_t count = 0;
+
+		if (entry == NULL && (entry = calloc (1, sizeof (*entry))) != NULL) {
+			entry->key = key;
+			key = NULL;
+		}
+		if (entry != NULL) {
+			if (++entry->failures >= WAITRESS_BREAKER_THRESHOLD) {
+				entry->openUntil = WaitressNow () +
+						WAITRESS_BREAKER_COOLDOWN * 1000;
+			}
+
+			/* most recent failure first, the oldest ones are evicted */
+			entry->next = waitressBreaker.entries;
+			waitressBreaker.entries = entry;
+			prev = &entry->next;
+			while (*prev != NULL) {
+				WaitressBreaker_t * const cur = *prev;
+				if (++count >= WAITRESS_BREAKER_SIZE) {
+					*prev = cur->next;
+					WaitressBreakerFree (cur);
+				} else {
+					prev = &cur->next;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock (&waitressBreaker.lock);
+
+	free (key);
+}
+
+/*	remove connection attempt from list without closing it
+ *	@param waitress handle
+ *	@param index into request.attemptFds
+ *	@return its socket
+ */
+static int WaitressConnectUnlink (WaitressHandle_t *waith, const size_t i) {
+	const int fd = waith->request.attemptFds[i];
+
+	memmove (&waith->request.attemptFds[i], &waith->request.attemptFds[i+1],
+			(waith->request.attemptCount - i - 1) *
+			sizeof (*waith->request.attemptFds));
+	--waith->request.attemptCount;
+
+	return fd;
+}
+
+/*	close connection attempt
+ *	@param waitress handle
+ *	@param index into request.attemptFds
+ */
+static void WaitressConnectDrop (WaitressHandle_t *waith, const size_t i) {
+	const int fd = WaitressConnectUnlink (waith, i);
+
+#ifdef __linux__
+	/* the number may be reused by another handle's socket before
+	 * WaitressMulti notices */
+	if (fd == waith->request.watchedFd) {
+		epoll_ctl (waith->request.watchEpollFd, EPOLL_CTL_DEL, fd, NULL);
+		waith->request.watchedFd = -1;
+	}
+#endif
+	waitress_close (fd);
+}
+
+/*	close all pending connection attempts
+ */
+static void WaitressConnectAbort (WaitressHandle_t *waith) {
+	while (waith->request.attemptCount > 0) {
+		WaitressConnectDrop (waith, waith->request.attemptCount-1);
+	}
+}
+
+/*	apply handle's socket options to a new socket, failures are ignored
+ */
+static void WaitressSetSockOpts (const WaitressHandle_t *waith,
+		const int fd) {
+	const WaitressSockOpts_t * const opts = &waith->sockOpts;
+	const int on = 1;
+
+	if (opts->recvBuffer > 0) {
+		waitress_setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &opts->recvBuffer,
+				sizeof (opts->recvBuffer));
+	}
+	if (opts->sendBuffer > 0) {
+		waitress_setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &opts->sendBuffer,
+				sizeof (opts->sendBuffer));
+	}
+	if (opts->noDelay) {
+		waitress_setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+	}
+	if (opts->keepAliveIdle > 0) {
+		waitress_setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof (on));
+#if defined TCP_KEEPIDLE
+		waitress_setsockopt (fd, IPPROTO_TCP, TCP_KEEPIDLE,
+				&opts->keepAliveIdle, sizeof (opts->keepAliveIdle));
+#elif defined TCP_KEEPALIVE
+		/* os x */
+		waitress_setsockopt (fd, IPPROTO_TCP, TCP_KEEPALIVE,
+				&opts->keepAliveIdle, sizeof (opts->keepAliveIdle));
+#endif
+#ifdef TCP_KEEPINTVL
+		if (opts->keepAliveInterval > 0) {
+			waitress_setsockopt (fd, IPPROTO_TCP, TCP_KEEPINTVL,
+					&opts->keepAliveInterval,
+					sizeof (opts->keepAliveInterval));
+		}
+#endif
+#ifdef TCP_KEEPCNT
+		if (opts->keepAliveCount > 0) {
+			waitress_setsockopt (fd, IPPROTO_TCP, TCP_KEEPCNT,
+					&opts->keepAliveCount, sizeof (opts->keepAliveCount));
+		}
+#endif
+	}
+#ifdef TCP_FASTOPEN_CONNECT
+	/* linux 4.11+, connect () returns right away and the SYN waits for
+	 * the first write */
+	if (opts->fastOpen) {
+		waitress_setsockopt (fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+				sizeof (on));
+	}
+#endif
+}
+
+/*	start non-blocking connect to the next resolved address
+ *	@return false if there is no address left
+ */
+static bool WaitressConnectAttempt (WaitressHandle_t *waith) {
+	const WaitressDnsJob_t * const job = waith->request.dnsJob;
+
+	while (waith->request.nextAddr < job->count) {
+		const WaitressAddr_t * const addr =
+				&job->addrs[waith->request.nextAddr++];
+		int fd;
+
+		if ((fd = socket (addr->family, addr->socktype,
+				addr->protocol)) == -1) {
+			continue;
+		}
+
+		/* we need shorter timeouts for connect() */
+		WaitressDisableBlocking(fd);
+
+		WaitressSetSockOpts (waith, fd);
+
+		/* non-blocking connect will return immediately */
+		connect (fd, (const struct sockaddr *) &addr->addr, addr->addrlen);
+
+		waith->request.attemptFds[waith->request.attemptCount++] = fd;
+		return true;
+	}
+	return false;
+}
+
+/*	race connection attempts to all resolved addresses (happy eyeballs,
+ *	RFC 8305): the next address is tried every
+ *	WAITRESS_CONNECT_ATTEMPT_DELAY ms or as soon as an attempt fails, the
+ *	first one to succeed wins.
+ *	@param waitress handle
+ *	@param wait at most this many ms for an attempt to finish
+ *	@return WAITRESS_RET_OK if connected, WAITRESS_RET_TIMEOUT if attempts
+ *		are still pending
+ */
+static WaitressReturn_t WaitressConnectRace (WaitressHandle_t *waith,
+		int timeout) {
+	const int64_t now = WaitressNow ();
+	const int cancelFd = waith->cancel != NULL ? waith->cancel->fds[0] : -1;
+	size_t i;
+	int pollres;
+#ifdef _WIN32
+	fd_set readFds, writeFds, exceptFds;
+	struct timeval tv;
+#else
+	struct pollfd fds[WAITRESS_CONNECT_MAX_ATTEMPTS+1];
+	nfds_t nfds;
+#endif
+
+	if (waith->request.attemptCount < WAITRESS_CONNECT_MAX_ATTEMPTS &&
+			(waith->request.attemptCount == 0 ||
+			now >= waith->request.nextAttempt) &&
+			WaitressConnectAttempt (waith)) {
+		waith->request.nextAttempt = now + WAITRESS_CONNECT_ATTEMPT_DELAY;
+	}
+	if (waith->request.attemptCount == 0) {
+		/* every address failed */
+		return WAITRESS_RET_CONNECT_REFUSED;
+	}
+
+	/* don't sleep through the next attempt */
+	if (waith->request.nextAddr < waith->request.dnsJob->count &&
+			waith->request.attemptCount < WAITRESS_CONNECT_MAX_ATTEMPTS &&
+			waith->request.nextAttempt - now < timeout) {
+		timeout = waith->request.nextAttempt - now;
+	}
+	if (timeout < 0) {
+		timeout = 0;
+	}
+
+	/* connecting sockets become writable once they're done */
+#ifdef _WIN32
+	FD_ZERO (&readFds);
+	FD_ZERO (&writeFds);
+	FD_ZERO (&exceptFds);
+	for (i = 0; i < waith->request.attemptCount; i++) {
+		FD_SET (waith->request.attemptFds[i], &writeFds);
+		/* failed connects are reported here */
+		FD_SET (waith->request.attemptFds[i], &exceptFds);
+	}
+	if (cancelFd != -1) {
+		FD_SET (cancelFd, &readFds);
+	}
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	pollres = select (0, &readFds, &writeFds, &exceptFds, &tv);
+	if (pollres > 0 && cancelFd != -1 && FD_ISSET (cancelFd, &readFds)) {
+		return WAITRESS_RET_CANCELLED;
+	}
+#else
+	for (i = 0; i < waith->request.attemptCount; i++) {
+		fds[i].fd = waith->request.attemptFds[i];
+		fds[i].events = POLLOUT;
+		fds[i].revents = 0;
+	}
+	nfds = waith->request.attemptCount;
+	if (cancelFd != -1) {
+		fds[nfds].fd = cancelFd;
+		fds[nfds].events = POLLIN;
+		fds[nfds++].revents = 0;
+	}
+	pollres = poll (fds, nfds, timeout);
+	if (pollres > 0 && cancelFd != -1 && fds[nfds-1].revents != 0) {
+		return WAITRESS_RET_CANCELLED;
+	}
+#endif
+	if (pollres <= 0) {
+		return WAITRESS_RET_TIMEOUT;
+	}
+
+	/* backwards, dropping an attempt moves the ones after it */
+	for (i = waith->request.attemptCount; i-- > 0;) {
+		const int fd = waith->request.attemptFds[i];
+		int error = -1;
+		socklen_t errorSize = sizeof (error);
+
+#ifdef _WIN32
+		if (!FD_ISSET (fd, &writeFds) && !FD_ISSET (fd, &exceptFds)) {
+			continue;
+		}
+#else
+		if (fds[i].revents == 0) {
+			continue;
+		}
+#endif
+
+		/* check connect () return value */
+		waitress_getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &errorSize);
+		if (error == 0) {
+			/* winner, cancel everybody else */
+			waith->request.sockfd = WaitressConnectUnlink (waith, i);
+			WaitressConnectAbort (waith);
+			return WAITRESS_RET_OK;
+		}
+
+		WaitressConnectDrop (waith, i);
+		/* try the next address right away */
+		waith->request.nextAttempt = now;
+	}
+
+	if (waith->request.attemptCount == 0 &&
+			waith->request.nextAddr >= waith->request.dnsJob->count) {
+		/* the last address failed too */
+		return WAITRESS_RET_CONNECT_REFUSED;
+	}
+	return WAITRESS_RET_TIMEOUT;
+}
+
+/*	resolve host
+ */
+static WaitressReturn_t WaitressResolve (WaitressHandle_t *waith) {
+	const char *host, *port;
+
+	WaitressConnectHost (waith, &host, &port);
+	if ((waith->request.dnsJob = WaitressDnsStart (host, port)) == NULL) {
+		return WAITRESS_RET_GETADDR_ERR;
+	}
+	if (!WaitressDnsWait (waith, waith->request.dnsJob,
+			WaitressTimeLeft (waith))) {
+		return WaitressCancelled (waith) ? WAITRESS_RET_CANCELLED :
+				WAITRESS_RET_TIMEOUT;
+	}
+	if (waith->request.dnsJob->count == 0) {
+		return WAITRESS_RET_GETADDR_ERR;
+	}
+
+	return WAITRESS_RET_OK;
+}
+
+/*	set up tls session and offer a cached session to the server
+ */
+static WaitressReturn_t WaitressTlsStart (WaitressHandle_t *waith) {
+	WaitressReturn_t wRet;
+
+	if ((wRet = WaitressTlsInit (waith)) != WAITRESS_RET_OK) {
+		return wRet;
+	}
+	waith->request.tlsResuming = WaitressTlsCacheLoad (waith);
+
+	return WAITRESS_RET_OK;
+}
+
+/*	run tls handshake and verify peer
+ *	@return WAITRESS_RET_OK if done; on non-blocking sockets the handshake
+ *		must be continued if request.wouldBlock is set
+ */
+static WaitressReturn_t WaitressTlsHandshake (WaitressHandle_t *waith) {
+	WaitressTlsSession_t * const session = waith->request.tlsSession;
+	WaitressReturn_t wRet;
+
+	if (!session->provider->handshake (session)) {
+		if (waith->request.wouldBlock) {
+			return WAITRESS_RET_ERR;
+		}
+		if (waith->request.readWriteRet == WAITRESS_RET_CANCELLED) {
+			return WAITRESS_RET_CANCELLED;
+		}
+		if (waith->request.tlsResuming) {
+			WaitressTlsCacheDrop (waith);
+		}
+		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+	}
+
+	/* a resumed session was verified when it was established; the server
+	 * does not send its certificate again */
+	if (!session->provider->resumed (session)) {
+		if ((wRet = WaitressTlsVerify (waith)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+	}
+	waith->request.tlsVerified = true;
+
+	/* now we can talk encrypted */
+	waith->request.read = WaitressTlsRead;
+	waith->request.write = WaitressTlsWrite;
+
+	return WAITRESS_RET_OK;
+}
+
+/*	replace request.sendBuf with an uninitialized buffer
+ */
+static bool WaitressSendBufAlloc (WaitressHandle_t *waith, const size_t size) {
+	free (waith->request.sendBuf);
+	waith->request.sendBody = NULL;
+	waith->request.sendSize = 0;
+	waith->request.sendBodySize = 0;
+	waith->request.sendPos = 0;
+	if ((waith->request.sendBuf = malloc (size)) == NULL) {
+		return false;
+	}
+	waith->request.sendSize = size;
+	return true;
+}
+
+/*	serialize proxy tunnel request into request.sendBuf
+ */
+static WaitressReturn_t WaitressFormatProxyConnect (WaitressHandle_t *waith) {
+	char * const buf = waith->request.buf;
+	size_t size;
+
+	waitress_snprintf (buf, WAITRESS_BUFFER_SIZE, "CONNECT %s:%s HTTP/"
+			WAITRESS_HTTP_VERSION "\r\n"
+			"Host: %s:%s\r\n"
+			"Proxy-Connection: close\r\n",
+			waith->url.host, WaitressDefaultPort (&waith->url),
+			waith->url.host, WaitressDefaultPort (&waith->url));
+	size = strlen (buf);
+
+	/* write authorization headers */
+	if (WaitressFormatAuthorization (waith, &waith->proxy, "Proxy-",
+			buf + size, WAITRESS_BUFFER_SIZE - size)) {
+		size += strlen (buf + size);
+	}
+
+	if (!WaitressSendBufAlloc (waith, size + 2)) {
+		return WAITRESS_RET_ERR;
+	}
+	memcpy (waith->request.sendBuf, buf, size);
+	memcpy (waith->request.sendBuf + size, "\r\n", 2);
+
+	return WAITRESS_RET_OK;
+}
+
+/*	Connect to server
+ */
+static WaitressReturn_t WaitressConnect (WaitressHandle_t *waith) {
+	int64_t deadline;
+	WaitressReturn_t wRet;
+
+	WaitressPhaseStart (waith, waith->timeouts.resolve);
+	if ((wRet = WaitressResolve (waith)) != WAITRESS_RET_OK) {
+		return wRet;
+	}
+	WaitressTimingMark (waith, &waith->timing.resolved);
+
+	WaitressPhaseStart (waith, waith->timeouts.connect);
+	deadline = WaitressDeadline (waith, WaitressNow ());
+	while ((wRet = WaitressConnectRace (waith,
+			deadline - WaitressNow ())) == WAITRESS_RET_TIMEOUT) {
+		if (WaitressNow () >= deadline) {
+			return WAITRESS_RET_TIMEOUT;
+		}
+	}
+	if (wRet != WAITRESS_RET_OK) {
+		return wRet;
+	}
+	WaitressTimingMark (waith, &waith->timing.connected);
+
+	if (waith->url.tls) {
+		WaitressPhaseStart (waith, waith->timeouts.handshake);
+
+		/* set up proxy tunnel */
+		if (WaitressProxyEnabled (waith)) {
+			if ((wRet = WaitressFormatProxyConnect (waith)) !=
+					WAITRESS_RET_OK) {
+				return wRet;
+			}
+			WRITE_RET (waith->request.sendBuf, waith->request.sendSize);
+
+			if ((wRet = WaitressReceiveHeaders (waith)) !=
+					WAITRESS_RET_OK) {
+				return wRet;
+			}
+		}
+
+		if ((wRet = WaitressTlsStart (waith)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+		if ((wRet = WaitressTlsHandshake (waith)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+		WaitressTimingMark (waith, &waith->timing.handshakeDone);
+
+		if ((wRet = WaitressH2Start (waith)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+	}
+
+	return WAITRESS_RET_OK;
+}
+
+/*	Serialize http header into request.sendBuf, post data is appended for
+ *	tls connections and sent from where it is otherwise
+ */
+static WaitressReturn_t WaitressFormatRequest (WaitressHandle_t *waith) {
+	const char *path;
+	char * buf;
+	size_t headSize, extraSize = 0, postSize = 0, copySize;
+	const bool post = waith->method == WAITRESS_METHOD_POST &&
+			waith->postData != NULL;
+
+	assert (waith != NULL);
+	assert (waith->request.buf != NULL);
+
+	path = waith->url.path;
+	buf = waith->request.buf;
+
+	if (waith->url.path == NULL) {
+		/* avoid NULL pointer deref */
+		path = "";
+	} else if (waith->url.path[0] == '/') {
+		/* most servers don't like "//" */
+		++path;
+	}
+
+	/* request line */
+	if (WaitressProxyEnabled (waith) && !waith->url.tls) {
+		waitress_snprintf (buf, WAITRESS_BUFFER_SIZE,
+			"%s http://%s:%s/%s HTTP/" WAITRESS_HTTP_VERSION "\r\n",
+			(waith->method == WAITRESS_METHOD_GET ? "GET" : "POST"),
+			waith->url.host,
+			WaitressDefaultPort (&waith->url), path);
+	} else {
+		waitress_snprintf (buf, WAITRESS_BUFFER_SIZE,
+			"%s /%s HTTP/" WAITRESS_HTTP_VERSION "\r\n",
+			(waith->method == WAITRESS_METHOD_GET ? "GET" : "POST"),
+			path);
+	}
+	headSize = strlen (buf);
+
+	waitress_snprintf (buf + headSize, WAITRESS_BUFFER_SIZE - headSize,
+			"Host: %s\r\nUser-Agent: " PACKAGE "\r\nConnection: %s\r\n",
+			waith->url.host, waith->keepAlive ? "keep-alive" : "Close");
+	headSize += strlen (buf + headSize);
+
+#if WAITRESS_USE_ZLIB
+	if (waith->acceptEncoding) {
+		waitress_snprintf (buf + headSize, WAITRESS_BUFFER_SIZE - headSize,
+				"Accept-Encoding: gzip, deflate\r\n");
+		headSize += strlen (buf + headSize);
+	}
+#endif
+
+	if (post) {
+		postSize = strlen (waith->postData);
+		waitress_snprintf (buf + headSize, WAITRESS_BUFFER_SIZE - headSize,
+				"Content-Length: " waitress_size_t_spec "\r\n", postSize);
+		headSize += strlen (buf + headSize);
+	}
+
+	/* write authorization headers */
+	if (WaitressFormatAuthorization (waith, &waith->url, "", buf + headSize,
+			WAITRESS_BUFFER_SIZE - headSize)) {
+		headSize += strlen (buf + headSize);
+	}
+	/* don't leak proxy credentials to destination server if tls is used */
+	if (!waith->url.tls &&
+			WaitressFormatAuthorization (waith, &waith->proxy, "Proxy-",
+			buf + headSize, WAITRESS_BUFFER_SIZE - headSize)) {
+		headSize += strlen (buf + headSize);
+	}
+
+	if (waith->extraHeaders != NULL) {
+		extraSize = strlen (waith->extraHeaders);
+	}
+	copySize = postSize;
+
+	/* a gathered write needs a plain socket, tls would turn header and
+	 * body into separate records */
+	if (waith->request.write == WaitressOrdinaryWrite) {
+		copySize = 0;
+	}
+
+	if (!WaitressSendBufAlloc (waith, headSize + extraSize + 2 + copySize)) {
+		return WAITRESS_RET_ERR;
+	}
+	buf = waith->request.sendBuf;
+	memcpy (buf, waith->request.buf, headSize);
+	buf += headSize;
+	if (extraSize > 0) {
+		memcpy (buf, waith->extraHeaders, extraSize);
+		buf += extraSize;
+	}
+	memcpy (buf, "\r\n", 2);
+	buf += 2;
+	if (copySize > 0) {
+		memcpy (buf, waith->postData, copySize);
+	} else if (postSize > 0) {
+		waith->request.sendBody = waith->postData;
+		waith->request.sendBodySize = postSize;
+	}
+
+	return WAITRESS_RET_OK;
+}
+
+/*	Send the next part of the serialized request, header and body are
+ *	written with a single writev () on plain connections
+ *	@param waitress handle
+ *	@return WAITRESS_RET_OK if some data was written, request.sendPos is
+ *		advanced
+ */
+static WaitressReturn_t WaitressSendSome (WaitressHandle_t *waith) {
+	const size_t pos = waith->request.sendPos,
+			size = waith->request.sendSize;
+	size_t written = 0;
+	WaitressReturn_t wRet;
+
+	assert (pos < size + waith->request.sendBodySize);
+
+	if (pos < size && waith->request.sendBodySize > 0) {
+		waitress_iovec_t iov[2];
+		ssize_t ret;
+
+		waitress_iov_set (iov[0], waith->request.sendBuf + pos, size - pos);
+		waitress_iov_set (iov[1], waith->request.sendBody,
+				waith->request.sendBodySize);
+		if ((ret = WaitressPollWritev (waith, iov, 2)) < 0) {
+			return waith->request.readWriteRet;
+		}
+		written = (size_t) ret;
+		wRet = WAITRESS_RET_OK;
+	} else if (pos < size) {
+		wRet = waith->request.write (waith, waith->request.sendBuf + pos,
+				size - pos, &written);
+	} else {
+		wRet = waith->request.write (waith,
+				waith->request.sendBody + (pos - size),
+				size + waith->request.sendBodySize - pos, &written);
+	}
+	if (wRet == WAITRESS_RET_OK) {
+		waith->request.sendPos += written;
+	}
+
+	return wRet;
+}
+
+/*	request.sendBuf and body are completely written
+ */
+static bool WaitressSendDone (const WaitressHandle_t *waith) {
+	return waith->request.sendPos ==
+			waith->request.sendSize + waith->request.sendBodySize;
+}
+
+/*	Write http header/post data to socket
+ */
+static WaitressReturn_t WaitressSendRequest (WaitressHandle_t *waith) {
+	WaitressReturn_t wRet;
+
+	WaitressPhaseStart (waith, waith->timeouts.firstByte);
+	if ((wRet = WaitressFormatRequest (waith)) != WAITRESS_RET_OK) {
+		return wRet;
+	}
+	while (!WaitressSendDone (waith)) {
+		if ((wRet = WaitressSendSome (waith)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+	}
+	WaitressTimingMark (waith, &waith->timing.requestSent);
+
+	return WAITRESS_RET_OK;
+}
+
+/*	parse response headers in buf, from bufPos up to bufFilled, one byte at
+ *	a time; parsing stops and resumes at any byte
+ *	@param Waitress handle
+ *	@return WAITRESS_RET_OK if no error occured; all headers have been parsed
+ *		if request.hdrParseMode is HDRM_FINISHED, the body starts at bufPos
+ *		then
+ */
+static WaitressReturn_t WaitressParseHeaders (WaitressHandle_t *waith) {
+	const char * const buf = waith->request.buf;
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+
+	while (waith->request.bufPos < waith->request.bufFilled &&
+			waith->request.hdrParseMode != HDRM_FINISHED) {
+		const char c = buf[waith->request.bufPos++];
+
+		/* lines end with \r\n or \n */
+		if (c == '\r') {
+			continue;
+		}
+
+		switch (waith->request.hdrParseMode) {
+			/* Status code */
+			case HDRM_HEAD:
+				if (c == '\n') {
+					if ((wRet = WaitressHandleStatusline (waith)) !=
+							WAITRESS_RET_OK) {
+						return wRet;
+					}
+				} else {
+					WaitressHeaderAppend (waith->request.hdrValue,
+							&waith->request.hdrValueLen,
+							sizeof (waith->request.hdrValue), c);
+				}
+				break;
+
+			/* start of a header line */
+			case HDRM_LINES:
+				if (c == '\n') {
+					/* empty line => content starts here */
+					waith->request.hdrParseMode = HDRM_FINISHED;
+				} else {
+					waith->request.hdrKeyLen = 0;
+					waith->request.hdrValueLen = 0;
+					WaitressHeaderAppend (waith->request.hdrKey,
+							&waith->request.hdrKeyLen,
+							sizeof (waith->request.hdrKey), c);
+					waith->request.hdrParseMode = HDRM_KEY;
+				}
+				break;
+
+			/* "key: value", ignore invalid lines */
+			case HDRM_KEY:
+				if (c == ':') {
+					waith->request.hdrParseMode = HDRM_VALUE;
+				} else if (c == '\n') {
+					waith->request.hdrParseMode = HDRM_LINES;
+				} else {
+					WaitressHeaderAppend (waith->request.hdrKey,
+							&waith->request.hdrKeyLen,
+							sizeof (waith->request.hdrKey), c);
+				}
+				break;
+
+			case HDRM_VALUE:
+				if (c == '\n') {
+					/* none of the headers we care about is that long */
+					if (WaitressHeaderTerminate (waith->request.hdrKey,
+							&waith->request.hdrKeyLen,
+							sizeof (waith->request.hdrKey)) &&
+							WaitressHeaderTerminate (waith->request.hdrValue,
+							&waith->request.hdrValueLen,
+							sizeof (waith->request.hdrValue))) {
+						WaitressHandleHeader (waith, waith->request.hdrKey,
+								waith->request.hdrValue);
+					}
+					waith->request.hdrParseMode = HDRM_LINES;
+				} else if (waith->request.hdrValueLen > 0 ||
+						!isspace ((unsigned char) c)) {
+					WaitressHeaderAppend (waith->request.hdrValue,
+							&waith->request.hdrValueLen,
+							sizeof (waith->request.hdrValue), c);
+				}
+				break;
+
+			default:
+				break;
+		} /* end switch */
+	}
+
+	return WAITRESS_RET_OK;
+}
+
+/*	prepare header parser for a new response
+ */
+static void WaitressResetHeaders (WaitressHandle_t *waith) {
+	waith->request.hdrParseMode = HDRM_HEAD;
+	waith->request.hdrValueLen = 0;
+	waith->request.bufFilled = 0;
+	waith->request.bufPos = 0;
+}
+
+/*	read and parse the next part of the response headers
+ */
+static WaitressReturn_t WaitressReadHeaders (WaitressHandle_t *waith) {
+	size_t recvSize = 0;
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+
+	READ_RET (waith->request.buf, WAITRESS_BUFFER_SIZE, &recvSize);
+	if (recvSize == 0) {
+		/* connection closed too early */
+		return WAITRESS_RET_CONNECTION_CLOSED;
+	}
+	waith->request.responseStarted = true;
+	waith->request.bufFilled = recvSize;
+	waith->request.bufPos = 0;
+
+	return WaitressParseHeaders (waith);
+}
+
+/*	receive response headers, body data that arrived with them is left in
+ *	buf between bufPos and bufFilled
+ *	@param Waitress handle
+ */
+static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *waith) {
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+
+	assert (waith != NULL);
+	assert (waith->request.buf != NULL);
+
+	WaitressResetHeaders (waith);
+
+	/* receive answer */
+	while (waith->request.hdrParseMode != HDRM_FINISHED) {
+		if ((wRet = WaitressReadHeaders (waith)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+	}
+
+	return wRet;
+}
+
+/*	pass body data to the data handler
+ *	@param waitress handle
+ *	@param received data
+ *	@param data size
+ *	@return WAITRESS_RET_OK if no error occured, request.bodyComplete is set
+ *		once the whole body was received
+ */
+static WaitressReturn_t WaitressHandleBody (WaitressHandle_t *waith,
+		char *buf, const size_t size) {
+	if (size > 0) {
+		switch (waith->request.dataHandler (waith, buf, size)) {
+			case WAITRESS_HANDLER_DONE:
+				waith->request.bodyComplete = true;
+				return WAITRESS_RET_OK;
+				break;
+
+			case WAITRESS_HANDLER_ERR:
+				return WAITRESS_RET_DECODING_ERR;
+				break;
+
+			case WAITRESS_HANDLER_ABORTED:
+				return WAITRESS_RET_CB_ABORT;
+				break;
+
+			case WAITRESS_HANDLER_CONTINUE:
+				/* go on */
+				break;
+		}
+	}
+	if (waith->request.contentLengthKnown &&
+			waith->request.contentReceived >= waith->request.contentLength) {
+		/* don’t call read() again if we know the body’s size and have all
+		 * of it already */
+		waith->request.bodyComplete = true;
+	}
+
+	return WAITRESS_RET_OK;
+}
+
+/*	read response header and data
+ */
+static WaitressReturn_t WaitressReceiveResponse (WaitressHandle_t *waith) {
+	char * buf;
+	size_t recvSize = 0;
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+
+	assert (waith != NULL);
+	assert (waith->request.buf != NULL);
+
+	WaitressResetHeaders (waith);
+	while (waith->request.hdrParseMode != HDRM_FINISHED) {
+		if ((wRet = WaitressReadHeaders (waith)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+		/* first byte arrived */
+		WaitressPhaseStart (waith, 0);
+		WaitressTimingMark (waith, &waith->timing.firstByte);
+	}
+
+	buf = waith->request.buf + waith->request.bufPos;
+	recvSize = waith->request.bufFilled - waith->request.bufPos;
+	do {
+		size_t allowed;
+		int wait = 0;
+
+		if ((wRet = WaitressHandleBody (waith, buf, recvSize)) !=
+				WAITRESS_RET_OK || waith->request.bodyComplete) {
+			return wRet;
+		}
+		while ((allowed = WaitressThrottle (waith, &wait)) == 0) {
+			if (WaitressWaitFd (waith, -1, false, wait) ==
+					WAITRESS_RET_CANCELLED) {
+				return WAITRESS_RET_CANCELLED;
+			}
+		}
+		buf = waith->request.buf;
+		READ_RET (buf, allowed, &recvSize);
+		WaitressThrottleConsume (waith, recvSize);
+	} while (recvSize > 0);
+
+	return WAITRESS_RET_OK;
+}
+
+/*	free tls session of the current connection
+ */
+static void WaitressTlsFree (WaitressHandle_t *waith) {
+	WaitressTlsSession_t * const session = waith->request.tlsSession;
+
+	if (session != NULL) {
+		session->provider->sessionFree (session);
+		waith->request.tlsSession = NULL;
+	}
+}
+
+/*	close the current connection
+ *	@param waitress handle
+ *	@param say goodbye to tls peer
+ */
+static void WaitressCloseConnection (WaitressHandle_t *waith,
+		const bool graceful) {
+	if (waith->url.tls) {
+		if (graceful && waith->request.tlsSession != NULL) {
+			waith->request.tlsSession->provider->bye (
+					waith->request.tlsSession);
+		}
+		WaitressTlsFree (waith);
+	}
+	WaitressConnectAbort (waith);
+	if (waith->request.sockfd != -1) {
+		waitress_close (waith->request.sockfd);
+		waith->request.sockfd = -1;
+	}
+}
+
+/*	idle keep-alive connection
+ */
+typedef struct WaitressPoolConn {
+	char *key;
+	int sockfd;
+	time_t idleSince;
+	/* fingerprint the tls peer was verified against */
+	char tlsFingerprint[20];
+	WaitressTlsSession_t *tlsSession;
+	struct WaitressPoolConn *next;
+} WaitressPoolConn_t;
+
+/* shared by all handles, protected by lock */
+static struct {
+	pthread_mutex_t lock;
+	WaitressPoolConn_t *conns;
+} waitressPool = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+/*	pool key, connections are interchangeable if their keys match
+ */
+static char *WaitressPoolKey (const WaitressHandle_t *waith) {
+	char key[1024];
+
+	waitress_snprintf (key, sizeof (key), "%s:%s/%c/%s:%s", waith->url.host,
+			WaitressDefaultPort (&waith->url), waith->url.tls ? 's' : 'p',
+			WaitressProxyEnabled (waith) ? waith->proxy.host : "",
+			WaitressProxyEnabled (waith) ? WaitressDefaultPort (&waith->proxy) : "");
+	return waitress_strdup (key);
+}
+
+/*	close idle connection, must not touch any handle (the tls transport
+ *	still points to the handle that returned it)
+ */
+static void WaitressPoolConnFree (WaitressPoolConn_t *conn) {
+	if (conn->tlsSession != NULL) {
+		conn->tlsSession->provider->sessionFree (conn->tlsSession);
+	}
+	waitress_close (conn->sockfd);
+	free (conn->key);
+	free (conn);
+}
+
+/*	idle connection is still usable? The server must not have sent anything
+ *	(most likely a FIN) since we put it into the pool.
+ */
+static bool WaitressPoolConnAlive (const int sockfd) {
+	fd_set fds;
+	struct timeval tv;
+
+	memset (&tv, 0, sizeof (tv));
+	FD_ZERO (&fds);
+	FD_SET (sockfd, &fds);
+
+	return select (sockfd+1, &fds, NULL, NULL, &tv) == 0;
+}
+
+/*	take matching idle connection from pool
+ *	@param waitress handle
+ *	@return true if a connection was found, it becomes the handle's current
+ *			connection
+ */
+static bool WaitressPoolGet (WaitressHandle_t *waith) {
+	WaitressPoolConn_t *conn = NULL, **prev;
+	const time_t now = time (NULL);
+	char *key = WaitressPoolKey (waith);
+
+	pthread_mutex_lock (&waitressPool.lock);
+	prev = &waitressPool.conns;
+	while (*prev != NULL) {
+		WaitressPoolConn_t * const cur = *prev;
+
+		if (now - cur->idleSince >= WAITRESS_POOL_IDLE_TIMEOUT) {
+			/* expired */
+			*prev = cur->next;
+			WaitressPoolConnFree (cur);
+		} else if (conn == NULL && strcmp (cur->key, key) == 0 &&
+				(!waith->url.tls || memcmp (cur->tlsFingerprint,
+				waith->tlsFingerprint, sizeof (cur->tlsFingerprint)) == 0)) {
+			*prev = cur->next;
+			if (WaitressPoolConnAlive (cur->sockfd)) {
+				conn = cur;
+			} else {
+				WaitressPoolConnFree (cur);
+			}
+		} else {
+			prev = &cur->next;
+		}
+	}
+	pthread_mutex_unlock (&waitressPool.lock);
+	free (key);
+
+	if (conn == NULL) {
+		return false;
+	}
+
+	waith->request.sockfd = conn->sockfd;
+	if (waith->url.tls) {
+		waith->request.tlsSession = conn->tlsSession;
+		WaitressTlsBind (waith);
+		waith->request.read = WaitressTlsRead;
+		waith->request.write = WaitressTlsWrite;
+	}
+	waith->request.reused = true;
+
+	free (conn->key);
+	free (conn);
+
+	return true;
+}
+
+/*	return the handle's current connection to pool
+ */
+static void WaitressPoolPut (WaitressHandle_t *waith) {
+	WaitressPoolConn_t *conn, *cur;
+	size_t count = 0;
+
+	if ((conn = calloc (1, sizeof (*conn))) == NULL) {
+		WaitressCloseConnection (waith, true);
+		return;
+	}
+	conn->key = WaitressPoolKey (waith);
+	conn->sockfd = waith->request.sockfd;
+	conn->idleSince = time (NULL);
+	if (waith->url.tls) {
+		memcpy (conn->tlsFingerprint, waith->tlsFingerprint,
+				sizeof (conn->tlsFingerprint));
+		conn->tlsSession = waith->request.tlsSession;
+		waith->request.tlsSession = NULL;
+	}
+	waith->request.sockfd = -1;
+
+	pthread_mutex_lock (&waitressPool.lock);
+	for (cur = waitressPool.conns; cur != NULL; cur = cur->next) {
+		if (strcmp (cur->key, conn->key) == 0) {
+			++count;
+		}
+	}
+	if (count < WAITRESS_POOL_MAX_PER_HOST) {
+		/* most recently used connections first */
+		conn->next = waitressPool.conns;
+		waitressPool.conns = conn;
+		conn = NULL;
+	}
+	pthread_mutex_unlock (&waitressPool.lock);
+
+	if (conn != NULL) {
+		WaitressPoolConnFree (conn);
+	}
+}
+
+/* http/2 (rfc 7540) frame types */
+#define WAITRESS_H2_DATA			0x0
+#define WAITRESS_H2_HEADERS			0x1
+#define WAITRESS_H2_RST_STREAM		0x3
+#define WAITRESS_H2_SETTINGS		0x4
+#define WAITRESS_H2_PUSH_PROMISE	0x5
+#define WAITRESS_H2_PING			0x6
+#define WAITRESS_H2_GOAWAY			0x7
+#define WAITRESS_H2_WINDOW_UPDATE	0x8
+#define WAITRESS_H2_CONTINUATION	0x9
+
+/* frame flags */
+#define WAITRESS_H2_END_STREAM		0x1
+#define WAITRESS_H2_ACK				0x1
+#define WAITRESS_H2_END_HEADERS		0x4
+#define WAITRESS_H2_PADDED			0x8
+#define WAITRESS_H2_PRIORITY		0x20
+
+/* error codes */
+#define WAITRESS_H2_PROTOCOL_ERROR		0x1
+#define WAITRESS_H2_CANCEL				0x8
+#define WAITRESS_H2_COMPRESSION_ERROR	0x9
+#define WAITRESS_H2_ENHANCE_YOUR_CALM	0xb
+
+/* frames are no larger than the default maximum in both directions */
+#define WAITRESS_H2_FRAME_SIZE 16384
+/* all received data is acknowledged at the connection level once this
+ * much is outstanding, streams limit what may be buffered */
+#define WAITRESS_H2_CONN_WINDOW (16*WAITRESS_H2_WINDOW)
+/* default header table size, not changed in either direction */
+#define WAITRESS_HPACK_TABLE_SIZE 4096
+/* received header blocks (HEADERS and CONTINUATION frames) are buffered
+ * up to this size, larger ones end the connection */
+#define WAITRESS_H2_BLOCK_SIZE (4*WAITRESS_H2_FRAME_SIZE)
+
+/*	growing byte buffer
+ */
+typedef struct {
+	char *data;
+	size_t size, alloc;
+} WaitressH2Buf_t;
+
+/*	make room for more data
+ *	@param buffer
+ *	@param number of bytes
+ *	@return where to put them, NULL if out of memory
+ */
+static char *WaitressH2BufReserve (WaitressH2Buf_t *buf, const size_t size) {
+	if (buf->size + size > buf->alloc) {
+		size_t alloc = buf->alloc == 0 ? 256 : buf->alloc;
+		char *data;
+
+		while (alloc < buf->size + size) {
+			alloc *= 2;
+		}
+		if ((data = realloc (buf->data, alloc)) == NULL) {
+			return NULL;
+		}
+		buf->data = data;
+		buf->alloc = alloc;
+	}
+	return buf->data + buf->size;
+}
+
+static bool WaitressH2BufAppend (WaitressH2Buf_t *buf, const void *data,
+		const size_t size) {
+	char * const dest = WaitressH2BufReserve (buf, size);
+
+	if (dest == NULL) {
+		return false;
+	}
+	memcpy (dest, data, size);
+	buf->size += size;
+	return true;
+}
+
+static void WaitressH2BufFree (WaitressH2Buf_t *buf) {
+	free (buf->data);
+	memset (buf, 0, sizeof (*buf));
+}
+
+/*	hpack (rfc 7541) static table
+ */
+static const struct {
+	const char *name, *value;
+} waitressHpackStatic[] = {
+	{":authority", ""}, {":method", "GET"}, {":method", "POST"},
+	{":path", "/"}, {":path", "/index.html"}, {":scheme", "http"},
+	{":scheme", "https"}, {":status", "200"}, {":status", "204"},
+	{":status", "206"}, {":status", "304"}, {":status", "400"},
+	{":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"}, {"accept-language", ""},
+	{"accept-ranges", ""}, {"accept", ""},
+	{"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""},
+	{"authorization", ""}, {"cache-control", ""},
+	{"content-disposition", ""}, {"content-encoding", ""},
+	{"content-language", ""}, {"content-length", ""},
+	{"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+	{"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+	{"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""},
+	{"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+	{"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+	{"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+	{"proxy-authorization", ""}, {"range", ""}, {"referer", ""},
+	{"refresh", ""}, {"retry-after", ""}, {"server", ""},
+	{"set-cookie", ""}, {"strict-transport-security", ""},
+	{"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""},
+	{"via", ""}, {"www-authenticate", ""},
+};
+
+#define WAITRESS_HPACK_STATIC_COUNT \
+		(sizeof (waitressHpackStatic) / sizeof (*waitressHpackStatic))
+
+/*	hpack huffman code of every byte and EOS, codes of the same length are
+ *	consecutive and ordered like their symbols (canonical)
+ */
+static const struct {
+	uint32_t code;
+	unsigned char bits;
+} waitressHuffman[257] = {
+	{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+	{0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+	{0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+	{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+	{0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+	{0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+	{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+	{0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+	{0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+	{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+	{0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+	{0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+	{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+	{0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+	{0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+	{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+	{0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+	{0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+	{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+	{0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+	{0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+	{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+	{0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+	{0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+	{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+	{0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+	{0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+	{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+	{0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+	{0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+	{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+	{0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+	{0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+	{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+	{0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+	{0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+	{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+	{0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+	{0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+	{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+	{0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+	{0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+	{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+	{0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+	{0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+	{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+	{0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+	{0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+	{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+	{0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+	{0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+	{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+	{0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+	{0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+	{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+	{0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+	{0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+	{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+	{0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+	{0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+	{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+	{0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+	{0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+	{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+	{0x3fffffff, 30},
+};
+
+#define WAITRESS_HUFFMAN_EOS 256
+
+/* decoder tables derived from waitressHuffman: per code length the first
+ * code, the number of codes and where their symbols start in symbols */
+static struct {
+	pthread_once_t once;
+	uint32_t first[31];
+	uint16_t count[31], offset[31];
+	uint16_t symbols[257];
+} waitressHuffmanDec = {PTHREAD_ONCE_INIT};
+
+static void WaitressHuffmanInit (void) {
+	unsigned int bits, sym;
+	uint16_t pos = 0;
+
+	for (bits = 0; bits < 31; bits++) {
+		waitressHuffmanDec.offset[bits] = pos;
+		for (sym = 0; sym < 257; sym++) {
+			if (waitressHuffman[sym].bits == bits) {
+				if (waitressHuffmanDec.count[bits] == 0) {
+					waitressHuffmanDec.first[bits] = waitressHuffman[sym].code;
+				}
+				++waitressHuffmanDec.count[bits];
+				waitressHuffmanDec.symbols[pos++] = sym;
+			}
+		}
+	}
+}
+
+/*	decode huffman coded string
+ *	@param input
+ *	@param input size
+ *	@param output, at least size*8/5 bytes
+ *	@param output size
+ *	@return false if the input is invalid
+ */
+static bool WaitressHuffmanDecode (const unsigned char *in, const size_t size,
+		char *out, size_t *outSize) {
+	uint32_t code = 0;
+	unsigned int bits = 0;
+	size_t i, n = 0;
+
+	pthread_once (&waitressHuffmanDec.once, WaitressHuffmanInit);
+
+	for (i = 0; i < size * 8; i++) {
+		code = (code << 1) | ((in[i / 8] >> (7 - i % 8)) & 1);
+		++bits;
+		/* unsigned, codes below first wrap around */
+		if (code - waitressHuffmanDec.first[bits] <
+				waitressHuffmanDec.count[bits]) {
+			const uint16_t sym = waitressHuffmanDec.symbols[
+					waitressHuffmanDec.offset[bits] + code -
+					waitressHuffmanDec.first[bits]];
+			if (sym == WAITRESS_HUFFMAN_EOS) {
+				return false;
+			}
+			out[n++] = (char) sym;
+			code = 0;
+			bits = 0;
+		} else if (bits == 30) {
+			return false;
+		}
+	}
+	/* padded with the most significant bits of EOS (all ones) */
+	if (bits > 7 || code != (1u << bits) - 1) {
+		return false;
+	}
+	*outSize = n;
+	return true;
+}
+
+/*	huffman coded size of a string in bytes
+ */
+static size_t WaitressHuffmanSize (const char *in, const size_t size) {
+	size_t i, bits = 0;
+
+	for (i = 0; i < size; i++) {
+		bits += waitressHuffman[(unsigned char) in[i]].bits;
+	}
+	return (bits + 7) / 8;
+}
+
+/*	huffman code a string
+ *	@param input
+ *	@param input size
+ *	@param output, WaitressHuffmanSize () bytes
+ */
+static void WaitressHuffmanEncode (const char *in, const size_t size,
+		unsigned char *out) {
+	uint64_t acc = 0;
+	unsigned int bits = 0;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		const unsigned char c = in[i];
+
+		acc = (acc << waitressHuffman[c].bits) | waitressHuffman[c].code;
+		bits += waitressHuffman[c].bits;
+		while (bits >= 8) {
+			bits -= 8;
+			*out++ = (unsigned char) (acc >> bits);
+		}
+	}
+	if (bits > 0) {
+		*out = (unsigned char) ((acc << (8 - bits)) | (0xff >> bits));
+	}
+}
+
+/*	hpack dynamic table entry, name and value share one allocation
+ */
+typedef struct {
+	char *name, *value;
+	size_t nameLen, valueLen;
+} WaitressHpackEntry_t;
+
+/*	hpack dynamic table, newest entry first
+ */
+typedef struct {
+	WaitressHpackEntry_t *entries;
+	size_t count, alloc;
+	/* sum of entry sizes as defined by rfc 7541, and its limit */
+	size_t size, maxSize;
+} WaitressHpackTable_t;
+
+/*	drop oldest entries until the table is no larger than limit
+ */
+static void WaitressHpackEvict (WaitressHpackTable_t *table,
+		const size_t limit) {
+	while (table->size > limit) {
+		WaitressHpackEntry_t * const entry = &table->entries[--table->count];
+
+		table->size -= entry->nameLen + entry->valueLen + 32;
+		free (entry->name);
+	}
+}
+
+static void WaitressHpackResize (WaitressHpackTable_t *table,
+		const size_t maxSize) {
+	table->maxSize = maxSize;
+	WaitressHpackEvict (table, maxSize);
+}
+
+static void WaitressHpackFree (WaitressHpackTable_t *table) {
+	WaitressHpackEvict (table, 0);
+	free (table->entries);
+	memset (table, 0, sizeof (*table));
+}
+
+/*	add entry to dynamic table
+ *	@return false if out of memory
+ */
+static bool WaitressHpackAdd (WaitressHpackTable_t *table, const char *name,
+		const size_t nameLen, const char *value, const size_t valueLen) {
+	const size_t size = nameLen + valueLen + 32;
+	WaitressHpackEntry_t *entry;
+	char *copy;
+
+	/* entries larger than the table empty it */
+	if (size > table->maxSize) {
+		WaitressHpackEvict (table, 0);
+		return true;
+	}
+
+	/* copy before evicting, name may point into an evicted entry */
+	if ((copy = malloc (nameLen + valueLen + 2)) == NULL) {
+		return false;
+	}
+	memcpy (copy, name, nameLen);
+	copy[nameLen] = '\0';
+	memcpy (copy + nameLen + 1, value, valueLen);
+	copy[nameLen + 1 + valueLen] = '\0';
+
+	WaitressHpackEvict (table, table->maxSize - size);
+
+	if (table->count == table->alloc) {
+		const size_t alloc = table->alloc == 0 ? 16 : table->alloc * 2;
+		WaitressHpackEntry_t * const entries = realloc (table->entries,
+				alloc * sizeof (*entries));
+		if (entries == NULL) {
+			free (copy);
+			return false;
+		}
+		table->entries = entries;
+		table->alloc = alloc;
+	}
+	memmove (&table->entries[1], &table->entries[0],
+			table->count * sizeof (*table->entries));
+	entry = &table->entries[0];
+	entry->name = copy;
+	entry->value = copy + nameLen + 1;
+	entry->nameLen = nameLen;
+	entry->valueLen = valueLen;
+	++table->count;
+	table->size += size;
+
+	return true;
+}
+
+/*	look up entry, static table first
+ *	@param dynamic table
+ *	@param index, starting at 1
+ *	@return false if there is no such entry
+ */
+static bool WaitressHpackLookup (const WaitressHpackTable_t *table,
+		const size_t index, const char **name, size_t *nameLen,
+		const char **value, size_t *valueLen) {
+	if (index == 0) {
+		return false;
+	} else if (index <= WAITRESS_HPACK_STATIC_COUNT) {
+		*name = waitressHpackStatic[index-1].name;
+		*value = waitressHpackStatic[index-1].value;
+		*nameLen = strlen (*name);
+		*valueLen = strlen (*value);
+	} else if (index - WAITRESS_HPACK_STATIC_COUNT <= table->count) {
+		const WaitressHpackEntry_t * const entry =
+				&table->entries[index - WAITRESS_HPACK_STATIC_COUNT - 1];
+		*name = entry->name;
+		*value = entry->value;
+		*nameLen = entry->nameLen;
+		*valueLen = entry->valueLen;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/*	find a header field in both tables
+ *	@param dynamic table
+ *	@param name
+ *	@param value
+ *	@param set if the value matches too
+ *	@return index, 0 if the name is not in any table
+ */
+static size_t WaitressHpackFind (const WaitressHpackTable_t *table,
+		const char *name, const size_t nameLen, const char *value,
+		const size_t valueLen, bool *exact) {
+	const size_t count = WAITRESS_HPACK_STATIC_COUNT + table->count;
+	size_t i, found = 0;
+
+	*exact = false;
+	for (i = 1; i <= count; i++) {
+		const char *n, *v;
+		size_t nLen, vLen;
+
+		if (!WaitressHpackLookup (table, i, &n, &nLen, &v, &vLen)) {
+			break;
+		}
+		if (nLen == nameLen && memcmp (n, name, nameLen) == 0) {
+			if (vLen == valueLen && memcmp (v, value, valueLen) == 0) {
+				*exact = true;
+				return i;
+			}
+			if (found == 0) {
+				found = i;
+			}
+		}
+	}
+	return found;
+}
+
+/*	decode integer with prefix bits
+ *	@return false if the input is truncated or the value too large
+ */
+static bool WaitressHpackDecodeInt (const unsigned char **pos,
+		const unsigned char *end, const unsigned int prefix, size_t *value) {
+	const size_t max = (1u << prefix) - 1;
+	unsigned int shift = 0;
+	unsigned char b;
+	size_t v;
+
+	if (*pos >= end) {
+		return false;
+	}
+	if ((v = *(*pos)++ & max) < max) {
+		*value = v;
+		return true;
+	}
+	do {
+		if (*pos >= end || shift > 21) {
+			return false;
+		}
+		b = *(*pos)++;
+		v += (size_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	*value = v;
+	return true;
+}
+
+/*	decode string literal
+ *	@param input position, advanced
+ *	@param end of input
+ *	@param decoded string, NUL terminated, must be freed
+ *	@param its length
+ *	@return false if the input is invalid
+ */
+static bool WaitressHpackDecodeString (const unsigned char **pos,
+		const unsigned char *end, char **out, size_t *outLen) {
+	bool huffman;
+	size_t len;
+
+	if (*pos >= end) {
+		return false;
+	}
+	huffman = (**pos & 0x80) != 0;
+	if (!WaitressHpackDecodeInt (pos, end, 7, &len) ||
+			len > (size_t) (end - *pos)) {
+		return false;
+	}
+	if ((*out = malloc (huffman ? len * 8 / 5 + 1 : len + 1)) == NULL) {
+		return false;
+	}
+	if (huffman) {
+		if (!WaitressHuffmanDecode (*pos, len, *out, outLen)) {
+			free (*out);
+			return false;
+		}
+	} else {
+		memcpy (*out, *pos, len);
+		*outLen = len;
+	}
+	(*out)[*outLen] = '\0';
+	*pos += len;
+	return true;
+}
+
+/*	decode header block
+ *	@param dynamic table
+ *	@param block
+ *	@param block size
+ *	@param called for every header field, names are lower case
+ *	@param callback data
+ *	@return false if the block is invalid, the connection is unusable then
+ */
+static bool WaitressHpackDecode (WaitressHpackTable_t *table,
+		const unsigned char *pos, const size_t size,
+		bool (*callback) (void *, const char *, size_t, const char *, size_t),
+		void *data) {
+	const unsigned char * const end = pos + size;
+
+	while (pos < end) {
+		const unsigned char first = *pos;
+		const char *name, *value;
+		char *nameCopy = NULL, *valueCopy = NULL;
+		size_t nameLen, valueLen, index;
+		bool ok, add = false;
+
+		if (first & 0x80) {
+			/* indexed field */
+			if (!WaitressHpackDecodeInt (&pos, end, 7, &index) ||
+					!WaitressHpackLookup (table, index, &name, &nameLen,
+					&value, &valueLen)) {
+				return false;
+			}
+			if (!callback (data, name, nameLen, value, valueLen)) {
+				return false;
+			}
+			continue;
+		} else if ((first & 0xe0) == 0x20) {
+			/* dynamic table size update, up to what we allowed */
+			if (!WaitressHpackDecodeInt (&pos, end, 5, &index) ||
+					index > WAITRESS_HPACK_TABLE_SIZE) {
+				return false;
+			}
+			WaitressHpackResize (table, index);
+			continue;
+		} else if (first & 0x40) {
+			/* literal with incremental indexing */
+			ok = WaitressHpackDecodeInt (&pos, end, 6, &index);
+			add = true;
+		} else {
+			/* literal without indexing or never indexed */
+			ok = WaitressHpackDecodeInt (&pos, end, 4, &index);
+		}
+		if (!ok) {
+			return false;
+		}
+
+		if (index == 0) {
+			if (!WaitressHpackDecodeString (&pos, end, &nameCopy,
+					&nameLen)) {
+				return false;
+			}
+			name = nameCopy;
+		} else if (!WaitressHpackLookup (table, index, &name, &nameLen,
+				&value, &valueLen)) {
+			return false;
+		}
+		ok = WaitressHpackDecodeString (&pos, end, &valueCopy, &valueLen);
+		if (ok) {
+			value = valueCopy;
+			ok = callback (data, name, nameLen, value, valueLen) &&
+					(!add || WaitressHpackAdd (table, name, nameLen, value,
+					valueLen));
+		}
+		free (nameCopy);
+		free (valueCopy);
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*	append integer with prefix bits to header block
+ *	@param header block
+ *	@param flag bits above the prefix
+ *	@param prefix bits
+ *	@param value
+ */
+static bool WaitressHpackEncodeInt (WaitressH2Buf_t *out,
+		const unsigned char flags, const unsigned int prefix, size_t value) {
+	const size_t max = (1u << prefix) - 1;
+	unsigned char * const dest = (unsigned char *) WaitressH2BufReserve (out,
+			1 + sizeof (value) * 8 / 7 + 1);
+	size_t n = 0;
+
+	if (dest == NULL) {
+		return false;
+	}
+	if (value < max) {
+		dest[n++] = flags | (unsigned char) value;
+	} else {
+		dest[n++] = flags | (unsigned char) max;
+		value -= max;
+		while (value >= 0x80) {
+			dest[n++] = (unsigned char) ((value & 0x7f) | 0x80);
+			value >>= 7;
+		}
+		dest[n++] = (unsigned char) value;
+	}
+	out->size += n;
+	return true;
+}
+
+/*	append string literal to header block, huffman coded if shorter
+ */
+static bool WaitressHpackEncodeString (WaitressH2Buf_t *out, const char *s,
+		const size_t len) {
+	const size_t huffmanSize = WaitressHuffmanSize (s, len);
+	unsigned char *dest;
+
+	if (huffmanSize >= len) {
+		return WaitressHpackEncodeInt (out, 0x00, 7, len) &&
+				WaitressH2BufAppend (out, s, len);
+	}
+	if (!WaitressHpackEncodeInt (out, 0x80, 7, huffmanSize) ||
+			(dest = (unsigned char *) WaitressH2BufReserve (out,
+			huffmanSize)) == NULL) {
+		return false;
+	}
+	WaitressHuffmanEncode (s, len, dest);
+	out->size += huffmanSize;
+	return true;
+}
+
+/*	append header field to header block; fields that change with every
+ *	request or carry credentials are not added to the dynamic table
+ *	@param dynamic table
+ *	@param header block
+ *	@param name, lower case
+ *	@param value
+ */
+static bool WaitressHpackEncode (WaitressHpackTable_t *table,
+		WaitressH2Buf_t *out, const char *name, const size_t nameLen,
+		const char *value, const size_t valueLen) {
+	bool exact, sensitive, indexed;
+	size_t index;
+
+	index = WaitressHpackFind (table, name, nameLen, value, valueLen, &exact);
+	if (exact) {
+		return WaitressHpackEncodeInt (out, 0x80, 7, index);
+	}
+
+#define NAMEEQ(n) (nameLen == strlen (n) && memcmp (name, n, nameLen) == 0)
+	sensitive = NAMEEQ ("authorization") || NAMEEQ ("proxy-authorization") ||
+			NAMEEQ ("cookie");
+	indexed = !sensitive && !NAMEEQ (":path") && !NAMEEQ ("content-length") &&
+			!NAMEEQ ("range");
+#undef NAMEEQ
+
+	if (!(indexed ? WaitressHpackEncodeInt (out, 0x40, 6, index) :
+			WaitressHpackEncodeInt (out, sensitive ? 0x10 : 0x00, 4, index))) {
+		return false;
+	}
+	if (index == 0 && !WaitressHpackEncodeString (out, name, nameLen)) {
+		return false;
+	}
+	if (!WaitressHpackEncodeString (out, value, valueLen)) {
+		return false;
+	}
+	return !indexed || WaitressHpackAdd (table, name, nameLen, value,
+			valueLen);
+}
+
+/*	http/2 stream, one request/response on a shared connection
+ */
+typedef struct WaitressH2Stream {
+	uint32_t id;
+	/* peer's flow control window, SETTINGS may make it negative */
+	int64_t sendWindow;
+	/* request body bytes not sent yet, from its Content-Length */
+	size_t sendLeft;
+	/* received body bytes not acknowledged with WINDOW_UPDATE yet */
+	size_t unacked;
+	/* response converted to http/1.1 (status line, headers, body), read
+	 * up to responsePos */
+	WaitressH2Buf_t response;
+	size_t responsePos;
+	bool headersDone;
+	/* END_STREAM sent/received, RST_STREAM or GOAWAY received */
+	bool sentEnd, ended, reset;
+	struct WaitressH2Stream *next;
+} WaitressH2Stream_t;
+
+/*	http/2 connection, shared by blocking requests on any thread; all
+ *	fields but key and tlsFingerprint are protected by lock
+ */
+typedef struct WaitressH2Conn {
+	char *key;
+	/* fingerprint the tls peer was verified against */
+	char tlsFingerprint[20];
+	int sockfd;
+	WaitressTlsSession_t *tlsSession;
+	pthread_mutex_t lock;
+	/* broadcast after every frame read */
+	pthread_cond_t cond;
+	/* attached handles, idle since idleSince if there are none */
+	unsigned int refs;
+	time_t idleSince;
+	/* one of the handles waits for and reads the next frame */
+	bool reading;
+	/* connection is broken, WAITRESS_RET_OK if it is not */
+	WaitressReturn_t error;
+	/* no new streams, the server sent GOAWAY or ids ran out */
+	bool goaway;
+	uint32_t nextStreamId;
+	WaitressH2Stream_t *streams;
+	size_t streamCount;
+	/* peer's settings */
+	size_t maxStreams;
+	int64_t initialWindow;
+	/* peer's connection flow control window */
+	int64_t sendWindow;
+	/* received bytes not acknowledged with WINDOW_UPDATE yet */
+	size_t unacked;
+	WaitressHpackTable_t encoder, decoder;
+	/* encoder table was shrunk, the next header block must say so */
+	bool encoderResized;
+	/* header block split across HEADERS/CONTINUATION frames */
+	WaitressH2Buf_t block;
+	uint32_t blockStream;
+	bool blockEnd;
+	unsigned char frame[9 + WAITRESS_H2_FRAME_SIZE];
+	struct WaitressH2Conn *next;
+} WaitressH2Conn_t;
+
+/* connections by pool key, protected by lock; lock is taken before any
+ * connection's lock */
+static struct {
+	pthread_mutex_t lock;
+	WaitressH2Conn_t *conns;
+} waitressH2 = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+static const char waitressH2Preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+/*	tls session holds decrypted data that was not read yet?
+ */
+static bool WaitressH2Pending (const WaitressH2Conn_t *conn) {
+	return conn->tlsSession->provider->pending (conn->tlsSession);
+}
+
+/*	close connection, must not touch any handle
+ */
+static void WaitressH2ConnFree (WaitressH2Conn_t *conn) {
+	assert (conn->streams == NULL);
+
+	if (conn->tlsSession != NULL) {
+		conn->tlsSession->provider->sessionFree (conn->tlsSession);
+	}
+	if (conn->sockfd != -1) {
+		waitress_close (conn->sockfd);
+	}
+	WaitressHpackFree (&conn->encoder);
+	WaitressHpackFree (&conn->decoder);
+	WaitressH2BufFree (&conn->block);
+	pthread_mutex_destroy (&conn->lock);
+	pthread_cond_destroy (&conn->cond);
+	free (conn->key);
+	free (conn);
+}
+
+/*	write to the connection, conn->lock must be held; a failed write
+ *	breaks the connection
+ */
+static WaitressReturn_t WaitressH2Send (WaitressHandle_t *waith,
+		const void *data, size_t size) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	const char *buf = data;
+
+	if (conn->error != WAITRESS_RET_OK) {
+		return conn->error;
+	}
+	WaitressTlsBind (waith);
+	while (size > 0) {
+		size_t written = 0;
+		WaitressReturn_t wRet;
+
+		if ((wRet = WaitressTlsWrite (waith, buf, size, &written)) !=
+				WAITRESS_RET_OK) {
+			conn->error = WAITRESS_RET_CONNECTION_CLOSED;
+			return wRet;
+		}
+		buf += written;
+		size -= written;
+	}
+	return WAITRESS_RET_OK;
+}
+
+/*	write a frame, conn->lock must be held
+ *	@param waitress handle
+ *	@param frame type
+ *	@param flags
+ *	@param stream id, 0 for the connection
+ *	@param payload, up to WAITRESS_H2_FRAME_SIZE bytes
+ *	@param payload size
+ */
+static WaitressReturn_t WaitressH2SendFrame (WaitressHandle_t *waith,
+		const unsigned char type, const unsigned char flags,
+		const uint32_t stream, const void *payload, const size_t size) {
+	unsigned char frame[9 + WAITRESS_H2_FRAME_SIZE];
+
+	assert (size <= WAITRESS_H2_FRAME_SIZE);
+
+	frame[0] = (unsigned char) (size >> 16);
+	frame[1] = (unsigned char) (size >> 8);
+	frame[2] = (unsigned char) size;
+	frame[3] = type;
+	frame[4] = flags;
+	frame[5] = (unsigned char) (stream >> 24);
+	frame[6] = (unsigned char) (stream >> 16);
+	frame[7] = (unsigned char) (stream >> 8);
+	frame[8] = (unsigned char) stream;
+	if (size > 0) {
+		memcpy (frame + 9, payload, size);
+	}
+	return WaitressH2Send (waith, frame, 9 + size);
+}
+
+/*	write a frame with a single 32 bit value (RST_STREAM, WINDOW_UPDATE)
+ */
+static WaitressReturn_t WaitressH2SendValue (WaitressHandle_t *waith,
+		const unsigned char type, const uint32_t stream,
+		const uint32_t value) {
+	const unsigned char payload[4] = {(unsigned char) (value >> 24),
+			(unsigned char) (value >> 16), (unsigned char) (value >> 8),
+			(unsigned char) value};
+
+	return WaitressH2SendFrame (waith, type, 0, stream, payload,
+			sizeof (payload));
+}
+
+/*	give up on the connection because the server violated the protocol
+ *	@return result for the request that noticed it
+ */
+static WaitressReturn_t WaitressH2Fail (WaitressHandle_t *waith,
+		const uint32_t code) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	const unsigned char payload[8] = {0, 0, 0, 0,
+			(unsigned char) (code >> 24), (unsigned char) (code >> 16),
+			(unsigned char) (code >> 8), (unsigned char) code};
+
+	WaitressH2SendFrame (waith, WAITRESS_H2_GOAWAY, 0, 0, payload,
+			sizeof (payload));
+	conn->error = WAITRESS_RET_CONNECTION_CLOSED;
+	return WAITRESS_RET_DECODING_ERR;
+}
+
+static uint32_t WaitressH2Uint32 (const unsigned char *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+			((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static WaitressH2Stream_t *WaitressH2FindStream (WaitressH2Conn_t *conn,
+		const uint32_t id) {
+	WaitressH2Stream_t *stream;
+
+	for (stream = conn->streams; stream != NULL; stream = stream->next) {
+		if (stream->id == id) {
+			return stream;
+		}
+	}
+	return NULL;
+}
+
+/*	header field of a response, converted to http/1.1 text
+ */
+static bool WaitressH2Header (void *data, const char *name,
+		const size_t nameLen, const char *value, const size_t valueLen) {
+	WaitressH2Buf_t * const text = data;
+
+	/* would break the line based parser */
+	if (memchr (value, '\r', valueLen) != NULL ||
+			memchr (value, '\n', valueLen) != NULL) {
+		return true;
+	}
+	if (nameLen == 7 && memcmp (name, ":status", 7) == 0) {
+		return WaitressH2BufAppend (text, "HTTP/1.1 ", 9) &&
+				WaitressH2BufAppend (text, value, valueLen) &&
+				WaitressH2BufAppend (text, "\r\n", 2);
+	} else if (nameLen > 0 && name[0] != ':') {
+		return WaitressH2BufAppend (text, name, nameLen) &&
+				WaitressH2BufAppend (text, ": ", 2) &&
+				WaitressH2BufAppend (text, value, valueLen) &&
+				WaitressH2BufAppend (text, "\r\n", 2);
+	}
+	return true;
+}
+
+/*	decode the complete header block in conn->block; it becomes the head
+ *	of the stream's response unless it is informational (1xx) or trailers
+ */
+static WaitressReturn_t WaitressH2HandleBlock (WaitressHandle_t *waith) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	WaitressH2Stream_t * const stream = WaitressH2FindStream (conn,
+			conn->blockStream);
+	WaitressH2Buf_t text;
+	bool ok;
+
+	memset (&text, 0, sizeof (text));
+	/* decoded even if nobody is interested, the table must stay in sync */
+	ok = WaitressHpackDecode (&conn->decoder,
+			(const unsigned char *) conn->block.data, conn->block.size,
+			WaitressH2Header, &text);
+	conn->block.size = 0;
+	if (!ok) {
+		WaitressH2BufFree (&text);
+		return WaitressH2Fail (waith, WAITRESS_H2_COMPRESSION_ERROR);
+	}
+
+	if (stream != NULL && !stream->headersDone) {
+		if (text.size < 10 || memcmp (text.data, "HTTP/1.1 ", 9) != 0) {
+			/* no status */
+			stream->reset = true;
+		} else if (text.data[9] != '1') {
+			if (!WaitressH2BufAppend (&stream->response, text.data,
+					text.size) ||
+					!WaitressH2BufAppend (&stream->response, "\r\n", 2)) {
+				stream->reset = true;
+			}
+			stream->headersDone = true;
+		}
+	}
+	if (stream != NULL && conn->blockEnd) {
+		stream->ended = true;
+	}
+	WaitressH2BufFree (&text);
+
+	return WAITRESS_RET_OK;
+}
+
+/*	apply peer's SETTINGS frame
+ */
+static WaitressReturn_t WaitressH2HandleSettings (WaitressHandle_t *waith,
+		const unsigned char *payload, const size_t size) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	size_t i;
+
+	if (size % 6 != 0) {
+		return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+	}
+	for (i = 0; i < size; i += 6) {
+		const unsigned int id = (payload[i] << 8) | payload[i+1];
+		const uint32_t value = WaitressH2Uint32 (payload + i + 2);
+
+		switch (id) {
+			case 0x1: {
+				/* header table size */
+				const size_t maxSize = value < WAITRESS_HPACK_TABLE_SIZE ?
+						value : WAITRESS_HPACK_TABLE_SIZE;
+				if (maxSize != conn->encoder.maxSize) {
+					WaitressHpackResize (&conn->encoder, maxSize);
+					conn->encoderResized = true;
+				}
+				break;
+			}
+
+			case 0x3:
+				/* max concurrent streams */
+				conn->maxStreams = value;
+				break;
+
+			case 0x4: {
+				/* initial window size, applies to open streams too */
+				WaitressH2Stream_t *stream;
+
+				if (value > 0x7fffffff) {
+					return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+				}
+				for (stream = conn->streams; stream != NULL;
+						stream = stream->next) {
+					stream->sendWindow += (int64_t) value -
+							conn->initialWindow;
+				}
+				conn->initialWindow = value;
+				break;
+			}
+
+			default:
+				/* we never send frames larger than the default maximum */
+				break;
+		}
+	}
+	return WaitressH2SendFrame (waith, WAITRESS_H2_SETTINGS,
+			WAITRESS_H2_ACK, 0, NULL, 0);
+}
+
+/*	read exactly size bytes from the connection
+ */
+static WaitressReturn_t WaitressH2Recv (WaitressHandle_t *waith,
+		unsigned char *buf, size_t size) {
+	while (size > 0) {
+		size_t got = 0;
+		WaitressReturn_t wRet;
+
+		if ((wRet = WaitressTlsRead (waith, (char *) buf, size, &got)) !=
+				WAITRESS_RET_OK) {
+			return wRet;
+		}
+		if (got == 0) {
+			return WAITRESS_RET_CONNECTION_CLOSED;
+		}
+		buf += got;
+		size -= got;
+	}
+	return WAITRESS_RET_OK;
+}
+
+/*	read and handle one frame, conn->lock must be held; a failed read
+ *	breaks the connection
+ */
+static WaitressReturn_t WaitressH2ReadFrame (WaitressHandle_t *waith) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	unsigned char * const head = conn->frame, * const payload = conn->frame + 9;
+	WaitressH2Stream_t *stream;
+	unsigned char type, flags;
+	const unsigned char *data;
+	size_t size, dataSize;
+	uint32_t id;
+	WaitressReturn_t wRet;
+
+	WaitressTlsBind (waith);
+	if ((wRet = WaitressH2Recv (waith, head, 9)) != WAITRESS_RET_OK) {
+		conn->error = WAITRESS_RET_CONNECTION_CLOSED;
+		return wRet;
+	}
+	size = ((size_t) head[0] << 16) | (head[1] << 8) | head[2];
+	type = head[3];
+	flags = head[4];
+	id = WaitressH2Uint32 (head + 5) & 0x7fffffff;
+	if (size > WAITRESS_H2_FRAME_SIZE) {
+		return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+	}
+	if ((wRet = WaitressH2Recv (waith, payload, size)) != WAITRESS_RET_OK) {
+		conn->error = WAITRESS_RET_CONNECTION_CLOSED;
+		return wRet;
+	}
+	/* header blocks must not be interrupted */
+	if (conn->blockStream != 0 && (type != WAITRESS_H2_CONTINUATION ||
+			id != conn->blockStream)) {
+		return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+	}
+
+	/* strip padding (and priority) of DATA and HEADERS */
+	data = payload;
+	dataSize = size;
+	if ((type == WAITRESS_H2_DATA || type == WAITRESS_H2_HEADERS) &&
+			(flags & WAITRESS_H2_PADDED)) {
+		if (size < 1 || (size_t) payload[0] + 1 > size) {
+			return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+		}
+		data = payload + 1;
+		dataSize = size - 1 - payload[0];
+	}
+	if (type == WAITRESS_H2_HEADERS && (flags & WAITRESS_H2_PRIORITY)) {
+		if (dataSize < 5) {
+			return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+		}
+		data += 5;
+		dataSize -= 5;
+	}
+
+	stream = id != 0 ? WaitressH2FindStream (conn, id) : NULL;
+	switch (type) {
+		case WAITRESS_H2_DATA:
+			if (id == 0) {
+				return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+			}
+			/* padding counts against flow control windows too */
+			conn->unacked += size;
+			if (stream != NULL) {
+				if (!WaitressH2BufAppend (&stream->response, data,
+						dataSize)) {
+					stream->reset = true;
+				}
+				stream->unacked += size;
+				if (flags & WAITRESS_H2_END_STREAM) {
+					stream->ended = true;
+				}
+			}
+			if (conn->unacked >= WAITRESS_H2_WINDOW) {
+				wRet = WaitressH2SendValue (waith, WAITRESS_H2_WINDOW_UPDATE,
+						0, (uint32_t) conn->unacked);
+				conn->unacked = 0;
+			}
+			break;
+
+		case WAITRESS_H2_HEADERS:
+		case WAITRESS_H2_CONTINUATION:
+			if (id == 0 || (type == WAITRESS_H2_CONTINUATION &&
+					conn->blockStream == 0)) {
+				return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+			}
+			if (type == WAITRESS_H2_HEADERS) {
+				conn->blockEnd = (flags & WAITRESS_H2_END_STREAM) != 0;
+			}
+			/* a peer that never sends END_HEADERS must not grow it
+			 * without bounds */
+			if (dataSize > WAITRESS_H2_BLOCK_SIZE - conn->block.size) {
+				return WaitressH2Fail (waith, WAITRESS_H2_ENHANCE_YOUR_CALM);
+			}
+			if (!WaitressH2BufAppend (&conn->block, data, dataSize)) {
+				conn->error = WAITRESS_RET_CONNECTION_CLOSED;
+				return WAITRESS_RET_ERR;
+			}
+			conn->blockStream = id;
+			if (flags & WAITRESS_H2_END_HEADERS) {
+				wRet = WaitressH2HandleBlock (waith);
+				conn->blockStream = 0;
+			}
+			break;
+
+		case WAITRESS_H2_RST_STREAM:
+			if (stream != NULL) {
+				stream->reset = true;
+			}
+			break;
+
+		case WAITRESS_H2_SETTINGS:
+			if (!(flags & WAITRESS_H2_ACK)) {
+				wRet = WaitressH2HandleSettings (waith, payload, size);
+			}
+			break;
+
+		case WAITRESS_H2_PING:
+			if (!(flags & WAITRESS_H2_ACK)) {
+				wRet = WaitressH2SendFrame (waith, WAITRESS_H2_PING,
+						WAITRESS_H2_ACK, 0, payload, size);
+			}
+			break;
+
+		case WAITRESS_H2_GOAWAY:
+			/* streams the server did not process can be retried */
+			if (size < 8) {
+				return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+			}
+			conn->goaway = true;
+			for (stream = conn->streams; stream != NULL;
+					stream = stream->next) {
+				if (stream->id > (WaitressH2Uint32 (payload) & 0x7fffffff)) {
+					stream->reset = true;
+				}
+			}
+			break;
+
+		case WAITRESS_H2_WINDOW_UPDATE:
+			if (size != 4) {
+				return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+			}
+			if (id == 0) {
+				conn->sendWindow += WaitressH2Uint32 (payload) & 0x7fffffff;
+			} else if (stream != NULL) {
+				stream->sendWindow += WaitressH2Uint32 (payload) & 0x7fffffff;
+			}
+			break;
+
+		case WAITRESS_H2_PUSH_PROMISE:
+			/* disabled in our SETTINGS */
+			return WaitressH2Fail (waith, WAITRESS_H2_PROTOCOL_ERROR);
+
+		default:
+			/* PRIORITY, unknown frame types */
+			break;
+	}
+	return wRet;
+}
+
+/*	wait for the next frame, conn->lock must be held; it is read by this
+ *	handle unless another one does so already
+ *	@param waitress handle
+ *	@param give up at this time (monotonic clock, ms)
+ *	@return WAITRESS_RET_OK if something may have changed
+ */
+static WaitressReturn_t WaitressH2Pump (WaitressHandle_t *waith,
+		const int64_t deadline) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	WaitressReturn_t wRet;
+	int64_t left;
+
+	if (conn->error != WAITRESS_RET_OK) {
+		return conn->error;
+	}
+	if ((left = deadline - WaitressNow ()) <= 0) {
+		return WAITRESS_RET_TIMEOUT;
+	}
+
+	if (conn->reading) {
+		/* cancellation is not signalled, wake up regularly */
+		struct timespec ts;
+
+		WaitressCondDeadline (&ts, left < 100 ? (int) left : 100);
+		pthread_cond_timedwait (&conn->cond, &conn->lock, &ts);
+		return WaitressCancelled (waith) ? WAITRESS_RET_CANCELLED :
+				WAITRESS_RET_OK;
+	}
+
+	conn->reading = true;
+	if (!WaitressH2Pending (conn)) {
+		/* others may send in the meantime */
+		pthread_mutex_unlock (&conn->lock);
+		wRet = WaitressWaitFd (waith, conn->sockfd, false, (int) left);
+		pthread_mutex_lock (&conn->lock);
+	} else {
+		wRet = WAITRESS_RET_OK;
+	}
+	if (wRet == WAITRESS_RET_OK) {
+		if (conn->error != WAITRESS_RET_OK) {
+			wRet = conn->error;
+		} else {
+			wRet = WaitressH2ReadFrame (waith);
+		}
+	}
+	conn->reading = false;
+	pthread_cond_broadcast (&conn->cond);
+
+	return wRet;
+}
+
+/*	next line of a serialized http/1.1 request head
+ *	@param position, advanced
+ *	@param end of head
+ *	@param line, without line break
+ *	@param its length
+ *	@return false at the end of the head
+ */
+static bool WaitressH2NextLine (const char **pos, const char *end,
+		const char **line, size_t *len) {
+	const char *eol;
+
+	if (*pos >= end || (eol = memchr (*pos, '\n', end - *pos)) == NULL) {
+		return false;
+	}
+	*line = *pos;
+	*len = eol - *pos;
+	if (*len > 0 && (*line)[*len - 1] == '\r') {
+		--*len;
+	}
+	*pos = eol + 1;
+	return true;
+}
+
+/*	header field of a serialized request
+ *	@return false if the line is not one
+ */
+static bool WaitressH2SplitHeader (const char *line, const size_t len,
+		char *name, const size_t nameSize, size_t *nameLen,
+		const char **value, size_t *valueLen) {
+	const char * const colon = memchr (line, ':', len);
+	size_t i;
+
+	if (colon == NULL || colon == line ||
+			(size_t) (colon - line) >= nameSize) {
+		return false;
+	}
+	*nameLen = colon - line;
+	/* field names are lower case in http/2 */
+	for (i = 0; i < *nameLen; i++) {
+		name[i] = tolower ((unsigned char) line[i]);
+	}
+	name[*nameLen] = '\0';
+	*value = colon + 1;
+	while (*value < line + len && (**value == ' ' || **value == '\t')) {
+		++*value;
+	}
+	*valueLen = line + len - *value;
+	return true;
+}
+
+/*	open a stream and send the request head converted to HEADERS (and
+ *	CONTINUATION) frames, conn->lock must be held
+ *	@param waitress handle
+ *	@param serialized http/1.1 head, without the empty line
+ *	@param its size
+ *	@param give up waiting for a free stream at this time
+ */
+static WaitressReturn_t WaitressH2SendHead (WaitressHandle_t *waith,
+		const char *head, const size_t size, const int64_t deadline) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	const char * const end = head + size;
+	const char *pos = head, *line, *method, *path, *authority = "";
+	size_t len, methodLen, pathLen, authorityLen = 0, sendLeft = 0, sent;
+	WaitressH2Stream_t *stream;
+	WaitressH2Buf_t block;
+	char name[64];
+	const char *value;
+	size_t nameLen, valueLen;
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+	bool ok;
+
+	/* request line: method target version */
+	if (!WaitressH2NextLine (&pos, end, &line, &len) ||
+			(path = memchr (line, ' ', len)) == NULL) {
+		return WAITRESS_RET_ERR;
+	}
+	method = line;
+	methodLen = path - line;
+	++path;
+	pathLen = len - methodLen - 1;
+	if ((line = memchr (path, ' ', pathLen)) != NULL) {
+		pathLen = line - path;
+	}
+	while (WaitressH2NextLine (&pos, end, &line, &len)) {
+		if (!WaitressH2SplitHeader (line, len, name, sizeof (name), &nameLen,
+				&value, &valueLen)) {
+			continue;
+		}
+		if (strcmp (name, "host") == 0) {
+			authority = value;
+			authorityLen = valueLen;
+		} else if (strcmp (name, "content-length") == 0) {
+			sendLeft = strtoul (value, NULL, 10);
+		}
+	}
+
+	while (conn->streamCount >= conn->maxStreams) {
+		if ((wRet = WaitressH2Pump (waith, deadline)) != WAITRESS_RET_OK) {
+			return wRet;
+		}
+	}
+	if (conn->error != WAITRESS_RET_OK) {
+		return conn->error;
+	}
+	if (conn->goaway || conn->nextStreamId > 0x7fffffff) {
+		conn->goaway = true;
+		return WAITRESS_RET_CONNECTION_CLOSED;
+	}
+
+	memset (&block, 0, sizeof (block));
+	ok = true;
+	if (conn->encoderResized) {
+		ok = WaitressHpackEncodeInt (&block, 0x20, 5, conn->encoder.maxSize);
+		conn->encoderResized = false;
+	}
+	ok = ok && WaitressHpackEncode (&conn->encoder, &block, ":method", 7,
+			method, methodLen) &&
+			WaitressHpackEncode (&conn->encoder, &block, ":scheme", 7,
+			"https", 5) &&
+			WaitressHpackEncode (&conn->encoder, &block, ":authority", 10,
+			authority, authorityLen) &&
+			WaitressHpackEncode (&conn->encoder, &block, ":path", 5,
+			path, pathLen);
+	pos = head;
+	WaitressH2NextLine (&pos, end, &line, &len);
+	while (ok && WaitressH2NextLine (&pos, end, &line, &len)) {
+		if (!WaitressH2SplitHeader (line, len, name, sizeof (name), &nameLen,
+				&value, &valueLen)) {
+			continue;
+		}
+		/* connection specific fields are not allowed */
+		if (strcmp (name, "host") == 0 || strcmp (name, "connection") == 0 ||
+				strcmp (name, "keep-alive") == 0 ||
+				strcmp (name, "proxy-connection") == 0 ||
+				strcmp (name, "transfer-encoding") == 0 ||
+				strcmp (name, "upgrade") == 0) {
+			continue;
+		}
+		ok = WaitressHpackEncode (&conn->encoder, &block, name, nameLen,
+				value, valueLen);
+	}
+	if (!ok || (stream = calloc (1, sizeof (*stream))) == NULL) {
+		/* encoder table may be out of sync with the server's now */
+		WaitressH2BufFree (&block);
+		conn->error = WAITRESS_RET_CONNECTION_CLOSED;
+		return WAITRESS_RET_ERR;
+	}
+
+	stream->id = conn->nextStreamId;
+	conn->nextStreamId += 2;
+	stream->sendWindow = conn->initialWindow;
+	stream->sendLeft = sendLeft;
+	stream->sentEnd = sendLeft == 0;
+	stream->next = conn->streams;
+	conn->streams = stream;
+	++conn->streamCount;
+	waith->request.h2Stream = stream;
+
+	/* ids must increase on the wire, the block is sent before the lock is
+	 * released */
+	sent = 0;
+	do {
+		const size_t n = block.size - sent < WAITRESS_H2_FRAME_SIZE ?
+				block.size - sent : WAITRESS_H2_FRAME_SIZE;
+		unsigned char flags = 0;
+
+		if (sent + n == block.size) {
+			flags |= WAITRESS_H2_END_HEADERS;
+		}
+		if (sent == 0 && stream->sentEnd) {
+			flags |= WAITRESS_H2_END_STREAM;
+		}
+		wRet = WaitressH2SendFrame (waith, sent == 0 ? WAITRESS_H2_HEADERS :
+				WAITRESS_H2_CONTINUATION, flags, stream->id,
+				block.data + sent, n);
+		sent += n;
+	} while (wRet == WAITRESS_RET_OK && sent < block.size);
+	WaitressH2BufFree (&block);
+
+	return wRet;
+}
+
+/*	request.write of handles on http/2 connections, takes the serialized
+ *	http/1.1 request; its head must be written in one piece (it is, see
+ *	WaitressFormatRequest ()), the body is sent as DATA frames
+ */
+static WaitressReturn_t WaitressH2Write (void *data, const char *buf,
+		const size_t size, size_t *retSize) {
+	WaitressHandle_t * const waith = data;
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	const int64_t deadline = WaitressDeadline (waith, WaitressNow ());
+	WaitressH2Stream_t *stream;
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+	size_t pos = 0;
+
+	pthread_mutex_lock (&conn->lock);
+	if (waith->request.h2Stream == NULL) {
+		size_t i;
+
+		for (i = 0; i + 4 <= size; i++) {
+			if (memcmp (buf + i, "\r\n\r\n", 4) == 0) {
+				break;
+			}
+		}
+		if (i + 4 > size) {
+			pthread_mutex_unlock (&conn->lock);
+			return WAITRESS_RET_ERR;
+		}
+		wRet = WaitressH2SendHead (waith, buf, i + 2, deadline);
+		pos = i + 4;
+	}
+
+	stream = waith->request.h2Stream;
+	while (wRet == WAITRESS_RET_OK && pos < size && stream->sendLeft > 0) {
+		int64_t n = size - pos;
+
+		if (stream->reset) {
+			wRet = WAITRESS_RET_CONNECTION_CLOSED;
+			break;
+		}
+		if ((int64_t) stream->sendLeft < n) {
+			n = stream->sendLeft;
+		}
+		if (n > WAITRESS_H2_FRAME_SIZE) {
+			n = WAITRESS_H2_FRAME_SIZE;
+		}
+		if (conn->sendWindow < n) {
+			n = conn->sendWindow;
+		}
+		if (stream->sendWindow < n) {
+			n = stream->sendWindow;
+		}
+		if (n <= 0) {
+			/* wait for WINDOW_UPDATE */
+			wRet = WaitressH2Pump (waith, deadline);
+			continue;
+		}
+
+		stream->sentEnd = (size_t) n == stream->sendLeft;
+		if ((wRet = WaitressH2SendFrame (waith, WAITRESS_H2_DATA,
+				stream->sentEnd ? WAITRESS_H2_END_STREAM : 0, stream->id,
+				buf + pos, n)) == WAITRESS_RET_OK) {
+			pos += n;
+			stream->sendLeft -= n;
+			conn->sendWindow -= n;
+			stream->sendWindow -= n;
+		}
+	}
+	pthread_mutex_unlock (&conn->lock);
+
+	if (wRet == WAITRESS_RET_OK) {
+		*retSize = size;
+	}
+	return wRet;
+}
+
+/*	request.read of handles on http/2 connections, returns the response
+ *	converted to http/1.1; 0 bytes are read at the end of the stream
+ */
+static WaitressReturn_t WaitressH2Read (void *data, char *buf,
+		const size_t size, size_t *retSize) {
+	WaitressHandle_t * const waith = data;
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	WaitressH2Stream_t * const stream = waith->request.h2Stream;
+	const int64_t deadline = WaitressDeadline (waith, WaitressNow ());
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+
+	if (stream == NULL) {
+		return WAITRESS_RET_ERR;
+	}
+
+	pthread_mutex_lock (&conn->lock);
+	while (true) {
+		const size_t avail = stream->response.size - stream->responsePos;
+
+		if (avail > 0) {
+			const size_t n = avail < size ? avail : size;
+
+			memcpy (buf, stream->response.data + stream->responsePos, n);
+			stream->responsePos += n;
+			*retSize = n;
+			if (stream->responsePos == stream->response.size) {
+				stream->response.size = 0;
+				stream->responsePos = 0;
+				/* everything received was consumed, the server may send
+				 * more */
+				if (stream->unacked >= WAITRESS_H2_WINDOW / 2 &&
+						!stream->ended && !stream->reset) {
+					WaitressH2SendValue (waith, WAITRESS_H2_WINDOW_UPDATE,
+							stream->id, (uint32_t) stream->unacked);
+					stream->unacked = 0;
+				}
+			}
+			break;
+		} else if (stream->ended) {
+			*retSize = 0;
+			break;
+		} else if (stream->reset) {
+			wRet = WAITRESS_RET_CONNECTION_CLOSED;
+			break;
+		} else if ((wRet = WaitressH2Pump (waith, deadline)) !=
+				WAITRESS_RET_OK) {
+			break;
+		}
+	}
+	pthread_mutex_unlock (&conn->lock);
+
+	return wRet;
+}
+
+/*	switch the handle's new connection to http/2 if the server picked it
+ *	in the tls handshake; it is shared by blocking requests from now on
+ */
+static WaitressReturn_t WaitressH2Start (WaitressHandle_t *waith) {
+	static const unsigned char settings[] = {
+			/* no server push */
+			0x0, 0x2, 0, 0, 0, 0,
+			/* initial window size */
+			0x0, 0x4, (WAITRESS_H2_WINDOW >> 24) & 0xff,
+			(WAITRESS_H2_WINDOW >> 16) & 0xff, (WAITRESS_H2_WINDOW >> 8) & 0xff,
+			WAITRESS_H2_WINDOW & 0xff};
+	WaitressH2Conn_t *conn;
+	WaitressReturn_t wRet;
+
+	if (!waith->http2 || waith->request.nonBlocking ||
+			!waith->request.tlsSession->provider->alpnH2 (
+			waith->request.tlsSession)) {
+		return WAITRESS_RET_OK;
+	}
+	if ((conn = calloc (1, sizeof (*conn))) == NULL) {
+		return WAITRESS_RET_ERR;
+	}
+	conn->key = WaitressPoolKey (waith);
+	memcpy (conn->tlsFingerprint, waith->tlsFingerprint,
+			sizeof (conn->tlsFingerprint));
+	conn->sockfd = waith->request.sockfd;
+	conn->tlsSession = waith->request.tlsSession;
+	pthread_mutex_init (&conn->lock, NULL);
+	pthread_cond_init (&conn->cond, NULL);
+	conn->refs = 1;
+	conn->error = WAITRESS_RET_OK;
+	conn->nextStreamId = 1;
+	conn->maxStreams = SIZE_MAX;
+	conn->initialWindow = 65535;
+	conn->sendWindow = 65535;
+	conn->encoder.maxSize = WAITRESS_HPACK_TABLE_SIZE;
+	conn->decoder.maxSize = WAITRESS_HPACK_TABLE_SIZE;
+	waith->request.h2Conn = conn;
+
+	pthread_mutex_lock (&conn->lock);
+	if ((wRet = WaitressH2Send (waith, waitressH2Preface,
+			sizeof (waitressH2Preface) - 1)) == WAITRESS_RET_OK &&
+			(wRet = WaitressH2SendFrame (waith, WAITRESS_H2_SETTINGS, 0, 0,
+			settings, sizeof (settings))) == WAITRESS_RET_OK) {
+		wRet = WaitressH2SendValue (waith, WAITRESS_H2_WINDOW_UPDATE, 0,
+				WAITRESS_H2_CONN_WINDOW - 65535);
+	}
+	pthread_mutex_unlock (&conn->lock);
+
+	if (wRet != WAITRESS_RET_OK) {
+		/* socket and tls session are closed with the handle's connection */
+		conn->sockfd = -1;
+		conn->tlsSession = NULL;
+		WaitressH2ConnFree (conn);
+		waith->request.h2Conn = NULL;
+		return wRet;
+	}
+
+	waith->request.read = WaitressH2Read;
+	waith->request.write = WaitressH2Write;
+
+	pthread_mutex_lock (&waitressH2.lock);
+	conn->next = waitressH2.conns;
+	waitressH2.conns = conn;
+	pthread_mutex_unlock (&waitressH2.lock);
+
+	return WAITRESS_RET_OK;
+}
+
+/*	attach handle to an http/2 connection to its host, unused connections
+ *	expire like pooled ones
+ *	@param waitress handle
+ *	@return true if there is one, it becomes the handle's current
+ *			connection
+ */
+static bool WaitressH2Get (WaitressHandle_t *waith) {
+	WaitressH2Conn_t *conn = NULL, **prev;
+	const time_t now = time (NULL);
+	char *key;
+
+	if (!waith->http2 || !waith->url.tls || waith->request.nonBlocking) {
+		return false;
+	}
+
+	key = WaitressPoolKey (waith);
+	pthread_mutex_lock (&waitressH2.lock);
+	prev = &waitressH2.conns;
+	while (*prev != NULL) {
+		WaitressH2Conn_t * const cur = *prev;
+		bool expired;
+
+		pthread_mutex_lock (&cur->lock);
+		/* the server should not send anything while no stream is open */
+		expired = cur->refs == 0 && (cur->error != WAITRESS_RET_OK ||
+				cur->goaway || now - cur->idleSince >=
+				WAITRESS_POOL_IDLE_TIMEOUT ||
+				!WaitressPoolConnAlive (cur->sockfd));
+		if (!expired && conn == NULL && cur->error == WAITRESS_RET_OK &&
+				!cur->goaway && strcmp (cur->key, key) == 0 &&
+				memcmp (cur->tlsFingerprint, waith->tlsFingerprint,
+				sizeof (cur->tlsFingerprint)) == 0) {
+			conn = cur;
+			++conn->refs;
+		}
+		pthread_mutex_unlock (&cur->lock);
+
+		if (expired) {
+			*prev = cur->next;
+			WaitressH2ConnFree (cur);
+		} else {
+			prev = &cur->next;
+		}
+	}
+	pthread_mutex_unlock (&waitressH2.lock);
+	free (key);
+
+	if (conn == NULL) {
+		return false;
+	}
+
+	waith->request.h2Conn = conn;
+	waith->request.sockfd = conn->sockfd;
+	waith->request.tlsSession = conn->tlsSession;
+	waith->request.read = WaitressH2Read;
+	waith->request.write = WaitressH2Write;
+	waith->request.reused = true;
+
+	return true;
+}
+
+/*	detach handle from its http/2 connection, an unfinished stream is
+ *	reset; the connection stays open for other requests unless it is
+ *	broken
+ */
+static void WaitressH2Detach (WaitressHandle_t *waith) {
+	WaitressH2Conn_t * const conn = waith->request.h2Conn;
+	WaitressH2Stream_t * const stream = waith->request.h2Stream;
+	bool dead;
+
+	pthread_mutex_lock (&waitressH2.lock);
+	pthread_mutex_lock (&conn->lock);
+	if (stream != NULL) {
+		WaitressH2Stream_t **prev = &conn->streams;
+
+		if (!stream->reset && !(stream->sentEnd && stream->ended)) {
+			WaitressH2SendValue (waith, WAITRESS_H2_RST_STREAM, stream->id,
+					WAITRESS_H2_CANCEL);
+		}
+		while (*prev != stream) {
+			prev = &(*prev)->next;
+		}
+		*prev = stream->next;
+		--conn->streamCount;
+		WaitressH2BufFree (&stream->response);
+		free (stream);
+		/* a stream is available */
+		pthread_cond_broadcast (&conn->cond);
+	}
+	--conn->refs;
+	conn->idleSince = time (NULL);
+	dead = conn->refs == 0 && (conn->error != WAITRESS_RET_OK ||
+			conn->goaway);
+	pthread_mutex_unlock (&conn->lock);
+	if (dead) {
+		WaitressH2Conn_t **prev = &waitressH2.conns;
+
+		while (*prev != conn) {
+			prev = &(*prev)->next;
+		}
+		*prev = conn->next;
+	}
+	pthread_mutex_unlock (&waitressH2.lock);
+	if (dead) {
+		WaitressH2ConnFree (conn);
+	}
+
+	waith->request.h2Conn = NULL;
+	waith->request.h2Stream = NULL;
+	waith->request.sockfd = -1;
+	waith->request.tlsSession = NULL;
+}
+
+/*	close all idle connections
+ */
+void WaitressPoolClear (void) {
+	WaitressPoolConn_t *conn;
+	WaitressH2Conn_t **prev;
+
+	pthread_mutex_lock (&waitressPool.lock);
+	conn = waitressPool.conns;
+	waitressPool.conns = NULL;
+	pthread_mutex_unlock (&waitressPool.lock);
+
+	while (conn != NULL) {
+		WaitressPoolConn_t * const next = conn->next;
+		WaitressPoolConnFree (conn);
+		conn = next;
+	}
+
+	/* http/2 connections without streams */
+	pthread_mutex_lock (&waitressH2.lock);
+	prev = &waitressH2.conns;
+	while (*prev != NULL) {
+		WaitressH2Conn_t * const cur = *prev;
+		bool idle;
+
+		pthread_mutex_lock (&cur->lock);
+		idle = cur->refs == 0;
+		pthread_mutex_unlock (&cur->lock);
+		if (idle) {
+			*prev = cur->next;
+			WaitressH2ConnFree (cur);
+		} else {
+			prev = &cur->next;
+		}
+	}
+	pthread_mutex_unlock (&waitressH2.lock);
+}
+
+/*	reset per-response state
+ */
+static void WaitressResetResponse (WaitressHandle_t *waith) {
+	waith->request.dataHandler = WaitressHandleIdentity;
+	waith->request.contentLength = 0;
+	waith->request.contentReceived = 0;
+	waith->request.chunkSize = 0;
+	waith->request.contentLengthKnown = false;
+	waith->request.rangeStart = 0;
+	waith->request.rangeTotal = 0;
+	waith->request.chunkedState = CHUNKSIZE;
+	waith->request.contentEncoding = ENCODING_IDENTITY;
+#if WAITRESS_USE_ZLIB
+	WaitressInflateFree (waith);
+#endif
+	waith->request.responseStarted = false;
+	waith->request.keepAlive = waith->keepAlive;
+	waith->request.bodyComplete = false;
+}
+
+/*	set up per-request state
+ */
+static void WaitressRequestInit (WaitressHandle_t *waith) {
+	memset (&waith->request, 0, sizeof (waith->request));
+	waith->request.sockfd = -1;
+	waith->request.watchedFd = -1;
+	waith->request.started = WaitressNowUs ();
+	memset (&waith->timing, 0, sizeof (waith->timing));
+	WaitressTimingReset (waith);
+	if (waith->timeouts.total > 0) {
+		waith->request.totalDeadline = WaitressNow () + waith->timeouts.total;
+	}
+
+	/* buffer is required for connect already */
+	waith->request.buf = malloc (WAITRESS_BUFFER_SIZE *
+			sizeof (*waith->request.buf));
+}
+
+/*	start a new attempt
+ *	@param waitress handle
+ *	@return true if an idle connection was taken from the pool, otherwise
+ *		the caller has to connect
+ */
+static bool WaitressAttemptStart (WaitressHandle_t *waith) {
+	++waith->request.attempts;
+	waith->request.read = WaitressOrdinaryRead;
+	waith->request.write = WaitressOrdinaryWrite;
+	waith->request.reused = false;
+	waith->request.tlsVerified = false;
+	waith->request.tlsResuming = false;
+	waith->request.nextAddr = 0;
+	waith->request.phaseDeadline = 0;
+	waith->request.throttledUntil = 0;
+	WaitressTimingReset (waith);
+
+	waith->timing.reused = WaitressH2Get (waith) ||
+			(waith->keepAlive && WaitressPoolGet (waith));
+	return waith->timing.reused;
+}
+
+/*	delay before retrying a request
+ *	@param retry policy
+ *	@param failed attempts so far
+ *	@return milliseconds
+ */
+int WaitressRetryDelay (const WaitressRetry_t *retry, unsigned int attempt) {
+	int64_t delay = retry->backoffBase;
+
+	assert (retry != NULL);
+
+	while (attempt > 1 && delay < retry->backoffMax) {
+		delay *= 2;
+		--attempt;
+	}
+	if (delay > retry->backoffMax) {
+		delay = retry->backoffMax;
+	}
+	/* clients failing at the same time should not retry in lockstep; the
+	 * clock's microseconds are random enough for that */
+	if (retry->jitter > 0 && delay > 0) {
+		delay -= delay * retry->jitter / 100 * (WaitressNowUs () % 1000) /
+				1000;
+	}
+	return delay > 0 ? (int) delay : 0;
+}
+
+/*	errors that may go away if the request is sent again
+ */
+static bool WaitressTransientError (const WaitressReturn_t wRet) {
+	switch (wRet) {
+		case WAITRESS_RET_CONNECT_REFUSED:
+		case WAITRESS_RET_SOCK_ERR:
+		case WAITRESS_RET_GETADDR_ERR:
+		case WAITRESS_RET_TIMEOUT:
+		case WAITRESS_RET_READ_ERR:
+		case WAITRESS_RET_CONNECTION_CLOSED:
+		case WAITRESS_RET_TLS_WRITE_ERR:
+		case WAITRESS_RET_TLS_READ_ERR:
+		case WAITRESS_RET_TLS_HANDSHAKE_ERR:
+		case WAITRESS_RET_SERVICE_UNAVAILABLE:
+			return true;
+
+		default:
+			return false;
+	}
+}
 
-#if WAITRESS_USE_POLARSSL
-	unsigned char fingerprint[20];
+/*	clean up after an attempt, the connection is returned to the pool or
+ *	closed
+ *	@param waitress handle
+ *	@param result of this attempt
+ *	@param connection was established
+ *	@return true if the request should be tried again
+ */
+static bool WaitressAttemptEnd (WaitressHandle_t *waith,
+		const WaitressReturn_t wRet, const bool connected) {
+	if (connected) {
+		/* store session after talking to the server, tls 1.3 tickets
+		 * arrive after the handshake */
+		if (waith->url.tls && waith->request.tlsVerified &&
+				!waith->request.reused) {
+			WaitressTlsCacheStore (waith);
+		}
 
-	x509_cert* cert = waith->request.sslCtx->ssl.peer_cert;
+		if (waith->request.h2Conn != NULL) {
+			WaitressH2Detach (waith);
+		} else if (wRet == WAITRESS_RET_OK && waith->request.keepAlive &&
+				waith->request.bodyComplete) {
+			WaitressPoolPut (waith);
+		} else {
+			WaitressCloseConnection (waith, true);
+		}
+	} else {
+		WaitressCloseConnection (waith, false);
 
-	if (NULL == cert)
-		return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+		/* cached address may be stale */
+		if (wRet == WAITRESS_RET_CONNECT_REFUSED) {
+			const char *host, *port;
 
-	sha1(cert->raw.p, cert->raw.len, fingerprint);
+			WaitressConnectHost (waith, &host, &port);
+			WaitressDnsForget (host, port);
+		}
+	}
 
-	if (memcmp (fingerprint, waith->tlsFingerprint, sizeof (fingerprint)) != 0)
-		return WAITRESS_RET_TLS_FINGERPRINT_MISMATCH;
+	free (waith->request.sendBuf);
+	waith->request.sendBuf = NULL;
+	if (waith->request.dnsJob != NULL) {
+		WaitressDnsRelease (waith->request.dnsJob);
+		waith->request.dnsJob = NULL;
+	}
 
-	return WAITRESS_RET_OK;
-#endif
+	/* the server may have closed an idle connection just before we sent
+	 * our request, try again with a fresh one right away; this is not the
+	 * host's fault */
+	if (waith->request.reused && !waith->request.responseStarted &&
+			(wRet == WAITRESS_RET_CONNECTION_CLOSED ||
+			wRet == WAITRESS_RET_READ_ERR || wRet == WAITRESS_RET_ERR ||
+			wRet == WAITRESS_RET_TLS_READ_ERR ||
+			wRet == WAITRESS_RET_TLS_WRITE_ERR)) {
+		--waith->request.attempts;
+		++waith->timing.retries;
+		return true;
+	}
 
-	return 0;
+	if (WaitressTransientError (wRet)) {
+		WaitressBreakerRecord (waith, true);
+	} else if (wRet == WAITRESS_RET_OK || waith->request.responseStarted) {
+		WaitressBreakerRecord (waith, false);
+	}
+
+	if (waith->request.attempts >= waith->retry.maxAttempts) {
+		return false;
+	}
+	/* requests are sent again only if the server cannot have acted on them
+	 * or they are safe to repeat; a callback must not see data twice */
+	if (wRet == WAITRESS_RET_RETRY || (WaitressTransientError (wRet) &&
+			(!connected || (waith->method == WAITRESS_METHOD_GET &&
+			(!waith->request.responseStarted ||
+			wRet == WAITRESS_RET_SERVICE_UNAVAILABLE))))) {
+		const int64_t now = WaitressNow ();
+		const int64_t retryAt = now + WaitressRetryDelay (&waith->retry,
+				waith->request.attempts);
+
+		if (waith->request.totalDeadline != 0 &&
+				retryAt >= waith->request.totalDeadline) {
+			return false;
+		}
+		waith->request.retryAt = retryAt;
+		++waith->timing.retries;
+		return true;
+	}
+	return false;
 }
 
-static void WaitressDisableBlocking(int sockfd)
-{
-	#ifdef _WIN32
-	u_long iMode = 1;
-	ioctlsocket(sockfd, FIONBIO, &iMode);
-	#else
-	fcntl (sockfd, F_SETFL, O_NONBLOCK);
-	#endif
+/*	free per-request state
+ *	@param waitress handle
+ *	@param result of the last attempt
+ *	@return result of the request
+ */
+static WaitressReturn_t WaitressRequestEnd (WaitressHandle_t *waith,
+		const WaitressReturn_t wRet) {
+	WaitressTimingMark (waith, &waith->timing.done);
+
+	free (waith->request.buf);
+	waith->request.buf = NULL;
+#if WAITRESS_USE_ZLIB
+	WaitressInflateFree (waith);
+#endif
+
+	/* connection closed before the end of the body */
+	if (wRet == WAITRESS_RET_OK &&
+			(waith->request.contentReceived < waith->request.contentLength ||
+			(waith->request.dataHandler == WaitressHandleChunked &&
+			!waith->request.bodyComplete))) {
+		return WAITRESS_RET_PARTIAL_FILE;
 	}
+	return wRet;
+}
 
-/*	Connect to server
+/*	Receive data from host and call *callback ()
+ *	@param waitress handle
+ *	@return WaitressReturn_t
  */
-static WaitressReturn_t WaitressConnect (WaitressHandle_t *waith) {
-	struct addrinfo hints, *res;
-	const int sockopt = 256*1024;
-	int pollres;
-	socklen_t pollresSize = sizeof (pollres);
-	fd_set fds;
-	struct timeval tv;
+WaitressReturn_t WaitressFetchCall (WaitressHandle_t *waith) {
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+	bool connected;
 
-	memset (&hints, 0, sizeof hints);
+	/* initialize */
+	WaitressRequestInit (waith);
 
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	/* request */
+	do {
+		const int64_t wait = waith->request.retryAt - WaitressNow ();
 
-	/* Use proxy? */
-	if (WaitressProxyEnabled (waith)) {
-		if (getaddrinfo (waith->proxy.host,
-				WaitressDefaultPort (&waith->proxy), &hints, &res) != 0) {
-			return WAITRESS_RET_GETADDR_ERR;
+		if ((wait > 0 && WaitressWaitFd (waith, -1, false, (int) wait) ==
+				WAITRESS_RET_CANCELLED) || WaitressCancelled (waith)) {
+			wRet = WAITRESS_RET_CANCELLED;
+			break;
 		}
-	} else {
-		if (getaddrinfo (waith->url.host,
-				WaitressDefaultPort (&waith->url), &hints, &res) != 0) {
-			return WAITRESS_RET_GETADDR_ERR;
+		if (!WaitressBreakerAllow (waith)) {
+			wRet = WAITRESS_RET_CIRCUIT_OPEN;
+			break;
+		}
+		if (WaitressAttemptStart (waith)) {
+			wRet = WAITRESS_RET_OK;
+		} else {
+			wRet = WaitressConnect (waith);
+		}
+		connected = wRet == WAITRESS_RET_OK;
+		/* a proxy tunnel's response must not leak into ours */
+		WaitressResetResponse (waith);
+
+		if (connected) {
+			if ((wRet = WaitressSendRequest (waith)) == WAITRESS_RET_OK) {
+				wRet = WaitressReceiveResponse (waith);
+			}
 		}
+	} while (WaitressAttemptEnd (waith, wRet, connected));
+
+	return WaitressRequestEnd (waith, wRet);
+}
+
+/*	Connect to the handle's host without sending a request and put the
+ *	connection into the pool, so a later request to this host can skip dns
+ *	lookup, tcp and tls handshake. Tried once, no retries.
+ *	@param waitress handle
+ *	@return WaitressReturn_t
+ */
+WaitressReturn_t WaitressPreconnect (WaitressHandle_t *waith) {
+	WaitressReturn_t wRet;
+	bool connected;
+
+	if (!waith->keepAlive) {
+		return WAITRESS_RET_OK;
 	}
 
-	if ((waith->request.sockfd = socket (res->ai_family, res->ai_socktype,
-			res->ai_protocol)) == -1) {
-		freeaddrinfo (res);
-		return WAITRESS_RET_SOCK_ERR;
+	WaitressRequestInit (waith);
+
+	if (WaitressCancelled (waith)) {
+		wRet = WAITRESS_RET_CANCELLED;
+	} else if (!WaitressBreakerAllow (waith)) {
+		wRet = WAITRESS_RET_CIRCUIT_OPEN;
+	} else if (WaitressAttemptStart (waith)) {
+		/* idle connection to this host exists already */
+		wRet = WAITRESS_RET_OK;
+	} else {
+		wRet = WaitressConnect (waith);
 	}
+	connected = wRet == WAITRESS_RET_OK;
+	WaitressResetResponse (waith);
+	/* nothing was sent, the connection is clean */
+	waith->request.bodyComplete = true;
+	/* do not schedule a retry */
+	waith->request.attempts = waith->retry.maxAttempts;
+	WaitressAttemptEnd (waith, wRet, connected);
+
+	return WaitressRequestEnd (waith, wRet);
+}
 
-	/* we need shorter timeouts for connect() */
-	WaitressDisableBlocking(waith->request.sockfd);
+void WaitressMultiInit (WaitressMulti_t *multi) {
+	assert (multi != NULL);
 
-	/* increase socket receive buffer */
-	waitress_setsockopt (waith->request.sockfd, SOL_SOCKET, SO_RCVBUF, &sockopt,
-			sizeof (sockopt));
+	memset (multi, 0, sizeof (*multi));
+#ifdef __linux__
+	multi->epollfd = epoll_create (16);
+#else
+	multi->epollfd = -1;
+#endif
+}
 
-	/* non-blocking connect will return immediately */
-	connect (waith->request.sockfd, res->ai_addr, res->ai_addrlen);
+/*	stop watching handle's socket, must be called before it is closed or
+ *	returned to the pool
+ */
+static void WaitressMultiUnwatch (WaitressMulti_t *multi,
+		WaitressHandle_t *waith) {
+#ifdef __linux__
+	if (waith->request.watchedFd != -1) {
+		epoll_ctl (multi->epollfd, EPOLL_CTL_DEL, waith->request.watchedFd,
+				NULL);
+		waith->request.watchedFd = -1;
+	}
+#endif
+}
 
-	memset (&tv, 0, sizeof (tv));
-	tv.tv_sec = waith->timeout / 1000;
-	tv.tv_usec = (waith->timeout % 1000) * 1000;
+/*	socket the handle waits for: its connection or the latest connection
+ *	attempt, -1 if there is none
+ */
+static int WaitressMultiFd (const WaitressHandle_t *waith) {
+	if (waith->request.state == WAITRESS_STATE_CONNECT) {
+		/* attempt list is stale until the next attempt starts */
+		return -1;
+	} else if (waith->request.throttledUntil != 0) {
+		/* data must not be read right now */
+		return -1;
+	} else if (waith->request.sockfd != -1) {
+		return waith->request.sockfd;
+	} else if (waith->request.attemptCount > 0) {
+		return waith->request.attemptFds[waith->request.attemptCount-1];
+	}
+	return -1;
+}
 
-	FD_ZERO (&fds);
-	FD_SET (waith->request.sockfd, &fds);
+/*	keep epoll interest list in sync with the handle's socket and the
+ *	direction it is waiting for
+ */
+static void WaitressMultiWatch (WaitressMulti_t *multi,
+		WaitressHandle_t *waith) {
+#ifdef __linux__
+	struct epoll_event ev;
+	const int fd = WaitressMultiFd (waith);
+
+	if (multi->epollfd == -1 || waith->request.state == WAITRESS_STATE_DONE) {
+		return;
+	}
+	if (fd == -1) {
+		/* a readable socket would wake us up over and over again */
+		if (waith->request.throttledUntil != 0) {
+			WaitressMultiUnwatch (multi, waith);
+		}
+		return;
+	}
 
-	pollres = select (waith->request.sockfd, &fds, &fds, &fds, &tv);
-	freeaddrinfo (res);
-	if (pollres == 0) {
-		return WAITRESS_RET_TIMEOUT;
-	} else if (pollres == -1) {
-		return WAITRESS_RET_ERR;
+	memset (&ev, 0, sizeof (ev));
+	ev.events = waith->request.wantWrite ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = waith;
+
+	if (waith->request.watchedFd != fd) {
+		WaitressMultiUnwatch (multi, waith);
+		if (epoll_ctl (multi->epollfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+			waith->request.watchedFd = fd;
+			waith->request.watchEpollFd = multi->epollfd;
+			waith->request.watchedWrite = waith->request.wantWrite;
+		}
+	} else if (waith->request.watchedWrite != waith->request.wantWrite) {
+		epoll_ctl (multi->epollfd, EPOLL_CTL_MOD, waith->request.watchedFd,
+				&ev);
+		waith->request.watchedWrite = waith->request.wantWrite;
 	}
-	/* check connect () return value */
-	waitress_getsockopt (waith->request.sockfd, SOL_SOCKET, SO_ERROR, &pollres,
-			&pollresSize);
-	if (pollres != 0) {
-		return WAITRESS_RET_CONNECT_REFUSED;
+#endif
+}
+
+/*	end the current attempt, start the next one if the request is retried
+ */
+static void WaitressMultiFinish (WaitressMulti_t *multi,
+		WaitressHandle_t *waith, const WaitressReturn_t wRet) {
+	/* states from WAITRESS_STATE_REQUEST on have a usable connection */
+	const bool connected = waith->request.state >= WAITRESS_STATE_REQUEST;
+
+	WaitressMultiUnwatch (multi, waith);
+	if (WaitressAttemptEnd (waith, wRet, connected)) {
+		waith->request.state = WAITRESS_STATE_CONNECT;
+	} else {
+		waith->request.result = WaitressRequestEnd (waith, wRet);
+		waith->request.state = WAITRESS_STATE_DONE;
 	}
+}
 
-	if (waith->url.tls) {
-		WaitressReturn_t wRet;
+/*	advance request until its socket would block or it is done
+ */
+static void WaitressMultiStep (WaitressMulti_t *multi,
+		WaitressHandle_t *waith) {
+	while (waith->request.state != WAITRESS_STATE_DONE) {
+		WaitressReturn_t wRet = WAITRESS_RET_OK;
+		bool done = false;
+		size_t size = 0;
+
+		waith->request.wouldBlock = false;
+
+		switch (waith->request.state) {
+			case WAITRESS_STATE_CONNECT:
+				waith->request.lastActivity = WaitressNow ();
+				if (waith->request.lastActivity < waith->request.retryAt) {
+					/* backing off, WaitressMultiPerform comes back later */
+					return;
+				}
+				if (!WaitressBreakerAllow (waith)) {
+					waith->request.result = WaitressRequestEnd (waith,
+							WAITRESS_RET_CIRCUIT_OPEN);
+					waith->request.state = WAITRESS_STATE_DONE;
+					return;
+				}
+				if (WaitressAttemptStart (waith)) {
+					waith->request.state = WAITRESS_STATE_REQUEST;
+				} else {
+					const char *host, *port;
 
-		/* set up proxy tunnel */
-		if (WaitressProxyEnabled (waith)) {
-			char buf[256];
-			size_t size;
-			waitress_snprintf (buf, sizeof (buf), "CONNECT %s:%s HTTP/"
-					WAITRESS_HTTP_VERSION "\r\n"
-					"Host: %s:%s\r\n"
-					"Proxy-Connection: close\r\n",
-					waith->url.host, WaitressDefaultPort (&waith->url),
-					waith->url.host, WaitressDefaultPort (&waith->url));
-			WRITE_RET (buf, strlen (buf));
-
-			/* write authorization headers */
-			if (WaitressFormatAuthorization (waith, &waith->proxy, "Proxy-",
-					buf, WAITRESS_BUFFER_SIZE)) {
-				WRITE_RET (buf, strlen (buf));
-			}
+					WaitressConnectHost (waith, &host, &port);
+					WaitressPhaseStart (waith, waith->timeouts.resolve);
+					if ((waith->request.dnsJob = WaitressDnsStart (host,
+							port)) == NULL) {
+						wRet = WAITRESS_RET_GETADDR_ERR;
+					}
+					waith->request.state = WAITRESS_STATE_RESOLVING;
+				}
+				break;
 
-			WRITE_RET ("\r\n", 2);
+			case WAITRESS_STATE_RESOLVING:
+				if (!WaitressDnsDone (waith->request.dnsJob)) {
+					return;
+				}
+				if (waith->request.dnsJob->count == 0) {
+					wRet = WAITRESS_RET_GETADDR_ERR;
+				}
+				WaitressTimingMark (waith, &waith->timing.resolved);
+				WaitressPhaseStart (waith, waith->timeouts.connect);
+				waith->request.state = WAITRESS_STATE_CONNECTING;
+				break;
 
-			if ((wRet = WaitressReceiveHeaders (waith, &size)) !=
-					WAITRESS_RET_OK) {
-				return wRet;
+			case WAITRESS_STATE_CONNECTING:
+				if ((wRet = WaitressConnectRace (waith, 0)) ==
+						WAITRESS_RET_TIMEOUT) {
+					/* connected once a socket becomes writable */
+					waith->request.wantWrite = true;
+					return;
+				} else if (wRet != WAITRESS_RET_OK) {
+					break;
+				}
+				WaitressTimingMark (waith, &waith->timing.connected);
+				WaitressPhaseStart (waith, waith->timeouts.handshake);
+				if (!waith->url.tls) {
+					waith->request.state = WAITRESS_STATE_REQUEST;
+				} else if (WaitressProxyEnabled (waith)) {
+					wRet = WaitressFormatProxyConnect (waith);
+					waith->request.state = WAITRESS_STATE_PROXY_SEND;
+				} else {
+					wRet = WaitressTlsStart (waith);
+					waith->request.state = WAITRESS_STATE_HANDSHAKE;
+				}
+				break;
+
+			case WAITRESS_STATE_PROXY_SEND:
+			case WAITRESS_STATE_SEND:
+				if ((wRet = WaitressSendSome (waith)) != WAITRESS_RET_OK) {
+					break;
+				}
+				if (WaitressSendDone (waith)) {
+					WaitressResetHeaders (waith);
+					if (waith->request.state == WAITRESS_STATE_SEND) {
+						WaitressTimingMark (waith, &waith->timing.requestSent);
+						waith->request.state = WAITRESS_STATE_HEADERS;
+					} else {
+						waith->request.state = WAITRESS_STATE_PROXY_HEADERS;
+					}
+				}
+				break;
+
+			case WAITRESS_STATE_PROXY_HEADERS:
+				if ((wRet = WaitressReadHeaders (waith)) == WAITRESS_RET_OK &&
+						waith->request.hdrParseMode == HDRM_FINISHED) {
+					wRet = WaitressTlsStart (waith);
+					waith->request.state = WAITRESS_STATE_HANDSHAKE;
+				}
+				break;
+
+			case WAITRESS_STATE_HANDSHAKE:
+				if ((wRet = WaitressTlsHandshake (waith)) == WAITRESS_RET_OK) {
+					WaitressTimingMark (waith, &waith->timing.handshakeDone);
+					waith->request.state = WAITRESS_STATE_REQUEST;
+				}
+				break;
+
+			case WAITRESS_STATE_REQUEST:
+				/* a proxy tunnel's response must not leak into ours */
+				WaitressResetResponse (waith);
+				WaitressPhaseStart (waith, waith->timeouts.firstByte);
+				wRet = WaitressFormatRequest (waith);
+				waith->request.state = WAITRESS_STATE_SEND;
+				break;
+
+			case WAITRESS_STATE_HEADERS:
+				if ((wRet = WaitressReadHeaders (waith)) != WAITRESS_RET_OK) {
+					break;
+				}
+				/* first byte arrived */
+				WaitressPhaseStart (waith, 0);
+				WaitressTimingMark (waith, &waith->timing.firstByte);
+				if (waith->request.hdrParseMode == HDRM_FINISHED) {
+					waith->request.state = WAITRESS_STATE_BODY;
+					wRet = WaitressHandleBody (waith,
+							waith->request.buf + waith->request.bufPos,
+							waith->request.bufFilled - waith->request.bufPos);
+					done = waith->request.bodyComplete;
+				}
+				break;
+
+			case WAITRESS_STATE_BODY: {
+				int wait = 0;
+				const size_t allowed = WaitressThrottle (waith, &wait);
+
+				/* rate limit waits do not count as inactivity */
+				waith->request.lastActivity = WaitressNow ();
+				if (allowed == 0) {
+					waith->request.throttledUntil =
+							waith->request.lastActivity + wait;
+					return;
+				}
+				waith->request.throttledUntil = 0;
+
+				wRet = waith->request.read (waith, waith->request.buf,
+						allowed, &size);
+				WaitressThrottleConsume (waith, size);
+				if (wRet != WAITRESS_RET_OK) {
+					break;
+				}
+				if (size == 0) {
+					/* server closed the connection, body ends here */
+					done = true;
+				} else {
+					wRet = WaitressHandleBody (waith, waith->request.buf, size);
+					done = waith->request.bodyComplete;
+				}
+				break;
 			}
+
+			case WAITRESS_STATE_DONE:
+				break;
 		}
 
-#if WAITRESS_USE_GNUTLS
-		if (gnutls_handshake (waith->request.tlsSession) != GNUTLS_E_SUCCESS) {
-			return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+		if (waith->request.wouldBlock && wRet != WAITRESS_RET_OK) {
+			return;
 		}
-#endif
-#if WAITRESS_USE_POLARSSL
-		if (ssl_handshake(&waith->request.sslCtx->ssl) != 0) {
-			return WAITRESS_RET_TLS_HANDSHAKE_ERR;
+		if (wRet != WAITRESS_RET_OK || done) {
+			WaitressMultiFinish (multi, waith, wRet);
 		}
-#endif
+	}
+}
 
-		if ((wRet = WaitressTlsVerify (waith)) != WAITRESS_RET_OK) {
-			return wRet;
+/*	Add request to multi handle, the handle must not be used for anything
+ *	else until WaitressMultiInfoRead returns it or it is removed
+ *	@param multi handle
+ *	@param waitress handle, url and callback must be set up
+ *	@return true on success
+ */
+bool WaitressMultiAdd (WaitressMulti_t *multi, WaitressHandle_t *waith) {
+	assert (multi != NULL);
+	assert (waith != NULL);
+
+	if (multi->count >= multi->size) {
+		const size_t newSize = multi->size == 0 ? 4 : multi->size * 2;
+		WaitressHandle_t **newHandles = realloc (multi->handles,
+				newSize * sizeof (*newHandles));
+		if (newHandles == NULL) {
+			return false;
 		}
+		multi->handles = newHandles;
+		multi->size = newSize;
+	}
 
-		/* now we can talk encrypted */
-		waith->request.read = WaitressTlsRead;
-		waith->request.write = WaitressTlsWrite;
+	WaitressRequestInit (waith);
+	if (waith->request.buf == NULL) {
+		return false;
 	}
+	waith->request.nonBlocking = true;
+	waith->request.state = WAITRESS_STATE_CONNECT;
 
-	return WAITRESS_RET_OK;
+	multi->handles[multi->count++] = waith;
+
+	return true;
 }
 
-/*	Write http header/post data to socket
+/*	remove request from multi handle, abort it if still running
  */
-static WaitressReturn_t WaitressSendRequest (WaitressHandle_t *waith) {
-	const char *path;
-	char * buf;
-	WaitressReturn_t wRet = WAITRESS_RET_OK;
+void WaitressMultiRemove (WaitressMulti_t *multi, WaitressHandle_t *waith) {
+	size_t i;
 
+	assert (multi != NULL);
 	assert (waith != NULL);
-	assert (waith->request.buf != NULL);
-
-	path = waith->url.path;
-	buf = waith->request.buf;
 
-	if (waith->url.path == NULL) {
-		/* avoid NULL pointer deref */
-		path = "";
-	} else if (waith->url.path[0] == '/') {
-		/* most servers don't like "//" */
-		++path;
+	for (i = 0; i < multi->count; i++) {
+		if (multi->handles[i] == waith) {
+			break;
+		}
 	}
-
-	/* send request */
-	if (WaitressProxyEnabled (waith) && !waith->url.tls) {
-		waitress_snprintf (buf, WAITRESS_BUFFER_SIZE,
-			"%s http://%s:%s/%s HTTP/" WAITRESS_HTTP_VERSION "\r\n",
-			(waith->method == WAITRESS_METHOD_GET ? "GET" : "POST"),
-			waith->url.host,
-			WaitressDefaultPort (&waith->url), path);
-	} else {
-		waitress_snprintf (buf, WAITRESS_BUFFER_SIZE,
-			"%s /%s HTTP/" WAITRESS_HTTP_VERSION "\r\n",
-			(waith->method == WAITRESS_METHOD_GET ? "GET" : "POST"),
-			path);
+	if (i == multi->count) {
+		return;
 	}
-	WRITE_RET (buf, strlen (buf));
-
-	waitress_snprintf (buf, WAITRESS_BUFFER_SIZE,
-			"Host: %s\r\nUser-Agent: " PACKAGE "\r\nConnection: Close\r\n",
-			waith->url.host);
-	WRITE_RET (buf, strlen (buf));
-
-	if (waith->method == WAITRESS_METHOD_POST && waith->postData != NULL) {
-		waitress_snprintf (buf, WAITRESS_BUFFER_SIZE, "Content-Length: "
-				waitress_size_t_spec "\r\n", strlen (waith->postData));
-		WRITE_RET (buf, strlen (buf));
+	memmove (&multi->handles[i], &multi->handles[i+1],
+			(multi->count - i - 1) * sizeof (*multi->handles));
+	--multi->count;
+
+	if (waith->request.state != WAITRESS_STATE_DONE) {
+		WaitressMultiUnwatch (multi, waith);
+		WaitressCloseConnection (waith, false);
+		free (waith->request.sendBuf);
+		waith->request.sendBuf = NULL;
+		if (waith->request.dnsJob != NULL) {
+			WaitressDnsRelease (waith->request.dnsJob);
+			waith->request.dnsJob = NULL;
+		}
+		waith->request.result = WaitressRequestEnd (waith,
+				WAITRESS_RET_CB_ABORT);
+		waith->request.state = WAITRESS_STATE_DONE;
 	}
+	waith->request.nonBlocking = false;
+}
 
-	/* write authorization headers */
-	if (WaitressFormatAuthorization (waith, &waith->url, "", buf,
-			WAITRESS_BUFFER_SIZE)) {
-		WRITE_RET (buf, strlen (buf));
+/*	wait for socket events and advance all requests
+ *	@param multi handle
+ *	@param wait at most this many milliseconds, -1 waits until any request
+ *		makes progress or times out
+ *	@return number of requests still running
+ */
+size_t WaitressMultiPerform (WaitressMulti_t *multi, int timeout) {
+	size_t i, running = 0;
+	int64_t now;
+
+	assert (multi != NULL);
+
+	/* start new requests and find the earliest timeout */
+	now = WaitressNow ();
+	for (i = 0; i < multi->count; i++) {
+		WaitressHandle_t * const waith = multi->handles[i];
+		int64_t left;
+
+		waith->request.ready = false;
+		if (waith->request.state == WAITRESS_STATE_CONNECT) {
+			WaitressMultiStep (multi, waith);
+			WaitressMultiWatch (multi, waith);
+		}
+		if (waith->request.state == WAITRESS_STATE_DONE) {
+			continue;
+		}
+		++running;
+
+		if (waith->request.state == WAITRESS_STATE_CONNECT) {
+			/* waiting for the next attempt */
+			left = waith->request.retryAt - now;
+		} else if (waith->request.throttledUntil != 0) {
+			/* waiting for the rate limit */
+			left = waith->request.throttledUntil - now;
+		} else {
+			left = WaitressDeadline (waith, waith->request.lastActivity) - now;
+		}
+		if (left < 0) {
+			left = 0;
+		}
+		if (timeout < 0 || left < timeout) {
+			timeout = left;
+		}
+		/* finished lookups and connection attempts other than the latest
+		 * one do not wake us up */
+		if ((waith->request.state == WAITRESS_STATE_RESOLVING ||
+				(waith->request.state == WAITRESS_STATE_CONNECTING &&
+				waith->request.attemptCount > 1)) &&
+				(timeout < 0 || timeout > 10)) {
+			timeout = 10;
+		}
+		/* neither does the timer for the next connection attempt */
+		if (waith->request.state == WAITRESS_STATE_CONNECTING &&
+				waith->request.nextAddr < waith->request.dnsJob->count &&
+				waith->request.attemptCount < WAITRESS_CONNECT_MAX_ATTEMPTS) {
+			left = waith->request.nextAttempt - now;
+			if (left < 0) {
+				left = 0;
+			}
+			if (timeout < 0 || left < timeout) {
+				timeout = left;
+			}
+		}
 	}
-	/* don't leak proxy credentials to destination server if tls is used */
-	if (!waith->url.tls &&
-			WaitressFormatAuthorization (waith, &waith->proxy, "Proxy-",
-			buf, WAITRESS_BUFFER_SIZE)) {
-		WRITE_RET (buf, strlen (buf));
+	if (running == 0) {
+		return 0;
 	}
-	
-	if (waith->extraHeaders != NULL) {
-		WRITE_RET (waith->extraHeaders, strlen (waith->extraHeaders));
+
+	/* wait */
+#ifdef __linux__
+	if (multi->epollfd != -1) {
+		struct epoll_event events[16];
+		const int n = epoll_wait (multi->epollfd, events,
+				sizeof (events) / sizeof (*events), timeout);
+		int j;
+
+		for (j = 0; j < n; j++) {
+			WaitressHandle_t * const waith = events[j].data.ptr;
+			waith->request.ready = true;
+		}
+	} else
+#endif
+	{
+#ifdef _WIN32
+		fd_set readFds, writeFds, exceptFds;
+		struct timeval tv;
+
+		FD_ZERO (&readFds);
+		FD_ZERO (&writeFds);
+		FD_ZERO (&exceptFds);
+		for (i = 0; i < multi->count; i++) {
+			const WaitressHandle_t * const waith = multi->handles[i];
+			const int fd = WaitressMultiFd (waith);
+			if (waith->request.state != WAITRESS_STATE_DONE && fd != -1) {
+				FD_SET (fd, waith->request.wantWrite ? &writeFds : &readFds);
+				/* failed connects are reported here */
+				FD_SET (fd, &exceptFds);
+			}
+		}
+		tv.tv_sec = timeout / 1000;
+		tv.tv_usec = (timeout % 1000) * 1000;
+		if (readFds.fd_count + writeFds.fd_count == 0) {
+			/* select () fails without sockets */
+			Sleep (timeout);
+		} else if (select (0, &readFds, &writeFds, &exceptFds, &tv) > 0) {
+			for (i = 0; i < multi->count; i++) {
+				WaitressHandle_t * const waith = multi->handles[i];
+				const int fd = WaitressMultiFd (waith);
+				if (waith->request.state != WAITRESS_STATE_DONE && fd != -1 &&
+						(FD_ISSET (fd, &readFds) || FD_ISSET (fd, &writeFds) ||
+						FD_ISSET (fd, &exceptFds))) {
+					waith->request.ready = true;
+				}
+			}
+		}
+#else
+		struct pollfd *fds;
+		WaitressHandle_t **polled;
+		nfds_t nfds = 0, j;
+
+		fds = malloc (running * sizeof (*fds));
+		polled = malloc (running * sizeof (*polled));
+		if (fds != NULL && polled != NULL) {
+			for (i = 0; i < multi->count; i++) {
+				WaitressHandle_t * const waith = multi->handles[i];
+				const int fd = WaitressMultiFd (waith);
+				if (waith->request.state != WAITRESS_STATE_DONE && fd != -1) {
+					fds[nfds].fd = fd;
+					fds[nfds].events = waith->request.wantWrite ? POLLOUT : POLLIN;
+					fds[nfds].revents = 0;
+					polled[nfds++] = waith;
+				}
+			}
+			if (poll (fds, nfds, timeout) > 0) {
+				for (j = 0; j < nfds; j++) {
+					if (fds[j].revents != 0) {
+						polled[j]->request.ready = true;
+					}
+				}
+			}
+		}
+		free (fds);
+		free (polled);
+#endif
+	}
+
+	/* advance */
+	running = 0;
+	now = WaitressNow ();
+	for (i = 0; i < multi->count; i++) {
+		WaitressHandle_t * const waith = multi->handles[i];
+
+		if (waith->request.state == WAITRESS_STATE_DONE) {
+			continue;
+		}
+		if (waith->request.ready) {
+			waith->request.lastActivity = now;
+			WaitressMultiStep (multi, waith);
+		} else if ((waith->request.state == WAITRESS_STATE_RESOLVING &&
+				WaitressDnsDone (waith->request.dnsJob)) ||
+				waith->request.state == WAITRESS_STATE_CONNECTING ||
+				waith->request.state == WAITRESS_STATE_CONNECT ||
+				(waith->request.throttledUntil != 0 &&
+				now >= waith->request.throttledUntil)) {
+			WaitressMultiStep (multi, waith);
+		}
+		/* retries are never scheduled past the deadline, throttled requests
+		 * check theirs once they may read again */
+		if (waith->request.state != WAITRESS_STATE_DONE &&
+				waith->request.state != WAITRESS_STATE_CONNECT &&
+				waith->request.throttledUntil == 0 &&
+				now >= WaitressDeadline (waith, waith->request.lastActivity)) {
+			WaitressMultiFinish (multi, waith, WAITRESS_RET_TIMEOUT);
+		}
+		WaitressMultiWatch (multi, waith);
+		if (waith->request.state != WAITRESS_STATE_DONE) {
+			++running;
+		}
 	}
-	
-	WRITE_RET ("\r\n", 2);
 
-	if (waith->method == WAITRESS_METHOD_POST && waith->postData != NULL) {
-		WRITE_RET (waith->postData, strlen (waith->postData));
-	}
+	return running;
+}
 
-	return WAITRESS_RET_OK;
+/*	get next finished request, it is removed from the multi handle
+ *	@param multi handle
+ *	@param request's result
+ *	@return waitress handle or NULL if no request finished
+ */
+WaitressHandle_t *WaitressMultiInfoRead (WaitressMulti_t *multi,
+		WaitressReturn_t *wRet) {
+	size_t i;
+
+	assert (multi != NULL);
+	assert (wRet != NULL);
+
+	for (i = 0; i < multi->count; i++) {
+		WaitressHandle_t * const waith = multi->handles[i];
+		if (waith->request.state == WAITRESS_STATE_DONE) {
+			*wRet = waith->request.result;
+			WaitressMultiRemove (multi, waith);
+			return waith;
+		}
+	}
+	return NULL;
 }
 
-/*	receive response headers
- *	@param Waitress handle
- *	@param return unhandled bytes count in buf
- */
-static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *waith,
-		size_t *retRemaining) {
-	char * buf = waith->request.buf;
-	size_t bufFilled = 0, recvSize = 0;
-	char *nextLine = NULL, *thisLine = NULL;
-	enum {HDRM_HEAD, HDRM_LINES, HDRM_FINISHED} hdrParseMode = HDRM_HEAD;
-	WaitressReturn_t wRet = WAITRESS_RET_OK;
+/*	abort all remaining requests and free multi handle
+ */
+void WaitressMultiFree (WaitressMulti_t *multi) {
+	assert (multi != NULL);
 
-	assert (waith != NULL);
-	assert (waith->request.buf != NULL);
+	while (multi->count > 0) {
+		WaitressMultiRemove (multi, multi->handles[0]);
+	}
+	free (multi->handles);
+	if (multi->epollfd != -1) {
+		waitress_close (multi->epollfd);
+	}
+	memset (multi, 0, sizeof (*multi));
+}
 
-	buf = waith->request.buf;
+/*	one byte range of a segmented download
+ */
+typedef struct {
+	WaitressHandle_t waith;
+	struct WaitressSegmented *parent;
+	/* bytes [start, end) of the resource */
+	size_t start, end;
+	char *extraHeaders;
+	/* data received while an earlier range is still being delivered */
+	char *buf;
+	size_t filled;
+	/* data goes straight to the user's callback */
+	bool head;
+	bool responseChecked, done;
+} WaitressSegment_t;
+
+/*	state of WaitressFetchSegmented ()
+ */
+typedef struct WaitressSegmented {
+	WaitressHandle_t *waith;
+	/* ring of ranges in flight (including finished ones not delivered
+	 * yet), starting at head */
+	WaitressSegment_t *segs;
+	unsigned int parallel, head, running;
+	size_t segmentSize;
+	/* first byte requested and first byte not assigned to a range yet */
+	size_t offset, next;
+	/* resource size, known after the first response */
+	size_t total;
+	bool totalKnown;
+	/* server ignored the range, the first response has everything */
+	bool single;
+	/* reason a range's callback aborted it */
+	WaitressReturn_t wRet;
+} WaitressSegmented_t;
 
-	/* receive answer */
-	nextLine = buf;
-	while (hdrParseMode != HDRM_FINISHED) {
-		READ_RET (buf+bufFilled, WAITRESS_BUFFER_SIZE-1 - bufFilled, &recvSize);
-		if (recvSize == 0) {
-			/* connection closed too early */
-			return WAITRESS_RET_CONNECTION_CLOSED;
+/*	hand data to the user's callback, in order and in pieces no larger than
+ *	a single read
+ *	@return false if the callback aborted
+ */
+static bool WaitressSegmentedDeliver (WaitressSegmented_t *sd, char *data,
+		size_t size) {
+	WaitressHandle_t * const waith = sd->waith;
+
+	while (size > 0) {
+		const size_t n = size < WAITRESS_BUFFER_SIZE ? size :
+				WAITRESS_BUFFER_SIZE;
+
+		WaitressTimingMark (waith, &waith->timing.firstByte);
+		waith->request.contentReceived += n;
+		if (waith->callback (data, n, waith->data) != WAITRESS_CB_RET_OK) {
+			return false;
 		}
-		bufFilled += recvSize;
-		buf[bufFilled] = '\0';
-		thisLine = buf;
-
-		/* split */
-		while (hdrParseMode != HDRM_FINISHED &&
-				(nextLine = WaitressGetline (thisLine)) != NULL) {
-
-			int httpStatusCode = -1;
-
-			switch (hdrParseMode) {
-				/* Status code */
-				case HDRM_HEAD:
-					httpStatusCode = WaitressParseStatusline (thisLine);
-
-					switch (httpStatusCode) {
-						case 200:
-						case 206:
-							hdrParseMode = HDRM_LINES;
-							break;
-
-						case 400:
-							return WAITRESS_RET_BAD_REQUEST;
-							break;
-
-						case 403:
-							return WAITRESS_RET_FORBIDDEN;
-							break;
-
-						case 404:
-							return WAITRESS_RET_NOTFOUND;
-							break;
-
-						case 407:
-							/* Fix for GlobalPandora.com. Proxy sometimes 'miss' credentials.
-							 * Same request send again is handled properly.
-							 */
-							if (WaitressProxyEnabled (waith))
-								return WAITRESS_RET_RETRY;
-							else
-								return WAITRESS_RET_STATUS_UNKNOWN;
-							break;
-
-						case -1:
-							/* ignore invalid line */
-							break;
-
-						default:
-							return WAITRESS_RET_STATUS_UNKNOWN;
-							break;
-					}
-					break;
-
-				/* Everything else, except status code */
-				case HDRM_LINES:
-					/* empty line => content starts here */
-					if (*thisLine == '\0') {
-						hdrParseMode = HDRM_FINISHED;
-					} else {
-						/* parse header: "key: value", ignore invalid lines */
-						char *key = thisLine, *val;
-
-						val = strchr (thisLine, ':');
-						if (val != NULL) {
-							*val++ = '\0';
-							while (*val != '\0' && isspace ((unsigned char) *val)) {
-								++val;
-							}
-							WaitressHandleHeader (waith, key, val);
-						}
-					}
-					break;
-
-				default:
-					break;
-			} /* end switch */
-			thisLine = nextLine;
-		} /* end while strchr */
-		memmove (buf, thisLine, bufFilled-(thisLine-buf));
-		bufFilled -= (thisLine-buf);
-	} /* end while hdrParseMode */
+		data += n;
+		size -= n;
+	}
+	return true;
+}
 
-	*retRemaining = bufFilled;
+/*	check a range's response headers, the first one tells the resource's
+ *	size
+ */
+static bool WaitressSegmentCheck (WaitressSegmented_t *sd,
+		WaitressSegment_t *seg) {
+	WaitressHandle_t * const waith = sd->waith;
+	const WaitressHandle_t * const segh = &seg->waith;
+
+	if (!sd->totalKnown) {
+		sd->totalKnown = true;
+		if (segh->request.rangeTotal == 0) {
+			/* plain 200 response or unknown size, stream all of it */
+			sd->single = true;
+			sd->total = sd->next = SIZE_MAX;
+			seg->end = SIZE_MAX;
+			waith->request.contentLength = segh->request.contentLength;
+			waith->request.contentLengthKnown =
+					segh->request.contentLengthKnown;
+			return true;
+		}
+		/* ranges past the end cannot be told from the rest without the
+		 * size */
+		if (segh->request.rangeStart != seg->start ||
+				segh->request.rangeTotal <= seg->start ||
+				segh->request.rangeTotal == SIZE_MAX) {
+			return false;
+		}
+		sd->total = segh->request.rangeTotal;
+		if (seg->end > sd->total) {
+			seg->end = sd->next = sd->total;
+		}
+		waith->request.contentLength = sd->total - sd->offset;
+		waith->request.contentLengthKnown = true;
+	}
 
-	return wRet;
+	return segh->request.rangeStart == seg->start &&
+			segh->request.rangeTotal == sd->total &&
+			segh->request.contentLength == seg->end - seg->start;
 }
 
-/*	read response header and data
- */
-static WaitressReturn_t WaitressReceiveResponse (WaitressHandle_t *waith) {
-	char * buf;
-	size_t recvSize = 0;
-	WaitressReturn_t wRet = WAITRESS_RET_OK;
+static WaitressCbReturn_t WaitressSegmentCb (void *ptr, size_t size,
+		void *data) {
+	WaitressSegment_t * const seg = data;
+	WaitressSegmented_t * const sd = seg->parent;
 
-	assert (waith != NULL);
-	assert (waith->request.buf != NULL);
+	if (!seg->responseChecked) {
+		seg->responseChecked = true;
+		if (!sd->single && !WaitressSegmentCheck (sd, seg)) {
+			sd->wRet = WAITRESS_RET_ERR;
+			return WAITRESS_CB_RET_ERR;
+		}
+	}
 
-	buf = waith->request.buf;
+	if (seg->head) {
+		if (!WaitressSegmentedDeliver (sd, ptr, size)) {
+			sd->wRet = WAITRESS_RET_CB_ABORT;
+			return WAITRESS_CB_RET_ERR;
+		}
+		return WAITRESS_CB_RET_OK;
+	}
 
-	if ((wRet = WaitressReceiveHeaders (waith, &recvSize)) != WAITRESS_RET_OK) {
-		return wRet;
+	if (size > seg->end - seg->start - seg->filled) {
+		sd->wRet = WAITRESS_RET_ERR;
+		return WAITRESS_CB_RET_ERR;
 	}
+	memcpy (seg->buf + seg->filled, ptr, size);
+	seg->filled += size;
+	return WAITRESS_CB_RET_OK;
+}
 
-	do {
-		/* data must be \0-terminated for chunked handler */
-		buf[recvSize] = '\0';
-		switch (waith->request.dataHandler (waith, buf, recvSize)) {
-			case WAITRESS_HANDLER_DONE:
-				return WAITRESS_RET_OK;
-				break;
+/*	request the next range
+ *	@return false if out of memory
+ */
+static bool WaitressSegmentStart (WaitressSegmented_t *sd,
+		WaitressMulti_t *multi) {
+	const WaitressHandle_t * const waith = sd->waith;
+	WaitressSegment_t * const seg =
+			&sd->segs[(sd->head + sd->running) % sd->parallel];
+	char range[64];
+	size_t rangeLen, extraLen;
+
+	memset (seg, 0, sizeof (*seg));
+	seg->parent = sd;
+	seg->start = sd->next;
+	seg->end = sd->totalKnown && sd->total - seg->start < sd->segmentSize ?
+			sd->total : seg->start + sd->segmentSize;
+	seg->head = sd->running == 0;
+
+	rangeLen = waitress_snprintf (range, sizeof (range), "Range: bytes="
+			waitress_size_t_spec "-" waitress_size_t_spec "\r\n", seg->start,
+			seg->end - 1);
+	extraLen = waith->extraHeaders == NULL ? 0 : strlen (waith->extraHeaders);
+	if ((seg->extraHeaders = malloc (rangeLen + extraLen + 1)) == NULL) {
+		return false;
+	}
+	memcpy (seg->extraHeaders, range, rangeLen);
+	if (extraLen > 0) {
+		memcpy (seg->extraHeaders + rangeLen, waith->extraHeaders, extraLen);
+	}
+	seg->extraHeaders[rangeLen + extraLen] = '\0';
 
-			case WAITRESS_HANDLER_ERR:
-				return WAITRESS_RET_DECODING_ERR;
-				break;
+	if (!seg->head && (seg->buf = malloc (seg->end - seg->start)) == NULL) {
+		free (seg->extraHeaders);
+		return false;
+	}
 
-			case WAITRESS_HANDLER_ABORTED:
-				return WAITRESS_RET_CB_ABORT;
-				break;
+	/* url and proxy are shared with the user's handle */
+	WaitressInit (&seg->waith);
+	seg->waith.url = waith->url;
+	seg->waith.proxy = waith->proxy;
+	seg->waith.timeout = waith->timeout;
+	seg->waith.sockOpts = waith->sockOpts;
+	seg->waith.timeouts = waith->timeouts;
+	/* the deadline applies to the whole download */
+	seg->waith.timeouts.total = 0;
+	seg->waith.retry = waith->retry;
+	seg->waith.tlsFingerprint = waith->tlsFingerprint;
+	/* buckets are shared, so the limits apply to all ranges together */
+	seg->waith.rateLimit = waith->rateLimit;
+	seg->waith.globalRateLimit = waith->globalRateLimit;
+	seg->waith.keepAlive = waith->keepAlive;
+	seg->waith.extraHeaders = seg->extraHeaders;
+	seg->waith.callback = WaitressSegmentCb;
+	seg->waith.data = seg;
+
+	if (!WaitressMultiAdd (multi, &seg->waith)) {
+		free (seg->waith.request.buf);
+		free (seg->buf);
+		free (seg->extraHeaders);
+		return false;
+	}
+	sd->next = seg->end;
+	++sd->running;
 
-			case WAITRESS_HANDLER_CONTINUE:
-				/* go on */
-				break;
-		}
-		if (waith->request.contentLengthKnown &&
-				waith->request.contentReceived >= waith->request.contentLength) {
-			/* don’t call read() again if we know the body’s size and have all
-			 * of it already */
-			break;
-		}
-		READ_RET (buf, WAITRESS_BUFFER_SIZE-1, &recvSize);
-	} while (recvSize > 0);
+	return true;
+}
 
-	return WAITRESS_RET_OK;
+/*	free a range that is no longer in a multi handle, its transfer stats
+ *	are added to the user's handle
+ */
+static void WaitressSegmentFree (WaitressSegmented_t *sd,
+		WaitressSegment_t *seg) {
+	WaitressTiming_t * const timing = &sd->waith->timing;
+	const WaitressTiming_t * const segTiming = &seg->waith.timing;
+
+	if (seg->start == sd->offset) {
+		timing->resolved = segTiming->resolved;
+		timing->connected = segTiming->connected;
+		timing->handshakeDone = segTiming->handshakeDone;
+		timing->requestSent = segTiming->requestSent;
+		timing->reused = segTiming->reused;
+	}
+	timing->bytesSent += segTiming->bytesSent;
+	timing->bytesReceived += segTiming->bytesReceived;
+	timing->retries += segTiming->retries;
+
+	memset (&seg->waith.url, 0, sizeof (seg->waith.url));
+	memset (&seg->waith.proxy, 0, sizeof (seg->waith.proxy));
+	WaitressFree (&seg->waith);
+	free (seg->buf);
+	free (seg->extraHeaders);
+	memset (seg, 0, sizeof (*seg));
 }
 
-/*	Receive data from host and call *callback ()
- *	@param waitress handle
+/*	Fetch the handle's resource from offset on as consecutive byte ranges,
+ *	up to parallel of them at once. This fills the caller's buffer faster
+ *	if the server limits each connection's bandwidth. The callback still
+ *	gets the data in order, ranges ahead of the one being delivered are
+ *	held in memory (at most (parallel-1)*segmentSize bytes). If the server
+ *	ignores Range the whole response is delivered as is.
+ *
+ *	request.contentLength and request.contentReceived refer to everything
+ *	from offset on, so after a failure the caller can resume at
+ *	offset+contentReceived.
+ *	@param waitress handle, extraHeaders must not contain a Range
+ *	@param first byte
+ *	@param ranges downloaded at once
+ *	@param bytes per range
  *	@return WaitressReturn_t
  */
-WaitressReturn_t WaitressFetchCall (WaitressHandle_t *waith) {
+WaitressReturn_t WaitressFetchSegmented (WaitressHandle_t *waith,
+		size_t offset, unsigned int parallel, size_t segmentSize) {
+	WaitressSegmented_t sd;
+	WaitressMulti_t multi;
 	WaitressReturn_t wRet = WAITRESS_RET_OK;
+	unsigned int i;
 
-	/* initialize */
-	memset (&waith->request, 0, sizeof (waith->request));
-	waith->request.sockfd = -1;
-	waith->request.dataHandler = WaitressHandleIdentity;
-	waith->request.read = WaitressOrdinaryRead;
-	waith->request.write = WaitressOrdinaryWrite;
-	waith->request.contentLengthKnown = false;
-	waith->request.retriesLeft = 3;
+	assert (waith != NULL);
+	assert (parallel > 0);
+	assert (segmentSize > 0);
+
+	WaitressRequestInit (waith);
+
+	memset (&sd, 0, sizeof (sd));
+	sd.waith = waith;
+	sd.parallel = parallel;
+	sd.segmentSize = segmentSize;
+	sd.offset = sd.next = offset;
+	sd.wRet = WAITRESS_RET_OK;
+	if ((sd.segs = calloc (parallel, sizeof (*sd.segs))) == NULL) {
+		return WaitressRequestEnd (waith, WAITRESS_RET_ERR);
+	}
 
-	if (waith->url.tls) {
-#if WAITRESS_USE_GNUTLS
-		gnutls_init (&waith->request.tlsSession, GNUTLS_CLIENT);
-		gnutls_set_default_priority (waith->request.tlsSession);
+	WaitressMultiInit (&multi);
 
-		gnutls_certificate_allocate_credentials (&waith->tlsCred);
-		if (gnutls_credentials_set (waith->request.tlsSession,
-			GNUTLS_CRD_CERTIFICATE,
-			waith->tlsCred) != GNUTLS_E_SUCCESS) {
-				return WAITRESS_RET_ERR;
+	/* more ranges are requested once the first response tells us the
+	 * resource's size */
+	if (!WaitressSegmentStart (&sd, &multi)) {
+		wRet = WAITRESS_RET_ERR;
+	}
+	while (wRet == WAITRESS_RET_OK && sd.running > 0) {
+		WaitressHandle_t *finished;
+		WaitressReturn_t segRet;
+
+		/* multi does not wake up for cancellation, check regularly */
+		WaitressMultiPerform (&multi, 100);
+		if (WaitressCancelled (waith)) {
+			wRet = WAITRESS_RET_CANCELLED;
+			break;
+		}
+		if (waith->request.totalDeadline != 0 &&
+				WaitressNow () >= waith->request.totalDeadline) {
+			wRet = WAITRESS_RET_TIMEOUT;
+			break;
 		}
 
-		/* set up custom read/write functions */
-		gnutls_transport_set_ptr (waith->request.tlsSession,
-			(gnutls_transport_ptr_t) waith);
-		gnutls_transport_set_pull_function (waith->request.tlsSession,
-			WaitressPollRead);
-		gnutls_transport_set_push_function (waith->request.tlsSession,
-			WaitressPollWrite);
-#endif
+		while ((finished = WaitressMultiInfoRead (&multi, &segRet)) !=
+				NULL) {
+			WaitressSegment_t * const seg = finished->data;
 
-#if WAITRESS_USE_POLARSSL
-		waith->request.sslCtx = malloc(sizeof(polarssl_ctx));
-		memset(waith->request.sslCtx, 0, sizeof(polarssl_ctx));
-		entropy_init(&waith->request.sslCtx->entrophy);
-		ctr_drbg_init(&waith->request.sslCtx->rnd, entropy_func, &waith->request.sslCtx->entrophy, "libwaitress", 11);
-		ssl_init(&waith->request.sslCtx->ssl);
-		ssl_set_endpoint(&waith->request.sslCtx->ssl, SSL_IS_CLIENT);
-		ssl_set_authmode(&waith->request.sslCtx->ssl, SSL_VERIFY_NONE);
-		ssl_set_rng(&waith->request.sslCtx->ssl, ctr_drbg_random, &waith->request.sslCtx->rnd);
-		ssl_set_ciphersuites(&waith->request.sslCtx->ssl, ssl_default_ciphersuites);
-		ssl_set_session(&waith->request.sslCtx->ssl, 1, 600, &waith->request.sslCtx->session);
-		ssl_set_bio(&waith->request.sslCtx->ssl,
-			WaitressPollRead, waith,
-			WaitressPollWrite, waith);
-#endif
-	}
+			if (segRet != WAITRESS_RET_OK) {
+				wRet = segRet == WAITRESS_RET_CB_ABORT ? sd.wRet : segRet;
+				break;
+			}
+			seg->done = true;
+		}
 
-	/* buffer is required for connect already */
-	waith->request.buf = malloc (WAITRESS_BUFFER_SIZE *
-			sizeof (*waith->request.buf));
+		/* deliver finished ranges in order and reuse their slots */
+		while (wRet == WAITRESS_RET_OK && sd.running > 0 &&
+				sd.segs[sd.head].done) {
+			WaitressSegment_t *seg = &sd.segs[sd.head];
 
-	/* request */
-	while (waith->request.retriesLeft-- > 0) {
-		if ((wRet = WaitressConnect (waith)) == WAITRESS_RET_OK) {
-			if ((wRet = WaitressSendRequest (waith)) == WAITRESS_RET_OK) {
-				wRet = WaitressReceiveResponse (waith);
-			}
-			if (waith->url.tls) {
-#if WAITRESS_USE_GNUTLS
-				gnutls_bye (waith->request.tlsSession, GNUTLS_SHUT_RDWR);
-#endif
+			WaitressSegmentFree (&sd, seg);
+			sd.head = (sd.head + 1) % sd.parallel;
+			--sd.running;
+
+			if (sd.running > 0) {
+				seg = &sd.segs[sd.head];
+				seg->head = true;
+				if (!WaitressSegmentedDeliver (&sd, seg->buf, seg->filled)) {
+					wRet = WAITRESS_RET_CB_ABORT;
+				}
+				free (seg->buf);
+				seg->buf = NULL;
 			}
 		}
 
-		if (wRet != WAITRESS_RET_RETRY)
-			break;
+		while (wRet == WAITRESS_RET_OK && sd.totalKnown &&
+				sd.next < sd.total && sd.running < sd.parallel) {
+			if (!WaitressSegmentStart (&sd, &multi)) {
+				wRet = WAITRESS_RET_ERR;
+			}
+		}
 	}
 
-	/* cleanup */
-	if (waith->url.tls) {
-#if WAITRESS_USE_GNUTLS
-		gnutls_deinit (waith->request.tlsSession);
-		gnutls_certificate_free_credentials (waith->tlsCred);
-#endif
-
-#if WAITRESS_USE_POLARSSL
-		ssl_free(&waith->request.sslCtx->ssl);
-		free(waith->request.sslCtx);
-#endif
+	/* abort ranges still running */
+	WaitressMultiFree (&multi);
+	for (i = 0; i < sd.running; i++) {
+		WaitressSegmentFree (&sd, &sd.segs[(sd.head + i) % sd.parallel]);
 	}
-	if (waith->request.sockfd != -1) {
-		waitress_close (waith->request.sockfd);
-	}
-	free (waith->request.buf);
+	free (sd.segs);
 
-	if (wRet == WAITRESS_RET_OK &&
-			waith->request.contentReceived < waith->request.contentLength) {
-		return WAITRESS_RET_PARTIAL_FILE;
-	}
-	return wRet;
+	return WaitressRequestEnd (waith, wRet);
 }
 
 const char *WaitressErrorToStr (WaitressReturn_t wRet) {
@@ -1474,6 +7070,18 @@ const char *WaitressErrorToStr (WaitressReturn_t wRet) {
 			return "TLS fingerprint mismatch.";
 			break;
 
+		case WAITRESS_RET_SERVICE_UNAVAILABLE:
+			return "Service unavailable.";
+			break;
+
+		case WAITRESS_RET_CIRCUIT_OPEN:
+			return "Host failed repeatedly, not trying again yet.";
+			break;
+
+		case WAITRESS_RET_CANCELLED:
+			return "Request cancelled.";
+			break;
+
 		default:
 			{
 				static char errorMessage[65];
@@ -1559,9 +7167,575 @@ void compareStr (const char *result, const char *expected) {
 	}
 }
 
+/*	received body of a parser test
+ */
+typedef struct {
+	char data[256];
+	size_t pos;
+} testBody_t;
+
+static WaitressCbReturn_t testBodyCb (void *data, size_t size,
+		void *userData) {
+	testBody_t * const body = userData;
+
+	if (body->pos + size >= sizeof (body->data)) {
+		return WAITRESS_CB_RET_ERR;
+	}
+	memcpy (body->data + body->pos, data, size);
+	body->pos += size;
+	body->data[body->pos] = '\0';
+	return WAITRESS_CB_RET_OK;
+}
+
+/*	feed response to the parser as if it was read from a socket
+ *	@param waitress handle, set up by WaitressRequestInit
+ *	@param response
+ *	@param response size
+ *	@param maximum number of bytes per read
+ */
+static WaitressReturn_t parseResponse (WaitressHandle_t *waith,
+		const char *response, const size_t len, const size_t step) {
+	size_t pos = 0;
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+
+	WaitressResetResponse (waith);
+	WaitressResetHeaders (waith);
+
+	while (pos < len && !waith->request.bodyComplete) {
+		const size_t n = len - pos < step ? len - pos : step;
+
+		memcpy (waith->request.buf, response + pos, n);
+		pos += n;
+		waith->request.bufFilled = n;
+		waith->request.bufPos = 0;
+
+		if (waith->request.hdrParseMode != HDRM_FINISHED) {
+			if ((wRet = WaitressParseHeaders (waith)) != WAITRESS_RET_OK) {
+				return wRet;
+			}
+			if (waith->request.hdrParseMode != HDRM_FINISHED) {
+				continue;
+			}
+		}
+		if ((wRet = WaitressHandleBody (waith,
+				waith->request.buf + waith->request.bufPos,
+				waith->request.bufFilled - waith->request.bufPos)) !=
+				WAITRESS_RET_OK) {
+			return wRet;
+		}
+	}
+
+	return wRet;
+}
+
+/*	test response parser, the response is split at every possible position
+ *	@param response
+ *	@param expected return value
+ *	@param expected body
+ *	@param expected keep-alive
+ */
+static void compareResponseSize (const char *response, const size_t len,
+		const WaitressReturn_t expectedRet, const char *expectedBody,
+		const bool keepAlive) {
+	size_t step;
+
+	for (step = 1; step <= len; step++) {
+		WaitressHandle_t waith;
+		testBody_t body;
+		WaitressReturn_t wRet;
+
+		WaitressInit (&waith);
+		WaitressRequestInit (&waith);
+		waith.callback = testBodyCb;
+		waith.data = &body;
+		body.pos = 0;
+		body.data[0] = '\0';
+
+		wRet = parseResponse (&waith, response, len, step);
+		WaitressRequestEnd (&waith, wRet);
+
+		if (wRet != expectedRet || (wRet == WAITRESS_RET_OK &&
+				(!streq (body.data, expectedBody) ||
+				waith.request.keepAlive != keepAlive))) {
+			printf ("FAIL for response %s at step %zu: %s, body %s\n",
+					expectedBody, step, WaitressErrorToStr (wRet), body.data);
+			return;
+		}
+	}
+	printf ("OK for response %s\n", expectedBody);
+}
+
+static void compareResponse (const char *response,
+		const WaitressReturn_t expectedRet, const char *expectedBody,
+		const bool keepAlive) {
+	compareResponseSize (response, strlen (response), expectedRet,
+			expectedBody, keepAlive);
+}
+
+#if WAITRESS_USE_ZLIB
+/*	test decompression, body is compressed and sent with the given encoding
+ *	@param body
+ *	@param content-encoding
+ *	@param zlib window bits, selects gzip, zlib or raw deflate format
+ *	@param use chunked transfer-encoding
+ */
+static void compareEncodedResponse (const char *body, const char *encoding,
+		const int windowBits, const bool chunked) {
+	char response[512], compressed[256];
+	size_t len, compressedSize;
+	z_stream stream;
+
+	memset (&stream, 0, sizeof (stream));
+	deflateInit2 (&stream, Z_BEST_COMPRESSION, Z_DEFLATED, windowBits, 8,
+			Z_DEFAULT_STRATEGY);
+	stream.next_in = (Bytef *) body;
+	stream.avail_in = strlen (body);
+	stream.next_out = (Bytef *) compressed;
+	stream.avail_out = sizeof (compressed);
+	deflate (&stream, Z_FINISH);
+	compressedSize = sizeof (compressed) - stream.avail_out;
+	deflateEnd (&stream);
+
+	if (chunked) {
+		len = sprintf (response, "HTTP/1.1 200 OK\r\nContent-Encoding: %s\r\n"
+				"Transfer-Encoding: chunked\r\n\r\n%zx\r\n", encoding,
+				compressedSize);
+	} else {
+		len = sprintf (response, "HTTP/1.1 200 OK\r\nContent-Encoding: %s\r\n"
+				"Content-Length: %zu\r\n\r\n", encoding, compressedSize);
+	}
+	memcpy (response + len, compressed, compressedSize);
+	len += compressedSize;
+	if (chunked) {
+		len += sprintf (response + len, "\r\n0\r\n\r\n");
+	}
+
+	compareResponseSize (response, len, WAITRESS_RET_OK, body, true);
+}
+#endif
+
+/*	test backoff delays and circuit breaker
+ */
+static void testRetryPolicy () {
+	WaitressHandle_t waith;
+	WaitressRetry_t retry = {5, 100, 1000, 0};
+	bool ok;
+	unsigned int i;
+
+	ok = WaitressRetryDelay (&retry, 1) == 100 &&
+			WaitressRetryDelay (&retry, 3) == 400 &&
+			WaitressRetryDelay (&retry, 5) == 1000 &&
+			WaitressRetryDelay (&retry, 40) == 1000;
+	retry.jitter = 50;
+	for (i = 0; i < 100; i++) {
+		const int delay = WaitressRetryDelay (&retry, 2);
+		ok = ok && delay > 100 && delay <= 200;
+	}
+	printf ("%s for retry delay\n", ok ? "OK" : "FAIL");
+
+	WaitressInit (&waith);
+	WaitressSetUrl (&waith, "http://breaker.invalid/");
+	for (i = 0; i < WAITRESS_BREAKER_THRESHOLD - 1; i++) {
+		WaitressBreakerRecord (&waith, true);
+	}
+	ok = WaitressBreakerAllow (&waith);
+	WaitressBreakerRecord (&waith, true);
+	ok = ok && !WaitressBreakerAllow (&waith);
+	WaitressBreakerRecord (&waith, false);
+	ok = ok && WaitressBreakerAllow (&waith);
+	printf ("%s for circuit breaker\n", ok ? "OK" : "FAIL");
+	WaitressFree (&waith);
+}
+
+/*	test token bucket, it starts out full and refills at its rate
+ */
+static void testRateLimit () {
+	WaitressRateLimit_t limit;
+	int wait = 0;
+	bool ok;
+
+	WaitressRateLimitInit (&limit, 1000, 100);
+	ok = WaitressRateLimitAvailable (&limit, 4096, &wait) == 100;
+	WaitressRateLimitConsume (&limit, 100);
+	ok = ok && WaitressRateLimitAvailable (&limit, 4096, &wait) == 0 &&
+			wait > 0 && wait <= 2;
+	WaitressRateLimitConsume (&limit, 1000);
+	ok = ok && WaitressRateLimitAvailable (&limit, 4096, &wait) == 0 &&
+			wait >= 1000 && wait <= 1002;
+	WaitressRateLimitSet (&limit, 0, 0);
+	ok = ok && WaitressRateLimitAvailable (&limit, 4096, &wait) == 4096;
+	ok = ok && WaitressRateLimitAvailable (NULL, 10, &wait) == 10;
+	printf ("%s for rate limit\n", ok ? "OK" : "FAIL");
+	WaitressRateLimitFree (&limit);
+}
+
+/*	test tls library selection, every compiled in library can be picked by
+ *	name
+ */
+static void testTlsSelect () {
+	const WaitressTlsProvider_t * const *provider;
+	bool ok = !WaitressTlsSelect ("no such library");
+
+	for (provider = waitressTlsProviders; *provider != NULL; ++provider) {
+		ok = ok && WaitressTlsSelect ((*provider)->name) &&
+				streq (WaitressTlsSelected (), (*provider)->name);
+	}
+	ok = ok && WaitressTlsSelect (NULL) && (waitressTlsProviders[0] == NULL ?
+			WaitressTlsSelected () == NULL :
+			streq (WaitressTlsSelected (), waitressTlsProviders[0]->name));
+	printf ("%s for tls library selection\n", ok ? "OK" : "FAIL");
+}
+
+/*	test Content-Range parser
+ */
+static void testContentRange () {
+	static const char response[] = "HTTP/1.1 206 Partial Content\r\n"
+			"Content-Range: bytes 1000-1003/5000\r\n"
+			"Content-Length: 4\r\n\r\nabcd";
+	WaitressHandle_t waith;
+	testBody_t body;
+	bool ok;
+
+	WaitressInit (&waith);
+	WaitressRequestInit (&waith);
+	waith.callback = testBodyCb;
+	waith.data = &body;
+	body.pos = 0;
+	body.data[0] = '\0';
+	ok = parseResponse (&waith, response, strlen (response), 7) ==
+			WAITRESS_RET_OK && waith.request.rangeStart == 1000 &&
+			waith.request.rangeTotal == 5000 && streq (body.data, "abcd");
+	WaitressRequestEnd (&waith, WAITRESS_RET_OK);
+	printf ("%s for content range\n", ok ? "OK" : "FAIL");
+	WaitressFree (&waith);
+}
+
+/*	collect decoded header fields as "name: value\n"
+ */
+static bool testHpackCb (void *data, const char *name, size_t nameLen,
+		const char *value, size_t valueLen) {
+	WaitressH2Buf_t * const text = data;
+
+	return WaitressH2BufAppend (text, name, nameLen) &&
+			WaitressH2BufAppend (text, ": ", 2) &&
+			WaitressH2BufAppend (text, value, valueLen) &&
+			WaitressH2BufAppend (text, "\n", 1);
+}
+
+/*	test hpack with the huffman coded requests of rfc 7541 C.4 and an
+ *	encode/decode round trip
+ */
+static void testHpack () {
+	static const unsigned char c41[] = {0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1,
+			0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b, 0xa0, 0xab, 0x90, 0xf4, 0xff};
+	static const unsigned char c42[] = {0x82, 0x86, 0x84, 0xbe, 0x58, 0x86,
+			0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf};
+	static const unsigned char c43[] = {0x82, 0x87, 0x85, 0xbf, 0x40, 0x88,
+			0x25, 0xa8, 0x49, 0xe9, 0x5b, 0xa9, 0x7d, 0x7f, 0x89, 0x25, 0xa8,
+			0x49, 0xe9, 0x5b, 0xb8, 0xe8, 0xb4, 0xbf};
+	static const char * const fields[][2] = {{":method", "POST"},
+			{":path", "/services/json/?method=test"},
+			{"user-agent", "pianobar"}, {"content-type", "text/plain"},
+			{"x-binary", "\x01\xff~"}};
+	static char big[3900], small[100];
+	WaitressHpackTable_t decoder, encoder;
+	WaitressH2Buf_t text, block;
+	size_t i, round, sizes[2];
+	bool ok;
+
+	memset (&decoder, 0, sizeof (decoder));
+	memset (&text, 0, sizeof (text));
+	decoder.maxSize = WAITRESS_HPACK_TABLE_SIZE;
+	ok = WaitressHpackDecode (&decoder, c41, sizeof (c41), testHpackCb,
+			&text) && decoder.size == 57 &&
+			WaitressHpackDecode (&decoder, c42, sizeof (c42), testHpackCb,
+			&text) && decoder.size == 110 &&
+			WaitressHpackDecode (&decoder, c43, sizeof (c43), testHpackCb,
+			&text) && decoder.size == 164 &&
+			WaitressH2BufAppend (&text, "", 1) && streq (text.data,
+			":method: GET\n:scheme: http\n:path: /\n"
+			":authority: www.example.com\n"
+			":method: GET\n:scheme: http\n:path: /\n"
+			":authority: www.example.com\ncache-control: no-cache\n"
+			":method: GET\n:scheme: https\n:path: /index.html\n"
+			":authority: www.example.com\ncustom-key: custom-value\n");
+	/* truncated */
+	ok = ok && !WaitressHpackDecode (&decoder, c43, sizeof (c43) - 1,
+			testHpackCb, &text);
+	WaitressHpackFree (&decoder);
+	WaitressH2BufFree (&text);
+	printf ("%s for hpack decoder\n", ok ? "OK" : "FAIL");
+
+	/* the second block refers to the dynamic table */
+	memset (&encoder, 0, sizeof (encoder));
+	encoder.maxSize = decoder.maxSize = WAITRESS_HPACK_TABLE_SIZE;
+	ok = true;
+	for (round = 0; round < 2; round++) {
+		memset (&block, 0, sizeof (block));
+		memset (&text, 0, sizeof (text));
+		for (i = 0; i < sizeof (fields) / sizeof (*fields); i++) {
+			ok = ok && WaitressHpackEncode (&encoder, &block, fields[i][0],
+					strlen (fields[i][0]), fields[i][1],
+					strlen (fields[i][1]));
+		}
+		sizes[round] = block.size;
+		ok = ok && WaitressHpackDecode (&decoder,
+				(const unsigned char *) block.data, block.size, testHpackCb,
+				&text) && WaitressH2BufAppend (&text, "", 1) &&
+				streq (text.data, ":method: POST\n"
+				":path: /services/json/?method=test\nuser-agent: pianobar\n"
+				"content-type: text/plain\nx-binary: \x01\xff~\n");
+		WaitressH2BufFree (&block);
+		WaitressH2BufFree (&text);
+	}
+	ok = ok && sizes[1] < sizes[0] && encoder.size == decoder.size;
+	WaitressHpackFree (&encoder);
+	WaitressHpackFree (&decoder);
+	printf ("%s for hpack round trip\n", ok ? "OK" : "FAIL");
+
+	/* the second field is named after the first one (index 62), which it
+	 * evicts from the table */
+	memset (big, 'n', sizeof (big));
+	memset (small, 'v', sizeof (small));
+	memset (&decoder, 0, sizeof (decoder));
+	memset (&block, 0, sizeof (block));
+	memset (&text, 0, sizeof (text));
+	decoder.maxSize = WAITRESS_HPACK_TABLE_SIZE;
+	ok = WaitressHpackEncodeInt (&block, 0x40, 6, 0) &&
+			WaitressHpackEncodeString (&block, big, sizeof (big)) &&
+			WaitressHpackEncodeString (&block, small, 68) &&
+			WaitressHpackEncodeInt (&block, 0x40, 6, 62) &&
+			WaitressHpackEncodeString (&block, small, sizeof (small)) &&
+			WaitressHpackDecode (&decoder,
+			(const unsigned char *) block.data, block.size, testHpackCb,
+			&text) && decoder.count == 1 && decoder.size == 4032 &&
+			decoder.entries[0].nameLen == sizeof (big) &&
+			memcmp (decoder.entries[0].name, big, sizeof (big)) == 0 &&
+			decoder.entries[0].valueLen == sizeof (small) &&
+			memcmp (decoder.entries[0].value, small, sizeof (small)) == 0;
+	WaitressHpackFree (&decoder);
+	WaitressH2BufFree (&block);
+	WaitressH2BufFree (&text);
+	printf ("%s for hpack eviction of the indexed name\n", ok ? "OK" : "FAIL");
+}
+
+/*	test cancellation, a cancelled request fails before it connects
+ */
+static void testCancel () {
+	WaitressHandle_t waith;
+	WaitressCancel_t cancel;
+	bool ok;
+
+	WaitressInit (&waith);
+	WaitressSetUrl (&waith, "http://cancel.invalid/");
+	ok = WaitressCancelInit (&cancel);
+	waith.cancel = &cancel;
+	ok = ok && !WaitressCancelled (&waith);
+	WaitressCancel (&cancel);
+	WaitressCancel (&cancel);
+	ok = ok && WaitressCancelled (&waith) &&
+			WaitressFetchCall (&waith) == WAITRESS_RET_CANCELLED;
+	WaitressCancelReset (&cancel);
+	ok = ok && !WaitressCancelled (&waith);
+	printf ("%s for cancellation\n", ok ? "OK" : "FAIL");
+	WaitressCancelFree (&cancel);
+	WaitressFree (&waith);
+}
+
+static WaitressCbReturn_t benchBodyCb (void *data, size_t size,
+		void *userData) {
+	size_t * const received = userData;
+
+	(void) data;
+	*received += size;
+	return WAITRESS_CB_RET_OK;
+}
+
+/*	response parser microbenchmark
+ */
+static void benchParser () {
+	static const char head[] = "HTTP/1.1 200 OK\r\n"
+			"Date: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+			"Server: Apache\r\n"
+			"Content-Type: audio/aac\r\n"
+			"Cache-Control: private, max-age=0\r\n"
+			"Last-Modified: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+			"ETag: \"4d2a1b7c9e3f\"\r\n"
+			"Accept-Ranges: bytes\r\n"
+			"Connection: keep-alive\r\n";
+	const size_t chunk = 16*1024, chunks = 64, rounds = 100,
+			headRounds = 200000;
+	WaitressHandle_t waith;
+	size_t received = 0, i, len;
+	char *response, *pos;
+	int64_t start, elapsed;
+
+	WaitressInit (&waith);
+	WaitressRequestInit (&waith);
+	waith.callback = benchBodyCb;
+	waith.data = &received;
+
+	/* headers only */
+	response = malloc (sizeof (head) + chunks * (chunk + 16) + 64);
+	len = sprintf (response, "%sContent-Length: 0\r\n\r\n", head);
+	start = WaitressNow ();
+	for (i = 0; i < headRounds; i++) {
+		parseResponse (&waith, response, len, WAITRESS_BUFFER_SIZE);
+	}
+	elapsed = WaitressNow () - start;
+	printf ("headers: %.0f responses/s\n",
+			(double) headRounds * 1000 / (elapsed > 0 ? elapsed : 1));
+
+	/* chunked body, read in buffer sized pieces */
+	pos = response + sprintf (response,
+			"%sTransfer-Encoding: chunked\r\n\r\n", head);
+	for (i = 0; i < chunks; i++) {
+		pos += sprintf (pos, "%zx\r\n", chunk);
+		memset (pos, 'x', chunk);
+		pos += chunk;
+		pos += sprintf (pos, "\r\n");
+	}
+	pos += sprintf (pos, "0\r\n\r\n");
+	len = pos - response;
+	start = WaitressNow ();
+	for (i = 0; i < rounds; i++) {
+		parseResponse (&waith, response, len, WAITRESS_BUFFER_SIZE);
+	}
+	elapsed = WaitressNow () - start;
+	printf ("chunked body: %.1f MB/s\n", (double) received /
+			(elapsed > 0 ? elapsed : 1) / 1000);
+
+	free (response);
+	free (waith.request.buf);
+}
+
+static int compareInt64 (const void *a, const void *b) {
+	const int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*	fetch the same resource repeatedly, report throughput and latency
+ *	@param base url of contrib/waitress-testserver.py
+ *	@param sha1 fingerprint (hex), the server talks tls if not NULL
+ *	@param path on the server
+ *	@param number of requests
+ *	@param use WaitressFetchBuf instead of WaitressFetchCall
+ *	@param keep connections alive
+ *	@param use WaitressFetchSegmented with this many ranges at once, if > 0
+ */
+static void benchFetch (const char *base, const char *fingerprint,
+		const char *path, const size_t count, const bool fetchBuf,
+		const bool keepAlive, const unsigned int segments) {
+	WaitressHandle_t waith;
+	char url[1024], fp[20];
+	size_t received = 0, bytes = 0, failed = 0, i;
+	int64_t *latency, start, elapsed;
+
+	WaitressInit (&waith);
+	snprintf (url, sizeof (url), "%s%s", base, path);
+	WaitressSetUrl (&waith, url);
+	waith.keepAlive = keepAlive;
+	if (fingerprint != NULL) {
+		for (i = 0; i < sizeof (fp); i++) {
+			unsigned int byte = 0;
+			sscanf (fingerprint + 2*i, "%2x", &byte);
+			fp[i] = byte;
+		}
+		waith.url.tls = true;
+		waith.url.tlsPort = waith.url.port;
+		waith.tlsFingerprint = fp;
+	}
+
+	latency = malloc (count * sizeof (*latency));
+	start = WaitressNowUs ();
+	for (i = 0; i < count; i++) {
+		const int64_t before = WaitressNowUs ();
+		WaitressReturn_t wRet;
+
+		if (fetchBuf) {
+			char *buf = NULL;
+			wRet = WaitressFetchBuf (&waith, &buf);
+			free (buf);
+		} else if (segments > 0) {
+			waith.callback = benchBodyCb;
+			waith.data = &received;
+			wRet = WaitressFetchSegmented (&waith, 0, segments, 256*1024);
+		} else {
+			waith.callback = benchBodyCb;
+			waith.data = &received;
+			wRet = WaitressFetchCall (&waith);
+		}
+		latency[i] = WaitressNowUs () - before;
+		bytes += waith.timing.bytesReceived;
+		if (wRet != WAITRESS_RET_OK) {
+			++failed;
+		}
+	}
+	elapsed = WaitressNowUs () - start;
+	if (elapsed <= 0) {
+		elapsed = 1;
+	}
+	qsort (latency, count, sizeof (*latency), compareInt64);
+
+	printf ("%s %s%s%s: %.0f requests/s, %.1f MB/s, latency p50 %.2f "
+			"p90 %.2f p99 %.2f ms, %zu failed\n",
+			fetchBuf ? "WaitressFetchBuf" : segments > 0 ?
+			"WaitressFetchSegmented" : "WaitressFetchCall",
+			fingerprint != NULL ? "tls " : "", path,
+			keepAlive ? "" : " (no keep-alive)",
+			(double) count * 1000000 / elapsed, (double) bytes / elapsed,
+			(double) latency[count/2] / 1000,
+			(double) latency[count*9/10] / 1000,
+			(double) latency[count*99/100] / 1000, failed);
+
+	free (latency);
+	WaitressFree (&waith);
+	WaitressPoolClear ();
+}
+
+/*	network benchmark against contrib/waitress-testserver.py
+ */
+static void benchServer (const char *base, const char *fingerprint) {
+	static const struct {
+		const char *path;
+		size_t count;
+		bool fetchBuf, keepAlive;
+		unsigned int segments;
+	} runs[] = {
+		{"bytes/1024", 2000, true, true, 0},
+		{"bytes/1024", 2000, false, true, 0},
+		{"bytes/1024", 500, false, false, 0},
+		{"bytes/1048576", 100, false, true, 0},
+		{"chunked/1048576", 100, false, true, 0},
+		/* per-connection bandwidth cap */
+		{"bytes/4194304?rate=4194304", 3, false, true, 0},
+		{"bytes/4194304?rate=4194304", 3, false, true, 4},
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof (runs) / sizeof (*runs); i++) {
+		benchFetch (base, fingerprint, runs[i].path, runs[i].count,
+				runs[i].fetchBuf, runs[i].keepAlive, runs[i].segments);
+	}
+}
+
 /*	test entry point
  */
-int main () {
+int main (int argc, char **argv) {
+	if (argc > 1 && streq (argv[1], "bench")) {
+		/* bench [plain url [tls url fingerprint]], urls are passed in by
+		 * contrib/waitress-testserver.py --run */
+		benchParser ();
+		if (argc > 2) {
+			benchServer (argv[2], NULL);
+		}
+		if (argc > 4) {
+			benchServer (argv[3], argv[4]);
+		}
+		return EXIT_SUCCESS;
+	}
+
 	/* WaitressSplitUrl tests */
 	compareUrl ("http://www.example.com/", NULL, NULL, "www.example.com", NULL,
 			"");
@@ -1600,6 +7774,56 @@ int main () {
 	compareStr (WaitressBase64Encode ("The quick brown fox jumped over the lazy do"),
 			"VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wZWQgb3ZlciB0aGUgbGF6eSBkbw==");
 
+	/* response parser tests */
+	compareResponse ("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello",
+			WAITRESS_RET_OK, "hello", true);
+	compareResponse ("HTTP/1.0 200 OK\nContent-Length:3  \n\nabc",
+			WAITRESS_RET_OK, "abc", false);
+	compareResponse ("HTTP/1.1 200 OK\r\nConnection: close\r\n"
+			"Transfer-Encoding: chunked\r\n\r\n"
+			"4\r\nchun\r\nA;name=value\r\nked body 1\r\n0\r\n\r\n",
+			WAITRESS_RET_OK, "chunked body 1", false);
+	compareResponse ("HTTP/1.1 206 Partial Content\r\n"
+			"Transfer-Encoding: chunked\r\n\r\n"
+			"F\r\nchunked body 2 \r\n1\r\n!\r\n0\r\nX-Trailer: 1\r\n\r\n",
+			WAITRESS_RET_OK, "chunked body 2 !", true);
+	compareResponse ("garbage\r\nHTTP/1.1 200 This reason phrase is too long "
+			"to fit into the buffer that collects header values\r\n"
+			"X-Oversized-Header-Key-That-Is-Ignored: 1\r\n"
+			"X-Padding: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+			"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n"
+			"invalid line\r\nContent-Length: 4\r\n\r\nlong",
+			WAITRESS_RET_OK, "long", true);
+	compareResponse ("HTTP/1.1 404 Not Found\r\n\r\n",
+			WAITRESS_RET_NOTFOUND, "404", true);
+	compareResponse ("HTTP/1.1 500 Internal Server Error\r\n\r\n",
+			WAITRESS_RET_STATUS_UNKNOWN, "500", true);
+	compareResponse ("HTTP/1.1 503 Service Unavailable\r\n\r\n",
+			WAITRESS_RET_SERVICE_UNAVAILABLE, "503", true);
+	compareResponse ("HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+			"zz\r\n", WAITRESS_RET_DECODING_ERR, "invalid chunk", true);
+#if WAITRESS_USE_ZLIB
+	compareEncodedResponse ("gzip gzip gzip gzip gzip gzip", "gzip", 15 + 16,
+			false);
+	compareEncodedResponse ("zlib zlib zlib zlib zlib zlib", "deflate", 15,
+			true);
+	compareEncodedResponse ("deflate deflate deflate deflate", "deflate", -15,
+			false);
+	compareResponse ("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+			"Content-Length: 12\r\n\r\nnot gzipped!", WAITRESS_RET_DECODING_ERR,
+			"invalid gzip", true);
+	compareResponse ("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\n"
+			"Transfer-Encoding: chunked\r\n\r\nc\r\nnot gzipped!\r\n0\r\n\r\n",
+			WAITRESS_RET_DECODING_ERR, "invalid chunked gzip", true);
+#endif
+
+	testRetryPolicy ();
+	testCancel ();
+	testContentRange ();
+	testRateLimit ();
+	testHpack ();
+	testTlsSelect ();
+
 	return EXIT_SUCCESS;
 }
 #endif /* TEST */
@@ -24,24 +24,69 @@ THE SOFTWARE.
 #ifndef _WAITRESS_H
 #define _WAITRESS_H
 
-/* Enable only one. */
+/* tls libraries, any number of them can be enabled; the first one (in this
+ * order) is used unless WaitressTlsSelect () picks another at runtime. The
+ * defaults can be overridden at build time, e.g. -DWAITRESS_USE_OPENSSL=1 */
+#ifndef WAITRESS_USE_GNUTLS
 #define WAITRESS_USE_GNUTLS		0
+#endif
+#ifndef WAITRESS_USE_POLARSSL
 #define WAITRESS_USE_POLARSSL	1
+#endif
+#ifndef WAITRESS_USE_OPENSSL
+#define WAITRESS_USE_OPENSSL	0
+#endif
+
+/* decode gzip/deflate content-encoding, requires zlib */
+#ifndef WAITRESS_USE_ZLIB
+#define WAITRESS_USE_ZLIB		1
+#endif
 
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 
-#if WAITRESS_USE_GNUTLS
-#include <gnutls/gnutls.h>
-#endif
-
-#if WAITRESS_USE_POLARSSL
-typedef struct _polarssl_ctx polarssl_ctx;
-#endif
+/* tls session of a connection, owned by the library that created it */
+typedef struct WaitressTlsSession WaitressTlsSession_t;
 
 #define WAITRESS_BUFFER_SIZE 10*1024
 
+/* keep-alive connection pool: idle connections are closed after this many
+ * seconds, at most WAITRESS_POOL_MAX_PER_HOST idle connections are kept for
+ * every host/port/tls/proxy combination */
+#define WAITRESS_POOL_IDLE_TIMEOUT 60
+#define WAITRESS_POOL_MAX_PER_HOST 4
+
+/* tls sessions are cached for resumption for this many seconds, one per
+ * host/port, up to WAITRESS_TLS_CACHE_SIZE hosts */
+#define WAITRESS_TLS_SESSION_TIMEOUT 600
+#define WAITRESS_TLS_CACHE_SIZE 16
+
+/* name lookups are cached for this many seconds, for up to
+ * WAITRESS_DNS_CACHE_SIZE hosts */
+#define WAITRESS_DNS_CACHE_TTL 300
+#define WAITRESS_DNS_CACHE_SIZE 32
+
+/* connection attempts to the next address of a host start every
+ * WAITRESS_CONNECT_ATTEMPT_DELAY ms, up to WAITRESS_CONNECT_MAX_ATTEMPTS at once */
+#define WAITRESS_CONNECT_ATTEMPT_DELAY 250
+#define WAITRESS_CONNECT_MAX_ATTEMPTS 4
+
+/* circuit breaker: after WAITRESS_BREAKER_THRESHOLD failed attempts in a row
+ * requests to a host fail immediately for WAITRESS_BREAKER_COOLDOWN seconds,
+ * then a single attempt is let through to probe it; failures are tracked for
+ * up to WAITRESS_BREAKER_SIZE hosts */
+#define WAITRESS_BREAKER_THRESHOLD 5
+#define WAITRESS_BREAKER_COOLDOWN 30
+#define WAITRESS_BREAKER_SIZE 16
+
+/* http/2: receive window of every stream in bytes, the server cannot send
+ * more than this before the response is read */
+#define WAITRESS_H2_WINDOW (256*1024)
+
 typedef enum {
 	WAITRESS_METHOD_GET = 0,
 	WAITRESS_METHOD_POST,
@@ -94,12 +139,119 @@ typedef enum {
 	WAITRESS_RET_DECODING_ERR,
 	WAITRESS_RET_TLS_HANDSHAKE_ERR,
 	WAITRESS_RET_TLS_FINGERPRINT_MISMATCH,
+	/* http 502/503/504 */
+	WAITRESS_RET_SERVICE_UNAVAILABLE,
+	/* host failed too often recently, request was not sent */
+	WAITRESS_RET_CIRCUIT_OPEN,
+	/* aborted by WaitressCancel () */
+	WAITRESS_RET_CANCELLED,
 } WaitressReturn_t;
 
+/* progress of a request driven by WaitressMulti_t */
+typedef enum {
+	WAITRESS_STATE_CONNECT = 0,
+	WAITRESS_STATE_RESOLVING,
+	WAITRESS_STATE_CONNECTING,
+	WAITRESS_STATE_PROXY_SEND,
+	WAITRESS_STATE_PROXY_HEADERS,
+	WAITRESS_STATE_HANDSHAKE,
+	/* connection established */
+	WAITRESS_STATE_REQUEST,
+	WAITRESS_STATE_SEND,
+	WAITRESS_STATE_HEADERS,
+	WAITRESS_STATE_BODY,
+	WAITRESS_STATE_DONE,
+} WaitressState_t;
+
+/*	time limits in ms for the phases of a request, 0 disables a limit
+ */
+typedef struct {
+	int resolve;
+	int connect;
+	/* tls handshake, including proxy tunnel setup */
+	int handshake;
+	/* from sending the request until the first byte of the response */
+	int firstByte;
+	/* whole request, including retries */
+	int total;
+} WaitressTimeouts_t;
+
+/*	retry policy for attempts that failed with a transient error; the n-th
+ *	retry waits min (backoffMax, backoffBase * 2^(n-1)) ms, shortened by a
+ *	random amount of up to jitter percent
+ */
+typedef struct {
+	/* attempts per request, including the first one */
+	unsigned int maxAttempts;
+	int backoffBase, backoffMax;
+	int jitter;
+} WaitressRetry_t;
+
+/*	timing of the last request; times are microseconds since the request
+ *	started, -1 if the last attempt did not go through that phase (pooled
+ *	connection, plain http)
+ */
+typedef struct {
+	int64_t resolved;
+	int64_t connected;
+	int64_t handshakeDone;
+	int64_t requestSent;
+	int64_t firstByte;
+	int64_t done;
+	/* on the socket, all attempts */
+	size_t bytesSent, bytesReceived;
+	unsigned int retries;
+	/* last attempt used a pooled connection */
+	bool reused;
+} WaitressTiming_t;
+
+/*	options for new sockets; pooled connections keep the ones they were
+ *	opened with. Unsupported options are ignored.
+ */
+typedef struct {
+	/* SO_RCVBUF/SO_SNDBUF in bytes, 0 keeps the system default */
+	int recvBuffer, sendBuffer;
+	/* TCP_NODELAY, small writes are not held back */
+	bool noDelay;
+	/* tcp keepalive: idle seconds before the first probe (0 disables it),
+	 * seconds between probes and probes before the connection is dropped
+	 * (0 keeps the system default) */
+	int keepAliveIdle, keepAliveInterval, keepAliveCount;
+	/* tcp fast open, the first write goes out with the SYN; the connection
+	 * counts as established right away, so connection errors show up as
+	 * write/read errors and addresses are not raced */
+	bool fastOpen;
+} WaitressSockOpts_t;
+
+/*	lets another thread abort blocking requests, see WaitressCancel ()
+ */
+typedef struct {
+	/* a byte written to fds[1] makes fds[0] readable; -1 if unusable */
+	int fds[2];
+} WaitressCancel_t;
+
+/*	token bucket limiting the download rate of response bodies, may be
+ *	shared by handles on several threads, see WaitressRateLimitInit ()
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	/* bytes per second, 0 is unlimited */
+	size_t rate;
+	/* bytes that can be read at full speed after an idle period */
+	size_t burst;
+	double tokens;
+	/* last refill, microseconds on the monotonic clock */
+	int64_t refilled;
+} WaitressRateLimit_t;
+
 /*	reusable handle
  */
 typedef struct {
+	/* max time between two reads/writes in ms */
 	int timeout;
+	WaitressTimeouts_t timeouts;
+	WaitressRetry_t retry;
+	WaitressSockOpts_t sockOpts;
 	WaitressMethod_t method;
 
 	const char *extraHeaders;
@@ -108,45 +260,129 @@ typedef struct {
 	void *data;
 	WaitressCbReturn_t (*callback) (void *, size_t, void *);
 	const char *tlsFingerprint;
+	/* blocking requests give up as soon as this is signalled, may be NULL;
+	 * WaitressMultiPerform () does not wake up for it */
+	WaitressCancel_t *cancel;
+	/* download rate limits, may be NULL; the global one is usually shared
+	 * by all handles that are limited together */
+	WaitressRateLimit_t *rateLimit, *globalRateLimit;
+	/* return connection to pool instead of closing it */
+	bool keepAlive;
+	/* ask for gzip/deflate compressed responses, callback gets them
+	 * decompressed */
+	bool acceptEncoding;
+	/* offer http/2 to tls servers; blocking requests to the same host
+	 * share a single connection then, whether keepAlive is set or not.
+	 * Other requests and servers without http/2 use http/1.1. */
+	bool http2;
 
 	WaitressUrl_t url;
 	WaitressUrl_t proxy;
 
-#if WAITRESS_USE_GNUTLS
-	gnutls_certificate_credentials_t tlsCred;
-#endif
+	/* filled in by WaitressFetchCall/WaitressMulti */
+	WaitressTiming_t timing;
 
 	/* per-request data */
 	struct {
 		int sockfd;
+		/* name lookup of the current attempt */
+		struct WaitressDnsJob *dnsJob;
+		/* shared http/2 connection and our stream on it, if any */
+		struct WaitressH2Conn *h2Conn;
+		struct WaitressH2Stream *h2Stream;
+		/* connections racing each other, to addresses from dnsJob up to
+		 * nextAddr */
+		int attemptFds[WAITRESS_CONNECT_MAX_ATTEMPTS];
+		size_t attemptCount, nextAddr;
+		int64_t nextAttempt;
+		/* next attempt of a retried request starts then */
+		int64_t retryAt;
+		/* body is not read until then because of a rate limit, 0 if it may
+		 * be read */
+		int64_t throttledUntil;
+		/* absolute deadlines of the current phase and the whole request on
+		 * the monotonic clock, 0 if there is none */
+		int64_t phaseDeadline, totalDeadline;
+		/* start of the request in microseconds, see timing */
+		int64_t started;
 
 		/* temporary return value storage */
 		WaitressReturn_t readWriteRet;
 
 		size_t contentLength, contentReceived, chunkSize;
 		bool contentLengthKnown;
-		enum {CHUNKSIZE = 0, DATA = 1} chunkedState;
+		/* Content-Range of a partial response; rangeTotal is 0 if there was
+		 * none, SIZE_MAX if the server did not know the size */
+		size_t rangeStart, rangeTotal;
+		enum {ENCODING_IDENTITY = 0, ENCODING_GZIP, ENCODING_DEFLATE}
+				contentEncoding;
+		/* decompressor, set up once compressed body data arrives */
+		struct WaitressInflate *inflate;
+		enum {CHUNKSIZE = 0, CHUNKEXT, DATA, TRAILER, TRAILERLINE}
+				chunkedState;
+		/* status line, start of header line, key, value */
+		enum {HDRM_HEAD = 0, HDRM_LINES, HDRM_KEY, HDRM_VALUE, HDRM_FINISHED}
+				hdrParseMode;
+		/* header tokens split across reads are collected here; a length
+		 * exceeding the buffer marks an oversized (ignored) token */
+		char hdrKey[32], hdrValue[64];
+		size_t hdrKeyLen, hdrValueLen;
 
 		char *buf;
+		/* bytes received into buf by the last read, parsed up to bufPos */
+		size_t bufFilled, bufPos;
+		/* serialized request, sent up to sendPos; the body follows sendBuf
+		 * and is sent straight from postData if sendBody is set */
+		char *sendBuf;
+		const char *sendBody;
+		size_t sendSize, sendBodySize, sendPos;
 
 		/* first argument is WaitressHandle_t, but that's not defined yet */
 		WaitressHandlerReturn_t (*dataHandler) (void *, char *, const size_t);
 		WaitressReturn_t (*read) (void *, char *, const size_t, size_t *);
-		WaitressReturn_t (*write) (void *, const char *, const size_t);
+		WaitressReturn_t (*write) (void *, const char *, const size_t, size_t *);
 
-#if WAITRESS_USE_GNUTLS
-		gnutls_session_t tlsSession;
-#endif
+		WaitressTlsSession_t *tlsSession;
 
-#if WAITRESS_USE_POLARSSL
-		polarssl_ctx* sslCtx;
-#endif
+		/* attempts started so far */
+		unsigned int attempts;
+
+		/* connection was taken from pool */
+		bool reused;
+		/* tls peer passed fingerprint check (or resumed a session that did) */
+		bool tlsVerified;
+		/* a cached tls session was offered to the server */
+		bool tlsResuming;
+		/* received at least one byte of the response */
+		bool responseStarted;
+		/* server did not ask us to close the connection */
+		bool keepAlive;
+		/* body framing (length/chunked) says we have all of it */
+		bool bodyComplete;
 
-		int retriesLeft;
+		/* socket is not waited for in read/write, which fail with
+		 * wouldBlock set instead; wantWrite tells which readiness to wait
+		 * for */
+		bool nonBlocking, wouldBlock, wantWrite;
+		/* WaitressMulti_t bookkeeping */
+		WaitressState_t state;
+		WaitressReturn_t result;
+		int64_t lastActivity;
+		int watchedFd, watchEpollFd;
+		bool watchedWrite, ready;
 
 	} request;
 } WaitressHandle_t;
 
+/*	runs many requests at once on a single thread
+ */
+typedef struct {
+	WaitressHandle_t **handles;
+	size_t count, size;
+	/* epoll instance on linux, -1 if poll () is used instead */
+	int epollfd;
+} WaitressMulti_t;
+
 void WaitressInit (WaitressHandle_t *);
 void WaitressFree (WaitressHandle_t *);
 bool WaitressSetProxy (WaitressHandle_t *, const char *);
@@ -154,7 +390,28 @@ char *WaitressUrlEncode (const char *);
 bool WaitressSetUrl (WaitressHandle_t *, const char *);
 WaitressReturn_t WaitressFetchBuf (WaitressHandle_t *, char **);
 WaitressReturn_t WaitressFetchCall (WaitressHandle_t *);
+WaitressReturn_t WaitressPreconnect (WaitressHandle_t *);
 const char *WaitressErrorToStr (WaitressReturn_t);
+int WaitressRetryDelay (const WaitressRetry_t *, unsigned int);
+void WaitressCondDeadline (struct timespec *, const int);
+bool WaitressCancelInit (WaitressCancel_t *);
+void WaitressCancelFree (WaitressCancel_t *);
+void WaitressCancel (WaitressCancel_t *);
+void WaitressCancelReset (WaitressCancel_t *);
+void WaitressRateLimitInit (WaitressRateLimit_t *, size_t, size_t);
+void WaitressRateLimitFree (WaitressRateLimit_t *);
+void WaitressRateLimitSet (WaitressRateLimit_t *, size_t, size_t);
+void WaitressPoolClear (void);
+bool WaitressTlsSelect (const char *);
+const char *WaitressTlsSelected (void);
+void WaitressMultiInit (WaitressMulti_t *);
+void WaitressMultiFree (WaitressMulti_t *);
+bool WaitressMultiAdd (WaitressMulti_t *, WaitressHandle_t *);
+void WaitressMultiRemove (WaitressMulti_t *, WaitressHandle_t *);
+size_t WaitressMultiPerform (WaitressMulti_t *, int);
+WaitressHandle_t *WaitressMultiInfoRead (WaitressMulti_t *, WaitressReturn_t *);
+WaitressReturn_t WaitressFetchSegmented (WaitressHandle_t *, size_t,
+		unsigned int, size_t);
 
 #endif /* _WAITRESS_H */
 
@@ -256,6 +256,84 @@ static void BarMainGetPlaylist (BarApp_t *app) {
 			pRet, wRet);
 }
 
+/*	set up waitress handle for a song's audio file
+ *	@param app handle
+ *	@param uninitialized waitress handle
+ *	@param audio url
+ */
+static void BarMainAudioHandleInit (const BarApp_t *app,
+		WaitressHandle_t *waith, const char *url) {
+	WaitressInit (waith);
+	WaitressSetUrl (waith, url);
+	waith->sockOpts = app->settings.audioSockOpts;
+	waith->timeout = BAR_PLAYER_TIMEOUT;
+	waith->timeouts.resolve = BAR_PLAYER_CONNECT_TIMEOUT;
+	waith->timeouts.connect = BAR_PLAYER_CONNECT_TIMEOUT;
+	waith->timeouts.handshake = BAR_PLAYER_CONNECT_TIMEOUT;
+	waith->timeouts.firstByte = BAR_PLAYER_CONNECT_TIMEOUT;
+
+	/* set up global proxy */
+	if (app->settings.proxy != NULL) {
+		WaitressSetProxy (waith, app->settings.proxy);
+	}
+}
+
+static void *BarMainPreconnectThread (void *data) {
+	WaitressHandle_t *waith = data;
+
+	WaitressPreconnect (waith);
+	WaitressFree (waith);
+	free (waith);
+
+	return NULL;
+}
+
+/*	abort the background connect, if any, and wait for its thread
+ */
+static void BarMainPreconnectStop (BarApp_t *app) {
+	if (app->preconnecting) {
+		WaitressCancel (&app->preconnectCancel);
+		pthread_join (app->preconnectThread, NULL);
+		WaitressCancelReset (&app->preconnectCancel);
+		app->preconnecting = false;
+	}
+}
+
+/*	connect to the next song's audio host in the background, the player
+ *	takes the connection from waitress' pool when the song starts
+ */
+static void BarMainPreconnect (BarApp_t *app) {
+	const PianoSong_t * const next = app->playlist->next;
+	WaitressHandle_t *waith;
+
+	/* songs are compared by url, a new playlist may reuse their memory */
+	if (next == NULL || next->audioUrl == NULL ||
+			(app->preconnected != NULL &&
+			strcmp (next->audioUrl, app->preconnected) == 0)) {
+		return;
+	}
+	/* one at a time, an unfinished one is for a song that is not next
+	 * anymore */
+	BarMainPreconnectStop (app);
+	free (app->preconnected);
+	if ((app->preconnected = bar_strdup (next->audioUrl)) == NULL) {
+		return;
+	}
+
+	if ((waith = malloc (sizeof (*waith))) == NULL) {
+		return;
+	}
+	BarMainAudioHandleInit (app, waith, next->audioUrl);
+	waith->cancel = &app->preconnectCancel;
+	if (pthread_create (&app->preconnectThread, NULL,
+			BarMainPreconnectThread, waith) != 0) {
+		WaitressFree (waith);
+		free (waith);
+		return;
+	}
+	app->preconnecting = true;
+}
+
 /*	start new player thread
  */
 static void BarMainStartPlayback (BarApp_t *app, pthread_t *playerThread) {
@@ -269,12 +347,17 @@ static void BarMainStartPlayback (BarApp_t *app, pthread_t *playerThread) {
 		/* setup player */
 		memset (&app->player, 0, sizeof (app->player));
 
-		WaitressInit (&app->player.waith);
-		WaitressSetUrl (&app->player.waith, app->playlist->audioUrl);
-
-		/* set up global proxy, player is NULLed on songfinish */
-		if (app->settings.proxy != NULL) {
-			WaitressSetProxy (&app->player.waith, app->settings.proxy);
+		/* player is NULLed on songfinish */
+		BarMainAudioHandleInit (app, &app->player.waith,
+				app->playlist->audioUrl);
+		if (WaitressCancelInit (&app->player.cancel)) {
+			app->player.waith.cancel = &app->player.cancel;
+		}
+		/* unlimited until the player knows the song's bitrate */
+		WaitressRateLimitInit (&app->player.rateLimit, 0, 0);
+		app->player.waith.rateLimit = &app->player.rateLimit;
+		if (app->settings.downloadRateLimit > 0) {
+			app->player.waith.globalRateLimit = &app->rateLimit;
 		}
 
 		app->player.gain = app->playlist->fileGain;
@@ -307,9 +390,10 @@ static void BarMainPlayerCleanup (BarApp_t *app, pthread_t *playerThread) {
 			app->playlist, &app->player, app->ph.stations, PIANO_RET_OK,
 			WAITRESS_RET_OK);
 
-	/* FIXME: pthread_join blocks everything if network connection
-	 * is hung up e.g. */
+	/* skip/quit cancel hung network transfers, so this returns quickly */
 	pthread_join (*playerThread, &threadRet);
+	WaitressCancelFree (&app->player.cancel);
+	WaitressRateLimitFree (&app->player.rateLimit);
 	pthread_cond_destroy (&app->player.pauseCond);
 	pthread_mutex_destroy (&app->player.pauseMutex);
 
@@ -427,6 +511,11 @@ static void BarMainLoop (BarApp_t *app) {
 		if (app->player.mode >= PLAYER_SAMPLESIZE_INITIALIZED &&
 				app->player.mode < PLAYER_FINISHED_PLAYBACK) {
 			BarMainPrintTime (app);
+
+			if (app->player.songDuration > 0 && app->player.songPlayed +
+					BAR_PLAYER_PRECONNECT >= app->player.songDuration) {
+				BarMainPreconnect (app);
+			}
 		}
 	}
 
@@ -488,6 +577,20 @@ int main (int argc, char **argv) {
 	app.waith.url.host = (host = bar_strdup (app.settings.rpcHost));
 	app.waith.url.tlsPort = app.settings.rpcTlsPort;
 	app.waith.tlsFingerprint = app.settings.tlsFingerprint;
+	app.waith.acceptEncoding = true;
+	app.waith.sockOpts = app.settings.rpcSockOpts;
+	app.waith.http2 = app.settings.rpcHttp2;
+	if (app.settings.tlsBackend != NULL &&
+			!WaitressTlsSelect (app.settings.tlsBackend)) {
+		BarUiMsg (&app.settings, MSG_ERR, "TLS library %s is not available.\n",
+				app.settings.tlsBackend);
+	}
+
+	/* one second worth of data may be read at once */
+	WaitressRateLimitInit (&app.rateLimit, app.settings.downloadRateLimit *
+			1024, app.settings.downloadRateLimit * 1024);
+	/* without it preconnecting works too, but may delay the exit */
+	WaitressCancelInit (&app.preconnectCancel);
 
 	/* init fds */
 	#ifndef _WIN32
@@ -532,7 +635,13 @@ int main (int argc, char **argv) {
 	PianoDestroy (&app.ph);
 	PianoDestroyPlaylist (app.songHistory);
 	PianoDestroyPlaylist (app.playlist);
+	/* it uses the pool and tls */
+	BarMainPreconnectStop (&app);
+	WaitressCancelFree (&app.preconnectCancel);
+	free (app.preconnected);
 	WaitressFree (&app.waith);
+	WaitressRateLimitFree (&app.rateLimit);
+	WaitressPoolClear ();
 	ao_shutdown();
 	BarSettingsDestroy (&app.settings);
 
@@ -43,6 +43,14 @@ typedef struct {
 	char doQuit;
 	BarReadlineFds_t input;
 	unsigned int playerErrors;
+	/* audio url of the song whose host was connected to in advance, by
+	 * preconnectThread if preconnecting is set */
+	char *preconnected;
+	pthread_t preconnectThread;
+	bool preconnecting;
+	WaitressCancel_t preconnectCancel;
+	/* shared by all audio downloads */
+	WaitressRateLimit_t rateLimit;
 } BarApp_t;
 
 #endif /* _MAIN_H */
@@ -0,0 +1,324 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* mpeg audio frame headers and the xing/info, lame and vbri tags */
+
+#include <string.h>
+
+#include "mp3.h"
+
+/* kbit/s by version (mpeg 1, 2/2.5), layer (I, II, III) and index */
+static const unsigned short bitrates[2][3][15] = {
+	{
+		{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+		{0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+		{0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+	},
+	{
+		{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+		{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+		{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+	},
+};
+
+static const unsigned int samplerates[3] = {44100, 48000, 32000};
+
+static unsigned long BarMp3Get32 (const unsigned char *data) {
+	return (unsigned long) data[0] << 24 | (unsigned long) data[1] << 16 |
+			(unsigned long) data[2] << 8 | (unsigned long) data[3];
+}
+
+/*	parse frame header
+ *	@param data
+ *	@param size of data
+ *	@param header
+ *	@return false if there is no valid header (free format is not supported)
+ */
+bool BarMp3ParseHeader (const unsigned char *data, size_t size,
+		BarMp3Header_t *header) {
+	/* 3: mpeg 1, 2: mpeg 2, 0: mpeg 2.5 */
+	unsigned int version, layer, bitrate, samplerate, padding;
+	bool mono;
+
+	if (size < 4 || data[0] != 0xff || (data[1] & 0xe0) != 0xe0) {
+		return false;
+	}
+	version = (data[1] >> 3) & 3;
+	/* 1: layer III, 3: layer I */
+	layer = 4 - ((data[1] >> 1) & 3);
+	bitrate = data[2] >> 4;
+	samplerate = (data[2] >> 2) & 3;
+	padding = (data[2] >> 1) & 1;
+	mono = (data[3] >> 6) == 3;
+	if (version == 1 || layer == 4 || bitrate == 0 || bitrate == 15 ||
+			samplerate == 3) {
+		return false;
+	}
+
+	memset (header, 0, sizeof (*header));
+	header->bitrate = bitrates[version != 3][layer-1][bitrate] * 1000;
+	header->samplerate = samplerates[samplerate] >> (version == 3 ? 0 :
+			version == 2 ? 1 : 2);
+	header->channels = mono ? 1 : 2;
+	if (layer == 1) {
+		header->samples = 384;
+		header->size = (12 * header->bitrate / header->samplerate + padding) *
+				4;
+	} else {
+		header->samples = layer == 3 && version != 3 ? 576 : 1152;
+		header->size = header->samples / 8 * header->bitrate /
+				header->samplerate + padding;
+	}
+	if (layer == 3) {
+		header->sideInfo = version == 3 ? (mono ? 17 : 32) : (mono ? 9 : 17);
+	}
+
+	return true;
+}
+
+/*	look for a xing/info or vbri tag
+ *	@param frame, starting with its header
+ *	@param bytes available
+ *	@param info
+ *	@return true if this frame is a tag
+ */
+bool BarMp3ParseInfo (const unsigned char *data, size_t size,
+		BarMp3Info_t *info) {
+	BarMp3Header_t header;
+	size_t pos;
+
+	memset (info, 0, sizeof (*info));
+	if (!BarMp3ParseHeader (data, size, &header)) {
+		return false;
+	}
+	if (header.size < size) {
+		size = header.size;
+	}
+
+	pos = 4 + header.sideInfo;
+	if (pos + 8 <= size && (memcmp (data + pos, "Xing", 4) == 0 ||
+			memcmp (data + pos, "Info", 4) == 0)) {
+		const unsigned long flags = BarMp3Get32 (data + pos + 4);
+
+		pos += 8;
+		if ((flags & 1) && pos + 4 <= size) {
+			info->frames = BarMp3Get32 (data + pos);
+			pos += 4;
+		}
+		if ((flags & 2) && pos + 4 <= size) {
+			info->bytes = BarMp3Get32 (data + pos);
+			pos += 4;
+		}
+		if ((flags & 4) && pos + 100 <= size) {
+			memcpy (info->toc, data + pos, sizeof (info->toc));
+			info->hasToc = true;
+			pos += 100;
+		}
+		if (flags & 8) {
+			/* quality */
+			pos += 4;
+		}
+		/* lame tag: encoder version, then 12 bits delay and padding each at
+		 * offset 21 */
+		if (pos + 24 <= size && memcmp (data + pos, "LAME", 4) == 0) {
+			info->delay = (data[pos+21] << 4) | (data[pos+22] >> 4);
+			info->padding = ((data[pos+22] & 0xf) << 8) | data[pos+23];
+		}
+		return true;
+	}
+
+	/* vbri always follows 32 bytes of side info */
+	pos = 4 + 32;
+	if (pos + 18 <= size && memcmp (data + pos, "VBRI", 4) == 0) {
+		info->bytes = BarMp3Get32 (data + pos + 10);
+		info->frames = BarMp3Get32 (data + pos + 14);
+		return true;
+	}
+
+	return false;
+}
+
+#ifdef TEST
+/* test cases for the header and tag parser */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*	test BarMp3ParseHeader
+ *	@param header bytes
+ *	@param expected result, the rest is ignored if false
+ */
+static void compareHeader (const char *name, const unsigned char bytes[4],
+		bool valid, unsigned int samplerate, unsigned int channels,
+		unsigned int bitrate, unsigned int samples, size_t size,
+		size_t sideInfo) {
+	BarMp3Header_t header;
+	const bool ret = BarMp3ParseHeader (bytes, 4, &header);
+
+	if (ret != valid || (valid && (header.samplerate != samplerate ||
+			header.channels != channels || header.bitrate != bitrate ||
+			header.samples != samples || header.size != size ||
+			header.sideInfo != sideInfo))) {
+		printf ("FAIL for header %s\n", name);
+	} else {
+		printf ("OK for header %s\n", name);
+	}
+}
+
+/* tag written into a frame */
+typedef struct {
+	const char *name;
+	unsigned char header[4];
+	/* "Xing", "Info" or "VBRI", NULL for none */
+	const char *tag;
+	size_t tagPos;
+	unsigned long flags, frames, bytes;
+	bool lame;
+	unsigned int delay, padding;
+	/* bytes passed to the parser */
+	size_t size;
+	/* expected result */
+	bool isTag, hasToc;
+	unsigned long expectFrames, expectBytes;
+} Mp3TagTest_t;
+
+static void put32 (unsigned char *data, unsigned long v) {
+	data[0] = v >> 24;
+	data[1] = v >> 16;
+	data[2] = v >> 8;
+	data[3] = v;
+}
+
+/*	test BarMp3ParseInfo on a frame built from t
+ */
+static void compareInfo (const Mp3TagTest_t *t) {
+	unsigned char frame[1024];
+	BarMp3Info_t info;
+	size_t pos = t->tagPos, i;
+	bool ret, ok;
+
+	memset (frame, 0, sizeof (frame));
+	memcpy (frame, t->header, sizeof (t->header));
+	if (t->tag != NULL) {
+		memcpy (frame + pos, t->tag, 4);
+	}
+	if (t->tag != NULL && strcmp (t->tag, "VBRI") == 0) {
+		put32 (frame + pos + 10, t->bytes);
+		put32 (frame + pos + 14, t->frames);
+	} else if (t->tag != NULL) {
+		put32 (frame + pos + 4, t->flags);
+		pos += 8;
+		if (t->flags & 1) {
+			put32 (frame + pos, t->frames);
+			pos += 4;
+		}
+		if (t->flags & 2) {
+			put32 (frame + pos, t->bytes);
+			pos += 4;
+		}
+		if (t->flags & 4) {
+			for (i = 0; i < 100; i++) {
+				frame[pos + i] = (unsigned char) (i * 2);
+			}
+			pos += 100;
+		}
+		if (t->flags & 8) {
+			pos += 4;
+		}
+		if (t->lame) {
+			memcpy (frame + pos, "LAME3.100", 9);
+			frame[pos + 21] = t->delay >> 4;
+			frame[pos + 22] = ((t->delay & 0xf) << 4) | (t->padding >> 8);
+			frame[pos + 23] = t->padding & 0xff;
+		}
+	}
+
+	ret = BarMp3ParseInfo (frame, t->size, &info);
+	ok = ret == t->isTag && info.frames == t->expectFrames &&
+			info.bytes == t->expectBytes && info.hasToc == t->hasToc &&
+			info.delay == (t->lame ? t->delay : 0) &&
+			info.padding == (t->lame ? t->padding : 0);
+	for (i = 0; ok && info.hasToc && i < 100; i++) {
+		ok = info.toc[i] == (unsigned char) (i * 2);
+	}
+	printf ("%s for tag %s\n", ok ? "OK" : "FAIL", t->name);
+}
+
+/*	test entry point
+ */
+int main () {
+	/* mpeg 1 layer III, 128 kbit/s, 44.1 kHz */
+	static const unsigned char stereo[] = {0xff, 0xfb, 0x90, 0x00},
+			mono[] = {0xff, 0xfb, 0x90, 0xc0},
+			padded[] = {0xff, 0xfb, 0x92, 0x00},
+			/* mpeg 2 layer III, 64 kbit/s, 22.05 kHz */
+			mpeg2[] = {0xff, 0xf3, 0x80, 0xc0},
+			/* mpeg 2.5 layer III, 8 kbit/s, 11.025 kHz */
+			mpeg25[] = {0xff, 0xe3, 0x10, 0x00},
+			/* mpeg 1 layer II, 192 kbit/s, 48 kHz */
+			layer2[] = {0xff, 0xfd, 0xa4, 0x00},
+			freeFormat[] = {0xff, 0xfb, 0x00, 0x00},
+			badBitrate[] = {0xff, 0xfb, 0xf0, 0x00},
+			badVersion[] = {0xff, 0xeb, 0x90, 0x00},
+			badSamplerate[] = {0xff, 0xfb, 0x9c, 0x00},
+			noSync[] = {0xff, 0x1b, 0x90, 0x00};
+	static const Mp3TagTest_t tags[] = {
+		{"xing", {0xff, 0xfb, 0x90, 0x00}, "Xing", 36, 0xf, 1000, 400000,
+				true, 576, 1234, 417, true, true, 1000, 400000},
+		{"info", {0xff, 0xfb, 0x90, 0x00}, "Info", 36, 0x3, 2000, 800000,
+				false, 0, 0, 417, true, false, 2000, 800000},
+		{"xing mono", {0xff, 0xfb, 0x90, 0xc0}, "Xing", 21, 0x5, 300, 0,
+				true, 1105, 0xfff, 417, true, true, 300, 0},
+		{"xing mpeg 2", {0xff, 0xf3, 0x80, 0xc0}, "Xing", 13, 0x7, 50, 9000,
+				false, 0, 0, 208, true, true, 50, 9000},
+		/* toc does not fit into the bytes passed */
+		{"xing truncated", {0xff, 0xfb, 0x90, 0x00}, "Xing", 36, 0x7, 10, 20,
+				false, 0, 0, 100, true, false, 10, 20},
+		{"vbri", {0xff, 0xfb, 0x90, 0x00}, "VBRI", 36, 0, 4000, 1600000,
+				false, 0, 0, 417, true, false, 4000, 1600000},
+		{"xing at wrong offset", {0xff, 0xfb, 0x90, 0x00}, "Xing", 21, 0x3, 1,
+				1, false, 0, 0, 417, false, false, 0, 0},
+		{"audio frame", {0xff, 0xfb, 0x90, 0x00}, NULL, 0, 0, 0, 0, false, 0,
+				0, 417, false, false, 0, 0},
+	};
+	size_t i;
+
+	compareHeader ("stereo", stereo, true, 44100, 2, 128000, 1152, 417, 32);
+	compareHeader ("mono", mono, true, 44100, 1, 128000, 1152, 417, 17);
+	compareHeader ("padded", padded, true, 44100, 2, 128000, 1152, 418, 32);
+	compareHeader ("mpeg 2", mpeg2, true, 22050, 1, 64000, 576, 208, 9);
+	compareHeader ("mpeg 2.5", mpeg25, true, 11025, 2, 8000, 576, 52, 17);
+	compareHeader ("layer II", layer2, true, 48000, 2, 192000, 1152, 576, 0);
+	compareHeader ("free format", freeFormat, false, 0, 0, 0, 0, 0, 0);
+	compareHeader ("bad bitrate", badBitrate, false, 0, 0, 0, 0, 0, 0);
+	compareHeader ("bad version", badVersion, false, 0, 0, 0, 0, 0, 0);
+	compareHeader ("bad samplerate", badSamplerate, false, 0, 0, 0, 0, 0, 0);
+	compareHeader ("no sync", noSync, false, 0, 0, 0, 0, 0, 0);
+
+	for (i = 0; i < sizeof (tags) / sizeof (*tags); i++) {
+		compareInfo (&tags[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
+#endif /* TEST */
@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _MP3_H
+#define _MP3_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* mpeg audio frame headers */
+
+typedef struct {
+	unsigned int samplerate, channels, bitrate;
+	/* samples per channel */
+	unsigned int samples;
+	/* bytes, including the header */
+	size_t size;
+	/* bytes between header and xing/info tag */
+	size_t sideInfo;
+} BarMp3Header_t;
+
+/* xing/info or vbri tag in the first frame, which carries no audio */
+typedef struct {
+	/* audio frames and bytes, 0 if unknown */
+	unsigned long frames, bytes;
+	/* encoder delay and padding in samples (lame) */
+	unsigned int delay, padding;
+	/* toc[i]: file position of i% of the duration in 1/256 of bytes */
+	bool hasToc;
+	unsigned char toc[100];
+} BarMp3Info_t;
+
+bool BarMp3ParseHeader (const unsigned char *, size_t, BarMp3Header_t *);
+bool BarMp3ParseInfo (const unsigned char *, size_t, BarMp3Info_t *);
+
+#endif /* _MP3_H */
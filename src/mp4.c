@@ -0,0 +1,887 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* iso base media file format (mp4) parser, just enough to find the samples
+ * of an aac track */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp4.h"
+
+/* tables of a trak box while it is parsed */
+typedef struct {
+	/* handler is "soun" */
+	bool audio;
+	unsigned char *config;
+	size_t configSize;
+	size_t samples;
+	uint32_t *sampleSize;
+	size_t chunks;
+	uint64_t *chunkOffset;
+	/* stsc: first chunk (counting from 1) and samples per chunk */
+	size_t runs;
+	uint32_t *run;
+	/* mdhd */
+	uint32_t timescale;
+	uint64_t duration;
+	/* stts */
+	size_t timeRuns;
+	uint32_t *timeRun;
+} BarMp4Trak_t;
+
+static uint32_t BarMp4Get32 (const unsigned char *data) {
+	return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 |
+			(uint32_t) data[2] << 8 | (uint32_t) data[3];
+}
+
+static uint64_t BarMp4Get64 (const unsigned char *data) {
+	return (uint64_t) BarMp4Get32 (data) << 32 | BarMp4Get32 (data + 4);
+}
+
+/*	parse box header
+ *	@param data
+ *	@param size of data
+ *	@param box
+ *	@return false if the header is incomplete
+ */
+bool BarMp4BoxHeader (const unsigned char *data, size_t size,
+		BarMp4Box_t *box) {
+	if (size < 8) {
+		return false;
+	}
+	box->size = BarMp4Get32 (data);
+	memcpy (box->type, data + 4, sizeof (box->type));
+	box->header = 8;
+	if (box->size == 1) {
+		/* 64 bit size follows */
+		if (size < 16) {
+			return false;
+		}
+		box->size = BarMp4Get64 (data + 8);
+		box->header = 16;
+	}
+	return true;
+}
+
+bool BarMp4BoxIs (const BarMp4Box_t *box, const char *type) {
+	return memcmp (box->type, type, sizeof (box->type)) == 0;
+}
+
+/*	read descriptor tag and length (esds)
+ *	@param data
+ *	@param size of data
+ *	@param tag
+ *	@param body length, fits into data
+ *	@return header size, 0 if invalid
+ */
+static size_t BarMp4Descriptor (const unsigned char *data, size_t size,
+		unsigned char *tag, size_t *length) {
+	size_t i, len = 0;
+
+	if (size < 2) {
+		return 0;
+	}
+	*tag = data[0];
+	/* up to four bytes, seven bits each */
+	for (i = 1; i < size && i <= 4; i++) {
+		len = (len << 7) | (data[i] & 0x7f);
+		if ((data[i] & 0x80) == 0) {
+			if (len > size - i - 1) {
+				return 0;
+			}
+			*length = len;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+/*	find the decoder setup in an esds box
+ */
+static bool BarMp4ParseEsds (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak) {
+	unsigned char tag, flags;
+	size_t header, length, skip;
+
+	/* version, flags */
+	if (size < 4) {
+		return false;
+	}
+	data += 4;
+	size -= 4;
+
+	/* ES_Descriptor: id, flags and optional fields */
+	if ((header = BarMp4Descriptor (data, size, &tag, &length)) == 0 ||
+			tag != 0x03 || length < 3) {
+		return false;
+	}
+	data += header;
+	size = length;
+	flags = data[2];
+	skip = 3;
+	if (flags & 0x80) {
+		/* depends on stream */
+		skip += 2;
+	}
+	if (flags & 0x40) {
+		/* url */
+		if (skip >= size) {
+			return false;
+		}
+		skip += 1 + data[skip];
+	}
+	if (flags & 0x20) {
+		/* ocr stream */
+		skip += 2;
+	}
+	if (skip > size) {
+		return false;
+	}
+	data += skip;
+	size -= skip;
+
+	/* DecoderConfigDescriptor: object type, stream type, buffer size,
+	 * bitrates */
+	if ((header = BarMp4Descriptor (data, size, &tag, &length)) == 0 ||
+			tag != 0x04 || length < 13) {
+		return false;
+	}
+	data += header + 13;
+	size = length - 13;
+
+	/* DecoderSpecificInfo */
+	if ((header = BarMp4Descriptor (data, size, &tag, &length)) == 0 ||
+			tag != 0x05 || length == 0) {
+		return false;
+	}
+	free (trak->config);
+	if ((trak->config = malloc (length)) == NULL) {
+		return false;
+	}
+	memcpy (trak->config, data + header, length);
+	trak->configSize = length;
+
+	return true;
+}
+
+static bool BarMp4ParseBoxes (const unsigned char *, size_t, BarMp4Trak_t *);
+
+/*	sample descriptions, only the first one is used
+ */
+static bool BarMp4ParseStsd (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak) {
+	BarMp4Box_t entry;
+	size_t skip;
+
+	/* version, flags, entry count */
+	if (size < 8) {
+		return false;
+	}
+	data += 8;
+	size -= 8;
+
+	if (!BarMp4BoxHeader (data, size, &entry) || entry.size > size ||
+			entry.size < entry.header + 28) {
+		return false;
+	}
+	if (!BarMp4BoxIs (&entry, "mp4a")) {
+		/* not aac, the track is skipped */
+		return true;
+	}
+	/* AudioSampleEntry, quicktime's version 1 and 2 are longer */
+	skip = entry.header + 28;
+	switch ((data[entry.header + 8] << 8) | data[entry.header + 9]) {
+		case 1:
+			skip += 16;
+			break;
+
+		case 2:
+			skip += 36;
+			break;
+	}
+	if (skip > entry.size) {
+		return false;
+	}
+	return BarMp4ParseBoxes (data + skip, (size_t) entry.size - skip, trak);
+}
+
+/*	sample sizes
+ */
+static bool BarMp4ParseStsz (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak) {
+	uint32_t fixed;
+	size_t i, count;
+
+	/* version, flags, sample size, sample count */
+	if (size < 12) {
+		return false;
+	}
+	fixed = BarMp4Get32 (data + 4);
+	count = BarMp4Get32 (data + 8);
+	if ((fixed == 0 && count > (size - 12) / 4) ||
+			count > BAR_MP4_SAMPLES_MAX) {
+		return false;
+	}
+
+	free (trak->sampleSize);
+	if ((trak->sampleSize = malloc (count * sizeof (*trak->sampleSize) +
+			1)) == NULL) {
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		trak->sampleSize[i] = fixed != 0 ? fixed :
+				BarMp4Get32 (data + 12 + 4 * i);
+	}
+	trak->samples = count;
+
+	return true;
+}
+
+/*	samples per chunk
+ */
+static bool BarMp4ParseStsc (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak) {
+	size_t i, count;
+
+	/* version, flags, entry count */
+	if (size < 8) {
+		return false;
+	}
+	count = BarMp4Get32 (data + 4);
+	if (count > (size - 8) / 12) {
+		return false;
+	}
+
+	free (trak->run);
+	if ((trak->run = malloc (2 * count * sizeof (*trak->run) + 1)) == NULL) {
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		/* first chunk, samples per chunk, sample description */
+		trak->run[2*i] = BarMp4Get32 (data + 8 + 12 * i);
+		trak->run[2*i+1] = BarMp4Get32 (data + 8 + 12 * i + 4);
+	}
+	trak->runs = count;
+
+	return true;
+}
+
+/*	sample durations
+ */
+static bool BarMp4ParseStts (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak) {
+	size_t i, count;
+
+	/* version, flags, entry count */
+	if (size < 8) {
+		return false;
+	}
+	count = BarMp4Get32 (data + 4);
+	if (count > (size - 8) / 8) {
+		return false;
+	}
+
+	free (trak->timeRun);
+	if ((trak->timeRun = malloc (2 * count * sizeof (*trak->timeRun) +
+			1)) == NULL) {
+		return false;
+	}
+	for (i = 0; i < 2 * count; i++) {
+		/* sample count, sample duration */
+		trak->timeRun[i] = BarMp4Get32 (data + 8 + 4 * i);
+	}
+	trak->timeRuns = count;
+
+	return true;
+}
+
+/*	media header: timescale and duration
+ */
+static bool BarMp4ParseMdhd (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak) {
+	/* version, flags, creation and modification time (32 or 64 bit) */
+	if (size >= 24 && data[0] == 0) {
+		trak->timescale = BarMp4Get32 (data + 12);
+		trak->duration = BarMp4Get32 (data + 16);
+	} else if (size >= 36 && data[0] == 1) {
+		trak->timescale = BarMp4Get32 (data + 20);
+		trak->duration = BarMp4Get64 (data + 24);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/*	chunk offsets, 32 (stco) or 64 bit (co64)
+ */
+static bool BarMp4ParseStco (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak, const size_t width) {
+	size_t i, count;
+
+	/* version, flags, entry count */
+	if (size < 8) {
+		return false;
+	}
+	count = BarMp4Get32 (data + 4);
+	if (count > (size - 8) / width) {
+		return false;
+	}
+
+	free (trak->chunkOffset);
+	if ((trak->chunkOffset = malloc (count * sizeof (*trak->chunkOffset) +
+			1)) == NULL) {
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		trak->chunkOffset[i] = width == 8 ? BarMp4Get64 (data + 8 + 8 * i) :
+				BarMp4Get32 (data + 8 + 4 * i);
+	}
+	trak->chunks = count;
+
+	return true;
+}
+
+/*	walk boxes, descending into those on the way to the sample tables
+ *	@param data
+ *	@param size of data
+ *	@param tables found so far
+ *	@return false if a box is broken
+ */
+static bool BarMp4ParseBoxes (const unsigned char *data, size_t size,
+		BarMp4Trak_t *trak) {
+	while (size > 0) {
+		BarMp4Box_t box;
+		const unsigned char *body;
+		size_t bodySize;
+		bool ok = true;
+
+		if (!BarMp4BoxHeader (data, size, &box)) {
+			return false;
+		}
+		if (box.size == 0) {
+			/* up to the end of its parent */
+			box.size = size;
+		}
+		if (box.size < box.header || box.size > size) {
+			return false;
+		}
+		body = data + box.header;
+		bodySize = (size_t) box.size - box.header;
+
+		if (BarMp4BoxIs (&box, "mdia") || BarMp4BoxIs (&box, "minf") ||
+				BarMp4BoxIs (&box, "stbl") || BarMp4BoxIs (&box, "wave")) {
+			ok = BarMp4ParseBoxes (body, bodySize, trak);
+		} else if (BarMp4BoxIs (&box, "mdhd")) {
+			ok = BarMp4ParseMdhd (body, bodySize, trak);
+		} else if (BarMp4BoxIs (&box, "hdlr")) {
+			/* version, flags, pre-defined, handler type */
+			trak->audio = bodySize >= 12 &&
+					memcmp (body + 8, "soun", 4) == 0;
+		} else if (BarMp4BoxIs (&box, "stsd")) {
+			ok = BarMp4ParseStsd (body, bodySize, trak);
+		} else if (BarMp4BoxIs (&box, "esds")) {
+			ok = BarMp4ParseEsds (body, bodySize, trak);
+		} else if (BarMp4BoxIs (&box, "stts")) {
+			ok = BarMp4ParseStts (body, bodySize, trak);
+		} else if (BarMp4BoxIs (&box, "stsz")) {
+			ok = BarMp4ParseStsz (body, bodySize, trak);
+		} else if (BarMp4BoxIs (&box, "stsc")) {
+			ok = BarMp4ParseStsc (body, bodySize, trak);
+		} else if (BarMp4BoxIs (&box, "stco")) {
+			ok = BarMp4ParseStco (body, bodySize, trak, 4);
+		} else if (BarMp4BoxIs (&box, "co64")) {
+			ok = BarMp4ParseStco (body, bodySize, trak, 8);
+		}
+		if (!ok) {
+			return false;
+		}
+
+		data += box.size;
+		size -= (size_t) box.size;
+	}
+
+	return true;
+}
+
+static void BarMp4TrakFree (BarMp4Trak_t *trak) {
+	free (trak->config);
+	free (trak->sampleSize);
+	free (trak->chunkOffset);
+	free (trak->run);
+	free (trak->timeRun);
+	memset (trak, 0, sizeof (*trak));
+}
+
+/*	compute each sample's file offset: chunks contain runs of samples
+ *	@param parsed trak, its config and sample sizes are moved to track
+ *	@param track
+ *	@return false if tables are missing or out of memory
+ */
+static bool BarMp4BuildTrack (BarMp4Trak_t *trak, BarMp4Track_t *track) {
+	size_t chunk, run = 0, sample = 0, i;
+
+	if (!trak->audio || trak->config == NULL || trak->samples == 0 ||
+			trak->runs == 0 || trak->timescale == 0) {
+		return false;
+	}
+
+	memset (track, 0, sizeof (*track));
+	if ((track->sampleOffset = malloc (trak->samples *
+			sizeof (*track->sampleOffset))) == NULL) {
+		return false;
+	}
+	for (chunk = 0; chunk < trak->chunks && sample < trak->samples; chunk++) {
+		uint64_t offset = trak->chunkOffset[chunk];
+
+		/* runs are sorted by their first chunk */
+		while (run + 1 < trak->runs && trak->run[2*(run+1)] <= chunk + 1) {
+			++run;
+		}
+		for (i = 0; i < trak->run[2*run+1] && sample < trak->samples; i++) {
+			track->sampleOffset[sample] = offset;
+			offset += trak->sampleSize[sample];
+			++sample;
+		}
+	}
+
+	/* samples without a chunk are lost */
+	if (sample == 0) {
+		return false;
+	}
+	track->samples = sample;
+	track->sampleSize = trak->sampleSize;
+	trak->sampleSize = NULL;
+	track->config = trak->config;
+	track->configSize = trak->configSize;
+	trak->config = NULL;
+	track->timeRun = trak->timeRun;
+	track->timeRuns = trak->timeRuns;
+	trak->timeRun = NULL;
+
+	/* stts is exact, mdhd's duration may include edits */
+	track->timescale = trak->timescale;
+	track->duration = 0;
+	for (i = 0; i < track->timeRuns; i++) {
+		track->duration += (uint64_t) track->timeRun[2*i] *
+				track->timeRun[2*i+1];
+	}
+	if (track->duration == 0) {
+		track->duration = trak->duration;
+	}
+
+	return true;
+}
+
+/*	find the first aac track in a moov box
+ *	@param box body
+ *	@param its size
+ *	@param track, BarMp4TrackFree it
+ *	@return false if there is none
+ */
+bool BarMp4ParseMoov (const unsigned char *data, size_t size,
+		BarMp4Track_t *track) {
+	memset (track, 0, sizeof (*track));
+
+	while (size > 0) {
+		BarMp4Box_t box;
+
+		if (!BarMp4BoxHeader (data, size, &box)) {
+			return false;
+		}
+		if (box.size == 0) {
+			box.size = size;
+		}
+		if (box.size < box.header || box.size > size) {
+			return false;
+		}
+
+		if (BarMp4BoxIs (&box, "trak")) {
+			BarMp4Trak_t trak;
+			bool found;
+
+			memset (&trak, 0, sizeof (trak));
+			found = BarMp4ParseBoxes (data + box.header,
+					(size_t) box.size - box.header, &trak) &&
+					BarMp4BuildTrack (&trak, track);
+			BarMp4TrakFree (&trak);
+			if (found) {
+				return true;
+			}
+			BarMp4TrackFree (track);
+		}
+
+		data += box.size;
+		size -= (size_t) box.size;
+	}
+
+	return false;
+}
+
+/*	find the sample playing at a time
+ *	@param track
+ *	@param time in the track's timescale
+ *	@param set to the sample's start time
+ *	@return sample index, track->samples if time is beyond the end
+ */
+size_t BarMp4SampleAt (const BarMp4Track_t *track, const uint64_t time,
+		uint64_t *start) {
+	uint64_t runStart = 0;
+	size_t sample = 0, i;
+
+	if (track->timeRuns == 0) {
+		/* no stts, assume samples of equal duration */
+		if (track->duration == 0 || time >= track->duration) {
+			*start = track->duration;
+			return track->samples;
+		}
+		sample = time * track->samples / track->duration;
+		*start = sample * track->duration / track->samples;
+		return sample;
+	}
+
+	for (i = 0; i < track->timeRuns; i++) {
+		const uint32_t count = track->timeRun[2*i],
+				delta = track->timeRun[2*i+1];
+		const uint64_t runEnd = runStart + (uint64_t) count * delta;
+
+		if (time < runEnd) {
+			sample += (size_t) ((time - runStart) / delta);
+			*start = runStart + (time - runStart) / delta * delta;
+			return sample < track->samples ? sample : track->samples;
+		}
+		runStart = runEnd;
+		sample += count;
+	}
+
+	*start = runStart;
+	return track->samples;
+}
+
+void BarMp4TrackFree (BarMp4Track_t *track) {
+	free (track->config);
+	free (track->sampleSize);
+	free (track->sampleOffset);
+	free (track->timeRun);
+	memset (track, 0, sizeof (*track));
+}
+
+#ifdef TEST
+/* test cases for the moov parser */
+
+#include <stdio.h>
+
+/* moov built by the test */
+typedef struct {
+	unsigned char data[4096];
+	size_t size;
+} Mp4Writer_t;
+
+static void put8 (Mp4Writer_t *w, unsigned int v) {
+	w->data[w->size++] = v;
+}
+
+static void put32 (Mp4Writer_t *w, uint32_t v) {
+	put8 (w, v >> 24);
+	put8 (w, (v >> 16) & 0xff);
+	put8 (w, (v >> 8) & 0xff);
+	put8 (w, v & 0xff);
+}
+
+/*	start a box, its size is set by boxEnd
+ *	@return box offset
+ */
+static size_t boxBegin (Mp4Writer_t *w, const char *type) {
+	const size_t start = w->size;
+
+	put32 (w, 0);
+	memcpy (w->data + w->size, type, 4);
+	w->size += 4;
+	return start;
+}
+
+static void boxEnd (Mp4Writer_t *w, size_t start) {
+	const size_t size = w->size;
+
+	w->size = start;
+	put32 (w, size - start);
+	w->size = size;
+}
+
+/* sample tables of a test track, lists end with 0 */
+typedef struct {
+	const char *name;
+	const char *handler;
+	uint32_t timescale;
+	/* sample size, 0 for the sizes list */
+	uint32_t fixed, count;
+	uint32_t sizes[8];
+	/* first chunk, samples per chunk */
+	uint32_t runs[8];
+	uint32_t chunks[8];
+	/* sample count, sample duration */
+	uint32_t times[8];
+	/* expected result */
+	bool found;
+	size_t samples;
+	uint64_t offsets[8];
+	uint64_t duration;
+} Mp4MoovTest_t;
+
+static size_t listLength (const uint32_t *list, size_t max) {
+	size_t n = 0;
+
+	while (n < max && list[n] != 0) {
+		++n;
+	}
+	return n;
+}
+
+/*	write moov with a single trak for t
+ */
+static void buildMoov (Mp4Writer_t *w, const Mp4MoovTest_t *t) {
+	static const unsigned char esds[] = {
+		/* ES_Descriptor, id, flags */
+		0x03, 0x19, 0x00, 0x01, 0x00,
+		/* DecoderConfigDescriptor: aac, audio stream */
+		0x04, 0x11, 0x40, 0x15, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		/* DecoderSpecificInfo: aac lc, 44.1 kHz, stereo */
+		0x05, 0x02, 0x12, 0x10,
+		/* SLConfigDescriptor */
+		0x06, 0x01, 0x02,
+	};
+	size_t moov, trak, mdia, minf, stbl, stsd, entry, box, i, n;
+
+	w->size = 0;
+	moov = boxBegin (w, "moov");
+	box = boxBegin (w, "mvhd");
+	for (i = 0; i < 25; i++) {
+		put32 (w, 0);
+	}
+	boxEnd (w, box);
+	trak = boxBegin (w, "trak");
+	mdia = boxBegin (w, "mdia");
+
+	box = boxBegin (w, "mdhd");
+	put32 (w, 0);
+	put32 (w, 0);
+	put32 (w, 0);
+	put32 (w, t->timescale);
+	/* duration, stts overrides it */
+	put32 (w, 12345);
+	put32 (w, 0);
+	boxEnd (w, box);
+
+	box = boxBegin (w, "hdlr");
+	put32 (w, 0);
+	put32 (w, 0);
+	memcpy (w->data + w->size, t->handler, 4);
+	w->size += 4;
+	put32 (w, 0);
+	put32 (w, 0);
+	put32 (w, 0);
+	put8 (w, 0);
+	boxEnd (w, box);
+
+	minf = boxBegin (w, "minf");
+	stbl = boxBegin (w, "stbl");
+
+	stsd = boxBegin (w, "stsd");
+	put32 (w, 0);
+	put32 (w, 1);
+	entry = boxBegin (w, "mp4a");
+	/* reserved, data reference, version 0 sample entry */
+	for (i = 0; i < 7; i++) {
+		put32 (w, 0);
+	}
+	box = boxBegin (w, "esds");
+	put32 (w, 0);
+	memcpy (w->data + w->size, esds, sizeof (esds));
+	w->size += sizeof (esds);
+	boxEnd (w, box);
+	boxEnd (w, entry);
+	boxEnd (w, stsd);
+
+	n = listLength (t->times, 8) / 2;
+	if (n > 0) {
+		box = boxBegin (w, "stts");
+		put32 (w, 0);
+		put32 (w, n);
+		for (i = 0; i < 2 * n; i++) {
+			put32 (w, t->times[i]);
+		}
+		boxEnd (w, box);
+	}
+
+	box = boxBegin (w, "stsz");
+	put32 (w, 0);
+	put32 (w, t->fixed);
+	put32 (w, t->count);
+	for (i = 0; t->fixed == 0 && i < t->count; i++) {
+		put32 (w, t->sizes[i]);
+	}
+	boxEnd (w, box);
+
+	n = listLength (t->runs, 8) / 2;
+	if (n > 0) {
+		box = boxBegin (w, "stsc");
+		put32 (w, 0);
+		put32 (w, n);
+		for (i = 0; i < n; i++) {
+			put32 (w, t->runs[2*i]);
+			put32 (w, t->runs[2*i+1]);
+			/* sample description */
+			put32 (w, 1);
+		}
+		boxEnd (w, box);
+	}
+
+	n = listLength (t->chunks, 8);
+	box = boxBegin (w, "stco");
+	put32 (w, 0);
+	put32 (w, n);
+	for (i = 0; i < n; i++) {
+		put32 (w, t->chunks[i]);
+	}
+	boxEnd (w, box);
+
+	boxEnd (w, stbl);
+	boxEnd (w, minf);
+	boxEnd (w, mdia);
+	boxEnd (w, trak);
+	boxEnd (w, moov);
+}
+
+/*	test BarMp4ParseMoov
+ */
+static void compareMoov (const Mp4MoovTest_t *t) {
+	Mp4Writer_t w;
+	BarMp4Box_t moov;
+	BarMp4Track_t track;
+	bool ok;
+	size_t i;
+
+	buildMoov (&w, t);
+	ok = BarMp4BoxHeader (w.data, w.size, &moov) &&
+			BarMp4BoxIs (&moov, "moov") &&
+			BarMp4ParseMoov (w.data + moov.header, w.size - moov.header,
+			&track) == t->found;
+	if (ok && t->found) {
+		ok = track.samples == t->samples && track.duration == t->duration &&
+				track.timescale == t->timescale && track.configSize == 2 &&
+				track.config[0] == 0x12 && track.config[1] == 0x10;
+		for (i = 0; ok && i < t->samples; i++) {
+			ok = track.sampleOffset[i] == t->offsets[i] &&
+					track.sampleSize[i] == (t->fixed != 0 ? t->fixed :
+					t->sizes[i]);
+		}
+	}
+	printf ("%s for moov %s\n", ok ? "OK" : "FAIL", t->name);
+	BarMp4TrackFree (&track);
+}
+
+/* stts runs of a test track */
+typedef struct {
+	const char *name;
+	uint32_t times[6];
+	size_t samples;
+	uint64_t duration;
+	/* query and expected result */
+	uint64_t time;
+	size_t sample;
+	uint64_t start;
+} Mp4SampleAtTest_t;
+
+/*	test BarMp4SampleAt
+ */
+static void compareSampleAt (const Mp4SampleAtTest_t *t) {
+	BarMp4Track_t track;
+	uint32_t times[6];
+	uint64_t start = 0;
+	size_t sample;
+
+	memset (&track, 0, sizeof (track));
+	memcpy (times, t->times, sizeof (times));
+	track.timeRun = times;
+	track.timeRuns = listLength (times, 6) / 2;
+	track.samples = t->samples;
+	track.duration = t->duration;
+	sample = BarMp4SampleAt (&track, t->time, &start);
+	if (sample != t->sample || start != t->start) {
+		printf ("FAIL for sample at %s: %zu at %llu\n", t->name, sample,
+				(unsigned long long) start);
+	} else {
+		printf ("OK for sample at %s\n", t->name);
+	}
+}
+
+/*	test entry point
+ */
+int main () {
+	static const Mp4MoovTest_t moovs[] = {
+		/* chunk 1 holds one sample, chunk 2 three and chunk 3 one */
+		{"stsc runs", "soun", 44100, 0, 5, {10, 20, 30, 40, 50},
+				{1, 1, 2, 3, 3, 1}, {1000, 2000, 3000}, {5, 1024}, true, 5,
+				{1000, 2000, 2020, 2050, 3000}, 5120},
+		{"fixed size", "soun", 48000, 100, 6, {0}, {1, 3}, {500, 900},
+				{4, 1024, 2, 512}, true, 6, {500, 600, 700, 900, 1000, 1100},
+				5120},
+		/* samples without a chunk are dropped */
+		{"short chunk table", "soun", 44100, 10, 10, {0}, {1, 4}, {64}, {0},
+				true, 4, {64, 74, 84, 94}, 12345},
+		{"no stsc", "soun", 44100, 10, 2, {0}, {0}, {64}, {2, 1024}, false, 0,
+				{0}, 0},
+		{"not audio", "vide", 44100, 10, 2, {0}, {1, 2}, {64}, {2, 1024},
+				false, 0, {0}, 0},
+		/* a fixed sample size does not bound the count */
+		{"huge sample count", "soun", 44100, 10, 0xffffffff, {0}, {1, 2},
+				{64}, {2, 1024}, false, 0, {0}, 0},
+		{"sample count at limit", "soun", 44100, 10, BAR_MP4_SAMPLES_MAX,
+				{0}, {1, 2}, {64}, {2, 1024}, true, 2, {64, 74}, 2048},
+	};
+	static const Mp4SampleAtTest_t sampleAt[] = {
+		{"start", {3, 1024, 2, 2048}, 5, 0, 0, 0, 0},
+		{"within first sample", {3, 1024, 2, 2048}, 5, 0, 1023, 0, 0},
+		{"first run", {3, 1024, 2, 2048}, 5, 0, 1024, 1, 1024},
+		{"second run", {3, 1024, 2, 2048}, 5, 0, 3072, 3, 3072},
+		{"end of second run", {3, 1024, 2, 2048}, 5, 0, 5119, 3, 3072},
+		{"last sample", {3, 1024, 2, 2048}, 5, 0, 5120, 4, 5120},
+		{"past the end", {3, 1024, 2, 2048}, 5, 0, 7168, 5, 7168},
+		/* stts lists more samples than there are */
+		{"beyond samples", {10, 100}, 5, 0, 700, 5, 700},
+		/* no stts, equal durations */
+		{"no stts", {0}, 10, 1000, 450, 4, 400},
+		{"no stts past the end", {0}, 10, 1000, 1000, 10, 1000},
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof (moovs) / sizeof (*moovs); i++) {
+		compareMoov (&moovs[i]);
+	}
+	for (i = 0; i < sizeof (sampleAt) / sizeof (*sampleAt); i++) {
+		compareSampleAt (&sampleAt[i]);
+	}
+
+	return EXIT_SUCCESS;
+}
+#endif /* TEST */
@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _MP4_H
+#define _MP4_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* iso base media file format (mp4) parser */
+
+/* upper limit for the number of samples in a track, a fixed sample size
+ * does not bound it by the size of the stsz box */
+#define BAR_MP4_SAMPLES_MAX (4*1024*1024)
+
+/* box header */
+typedef struct {
+	char type[4];
+	/* including the header; 0 if the box extends to the end of the file */
+	uint64_t size;
+	/* header size */
+	size_t header;
+} BarMp4Box_t;
+
+/* audio track found in a moov box */
+typedef struct {
+	/* decoder setup (AudioSpecificConfig) */
+	unsigned char *config;
+	size_t configSize;
+	/* size and file offset of each sample (aac frame) */
+	size_t samples;
+	uint32_t *sampleSize;
+	uint64_t *sampleOffset;
+	/* units per second of the track's times */
+	uint32_t timescale;
+	uint64_t duration;
+	/* stts: sample count and duration of runs of samples */
+	size_t timeRuns;
+	uint32_t *timeRun;
+} BarMp4Track_t;
+
+bool BarMp4BoxHeader (const unsigned char *, size_t, BarMp4Box_t *);
+bool BarMp4BoxIs (const BarMp4Box_t *, const char *);
+bool BarMp4ParseMoov (const unsigned char *, size_t, BarMp4Track_t *);
+size_t BarMp4SampleAt (const BarMp4Track_t *, uint64_t, uint64_t *);
+void BarMp4TrackFree (BarMp4Track_t *);
+
+#endif /* _MP4_H */
@@ -24,16 +24,14 @@ THE SOFTWARE.
 /* receive/play audio stream */
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <stdint.h>
 #include <limits.h>
 #include <assert.h>
 #include <stdio.h>
-
-#ifndef _WIN32
-#include <arpa/inet.h>
-#endif
+#include <errno.h>
 
 #include "player.h"
 #include "config.h"
@@ -47,8 +45,6 @@ THE SOFTWARE.
 #endif
 
 
-#define bigToHostEndian32(x) ntohl(x)
-
 /* pandora uses float values with 2 digits precision. Scale them by 100 to get
  * a "nice" integer */
 #define RG_SCALE_FACTOR 100
@@ -77,6 +73,141 @@ static bool BarPlayerCheckPauseQuit (struct audioPlayer *player) {
 	return quit;
 }
 
+/*	check the quit flag without waiting for the pause flag
+ *	@param player structure
+ *	@return true if the player should quit
+ */
+static bool BarPlayerCheckQuit (struct audioPlayer *player) {
+	bool quit;
+
+	pthread_mutex_lock (&player->pauseMutex);
+	quit = player->doQuit;
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	return quit;
+}
+
+/*	stop all player threads, used on errors
+ *	@param player structure
+ */
+static void BarPlayerAbort (struct audioPlayer *player) {
+	pthread_mutex_lock (&player->pauseMutex);
+	player->doQuit = true;
+	pthread_cond_broadcast (&player->pauseCond);
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	WaitressCancel (&player->cancel);
+}
+
+/*	wake up threads waiting for a ring, call after every ring change. The
+ *	fence pairs with the one in BarPlayerRingWait: either the waiter sees
+ *	the change or we see the waiter.
+ *	@param player structure
+ */
+static void BarPlayerRingNotify (struct audioPlayer *player) {
+	BarAtomicFence ();
+	if (BarAtomicLoad (&player->ringWaiters) > 0) {
+		pthread_mutex_lock (&player->pauseMutex);
+		pthread_cond_broadcast (&player->pauseCond);
+		pthread_mutex_unlock (&player->pauseMutex);
+	}
+}
+
+/*	wait until a ring has data/space
+ *	@param player structure
+ *	@param condition, checked without holding a lock
+ *	@return true if the player should quit
+ */
+static bool BarPlayerRingWait (struct audioPlayer *player,
+		bool (*ready) (const struct audioPlayer *)) {
+	bool quit;
+
+	if (ready (player)) {
+		return false;
+	}
+
+	pthread_mutex_lock (&player->pauseMutex);
+	BarAtomicStore (&player->ringWaiters, player->ringWaiters + 1);
+	BarAtomicFence ();
+	while (!player->doQuit && !ready (player)) {
+		pthread_cond_wait (&player->pauseCond, &player->pauseMutex);
+	}
+	BarAtomicStore (&player->ringWaiters, player->ringWaiters - 1);
+	quit = player->doQuit;
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	return quit;
+}
+
+/* ring conditions for BarPlayerRingWait */
+static bool BarPlayerInputSpace (const struct audioPlayer *player) {
+	/* the decoder wants data from elsewhere */
+	return BarRingFill (&player->input) <= player->inputLow ||
+			BarAtomicLoad (&player->seekPending);
+}
+
+static bool BarPlayerInputData (const struct audioPlayer *player) {
+	return BarRingFill (&player->input) > 0 ||
+			BarAtomicLoad (&player->input.eof) ||
+			BarAtomicLoad (&player->doSeek);
+}
+
+static bool BarPlayerPcmSpace (const struct audioPlayer *player) {
+	/* the decoder has to seek, even if the output is paused */
+	return BarRingSpace (&player->pcm) >= player->pcmWanted ||
+			BarAtomicLoad (&player->doSeek);
+}
+
+static bool BarPlayerPcmData (const struct audioPlayer *player) {
+	return BarRingFill (&player->pcm) > 0 || BarAtomicLoad (&player->pcm.eof);
+}
+
+/*	wait before the download is resumed, unless the player is told to quit
+ *	or the decoder wants another part of the file
+ *	@param player structure
+ *	@param milliseconds
+ *	@return true if the player should quit or seek
+ */
+static bool BarPlayerBackoff (struct audioPlayer *player, const int delay) {
+	struct timespec deadline;
+	bool quit;
+
+	WaitressCondDeadline (&deadline, delay);
+
+	pthread_mutex_lock (&player->pauseMutex);
+	while (!player->doQuit && !player->seekPending &&
+			pthread_cond_timedwait (&player->pauseCond, &player->pauseMutex,
+			&deadline) != ETIMEDOUT);
+	quit = player->doQuit || player->seekPending;
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	return quit;
+}
+
+/*	should an interrupted download be resumed? downloads that made no
+ *	progress are retried with the handle's backoff, up to its attempt limit
+ *	@param player structure
+ *	@param result of the last download
+ *	@param downloads without progress in a row
+ *	@return true if the download should be resumed
+ */
+static bool BarPlayerResume (struct audioPlayer *player,
+		const WaitressReturn_t wRet, const unsigned int stalled) {
+	if (wRet != WAITRESS_RET_PARTIAL_FILE && wRet != WAITRESS_RET_TIMEOUT &&
+			wRet != WAITRESS_RET_READ_ERR &&
+			wRet != WAITRESS_RET_CONNECTION_CLOSED) {
+		return false;
+	}
+	if (stalled == 0) {
+		return true;
+	}
+	if (stalled >= player->waith.retry.maxAttempts) {
+		return false;
+	}
+	return !BarPlayerBackoff (player,
+			WaitressRetryDelay (&player->waith.retry, stalled));
+}
+
 /*	compute replaygain scale factor
  *	algo taken from here: http://www.dsprelated.com/showmessage/29246/1.php
  *	mpd does the same
@@ -105,233 +236,367 @@ static INLINE signed short int applyReplayGain (const signed short int value,
 	}
 }
 
-/*	Refill player's buffer with dataSize of data
+/*	limit download rate to a multiple of the song's bitrate, once its duration
+ *	is known
+ *	@param player structure
+ */
+static void BarPlayerLimitRate (struct audioPlayer *player) {
+	const unsigned int factor = player->settings->downloadRateFactor;
+	unsigned long long int byteRate;
+
+	if (factor == 0 || player->songDuration == 0) {
+		return;
+	}
+	byteRate = (unsigned long long int) BarAtomicLoad (&player->fileSize) *
+			BAR_PLAYER_MS_TO_S_FACTOR / player->songDuration;
+	WaitressRateLimitSet (&player->rateLimit, factor * byteRate,
+			BAR_PLAYER_RATE_BURST * byteRate);
+}
+
+/*	Refill player's buffer with downloaded data, up to bufferWant bytes
  *	@param player structure
- *	@param new data
- *	@param data size
- *	@return 1 on success, 0 when buffer overflow occured
- */
-static INLINE int BarPlayerBufferFill (struct audioPlayer *player,
-		const char *data, const size_t dataSize) {
-	/* fill buffer */
-	if (player->bufferFilled + dataSize > BAR_PLAYER_BUFSIZE) {
-		BarUiMsg (player->settings, MSG_ERR, "Buffer overflow!\n");
-		return 0;
-	}
-	memcpy (player->buffer+player->bufferFilled, data, dataSize);
-	player->bufferFilled += dataSize;
+ *	@return false if out of memory
+ */
+static bool BarPlayerBufferFill (struct audioPlayer *player) {
+	BarBuffer_t * const buffer = &player->decodeBuffer;
+
+	while (BarBufferFill (buffer) < player->bufferWant) {
+		unsigned char *data;
+		size_t size = BarBufferReserve (buffer, &data);
+
+		if (size == 0) {
+			BarUiMsg (player->settings, MSG_ERR, "Out of memory\n");
+			return false;
+		}
+		if (size > player->bufferWant - BarBufferFill (buffer)) {
+			size = player->bufferWant - BarBufferFill (buffer);
+		}
+		if ((size = BarRingRead (&player->input, data, size)) == 0) {
+			break;
+		}
+		BarBufferCommit (buffer, size);
+	}
+	BarPlayerRingNotify (player);
+
+	/* decoders see buffered data as one block */
+	player->bufferFilled = BarBufferView (buffer, &player->buffer);
 	player->bufferRead = 0;
-	player->bytesReceived += dataSize;
-	return 1;
+
+	return true;
+}
+
+/*	drop data read by the decoder from player's buffer
+ *	@param player structure
+ */
+static void BarPlayerBufferSkip (struct audioPlayer *player) {
+	BarBufferSkip (&player->decodeBuffer, player->bufferRead);
+	player->bufferOffset += player->bufferRead;
+	if (player->bufferRead == 0 && !player->seekWanted &&
+			player->bufferFilled >= player->bufferWant) {
+		/* decoder needs more data than fits, it can have it */
+		player->bufferWant *= 2;
+	}
+}
+
+/*	move the decoder's view to a file offset. Data up to there is dropped,
+ *	unless the offset is far ahead or behind: then the download is restarted
+ *	there by BarPlayerSeekInput once the decoder returns.
+ *	@param player structure
+ *	@param file offset
+ *	@return true if player->buffer + bufferRead is at offset now
+ */
+static bool BarPlayerBufferSeek (struct audioPlayer *player,
+		const size_t offset) {
+	const size_t pos = player->bufferOffset + player->bufferRead;
+	const size_t end = player->bufferOffset + player->bufferFilled;
+
+	if (offset >= pos && offset <= end) {
+		player->bufferRead = offset - player->bufferOffset;
+		return true;
+	}
+	if (offset > end && offset - end <= BarRingFill (&player->input) +
+			BAR_PLAYER_SEEK_DISTANCE) {
+		/* downloaded already or soon */
+		player->bufferRead = player->bufferFilled;
+		return false;
+	}
+	player->seekOffset = offset;
+	player->seekWanted = true;
+	return false;
+}
+
+/*	decoder side of a seek: have the network thread continue the download at
+ *	seekOffset, drop everything buffered
+ *	@param player structure
+ *	@return true if the player should quit
+ */
+static bool BarPlayerSeekInput (struct audioPlayer *player) {
+	bool quit;
+
+	pthread_mutex_lock (&player->pauseMutex);
+	BarAtomicStore (&player->seekPending, true);
+	/* under the lock, so it is not reset before the seek is done */
+	WaitressCancel (&player->cancel);
+	pthread_cond_broadcast (&player->pauseCond);
+	while (!player->doQuit && player->seekPending) {
+		pthread_cond_wait (&player->pauseCond, &player->pauseMutex);
+	}
+	quit = player->doQuit;
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	BarBufferSkip (&player->decodeBuffer,
+			BarBufferFill (&player->decodeBuffer));
+	player->bufferOffset = player->seekOffset;
+	player->seekWanted = false;
+
+	return quit;
+}
+
+/*	network side of a seek
+ *	@param player structure
+ *	@return true if the decoder asked for one
+ */
+static bool BarPlayerSeekNetwork (struct audioPlayer *player) {
+	bool seek;
+
+	pthread_mutex_lock (&player->pauseMutex);
+	if ((seek = player->seekPending)) {
+		/* the decoder waits for us, so its end of the ring may be touched */
+		BarRingClear (&player->input);
+		player->bytesReceived = player->seekOffset;
+		WaitressCancelReset (&player->cancel);
+		BarAtomicStore (&player->seekPending, false);
+		pthread_cond_broadcast (&player->pauseCond);
+	}
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	return seek;
 }
 
-/*	move data beginning from read pointer to buffer beginning and
- *	overwrite data already read from buffer
+/*	download is done, wait until the decoder is done too or wants another
+ *	part of the file
  *	@param player structure
- *	@return nothing at all
+ *	@return true if the download should continue at bytesReceived
  */
-static INLINE void BarPlayerBufferMove (struct audioPlayer *player) {
-	/* move remaining bytes to buffer beginning */
-	memmove (player->buffer, player->buffer + player->bufferRead,
-			(player->bufferFilled - player->bufferRead));
-	player->bufferFilled -= player->bufferRead;
+static bool BarPlayerNetworkIdle (struct audioPlayer *player) {
+	BarRingSetEof (&player->input);
+	BarPlayerRingNotify (player);
+
+	pthread_mutex_lock (&player->pauseMutex);
+	while (!player->doQuit && !player->decoderDone && !player->seekPending) {
+		pthread_cond_wait (&player->pauseCond, &player->pauseMutex);
+	}
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	return BarPlayerSeekNetwork (player);
+}
+
+/*	hand decoded samples to the output thread, waits for free space. They
+ *	are dropped if a seek is requested meanwhile.
+ *	@param player structure
+ *	@param samples
+ *	@param size in bytes
+ *	@return false if the player should quit
+ */
+static bool BarPlayerPcmWrite (struct audioPlayer *player, const void *data,
+		const size_t size) {
+	assert (size <= player->pcm.size);
+
+	player->pcmWanted = size;
+	if (BarPlayerRingWait (player, BarPlayerPcmSpace)) {
+		return false;
+	}
+	if (BarAtomicLoad (&player->doSeek)) {
+		return true;
+	}
+	BarRingWrite (&player->pcm, data, size);
+	BarPlayerRingNotify (player);
+	return true;
+}
+
+/*	open the sound card once the stream's format is known
+ *	@param player structure
+ *	@return false on error
+ */
+static bool BarPlayerOpenOutput (struct audioPlayer *player) {
+	ao_sample_format format;
+	int audioOutDriver;
+
+	audioOutDriver = ao_default_driver_id();
+	memset (&format, 0, sizeof (format));
+	format.bits = 16;
+	format.channels = player->channels;
+	format.rate = player->samplerate;
+	format.byte_format = AO_FMT_NATIVE;
+	if ((player->audioOutDevice = ao_open_live (audioOutDriver,
+			&format, NULL)) == NULL) {
+		/* we're not interested in the errno */
+		player->aoError = 1;
+		BarUiMsg (player->settings, MSG_ERR, "Cannot open audio device\n");
+		return false;
+	}
+	return true;
 }
 
 #ifdef ENABLE_FAAD
 
-/*	play aac stream
- *	@param streamed data
- *	@param received bytes
- *	@param extra data (player data)
- *	@return received bytes or less on error
+/*	set up decoder and sound card for the track in a moov box
+ *	@param player structure
+ *	@param box body
+ *	@param its size
+ *	@return false on error
  */
-static WaitressCbReturn_t BarPlayerAACCb (void *ptr, size_t size,
-		void *stream) {
-	const char *data = ptr;
-	struct audioPlayer *player = stream;
+static bool BarPlayerAACInit (struct audioPlayer *player,
+		const unsigned char *moov, const size_t size) {
+	char err;
 
-	if (BarPlayerCheckPauseQuit (player) ||
-			!BarPlayerBufferFill (player, data, size)) {
-		return WAITRESS_CB_RET_ERR;
+	if (!BarMp4ParseMoov (moov, size, &player->track)) {
+		BarUiMsg (player->settings, MSG_ERR, "No audio track found\n");
+		return false;
 	}
 
-	if (player->mode == PLAYER_RECV_DATA) {
-		short int *aacDecoded;
-		NeAACDecFrameInfo frameInfo;
-		size_t i;
+	err = NeAACDecInit2 (player->aacHandle, player->track.config,
+			player->track.configSize, &player->samplerate, &player->channels);
+	if (err != 0) {
+		BarUiMsg (player->settings, MSG_ERR,
+				"Error while initializing audio decoder (%i)\n", err);
+		return false;
+	}
+	if (!BarPlayerOpenOutput (player)) {
+		return false;
+	}
 
-		while (player->sampleSizeCurr < player->sampleSizeN &&
-				(player->bufferFilled - player->bufferRead) >=
-			player->sampleSize[player->sampleSizeCurr]) {
-			/* going through this loop can take up to a few seconds =>
-			 * allow earlier thread abort */
-			if (BarPlayerCheckPauseQuit (player)) {
-				return WAITRESS_CB_RET_ERR;
-			}
+	/* sample durations are in the track's timescale, which is not
+	 * necessarily the output samplerate (sbr doubles it) */
+	player->songDuration = player->track.duration *
+			(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
+			player->track.timescale;
+	BarPlayerLimitRate (player);
 
-			/* decode frame */
-			aacDecoded = NeAACDecDecode(player->aacHandle, &frameInfo,
-					&player->buffer[player->bufferRead],
-					player->sampleSize[player->sampleSizeCurr]);
-			player->bufferRead += player->sampleSize[player->sampleSizeCurr];
-			++player->sampleSizeCurr;
-
-			if (frameInfo.error != 0) {
-				/* skip this frame, songPlayed will be slightly off if this
-				 * happens */
-				BarUiMsg (player->settings, MSG_ERR, "Decoding error: %s\n",
-						NeAACDecGetErrorMessage (frameInfo.error));
-				continue;
-			}
-			/* assuming data in stsz atom is correct */
-			assert (frameInfo.bytesconsumed ==
-					player->sampleSize[player->sampleSizeCurr-1]);
+	player->sampleCurr = 0;
+	player->mode = PLAYER_SAMPLESIZE_INITIALIZED;
 
-			for (i = 0; i < frameInfo.samples; i++) {
-				aacDecoded[i] = applyReplayGain (aacDecoded[i], player->scale);
-			}
-			/* ao_play needs bytes: 1 sample = 16 bits = 2 bytes */
-			ao_play (player->audioOutDevice, (char *) aacDecoded,
-					frameInfo.samples * 2);
-			/* add played frame length to played time, explained below */
-			player->songPlayed += (unsigned long long int) frameInfo.samples *
-					(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
-					(unsigned long long int) player->samplerate /
-					(unsigned long long int) player->channels;
-		}
-		if (player->sampleSizeCurr >= player->sampleSizeN) {
-			/* no more frames, drop data */
-			player->bufferRead = player->bufferFilled;
+	return true;
+}
+
+/*	walk the file's top-level boxes until moov is complete, everything else
+ *	is skipped; if mdat comes first another part of the file is downloaded
+ *	@param player structure
+ *	@return false on error
+ */
+static bool BarPlayerMp4Header (struct audioPlayer *player) {
+	while (BarPlayerBufferSeek (player, player->boxOffset)) {
+		const unsigned char * const data = player->buffer + player->bufferRead;
+		const size_t size = player->bufferFilled - player->bufferRead;
+		BarMp4Box_t box;
+
+		if (!BarMp4BoxHeader (data, size, &box)) {
+			/* need more data */
+			break;
 		}
-	} else {
-		if (player->mode == PLAYER_INITIALIZED) {
-			while (player->bufferRead+4 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead, "esds",
-						4) == 0) {
-					player->mode = PLAYER_FOUND_ESDS;
-					player->bufferRead += 4;
-					break;
-				}
-				player->bufferRead++;
-			}
+		if (box.size == 0 || box.size < box.header ||
+				box.size > SIZE_MAX - player->boxOffset ||
+				(BarMp4BoxIs (&box, "moov") &&
+				box.size > BAR_PLAYER_MOOV_MAX)) {
+			/* moov must have been before a box extending to the end; boxes
+			 * ending past SIZE_MAX cannot be skipped on 32 bit systems */
+			BarUiMsg (player->settings, MSG_ERR, "Invalid mp4 file\n");
+			return false;
 		}
-		if (player->mode == PLAYER_FOUND_ESDS) {
-			/* FIXME: is this the correct way? */
-			/* we're gonna read 10 bytes */
-			while (player->bufferRead+1+4+5 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead,
-						"\x05\x80\x80\x80", 4) == 0) {
-					ao_sample_format format;
-					int audioOutDriver;
-					char err;
-
-					/* +1+4 needs to be replaced by <something>! */
-					player->bufferRead += 1+4;
-					err = NeAACDecInit2 (player->aacHandle, player->buffer +
-							player->bufferRead, 5, &player->samplerate,
-							&player->channels);
-					player->bufferRead += 5;
-					if (err != 0) {
-						BarUiMsg (player->settings, MSG_ERR,
-								"Error while initializing audio decoder "
-								"(%i)\n", err);
-						return WAITRESS_CB_RET_ERR;
-					}
-					audioOutDriver = ao_default_driver_id();
-					memset (&format, 0, sizeof (format));
-					format.bits = 16;
-					format.channels = player->channels;
-					format.rate = player->samplerate;
-					format.byte_format = AO_FMT_NATIVE;
-					if ((player->audioOutDevice = ao_open_live (audioOutDriver,
-							&format, NULL)) == NULL) {
-						/* we're not interested in the errno */
-						player->aoError = 1;
-						BarUiMsg (player->settings, MSG_ERR,
-								"Cannot open audio device\n");
-						return WAITRESS_CB_RET_ERR;
-					}
-					player->mode = PLAYER_AUDIO_INITIALIZED;
-					break;
-				}
-				player->bufferRead++;
+		if (BarMp4BoxIs (&box, "moov")) {
+			if (size < box.size) {
+				/* wait for all of it */
+				break;
 			}
+			return BarPlayerAACInit (player, data + box.header,
+					(size_t) box.size - box.header);
 		}
-		if (player->mode == PLAYER_AUDIO_INITIALIZED) {
-			while (player->bufferRead+4+8 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead, "stsz",
-						4) == 0) {
-					player->mode = PLAYER_FOUND_STSZ;
-					player->bufferRead += 4;
-					/* skip version and unknown */
-					player->bufferRead += 8;
-					break;
-				}
-				player->bufferRead++;
-			}
+		player->boxOffset += (size_t) box.size;
+	}
+
+	return true;
+}
+
+/*	decode buffered aac stream
+ *	@param player structure
+ *	@return false on error or if the player should quit
+ */
+static bool BarPlayerAACDecode (struct audioPlayer *player) {
+	const BarMp4Track_t * const track = &player->track;
+
+	if (player->mode < PLAYER_SAMPLESIZE_INITIALIZED &&
+			!BarPlayerMp4Header (player)) {
+		return false;
+	}
+	if (player->mode < PLAYER_SAMPLESIZE_INITIALIZED) {
+		return true;
+	}
+
+	while (player->sampleCurr < track->samples &&
+			!BarAtomicLoad (&player->doSeek) &&
+			BarPlayerBufferSeek (player,
+			(size_t) track->sampleOffset[player->sampleCurr]) &&
+			player->bufferFilled - player->bufferRead >=
+			track->sampleSize[player->sampleCurr]) {
+		const uint32_t sampleSize = track->sampleSize[player->sampleCurr];
+		short int *aacDecoded;
+		NeAACDecFrameInfo frameInfo;
+		size_t i;
+
+		/* going through this loop can take up to a few seconds =>
+		 * allow earlier thread abort */
+		if (BarPlayerCheckQuit (player)) {
+			return false;
 		}
-		/* get frame sizes */
-		if (player->mode == PLAYER_FOUND_STSZ) {
-			while (player->bufferRead+4 < player->bufferFilled) {
-				/* how many frames do we have? */
-				if (player->sampleSizeN == 0) {
-					/* mp4 uses big endian, convert */
-					memcpy (&player->sampleSizeN, player->buffer +
-							player->bufferRead, sizeof (uint32_t));
-					player->sampleSizeN =
-							bigToHostEndian32 (player->sampleSizeN);
-
-					player->sampleSize = malloc (player->sampleSizeN *
-							sizeof (*player->sampleSize));
-					assert (player->sampleSize != NULL);
-					player->bufferRead += sizeof (uint32_t);
-					player->sampleSizeCurr = 0;
-					/* set up song duration (assuming one frame always contains
-					 * the same number of samples)
-					 * calculation: channels * number of frames * samples per
-					 * frame / samplerate */
-					/* FIXME: Hard-coded number of samples per frame */
-					player->songDuration = (unsigned long long int) player->sampleSizeN *
-							4096LL * (unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
-							(unsigned long long int) player->samplerate /
-							(unsigned long long int) player->channels;
-					break;
-				} else {
-					memcpy (&player->sampleSize[player->sampleSizeCurr],
-							player->buffer + player->bufferRead,
-							sizeof (uint32_t));
-					player->sampleSize[player->sampleSizeCurr] =
-							bigToHostEndian32 (
-							player->sampleSize[player->sampleSizeCurr]);
-
-					player->sampleSizeCurr++;
-					player->bufferRead += sizeof (uint32_t);
-				}
-				/* all sizes read, nearly ready for data mode */
-				if (player->sampleSizeCurr >= player->sampleSizeN) {
-					player->mode = PLAYER_SAMPLESIZE_INITIALIZED;
-					break;
-				}
-			}
+
+		/* decode frame */
+		aacDecoded = NeAACDecDecode(player->aacHandle, &frameInfo,
+				&player->buffer[player->bufferRead], sampleSize);
+		player->bufferRead += sampleSize;
+		++player->sampleCurr;
+		player->mode = PLAYER_RECV_DATA;
+
+		if (frameInfo.error != 0) {
+			/* skip this frame, songPlayed will be slightly off if this
+			 * happens */
+			BarUiMsg (player->settings, MSG_ERR, "Decoding error: %s\n",
+					NeAACDecGetErrorMessage (frameInfo.error));
+			continue;
 		}
-		/* search for data atom and let the show begin... */
-		if (player->mode == PLAYER_SAMPLESIZE_INITIALIZED) {
-			while (player->bufferRead+4 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead, "mdat",
-						4) == 0) {
-					player->mode = PLAYER_RECV_DATA;
-					player->sampleSizeCurr = 0;
-					player->bufferRead += 4;
-					break;
-				}
-				player->bufferRead++;
-			}
+		/* assuming data in stsz atom is correct */
+		assert (frameInfo.bytesconsumed == sampleSize);
+
+		for (i = 0; i < frameInfo.samples; i++) {
+			aacDecoded[i] = applyReplayGain (aacDecoded[i], player->scale);
 		}
+		/* ao_play needs bytes: 1 sample = 16 bits = 2 bytes */
+		if (!BarPlayerPcmWrite (player, aacDecoded, frameInfo.samples * 2)) {
+			return false;
+		}
+	}
+	if (player->sampleCurr >= track->samples) {
+		/* no more frames, drop data */
+		player->bufferRead = player->bufferFilled;
 	}
 
-	BarPlayerBufferMove (player);
+	return true;
+}
+
+/*	move the decoder to the sample playing at a time
+ *	@param player structure
+ *	@param time in ms
+ *	@return output sample the decoder continues with
+ */
+static unsigned long long int BarPlayerAACSeek (struct audioPlayer *player,
+		const unsigned long int time) {
+	const BarMp4Track_t * const track = &player->track;
+	uint64_t start;
+
+	player->sampleCurr = BarMp4SampleAt (track, (uint64_t) time *
+			track->timescale / BAR_PLAYER_MS_TO_S_FACTOR, &start);
+	NeAACDecPostSeekReset (player->aacHandle, (long) player->sampleCurr);
 
-	return WAITRESS_CB_RET_OK;
+	return start * player->samplerate / track->timescale;
 }
 
 #endif /* ENABLE_FAAD */
@@ -354,107 +619,457 @@ static INLINE signed short int BarPlayerMadToShort (const mad_fixed_t fixed) {
 	return (signed short int) (fixed >> (MAD_F_FRACBITS - 15));
 }
 
-/*	mp3 playback callback
+/*	set up song duration: exact if the first frame was a xing/vbri tag,
+ *	otherwise extrapolated from the average size of the frames decoded so
+ *	far, which is exact for cbr and gets better over time for vbr
+ *	@param player structure
  */
-static WaitressCbReturn_t BarPlayerMp3Cb (void *ptr, size_t size,
-		void *stream) {
-	const char *data = ptr;
-	struct audioPlayer *player = stream;
-	size_t i;
+static void BarPlayerMp3Duration (struct audioPlayer *player) {
+	const BarMp3Info_t * const info = &player->mp3Info;
+	const size_t fileSize = BarAtomicLoad (&player->fileSize);
+	unsigned long long int samples;
+
+	if (info->frames > 0) {
+		samples = (unsigned long long int) info->frames *
+				player->mp3Synth.pcm.length;
+		if (info->delay + info->padding < samples) {
+			samples -= info->delay + info->padding;
+		}
+	} else if (player->mp3Bytes > 0 && fileSize > player->mp3Start) {
+		samples = player->mp3Samples *
+				(unsigned long long int) (fileSize - player->mp3Start) /
+				player->mp3Bytes;
+	} else {
+		return;
+	}
+	player->songDuration = samples *
+			(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
+			player->samplerate;
+}
 
-	if (BarPlayerCheckPauseQuit (player) ||
-			!BarPlayerBufferFill (player, data, size)) {
-		return WAITRESS_CB_RET_ERR;
+/*	remember where a frame starts, if all frames before it are indexed
+ *	already
+ *	@param player structure
+ *	@param file offset of the frame being decoded
+ */
+static void BarPlayerMp3Index (struct audioPlayer *player,
+		const size_t offset) {
+	if (player->mp3FrameNext++ != player->mp3Indexed) {
+		return;
 	}
+	if (player->mp3Indexed == player->mp3IndexSize) {
+		const size_t size = player->mp3IndexSize > 0 ?
+				2 * player->mp3IndexSize : 1024;
+		size_t * const index = realloc (player->mp3Index,
+				size * sizeof (*index));
+
+		if (index == NULL) {
+			/* seeking falls back to estimates */
+			return;
+		}
+		player->mp3Index = index;
+		player->mp3IndexSize = size;
+	}
+	player->mp3Index[player->mp3Indexed++] = offset;
+}
+
+/*	move the decoder to the frame playing at a time. Indexed frames are
+ *	found exactly, others are estimated using the xing toc or the average
+ *	frame size.
+ *	@param player structure
+ *	@param time in ms
+ *	@return sample the frame starts with
+ */
+static unsigned long long int BarPlayerMp3Seek (struct audioPlayer *player,
+		const unsigned long int time) {
+	const BarMp3Info_t * const info = &player->mp3Info;
+	const unsigned int length = player->mp3Synth.pcm.length;
+	size_t frame = (unsigned long long int) time * player->samplerate /
+			BAR_PLAYER_MS_TO_S_FACTOR / length;
+
+	if (frame < player->mp3Indexed) {
+		player->mp3Offset = player->mp3Index[frame];
+	} else if (info->hasToc && info->frames > 0 && info->bytes > 0 &&
+			player->songDuration > 0) {
+		unsigned int percent = (unsigned long long int) time * 100 /
+				player->songDuration;
+
+		if (percent > 99) {
+			percent = 99;
+		}
+		frame = (unsigned long long int) info->frames * percent / 100;
+		player->mp3Offset = player->mp3Start +
+				(unsigned long long int) info->toc[percent] * info->bytes / 256;
+	} else {
+		player->mp3Offset = player->mp3Start +
+				(unsigned long long int) frame * length * player->mp3Bytes /
+				player->mp3Samples;
+	}
+	player->mp3FrameNext = frame;
+
+	/* forget the bit reservoir and the previous frame's overlap */
+	mad_stream_finish (&player->mp3Stream);
+	mad_stream_init (&player->mp3Stream);
+	mad_frame_mute (&player->mp3Frame);
+	mad_synth_mute (&player->mp3Synth);
+	player->mp3Resync = true;
+
+	return (unsigned long long int) frame * length;
+}
+
+/*	decode buffered mp3 stream
+ *	@param player structure
+ *	@return false on error or if the player should quit
+ */
+static bool BarPlayerMp3Decode (struct audioPlayer *player) {
+	size_t i;
 
 	/* some "prebuffering" */
 	if (player->mode < PLAYER_RECV_DATA &&
 			player->bufferFilled < BAR_PLAYER_BUFSIZE / 2) {
-		return WAITRESS_CB_RET_OK;
+		return true;
+	}
+	if (!BarPlayerBufferSeek (player, player->mp3Offset)) {
+		return true;
 	}
 
-	mad_stream_buffer (&player->mp3Stream, player->buffer,
-			player->bufferFilled);
+	mad_stream_buffer (&player->mp3Stream, player->buffer +
+			player->bufferRead, player->bufferFilled - player->bufferRead);
 	player->mp3Stream.error = 0;
 	do {
 		/* channels * max samples, found in mad.h */
 		signed short int madDecoded[2*1152], *madPtr = madDecoded;
+		BarMp3Info_t info;
+		size_t frameSize, frameOffset;
 
 		if (mad_frame_decode (&player->mp3Frame, &player->mp3Stream) != 0) {
-			if (player->mp3Stream.error != MAD_ERROR_BUFLEN) {
+			if (player->mp3Resync &&
+					MAD_RECOVERABLE (player->mp3Stream.error)) {
+				/* landed in the middle of a frame or without the
+				 * previous frames' data */
+				continue;
+			} else if (player->mp3Stream.error != MAD_ERROR_BUFLEN) {
 				BarUiMsg (player->settings, MSG_ERR,
 						"mp3 decoding error: %s\n",
 						mad_stream_errorstr (&player->mp3Stream));
-				return WAITRESS_CB_RET_ERR;
+				return false;
 			} else {
 				/* rebuffering required => exit loop */
 				break;
 			}
 		}
+		player->mp3Resync = false;
+		frameSize = player->mp3Stream.next_frame -
+				player->mp3Stream.this_frame;
+		frameOffset = player->bufferOffset +
+				(player->mp3Stream.this_frame - player->buffer);
+		if (player->mode < PLAYER_AUDIO_INITIALIZED &&
+				player->mp3Bytes == 0 && BarMp3ParseInfo (
+				player->mp3Stream.this_frame, frameSize, &info)) {
+			/* not audio, just the song's length */
+			player->mp3Info = info;
+			continue;
+		}
+		if (player->mp3Bytes == 0) {
+			player->mp3Start = frameOffset;
+		}
+		BarPlayerMp3Index (player, frameOffset);
 		mad_synth_frame (&player->mp3Synth, &player->mp3Frame);
+		player->mp3Bytes += frameSize;
+		player->mp3Samples += player->mp3Synth.pcm.length;
 		for (i = 0; i < player->mp3Synth.pcm.length; i++) {
 			/* left channel */
 			*(madPtr++) = applyReplayGain (BarPlayerMadToShort (
 					player->mp3Synth.pcm.samples[0][i]), player->scale);
 
 			/* right channel */
-			*(madPtr++) = applyReplayGain (BarPlayerMadToShort (
-					player->mp3Synth.pcm.samples[1][i]), player->scale);
+			if (player->mp3Synth.pcm.channels == 2) {
+				*(madPtr++) = applyReplayGain (BarPlayerMadToShort (
+						player->mp3Synth.pcm.samples[1][i]), player->scale);
+			}
 		}
 		if (player->mode < PLAYER_AUDIO_INITIALIZED) {
-			ao_sample_format format;
-			int audioOutDriver;
-
 			player->channels = (unsigned char)player->mp3Synth.pcm.channels;
 			player->samplerate = player->mp3Synth.pcm.samplerate;
-			audioOutDriver = ao_default_driver_id();
-			memset (&format, 0, sizeof (format));
-			format.bits = 16;
-			format.channels = player->channels;
-			format.rate = player->samplerate;
-			format.byte_format = AO_FMT_NATIVE;
-			if ((player->audioOutDevice = ao_open_live (audioOutDriver,
-					&format, NULL)) == NULL) {
-				player->aoError = 1;
-				BarUiMsg (player->settings, MSG_ERR,
-						"Cannot open audio device\n");
-				return WAITRESS_CB_RET_ERR;
+			if (!BarPlayerOpenOutput (player)) {
+				return false;
 			}
 
-			/* calc song length using the framerate of the first decoded frame */
-			player->songDuration = (unsigned long long int) player->waith.request.contentLength /
-					((unsigned long long int) player->mp3Frame.header.bitrate /
-					(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR / 8LL);
+			BarPlayerMp3Duration (player);
+			BarPlayerLimitRate (player);
 
 			/* must be > PLAYER_SAMPLESIZE_INITIALIZED, otherwise time won't
 			 * be visible to user (ugly, but mp3 decoding != aac decoding) */
 			player->mode = PLAYER_RECV_DATA;
+		} else if (player->mp3Info.frames == 0) {
+			BarPlayerMp3Duration (player);
 		}
 		/* samples * length * channels */
-		ao_play (player->audioOutDevice, (char *) madDecoded,
-				player->mp3Synth.pcm.length * 2 * 2);
-
-		/* avoid division by 0 */
-		if (player->mode == PLAYER_RECV_DATA) {
-			/* same calculation as in aac player; don't need to divide by
-			 * channels, length is number of samples for _one_ channel */
-			player->songPlayed += (unsigned long long int) player->mp3Synth.pcm.length *
-					(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
-					(unsigned long long int) player->samplerate;
+		if (!BarPlayerPcmWrite (player, madDecoded,
+				player->mp3Synth.pcm.length * 2 * player->channels)) {
+			return false;
 		}
 
-		if (BarPlayerCheckPauseQuit (player)) {
-			return WAITRESS_CB_RET_ERR;
+		if (BarPlayerCheckQuit (player)) {
+			return false;
+		}
+		if (BarAtomicLoad (&player->doSeek)) {
+			break;
 		}
 	} while (player->mp3Stream.error != MAD_ERROR_BUFLEN);
 
-	player->bufferRead += player->mp3Stream.next_frame - player->buffer;
+	player->bufferRead = player->mp3Stream.next_frame - player->buffer;
+	player->mp3Offset = player->bufferOffset + player->bufferRead;
+
+	return true;
+}
+#endif /* ENABLE_MAD */
+
+/*	network thread: queue downloaded data for the decoder, pauses while the
+ *	input ring is full
+ */
+static WaitressCbReturn_t BarPlayerNetworkCb (void *ptr, size_t size,
+		void *stream) {
+	const unsigned char *data = ptr;
+	struct audioPlayer *player = stream;
+	const size_t received = size;
 
-	BarPlayerBufferMove (player);
+	if (BarPlayerCheckQuit (player)) {
+		return WAITRESS_CB_RET_ERR;
+	}
+	if (BarAtomicLoad (&player->fileSize) == 0 &&
+			player->waith.request.contentLengthKnown) {
+		/* the response's length is counted from where it started */
+		BarAtomicStore (&player->fileSize, player->fetchOffset +
+				player->waith.request.contentLength);
+	}
+
+	while (true) {
+		const size_t fill = BarRingFill (&player->input);
+		size_t written = 0;
+
+		if (BarAtomicLoad (&player->seekPending)) {
+			/* BarPlayerSeekNetwork takes over */
+			return WAITRESS_CB_RET_ERR;
+		}
+		if (fill < player->inputHigh) {
+			const size_t room = player->inputHigh - fill;
+			written = BarRingWrite (&player->input, data,
+					size < room ? size : room);
+			BarPlayerRingNotify (player);
+		}
+		data += written;
+		size -= written;
+		if (size == 0) {
+			break;
+		}
+		if (BarPlayerRingWait (player, BarPlayerInputSpace)) {
+			return WAITRESS_CB_RET_ERR;
+		}
+	}
+	player->bytesReceived += received;
 
 	return WAITRESS_CB_RET_OK;
 }
-#endif /* ENABLE_MAD */
+
+/*	decode buffered data
+ *	@param player structure
+ *	@return false on error or if the player should quit
+ */
+static bool BarPlayerDecode (struct audioPlayer *player) {
+	switch (player->audioFormat) {
+		#ifdef ENABLE_FAAD
+		case PIANO_AF_AACPLUS:
+			return BarPlayerAACDecode (player);
+		#endif /* ENABLE_FAAD */
+
+		#ifdef ENABLE_MAD
+		case PIANO_AF_MP3:
+			return BarPlayerMp3Decode (player);
+		#endif /* ENABLE_MAD */
+
+		default:
+			/* this should never happen */
+			assert (0);
+			return false;
+	}
+}
+
+/*	decoder side of BarPlayerSeek: continue decoding at seekTime and have
+ *	the output thread drop what is not played yet. The decoder asks for
+ *	another part of the file if it is not buffered.
+ *	@param player structure
+ */
+static void BarPlayerDecodeSeek (struct audioPlayer *player) {
+	unsigned long int time;
+	unsigned long long int sample;
+
+	pthread_mutex_lock (&player->pauseMutex);
+	time = player->seekTime;
+	BarAtomicStore (&player->doSeek, false);
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	switch (player->audioFormat) {
+		#ifdef ENABLE_FAAD
+		case PIANO_AF_AACPLUS:
+			if (player->mode < PLAYER_SAMPLESIZE_INITIALIZED) {
+				return;
+			}
+			sample = BarPlayerAACSeek (player, time);
+			break;
+		#endif /* ENABLE_FAAD */
+
+		#ifdef ENABLE_MAD
+		case PIANO_AF_MP3:
+			if (player->mode < PLAYER_RECV_DATA) {
+				return;
+			}
+			sample = BarPlayerMp3Seek (player, time);
+			break;
+		#endif /* ENABLE_MAD */
+
+		default:
+			/* this should never happen */
+			assert (0);
+			return;
+	}
+
+	pthread_mutex_lock (&player->pauseMutex);
+	player->pcmDiscard = player->pcm.written;
+	player->samplesSeek = sample;
+	BarAtomicStore (&player->pcmSeek, true);
+	pthread_cond_broadcast (&player->pauseCond);
+	pthread_mutex_unlock (&player->pauseMutex);
+}
+
+/*	decoder thread: input ring -> pcm ring
+ *	@param audioPlayer structure
+ *	@return NULL
+ */
+static void *BarPlayerDecodeThread (void *data) {
+	struct audioPlayer *player = data;
+
+	while (!BarPlayerRingWait (player, BarPlayerInputData)) {
+		if (BarAtomicLoad (&player->doSeek)) {
+			/* the download may be done, but the decoder is not */
+			BarPlayerDecodeSeek (player);
+		} else if (BarRingDrained (&player->input)) {
+			break;
+		}
+		if (!BarPlayerBufferFill (player) || !BarPlayerDecode (player)) {
+			/* stop the download too */
+			BarPlayerAbort (player);
+			break;
+		}
+		BarPlayerBufferSkip (player);
+		if (player->seekWanted && BarPlayerSeekInput (player)) {
+			break;
+		}
+	}
+
+	BarRingSetEof (&player->pcm);
+	BarPlayerRingNotify (player);
+
+	pthread_mutex_lock (&player->pauseMutex);
+	player->decoderDone = true;
+	pthread_cond_broadcast (&player->pauseCond);
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	return NULL;
+}
+
+/*	output side of a seek: drop samples decoded before it
+ *	@param player structure
+ */
+static void BarPlayerOutputSeek (struct audioPlayer *player) {
+	const size_t pos = player->pcm.read;
+
+	pthread_mutex_lock (&player->pauseMutex);
+	if (pos < player->pcmDiscard) {
+		BarRingSkip (&player->pcm, player->pcmDiscard - pos);
+		player->samplesPlayed = player->samplesSeek;
+	} else {
+		/* some samples after the seek are played already */
+		player->samplesPlayed = player->samplesSeek +
+				(pos - player->pcmDiscard) / (2 * player->channels);
+	}
+	BarAtomicStore (&player->pcmSeek, false);
+	pthread_mutex_unlock (&player->pauseMutex);
+
+	player->songPlayed = player->samplesPlayed *
+			(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
+			(unsigned long long int) player->samplerate;
+	BarPlayerRingNotify (player);
+}
+
+/*	output thread: pcm ring -> sound card, the only one waiting for the
+ *	pause flag
+ *	@param audioPlayer structure
+ *	@return NULL
+ */
+static void *BarPlayerOutputThread (void *data) {
+	struct audioPlayer *player = data;
+
+	while (!BarPlayerCheckPauseQuit (player) &&
+			!BarPlayerRingWait (player, BarPlayerPcmData)) {
+		const unsigned char *pcm;
+		size_t size, frame;
+
+		if (BarAtomicLoad (&player->pcmSeek)) {
+			/* the ring may be empty now */
+			BarPlayerOutputSeek (player);
+			continue;
+		}
+		if ((size = BarRingPeek (&player->pcm, &pcm)) == 0) {
+			/* decoder is done */
+			break;
+		}
+		/* the decoder writes whole frames (16 bit * channels) and the ring's
+		 * size is a power of two, so frames never wrap */
+		frame = 2 * player->channels;
+		if (size > BAR_PLAYER_OUTPUT_CHUNK) {
+			size = BAR_PLAYER_OUTPUT_CHUNK;
+		}
+		size -= size % frame;
+
+		ao_play (player->audioOutDevice, (char *) pcm, size);
+		BarRingSkip (&player->pcm, size);
+		BarPlayerRingNotify (player);
+
+		player->samplesPlayed += size / frame;
+		player->songPlayed = player->samplesPlayed *
+				(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
+				(unsigned long long int) player->samplerate;
+	}
+
+	return NULL;
+}
+
+/*	seek within the song, called by the main thread
+ *	@param player structure
+ *	@param milliseconds relative to the current position, negative ones
+ *		seek backwards
+ */
+void BarPlayerSeek (struct audioPlayer *player, const long int offset) {
+	unsigned long int time;
+
+	pthread_mutex_lock (&player->pauseMutex);
+	/* relative to previous seeks, even if they are not done yet */
+	time = player->doSeek || player->pcmSeek ? player->seekTime :
+			player->songPlayed;
+	if (offset < 0 && (unsigned long int) -offset > time) {
+		time = 0;
+	} else {
+		time += offset;
+	}
+	if (player->songDuration > 0 && time > player->songDuration) {
+		time = player->songDuration;
+	}
+	player->seekTime = time;
+	BarAtomicStore (&player->doSeek, true);
+	pthread_cond_broadcast (&player->pauseCond);
+	pthread_mutex_unlock (&player->pauseMutex);
+}
 
 /*	player thread; for every song a new thread is started
  *	@param audioPlayer structure
@@ -468,12 +1083,31 @@ void *BarPlayerThread (void *data) {
 	NeAACDecConfigurationPtr conf;
 	#endif
 	WaitressReturn_t wRet = WAITRESS_RET_ERR;
+	unsigned int stalled = 0;
+	size_t inputHigh = player->settings->audioBufferHigh * 1024;
 
 	/* init handles */
 	player->waith.data = (void *) player;
+	player->waith.callback = BarPlayerNetworkCb;
 	/* extraHeaders will be initialized later */
 	player->waith.extraHeaders = extraHeaders;
-	player->buffer = malloc (BAR_PLAYER_BUFSIZE);
+	player->bufferWant = BAR_PLAYER_BUFSIZE;
+
+	if (inputHigh < BAR_PLAYER_BUFSIZE) {
+		inputHigh = BAR_PLAYER_BUFSIZE;
+	}
+	player->inputHigh = inputHigh;
+	player->inputLow = player->settings->audioBufferLow * 1024;
+	if (player->inputLow >= inputHigh) {
+		player->inputLow = inputHigh / 2;
+	}
+	if (!BarRingInit (&player->input, inputHigh) ||
+			!BarRingInit (&player->pcm, BAR_PLAYER_PCM_BUFSIZE) ||
+			!BarBufferInit (&player->decodeBuffer, 2 * BAR_PLAYER_BUFSIZE)) {
+		BarUiMsg (player->settings, MSG_ERR, "Out of memory\n");
+		ret = (void *) PLAYER_RET_HARDFAIL;
+		goto cleanup;
+	}
 
 	switch (player->audioFormat) {
 		#ifdef ENABLE_FAAD
@@ -484,8 +1118,6 @@ void *BarPlayerThread (void *data) {
 			conf->outputFormat = FAAD_FMT_16BIT;
 		    conf->downMatrix = 1;
 			NeAACDecSetConfiguration(player->aacHandle, conf);
-
-			player->waith.callback = BarPlayerAACCb;
 			break;
 		#endif /* ENABLE_FAAD */
 
@@ -494,8 +1126,6 @@ void *BarPlayerThread (void *data) {
 			mad_stream_init (&player->mp3Stream);
 			mad_frame_init (&player->mp3Frame);
 			mad_synth_init (&player->mp3Synth);
-
-			player->waith.callback = BarPlayerMp3Cb;
 			break;
 		#endif /* ENABLE_MAD */
 
@@ -508,20 +1138,74 @@ void *BarPlayerThread (void *data) {
 	
 	player->mode = PLAYER_INITIALIZED;
 
+	if (pthread_create (&player->decodeThread, NULL, BarPlayerDecodeThread,
+			player) != 0) {
+		BarUiMsg (player->settings, MSG_ERR, "Cannot start player thread\n");
+		ret = (void *) PLAYER_RET_HARDFAIL;
+		goto decoderCleanup;
+	}
+	if (pthread_create (&player->outputThread, NULL, BarPlayerOutputThread,
+			player) != 0) {
+		BarUiMsg (player->settings, MSG_ERR, "Cannot start player thread\n");
+		ret = (void *) PLAYER_RET_HARDFAIL;
+		BarPlayerAbort (player);
+		pthread_join (player->decodeThread, NULL);
+		goto decoderCleanup;
+	}
+
 	/* This loop should work around song abortions by requesting the
-	 * missing part of the song */
-	do {
-		bar_snprintf (extraHeaders, sizeof (extraHeaders), "Range: bytes="
-				player_size_t_spec "-\r\n", player->bytesReceived);
-		wRet = WaitressFetchCall (&player->waith);
-	} while (wRet == WAITRESS_RET_PARTIAL_FILE || wRet == WAITRESS_RET_TIMEOUT
-			|| wRet == WAITRESS_RET_READ_ERR);
+	 * missing part of the song, it also downloads the parts of the file the
+	 * decoder asks for */
+	while (true) {
+		const size_t received = player->bytesReceived;
+		const size_t fileSize = BarAtomicLoad (&player->fileSize);
+
+		player->fetchOffset = received;
+		if (fileSize > 0 && received >= fileSize) {
+			/* the decoder seeked to the end */
+			wRet = WAITRESS_RET_OK;
+		} else if (player->settings->audioSegments > 1) {
+			player->waith.extraHeaders = NULL;
+			wRet = WaitressFetchSegmented (&player->waith,
+					player->bytesReceived, player->settings->audioSegments,
+					BAR_PLAYER_SEGMENT_SIZE);
+		} else {
+			bar_snprintf (extraHeaders, sizeof (extraHeaders), "Range: bytes="
+					player_size_t_spec "-\r\n", player->bytesReceived);
+			wRet = WaitressFetchCall (&player->waith);
+		}
+		stalled = player->bytesReceived > received ? 0 : stalled + 1;
+		if (BarPlayerResume (player, wRet, stalled)) {
+			continue;
+		}
+		/* let the decoder and sound card catch up */
+		if (!BarPlayerNetworkIdle (player)) {
+			break;
+		}
+		stalled = 0;
+	}
+
+	pthread_join (player->decodeThread, NULL);
+	pthread_join (player->outputThread, NULL);
+
+	if (player->aoError) {
+		ret = (void *) PLAYER_RET_HARDFAIL;
+	}
 
+	/* Pandora sends broken audio url’s sometimes (“bad request”). ignore them. */
+	if (wRet != WAITRESS_RET_OK && wRet != WAITRESS_RET_CB_ABORT &&
+			wRet != WAITRESS_RET_CANCELLED) {
+		BarUiMsg (player->settings, MSG_ERR, "Cannot access audio file: %s\n",
+				WaitressErrorToStr (wRet));
+		ret = (void *) PLAYER_RET_SOFTFAIL;
+	}
+
+decoderCleanup:
 	switch (player->audioFormat) {
 		#ifdef ENABLE_FAAD
 		case PIANO_AF_AACPLUS:
 			NeAACDecClose(player->aacHandle);
-			free (player->sampleSize);
+			BarMp4TrackFree (&player->track);
 			break;
 		#endif /* ENABLE_FAAD */
 
@@ -530,6 +1214,7 @@ void *BarPlayerThread (void *data) {
 			mad_synth_finish (&player->mp3Synth);
 			mad_frame_finish (&player->mp3Frame);
 			mad_stream_finish (&player->mp3Stream);
+			free (player->mp3Index);
 			break;
 		#endif /* ENABLE_MAD */
 
@@ -539,21 +1224,12 @@ void *BarPlayerThread (void *data) {
 			break;
 	}
 
-	if (player->aoError) {
-		ret = (void *) PLAYER_RET_HARDFAIL;
-	}
-
-	/* Pandora sends broken audio url’s sometimes (“bad request”). ignore them. */
-	if (wRet != WAITRESS_RET_OK && wRet != WAITRESS_RET_CB_ABORT) {
-		BarUiMsg (player->settings, MSG_ERR, "Cannot access audio file: %s\n",
-				WaitressErrorToStr (wRet));
-		ret = (void *) PLAYER_RET_SOFTFAIL;
-	}
-
 cleanup:
 	ao_close (player->audioOutDevice);
 	WaitressFree (&player->waith);
-	free (player->buffer);
+	BarBufferFree (&player->decodeBuffer);
+	BarRingFree (&player->input);
+	BarRingFree (&player->pcm);
 
 	player->mode = PLAYER_FINISHED_PLAYBACK;
 
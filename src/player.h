@@ -44,13 +44,47 @@ THE SOFTWARE.
 #include <waitress.h>
 
 #include "settings.h"
+#include "ring.h"
+#include "mp4.h"
+#include "mp3.h"
 
 #define BAR_PLAYER_MS_TO_S_FACTOR 1000
+/* data handed to the decoder at once, doubled if it needs more */
 #define BAR_PLAYER_BUFSIZE (WAITRESS_BUFFER_SIZE*2)
+/* stalled audio fetches give up after this many ms, BarPlayerThread
+ * retries them; connection setup and waiting for the response are limited
+ * to BAR_PLAYER_CONNECT_TIMEOUT each */
+#define BAR_PLAYER_TIMEOUT 10000
+#define BAR_PLAYER_CONNECT_TIMEOUT 5000
+
+/* the next song's audio host is connected to this many ms before the
+ * current song ends */
+#define BAR_PLAYER_PRECONNECT 15000
+
+/* byte range size if songs are downloaded in parts, see audio_segments */
+#define BAR_PLAYER_SEGMENT_SIZE (256*1024)
+
+/* decoded audio buffered ahead of the sound card, ~1.5s of 44.1kHz stereo */
+#define BAR_PLAYER_PCM_BUFSIZE (256*1024)
+/* largest piece handed to ao_play at once */
+#define BAR_PLAYER_OUTPUT_CHUNK (16*1024)
+
+/* the decoder skips parts of the file up to this many bytes beyond what is
+ * downloaded already by dropping them, further ones are requested separately */
+#define BAR_PLAYER_SEEK_DISTANCE (64*1024)
+/* larger moov boxes (mp4 headers) are rejected */
+#define BAR_PLAYER_MOOV_MAX (16*1024*1024)
+
+/* with download_rate_factor this many seconds of a song are downloaded at
+ * full speed */
+#define BAR_PLAYER_RATE_BURST 30
 
 struct audioPlayer {
 	bool doQuit; /* protected by pauseMutex */
 	bool doPause; /* protected by pauseMutex */
+	/* seek to seekTime ms, see BarPlayerSeek; protected by pauseMutex */
+	volatile bool doSeek;
+	unsigned long int seekTime;
 	unsigned char channels;
 	unsigned char aoError;
 
@@ -58,9 +92,7 @@ struct audioPlayer {
 		PLAYER_FREED = 0, /* thread is not running */
 		PLAYER_STARTING, /* thread is starting */
 		PLAYER_INITIALIZED, /* decoder/waitress initialized */
-		PLAYER_FOUND_ESDS,
 		PLAYER_AUDIO_INITIALIZED, /* audio device opened */
-		PLAYER_FOUND_STSZ,
 		PLAYER_SAMPLESIZE_INITIALIZED,
 		PLAYER_RECV_DATA, /* playing track */
 		PLAYER_FINISHED_PLAYBACK
@@ -78,14 +110,48 @@ struct audioPlayer {
 
 	size_t bufferFilled;
 	size_t bufferRead;
+	/* file offset of buffer */
+	size_t bufferOffset;
+	/* file offset of the next byte downloaded */
 	size_t bytesReceived;
+	/* where the current download started */
+	size_t fetchOffset;
+	/* size of the whole file, 0 until known; set by the network thread */
+	volatile size_t fileSize;
+
+	/* network thread -> decoder thread: downloaded bytes, decoder thread ->
+	 * output thread: pcm samples. Each stage sleeps on pauseCond if its
+	 * ring is empty/full and is woken by the other side if ringWaiters > 0 */
+	BarRing_t input, pcm;
+	volatile unsigned int ringWaiters;
+	/* network pauses at inputHigh bytes (the ring itself may be larger, its
+	 * size is a power of two) and resumes at inputLow bytes */
+	size_t inputHigh, inputLow;
+	/* space required in pcm by the decoder */
+	size_t pcmWanted;
+	/* samples per channel sent to the sound card */
+	unsigned long long int samplesPlayed;
+	/* after a seek pcm data up to position pcmDiscard is dropped and
+	 * playback continues at samplesSeek; protected by pauseMutex */
+	volatile bool pcmSeek;
+	size_t pcmDiscard;
+	unsigned long long int samplesSeek;
+	pthread_t decodeThread, outputThread;
+	/* decoder wants the download to continue at seekOffset, see
+	 * BarPlayerSeekInput; seekPending and decoderDone are protected by
+	 * pauseMutex */
+	size_t seekOffset;
+	bool seekWanted;
+	volatile bool seekPending;
+	bool decoderDone;
 
 	/* aac */
 	#ifdef ENABLE_FAAD
-	/* stsz atom: sample sizes */
-	size_t sampleSizeN;
-	size_t sampleSizeCurr;
-	uint32_t *sampleSize;
+	/* file offset of the next top-level box while looking for moov */
+	size_t boxOffset;
+	BarMp4Track_t track;
+	/* next sample to decode */
+	size_t sampleCurr;
 	NeAACDecHandle aacHandle;
 	#endif
 
@@ -94,22 +160,44 @@ struct audioPlayer {
 	struct mad_stream mp3Stream;
 	struct mad_frame mp3Frame;
 	struct mad_synth mp3Synth;
+	/* from the first frame, if it is a xing/vbri tag */
+	BarMp3Info_t mp3Info;
+	/* file offset of the first frame with audio */
+	size_t mp3Start;
+	/* bytes and samples per channel of the frames decoded so far */
+	size_t mp3Bytes;
+	unsigned long long int mp3Samples;
+	/* file offset and number of the next frame to decode */
+	size_t mp3Offset, mp3FrameNext;
+	/* file offsets of the frames decoded from the beginning on */
+	size_t *mp3Index, mp3Indexed, mp3IndexSize;
+	/* decoding errors are expected until the first frame after a seek */
+	bool mp3Resync;
 	#endif
 
 	/* audio out */
 	ao_device *audioOutDevice;
 	const BarSettings_t *settings;
 
+	/* downloaded data not decoded yet, buffer/bufferFilled/bufferRead are
+	 * the decoder's view of it */
+	BarBuffer_t decodeBuffer;
+	size_t bufferWant;
 	unsigned char *buffer;
 
 	pthread_mutex_t pauseMutex;
 	pthread_cond_t pauseCond;
+	/* aborts network waits on skip/quit, owned by the main thread */
+	WaitressCancel_t cancel;
+	/* download rate of this song, set up by the main thread */
+	WaitressRateLimit_t rateLimit;
 	WaitressHandle_t waith;
 };
 
 enum {PLAYER_RET_OK = 0, PLAYER_RET_HARDFAIL = 1, PLAYER_RET_SOFTFAIL = 2};
 
 void *BarPlayerThread (void *data);
+void BarPlayerSeek (struct audioPlayer *, const long int);
 unsigned int BarPlayerCalcScale (const float);
 
 #endif /* _PLAYER_H */
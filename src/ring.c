@@ -0,0 +1,460 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* lock-free single-producer/single-consumer ring buffer and growable
+ * circular buffer */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "ring.h"
+
+/*	set up empty ring
+ *	@param ring
+ *	@param capacity in bytes, rounded up to a power of two
+ *	@return false if out of memory
+ */
+bool BarRingInit (BarRing_t *ring, size_t size) {
+	size_t pow2 = 1;
+
+	while (pow2 < size) {
+		pow2 <<= 1;
+	}
+
+	memset (ring, 0, sizeof (*ring));
+	if ((ring->buf = malloc (pow2)) == NULL) {
+		return false;
+	}
+	ring->size = pow2;
+	return true;
+}
+
+void BarRingFree (BarRing_t *ring) {
+	free (ring->buf);
+	memset (ring, 0, sizeof (*ring));
+}
+
+/*	bytes that can be read; exact for the consumer, a lower bound for
+ *	everybody else
+ */
+size_t BarRingFill (const BarRing_t *ring) {
+	return BarAtomicLoad (&ring->written) - BarAtomicLoad (&ring->read);
+}
+
+/*	bytes that can be written; exact for the producer, a lower bound for
+ *	everybody else
+ */
+size_t BarRingSpace (const BarRing_t *ring) {
+	return ring->size - BarRingFill (ring);
+}
+
+/*	producer: copy as much as fits
+ *	@return bytes written
+ */
+size_t BarRingWrite (BarRing_t *ring, const void *data, size_t size) {
+	const size_t written = ring->written;
+	const size_t pos = written & (ring->size - 1);
+	size_t first;
+
+	if (size > BarRingSpace (ring)) {
+		size = BarRingSpace (ring);
+	}
+	first = ring->size - pos < size ? ring->size - pos : size;
+	memcpy (ring->buf + pos, data, first);
+	memcpy (ring->buf, (const unsigned char *) data + first, size - first);
+	/* publish data */
+	BarAtomicStore (&ring->written, written + size);
+
+	return size;
+}
+
+/*	consumer: contiguous readable data, up to the end of the buffer
+ *	@param ring
+ *	@param set to the data
+ *	@return bytes available at *data, BarRingSkip them when done
+ */
+size_t BarRingPeek (const BarRing_t *ring, const unsigned char **data) {
+	const size_t pos = ring->read & (ring->size - 1);
+	const size_t fill = BarRingFill (ring);
+
+	*data = ring->buf + pos;
+	return ring->size - pos < fill ? ring->size - pos : fill;
+}
+
+/*	consumer: release bytes to the producer
+ */
+void BarRingSkip (BarRing_t *ring, size_t size) {
+	assert (size <= BarRingFill (ring));
+	BarAtomicStore (&ring->read, ring->read + size);
+}
+
+/*	consumer: copy out as much as there is
+ *	@return bytes read
+ */
+size_t BarRingRead (BarRing_t *ring, void *data, size_t size) {
+	size_t done = 0;
+
+	while (done < size) {
+		const unsigned char *p;
+		size_t avail = BarRingPeek (ring, &p);
+
+		if (avail == 0) {
+			break;
+		}
+		if (avail > size - done) {
+			avail = size - done;
+		}
+		memcpy ((unsigned char *) data + done, p, avail);
+		BarRingSkip (ring, avail);
+		done += avail;
+	}
+
+	return done;
+}
+
+/*	producer: no more data will be written
+ */
+void BarRingSetEof (BarRing_t *ring) {
+	BarAtomicStore (&ring->eof, true);
+}
+
+/*	drop all data and the eof mark; neither side may use the ring meanwhile
+ */
+void BarRingClear (BarRing_t *ring) {
+	BarAtomicStore (&ring->read, ring->written);
+	BarAtomicStore (&ring->eof, false);
+}
+
+/*	consumer: producer is done and everything was read
+ */
+bool BarRingDrained (const BarRing_t *ring) {
+	return BarAtomicLoad (&ring->eof) && BarRingFill (ring) == 0;
+}
+
+/*	set up empty buffer
+ *	@param buffer
+ *	@param initial capacity in bytes, rounded up to a power of two
+ *	@return false if out of memory
+ */
+bool BarBufferInit (BarBuffer_t *buffer, size_t size) {
+	size_t pow2 = 1;
+
+	while (pow2 < size) {
+		pow2 <<= 1;
+	}
+
+	memset (buffer, 0, sizeof (*buffer));
+	if ((buffer->mem = malloc (2 * pow2)) == NULL) {
+		return false;
+	}
+	buffer->buf = buffer->mem + pow2;
+	buffer->size = pow2;
+	return true;
+}
+
+void BarBufferFree (BarBuffer_t *buffer) {
+	free (buffer->mem);
+	memset (buffer, 0, sizeof (*buffer));
+}
+
+size_t BarBufferFill (const BarBuffer_t *buffer) {
+	return buffer->written - buffer->read;
+}
+
+/*	double the capacity, buffered data moves to the beginning
+ *	@return false if out of memory
+ */
+static bool BarBufferGrow (BarBuffer_t *buffer) {
+	BarBuffer_t grown;
+	unsigned char *data;
+	const size_t fill = BarBufferView (buffer, &data);
+
+	if (!BarBufferInit (&grown, 2 * buffer->size)) {
+		return false;
+	}
+	memcpy (grown.buf, data, fill);
+	grown.written = fill;
+
+	free (buffer->mem);
+	*buffer = grown;
+	return true;
+}
+
+/*	contiguous free space for new data, the buffer grows if it is full
+ *	@param buffer
+ *	@param set to the free space
+ *	@return its size, BarBufferCommit what was written; 0 if out of memory
+ */
+size_t BarBufferReserve (BarBuffer_t *buffer, unsigned char **data) {
+	size_t pos, space;
+
+	if (BarBufferFill (buffer) == buffer->size && !BarBufferGrow (buffer)) {
+		return 0;
+	}
+
+	pos = buffer->written & (buffer->size - 1);
+	space = buffer->size - BarBufferFill (buffer);
+	*data = buffer->buf + pos;
+	return buffer->size - pos < space ? buffer->size - pos : space;
+}
+
+void BarBufferCommit (BarBuffer_t *buffer, size_t size) {
+	assert (size <= buffer->size - BarBufferFill (buffer));
+	buffer->written += size;
+}
+
+/*	all buffered data as one block, valid until the buffer is changed. Only
+ *	the bytes before the wrap-around are copied, which are usually few:
+ *	readers consume as much as they can.
+ *	@param buffer
+ *	@param set to the data
+ *	@return bytes at *data, BarBufferSkip them when done
+ */
+size_t BarBufferView (BarBuffer_t *buffer, unsigned char **data) {
+	const size_t pos = buffer->read & (buffer->size - 1);
+	const size_t fill = BarBufferFill (buffer);
+	const size_t first = buffer->size - pos;
+
+	if (fill <= first) {
+		*data = buffer->buf + pos;
+	} else {
+		/* wrapped, move the first part in front of the second one */
+		memcpy (buffer->buf - first, buffer->buf + pos, first);
+		*data = buffer->buf - first;
+	}
+	return fill;
+}
+
+void BarBufferSkip (BarBuffer_t *buffer, size_t size) {
+	assert (size <= BarBufferFill (buffer));
+	buffer->read += size;
+}
+
+#ifdef TEST
+/* test cases for the ring and buffer */
+
+#include <stdio.h>
+
+typedef enum {
+	RING_WRITE, RING_PEEK, RING_SKIP,
+	BUFFER_RESERVE, BUFFER_COMMIT, BUFFER_VIEW, BUFFER_SKIP,
+} RingTestOp_t;
+
+/* write/reserve/view return expect, or skip/commit n bytes; views check
+ * the capacity too, which is n */
+typedef struct {
+	RingTestOp_t op;
+	size_t n, expect;
+} RingTestStep_t;
+
+/*	data written is a running byte counter, check it comes out in order
+ */
+static bool checkData (const unsigned char *data, size_t size, size_t from) {
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] != (unsigned char) (from + i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void testRing (const char *name, size_t capacity,
+		const RingTestStep_t *steps, size_t count) {
+	unsigned char in[64];
+	const unsigned char *data;
+	BarRing_t ring;
+	size_t written = 0, i, j;
+	bool ok = BarRingInit (&ring, capacity);
+
+	for (i = 0; ok && i < count; i++) {
+		const RingTestStep_t * const s = &steps[i];
+		size_t ret = 0;
+
+		switch (s->op) {
+			case RING_WRITE:
+				for (j = 0; j < s->n; j++) {
+					in[j] = (unsigned char) (written + j);
+				}
+				ret = BarRingWrite (&ring, in, s->n);
+				written += ret;
+				break;
+
+			case RING_PEEK:
+				ret = BarRingPeek (&ring, &data);
+				ok = checkData (data, ret, ring.read);
+				break;
+
+			case RING_SKIP:
+				BarRingSkip (&ring, s->n);
+				ret = s->expect;
+				break;
+
+			default:
+				ok = false;
+				break;
+		}
+		if (ret != s->expect) {
+			ok = false;
+		}
+		if (!ok) {
+			printf ("FAIL for ring %s at step %zu: %zu, expected %zu\n", name,
+					i, ret, s->expect);
+		}
+	}
+	if (ok) {
+		printf ("OK for ring %s\n", name);
+	}
+	BarRingFree (&ring);
+}
+
+static void testBuffer (const char *name, size_t capacity,
+		const RingTestStep_t *steps, size_t count) {
+	unsigned char *data, *reserved = NULL;
+	BarBuffer_t buffer;
+	size_t written = 0, read = 0, i, j;
+	bool ok = BarBufferInit (&buffer, capacity);
+
+	for (i = 0; ok && i < count; i++) {
+		const RingTestStep_t * const s = &steps[i];
+		size_t ret = 0;
+
+		switch (s->op) {
+			case BUFFER_RESERVE:
+				ret = BarBufferReserve (&buffer, &reserved);
+				break;
+
+			case BUFFER_COMMIT:
+				for (j = 0; j < s->n; j++) {
+					reserved[j] = (unsigned char) (written + j);
+				}
+				BarBufferCommit (&buffer, s->n);
+				written += s->n;
+				ret = s->expect;
+				break;
+
+			case BUFFER_VIEW:
+				ret = BarBufferView (&buffer, &data);
+				ok = checkData (data, ret, read) && buffer.size == s->n;
+				break;
+
+			case BUFFER_SKIP:
+				BarBufferSkip (&buffer, s->n);
+				read += s->n;
+				ret = s->expect;
+				break;
+
+			default:
+				ok = false;
+				break;
+		}
+		if (ret != s->expect) {
+			ok = false;
+		}
+		if (!ok) {
+			printf ("FAIL for buffer %s at step %zu: %zu, expected %zu\n",
+					name, i, ret, s->expect);
+		}
+	}
+	if (ok) {
+		printf ("OK for buffer %s\n", name);
+	}
+	BarBufferFree (&buffer);
+}
+
+#define steps(s) s, sizeof (s) / sizeof (*s)
+
+/*	test entry point
+ */
+int main () {
+	/* capacity 16: fill to 12, drain to 2, the next write wraps */
+	static const RingTestStep_t wrap[] = {
+		{RING_WRITE, 12, 12},
+		{RING_PEEK, 0, 12},
+		{RING_SKIP, 10, 0},
+		{RING_WRITE, 10, 10},
+		/* up to the end of the buffer only */
+		{RING_PEEK, 0, 6},
+		{RING_SKIP, 6, 0},
+		{RING_PEEK, 0, 6},
+		/* full */
+		{RING_WRITE, 20, 10},
+		{RING_WRITE, 1, 0},
+		{RING_PEEK, 0, 16},
+		{RING_SKIP, 16, 0},
+		{RING_PEEK, 0, 0},
+	};
+	/* exactly at the wrap point */
+	static const RingTestStep_t edge[] = {
+		{RING_WRITE, 16, 16},
+		{RING_PEEK, 0, 16},
+		{RING_SKIP, 16, 0},
+		{RING_PEEK, 0, 0},
+		{RING_WRITE, 5, 5},
+		{RING_PEEK, 0, 5},
+		{RING_SKIP, 5, 0},
+	};
+	/* capacity 16: data wraps and is moved in front of the buffer */
+	static const RingTestStep_t viewWrap[] = {
+		{BUFFER_RESERVE, 0, 16},
+		{BUFFER_COMMIT, 12, 0},
+		{BUFFER_SKIP, 10, 0},
+		{BUFFER_RESERVE, 0, 4},
+		{BUFFER_COMMIT, 4, 0},
+		{BUFFER_RESERVE, 0, 10},
+		{BUFFER_COMMIT, 6, 0},
+		{BUFFER_VIEW, 16, 12},
+		/* still wrapped, copied again */
+		{BUFFER_VIEW, 16, 12},
+		{BUFFER_SKIP, 7, 0},
+		{BUFFER_VIEW, 16, 5},
+	};
+	/* full buffer doubles, keeping wrapped data in order */
+	static const RingTestStep_t grow[] = {
+		{BUFFER_RESERVE, 0, 16},
+		{BUFFER_COMMIT, 16, 0},
+		{BUFFER_SKIP, 6, 0},
+		{BUFFER_RESERVE, 0, 6},
+		{BUFFER_COMMIT, 6, 0},
+		{BUFFER_RESERVE, 0, 16},
+		{BUFFER_VIEW, 32, 16},
+		{BUFFER_COMMIT, 16, 0},
+		{BUFFER_VIEW, 32, 32},
+		{BUFFER_SKIP, 20, 0},
+		{BUFFER_RESERVE, 0, 20},
+		{BUFFER_COMMIT, 20, 0},
+		{BUFFER_VIEW, 32, 32},
+	};
+
+	testRing ("wrap", 16, steps (wrap));
+	testRing ("edge", 16, steps (edge));
+	/* capacity is rounded up */
+	testRing ("rounded", 10, steps (wrap));
+	testBuffer ("wrap", 16, steps (viewWrap));
+	testBuffer ("grow", 16, steps (grow));
+
+	return EXIT_SUCCESS;
+}
+#endif /* TEST */
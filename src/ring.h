@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* access to variables shared by two threads without a lock; msvc's volatile
+ * loads/stores have acquire/release semantics already */
+#ifdef _MSC_VER
+#include <windows.h>
+#define BarAtomicLoad(p) (*(p))
+#define BarAtomicStore(p, v) (*(p) = (v))
+#define BarAtomicFence() MemoryBarrier ()
+#else
+#define BarAtomicLoad(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define BarAtomicStore(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define BarAtomicFence() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+#endif
+
+/* single-producer/single-consumer byte ring: one thread writes, another one
+ * reads, neither takes a lock. Waiting for data or space is up to the
+ * caller. */
+typedef struct {
+	unsigned char *buf;
+	/* power of two */
+	size_t size;
+	/* bytes written/read so far, changed by the producer/consumer only */
+	volatile size_t written, read;
+	/* producer is done */
+	volatile bool eof;
+} BarRing_t;
+
+/* growable circular buffer used by a single thread. Buffered data is always
+ * readable as one contiguous block: if it wraps, the part at the end of the
+ * buffer is copied in front of its beginning. */
+typedef struct {
+	/* buf is preceded by another size bytes of room for that */
+	unsigned char *mem, *buf;
+	/* power of two */
+	size_t size;
+	size_t written, read;
+} BarBuffer_t;
+
+bool BarRingInit (BarRing_t *, size_t);
+void BarRingFree (BarRing_t *);
+size_t BarRingFill (const BarRing_t *);
+size_t BarRingSpace (const BarRing_t *);
+size_t BarRingWrite (BarRing_t *, const void *, size_t);
+size_t BarRingPeek (const BarRing_t *, const unsigned char **);
+void BarRingSkip (BarRing_t *, size_t);
+size_t BarRingRead (BarRing_t *, void *, size_t);
+void BarRingSetEof (BarRing_t *);
+bool BarRingDrained (const BarRing_t *);
+void BarRingClear (BarRing_t *);
+
+bool BarBufferInit (BarBuffer_t *, size_t);
+void BarBufferFree (BarBuffer_t *);
+size_t BarBufferFill (const BarBuffer_t *);
+size_t BarBufferReserve (BarBuffer_t *, unsigned char **);
+void BarBufferCommit (BarBuffer_t *, size_t);
+size_t BarBufferView (BarBuffer_t *, unsigned char **);
+void BarBufferSkip (BarBuffer_t *, size_t);
+
+#endif /* _RING_H */
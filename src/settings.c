@@ -108,6 +108,7 @@ void BarSettingsDestroy (BarSettings_t *settings) {
 	free (settings->fifo);
 	free (settings->rpcHost);
 	free (settings->rpcTlsPort);
+	free (settings->tlsBackend);
 	free (settings->partnerUser);
 	free (settings->partnerPassword);
 	free (settings->device);
@@ -120,6 +121,35 @@ void BarSettingsDestroy (BarSettings_t *settings) {
 	memset (settings, 0, sizeof (*settings));
 }
 
+/*	parse socket option setting
+ *	@param options to change
+ *	@param key without rpc_/audio_ prefix
+ *	@param value
+ *	@return true if key is a socket option
+ */
+static bool BarSettingsSockOpt (WaitressSockOpts_t *opts, const char *key,
+		const char *val) {
+	if (streq ("recv_buffer", key)) {
+		opts->recvBuffer = atoi (val);
+	} else if (streq ("send_buffer", key)) {
+		opts->sendBuffer = atoi (val);
+	} else if (streq ("tcp_nodelay", key)) {
+		opts->noDelay = atoi (val);
+	} else if (streq ("tcp_keepalive", key)) {
+		/* idle[,interval[,count]] */
+		opts->keepAliveIdle = 0;
+		opts->keepAliveInterval = 0;
+		opts->keepAliveCount = 0;
+		sscanf (val, "%d,%d,%d", &opts->keepAliveIdle,
+				&opts->keepAliveInterval, &opts->keepAliveCount);
+	} else if (streq ("tcp_fastopen", key)) {
+		opts->fastOpen = atoi (val);
+	} else {
+		return false;
+	}
+	return true;
+}
+
 /*	read app settings from file; format is: key = value\n
  *	@param where to save these settings
  *	@return nothing yet
@@ -141,6 +171,14 @@ void BarSettingsRead (BarSettings_t *settings) {
 	settings->history = 5;
 	settings->volume = 0;
 	settings->maxPlayerErrors = 5;
+	settings->audioSegments = 1;
+	settings->audioBufferHigh = 512;
+	settings->audioBufferLow = 256;
+	settings->rpcSockOpts.recvBuffer = 256*1024;
+	settings->rpcSockOpts.noDelay = true;
+	settings->audioSockOpts = settings->rpcSockOpts;
+	/* keeps nat mappings of paused songs' connections alive */
+	settings->audioSockOpts.keepAliveIdle = 60;
 	settings->sortOrder = BAR_SORT_NAME_AZ;
 	settings->loveIcon = bar_strdup (" <3");
 	settings->banIcon = bar_strdup (" </3");
@@ -150,6 +188,7 @@ void BarSettingsRead (BarSettings_t *settings) {
 	settings->listSongFormat = bar_strdup ("%i) %a - %t%r");
 	settings->rpcHost = bar_strdup(PIANO_RPC_HOST);
 	settings->rpcTlsPort = NULL;
+	settings->tlsBackend = NULL;
 	settings->partnerUser = bar_strdup ("android");
 	settings->partnerPassword = bar_strdup ("AC7IBG09A3DTSYM4R41UJWL07VLN8JI7");
 	settings->device = bar_strdup ("android-generic");
@@ -233,6 +272,8 @@ void BarSettingsRead (BarSettings_t *settings) {
 			} else if (streq ("rpc_tls_port", key)) {
 				free (settings->rpcTlsPort);
 				settings->rpcTlsPort = bar_strdup (val);
+			} else if (streq ("rpc_http2", key)) {
+				settings->rpcHttp2 = atoi (val);
 			} else if (streq ("partner_user", key)) {
 				free (settings->partnerUser);
 				settings->partnerUser = bar_strdup (val);
@@ -248,6 +289,14 @@ void BarSettingsRead (BarSettings_t *settings) {
 			} else if (streq ("decrypt_password", key)) {
 				free (settings->inkey);
 				settings->inkey = bar_strdup (val);
+			} else if (memcmp ("rpc_", key, 4) == 0 &&
+					BarSettingsSockOpt (&settings->rpcSockOpts, key + 4,
+					val)) {
+				/* socket options for api requests */
+			} else if (memcmp ("audio_", key, 6) == 0 &&
+					BarSettingsSockOpt (&settings->audioSockOpts, key + 6,
+					val)) {
+				/* socket options for song downloads */
 			} else if (memcmp ("act_", key, 4) == 0) {
 				size_t i;
 				/* keyboard shortcuts */
@@ -261,6 +310,10 @@ void BarSettingsRead (BarSettings_t *settings) {
 						break;
 					}
 				}
+			} else if (streq ("audio_buffer_high", key)) {
+				settings->audioBufferHigh = atoi (val);
+			} else if (streq ("audio_buffer_low", key)) {
+				settings->audioBufferLow = atoi (val);
 			} else if (streq ("audio_quality", key)) {
 				if (streq (val, "low")) {
 					settings->audioQuality = PIANO_AQ_LOW;
@@ -269,9 +322,15 @@ void BarSettingsRead (BarSettings_t *settings) {
 				} else if (streq (val, "high")) {
 					settings->audioQuality = PIANO_AQ_HIGH;
 				}
+			} else if (streq ("audio_segments", key)) {
+				settings->audioSegments = atoi (val);
 			} else if (streq ("autostart_station", key)) {
 				free (settings->autostartStation);
 				settings->autostartStation = strdup (val);
+			} else if (streq ("download_rate_factor", key)) {
+				settings->downloadRateFactor = atoi (val);
+			} else if (streq ("download_rate_limit", key)) {
+				settings->downloadRateLimit = atoi (val);
 			} else if (streq ("event_command", key)) {
 				settings->eventCmd = strdup (val);
 			} else if (streq ("history", key)) {
@@ -316,6 +375,9 @@ void BarSettingsRead (BarSettings_t *settings) {
 				settings->fifo = strdup (val);
 			} else if (streq ("autoselect", key)) {
 				settings->autoselect = atoi (val);
+			} else if (streq ("tls_backend", key)) {
+				free (settings->tlsBackend);
+				settings->tlsBackend = bar_strdup (val);
 			} else if (streq ("tls_fingerprint", key)) {
 				/* expects 40 byte hex-encoded sha1 */
 				if (strlen (val) == 40) {
@@ -59,8 +59,10 @@ typedef enum {
 	BAR_KS_CREATESTATIONFROMSONG = 25,
         BAR_KS_PLAY = 26,
         BAR_KS_PAUSE = 27,
+	BAR_KS_SEEKBACK = 28,
+	BAR_KS_SEEKFORWARD = 29,
 	/* insert new shortcuts _before_ this element and increase its value */
-	BAR_KS_COUNT = 28,
+	BAR_KS_COUNT = 30,
 } BarKeyShortcutId_t;
 
 #define BAR_KS_DISABLED '\x00'
@@ -85,6 +87,16 @@ typedef struct {
 typedef struct {
 	bool autoselect;
 	unsigned int history, maxPlayerErrors;
+	/* audio file byte ranges downloaded in parallel, 1 streams it */
+	unsigned int audioSegments;
+	/* KiB of audio downloaded ahead of the decoder; downloading pauses when
+	 * the high watermark is reached and resumes below the low one */
+	unsigned int audioBufferHigh, audioBufferLow;
+	/* KiB/s for all audio downloads; multiple of a song's bitrate */
+	unsigned int downloadRateLimit, downloadRateFactor;
+	WaitressSockOpts_t rpcSockOpts, audioSockOpts;
+	/* offer http/2 to the api server */
+	bool rpcHttp2;
 	int volume;
 	BarStationSorting_t sortOrder;
 	PianoAudioQuality_t audioQuality;
@@ -102,6 +114,8 @@ typedef struct {
 	char *listSongFormat;
 	char *fifo;
 	char *rpcHost, *rpcTlsPort, *partnerUser, *partnerPassword, *device, *inkey, *outkey;
+	/* tls library, NULL for libwaitress' default */
+	char *tlsBackend;
 	char tlsFingerprint[20];
 	char keys[BAR_KS_COUNT];
 #ifdef _WIN32
@@ -48,9 +48,11 @@ THE SOFTWARE.
 
 #ifdef _WIN32
 #define ui_ssize_t_spec  "%Id"
+#define ui_size_t_spec   "%Iu"
 #define ui_size_t_spec_2 "%2Iu"
 #else
 #define ui_ssize_t_spec  "%zd"
+#define ui_size_t_spec   "%zu"
 #define ui_size_t_spec_2 "%2zu"
 #endif
 
@@ -672,6 +674,43 @@ void BarUiPrintSong (const BarSettings_t *settings,
 	BarUiMsg (settings, MSG_PLAYING, "%s", outstr);
 }
 
+/*	format request phase timestamp
+ */
+static const char *BarUiFormatTime (char *buf, const size_t size,
+		const int64_t us) {
+	if (us < 0) {
+		return "-";
+	}
+	bar_snprintf (buf, size, "%.1f ms", (double) us / 1000);
+	return buf;
+}
+
+/*	Print timing of a http request
+ *	@param pianobar settings
+ *	@param request description
+ *	@param timing recorded by waitress
+ */
+void BarUiPrintTiming (const BarSettings_t *settings, const char *what,
+		const WaitressTiming_t *timing) {
+	char resolved[16], connected[16], handshakeDone[16], requestSent[16],
+			firstByte[16], done[16];
+
+	BarUiMsg (settings, MSG_NONE,
+			"%s:	resolved %s, connected %s, tls %s, sent %s, "
+			"first byte %s, done %s; " ui_size_t_spec " bytes sent, "
+			ui_size_t_spec " received, %u retries%s\n", what,
+			BarUiFormatTime (resolved, sizeof (resolved), timing->resolved),
+			BarUiFormatTime (connected, sizeof (connected), timing->connected),
+			BarUiFormatTime (handshakeDone, sizeof (handshakeDone),
+			timing->handshakeDone),
+			BarUiFormatTime (requestSent, sizeof (requestSent),
+			timing->requestSent),
+			BarUiFormatTime (firstByte, sizeof (firstByte), timing->firstByte),
+			BarUiFormatTime (done, sizeof (done), timing->done),
+			timing->bytesSent, timing->bytesReceived, timing->retries,
+			timing->reused ? ", pooled connection" : "");
+}
+
 /*	Print list of songs
  *	@param pianobar settings
  *	@param linked list of songs
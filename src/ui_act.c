@@ -43,6 +43,9 @@ THE SOFTWARE.
 #define BarUiActDefaultPianoCall(call, arg) BarUiPianoCall (app, \
 		call, arg, &pRet, &wRet)
 
+/* act_songseekback/act_songseekforward step, in ms */
+#define BAR_UI_SEEK_STEP 10000
+
 /*	helper to _really_ skip a song (unlock mutex, quit player)
  *	@param player handle
  */
@@ -53,6 +56,11 @@ static INLINE void BarUiDoSkipSong (struct audioPlayer *player) {
 	player->doQuit = true;
 	pthread_cond_broadcast (&player->pauseCond);
 	pthread_mutex_unlock (&player->pauseMutex);
+
+	/* wake up player thread if it is waiting for the network */
+	if (player->mode != PLAYER_FREED) {
+		WaitressCancel (&player->cancel);
+	}
 }
 
 /*	transform station if necessary to allow changes like rename, rate, ...
@@ -380,6 +388,13 @@ BarUiActCallback(BarUiActDebug) {
 			selSong->stationId,
 			selSong->title,
 			selSong->trackToken);
+
+	/* where did the time go? the audio request may still be running */
+	BarUiPrintTiming (&app->settings, "last rpc", &app->waith.timing);
+	if (app->player.mode >= PLAYER_INITIALIZED &&
+			app->player.mode < PLAYER_FINISHED_PLAYBACK) {
+		BarUiPrintTiming (&app->settings, "audio", &app->player.waith.timing);
+	}
 }
 
 /*	rate current song
@@ -444,6 +459,29 @@ BarUiActCallback(BarUiActTogglePause) {
 	pthread_mutex_unlock (&app->player.pauseMutex);
 }
 
+/*	seek within the current song, if there is one
+ *	@param player handle
+ *	@param milliseconds, negative ones seek backwards
+ */
+static void BarUiDoSeek (struct audioPlayer *player, const long int offset) {
+	if (player->mode >= PLAYER_SAMPLESIZE_INITIALIZED &&
+			player->mode < PLAYER_FINISHED_PLAYBACK) {
+		BarPlayerSeek (player, offset);
+	}
+}
+
+/*	seek back
+ */
+BarUiActCallback(BarUiActSeekBack) {
+	BarUiDoSeek (&app->player, -BAR_UI_SEEK_STEP);
+}
+
+/*	seek forward
+ */
+BarUiActCallback(BarUiActSeekForward) {
+	BarUiDoSeek (&app->player, BAR_UI_SEEK_STEP);
+}
+
 /*	rename current station
  */
 BarUiActCallback(BarUiActRenameStation) {
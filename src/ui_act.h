@@ -48,6 +48,8 @@ BarUiActCallback(BarUiActSkipSong);
 BarUiActCallback(BarUiActPlay);
 BarUiActCallback(BarUiActPause);
 BarUiActCallback(BarUiActTogglePause);
+BarUiActCallback(BarUiActSeekBack);
+BarUiActCallback(BarUiActSeekForward);
 BarUiActCallback(BarUiActRenameStation);
 BarUiActCallback(BarUiActSelectStation);
 BarUiActCallback(BarUiActTempBanSong);
@@ -101,6 +101,10 @@ static const BarUiDispatchAction_t dispatchActions[BAR_KS_COUNT] = {
 				"act_songplay"},
 		{'S', BAR_DC_GLOBAL | BAR_DC_STATION, BarUiActPause, "pause playback",
 				"act_songpause"},
+		{'<', BAR_DC_GLOBAL | BAR_DC_STATION, BarUiActSeekBack,
+				"seek back", "act_songseekback"},
+		{'>', BAR_DC_GLOBAL | BAR_DC_STATION, BarUiActSeekForward,
+				"seek forward", "act_songseekforward"},
 		};
 
 #include <piano.h>